@@ -68,8 +68,7 @@ static void test1() {
       char *buffer = diagramAsSVG(diagram);
       if (buffer) {
         printf("%s\n\n\n", buffer);
-        svgtiny_free(diagram);
-        diagram = svgtiny_create();
+        svgtiny_reset(diagram);
         code = svgtiny_parse(diagram, buffer, strlen(buffer), "http://dontcare", 612, 792);
         if (svgtiny_OK == code) {
           char *buffer2 = diagramAsSVG(diagram);
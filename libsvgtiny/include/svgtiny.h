@@ -10,6 +10,8 @@
 
 // To get the definition of size_t
 #include <stdlib.h>
+// To get the definition of uint32_t
+#include <stdint.h>
 
 
 typedef unsigned int svgtiny_colour;
@@ -28,12 +30,15 @@ typedef unsigned int svgtiny_colour;
 
 // Use these colors to indicate special.
 // They are legal, but unlikely, black that's almost transparent.
-// TODO: in a future commit, we'll malloc the gradient description into the _internal_extensions
-// field of the svgtiny_shape, and we'll lopk at that to decide if an object has a gradient.
+// A shape filled with svgtiny_LINEAR_GRADIENT has its gradient described by
+// svgtiny_shape_linear_gradient() or svgtiny_shape_mesh(); see
+// svgtiny_KEEP_GRADIENTS and svgtiny_GRADIENT_MESH.
 #define svgtiny_LINEAR_GRADIENT 0x2000000
 #define svgtiny_TRANSPARENT     0x1000000
 
 
+struct svgtiny_instance;
+
 struct svgtiny_shape {
 	float *path;
 	unsigned int path_length;
@@ -42,9 +47,78 @@ struct svgtiny_shape {
 	svgtiny_colour fill;
 	svgtiny_colour stroke;
 	float stroke_width;
-  void *_internal_extensions;  // TODO: if non-NULL, points to an allocated on the heap extension block. (gradients, fonts)
+  // Non-NULL for a <use> kept by svgtiny_KEEP_INSTANCES, which has no path or text of its own.
+  const struct svgtiny_instance *instance;
+  // Tight bounds of the path, or the anchor point of text, not counting the stroke.
+  struct {
+    float x0, y0, x1, y1;
+  } bounds;
+  void *_internal_extensions;  // If non-NULL, points to an extension block in the diagram's arena. (gradients, fonts)
+};
+
+// One stop of a gradient; color includes the stop-opacity in its top byte.
+struct svgtiny_gradient_stop {
+  float offset;
+  svgtiny_colour color;
+};
+
+// A linear gradient fill kept by svgtiny_KEEP_GRADIENTS. The colour at a point
+// is found by mapping it back through transform (gradient space to diagram
+// coordinates), projecting it onto the vector from (x1, y1) to (x2, y2) to
+// get an offset from 0 to 1, and interpolating the stops, padded at both ends.
+// Vectors in objectBoundingBox units are already resolved against the shape.
+struct svgtiny_linear_gradient {
+  float x1, y1, x2, y2;
+  struct {
+    float a, b, c, d, e, f;
+  } transform;
+  unsigned int stop_count;
+  const struct svgtiny_gradient_stop *stop;
+};
+
+// A gradient fill tessellated by svgtiny_GRADIENT_MESH: triangle_count
+// triangles whose corners are given by index[3 * i] to index[3 * i + 2], each
+// an index into vertex (x, y pairs in diagram coordinates) and colour. Colours
+// are to be interpolated across each triangle (Gouraud shading).
+struct svgtiny_mesh {
+  unsigned int vertex_count;
+  const float *vertex;
+  const svgtiny_colour *colour;
+  unsigned int triangle_count;
+  const unsigned int *index;
 };
 
+// A <use> of an element whose shapes are stored once, in diagram->symbol_shape.
+// Draw shapes first to first + count - 1 with transform applied to their paths,
+// text and stroke widths. A symbol shape whose fill or stroke is 0 (not set)
+// takes the instance's fill or stroke instead.
+struct svgtiny_instance {
+  unsigned int first, count;
+  struct {
+    float a, b, c, d, e, f;
+  } transform;
+  svgtiny_colour fill, stroke;
+};
+
+// Flags for svgtiny_diagram.options.
+enum {
+  // Parse each element referred to by <use> once, into symbol_shape, and add an
+  // instance shape for each <use> rather than a transformed copy of its shapes.
+  svgtiny_KEEP_INSTANCES = 1 << 0,
+  // Keep a gradient-filled path as one shape with fill svgtiny_LINEAR_GRADIENT
+  // and a gradient description, rather than splitting it into flat triangles.
+  svgtiny_KEEP_GRADIENTS = 1 << 1,
+  // Tessellate a gradient-filled path into one shape with fill
+  // svgtiny_LINEAR_GRADIENT, its outline as path, and a triangle mesh with
+  // per-vertex colours, rather than one flat-filled shape per triangle.
+  svgtiny_GRADIENT_MESH = 1 << 2,
+  // Merge runs of shapes smaller than min_size into rectangles of their
+  // average colour, rather than dropping them.
+  svgtiny_MERGE_SMALL_SHAPES = 1 << 3
+};
+
+struct svgtiny_arena;
+
 struct svgtiny_diagram {
 	int width, height;
 
@@ -53,6 +127,41 @@ struct svgtiny_diagram {
 
 	unsigned short error_line;
 	const char *error_message;
+
+  // Flags that change how svgtiny_parse() builds the diagram. Kept by svgtiny_reset().
+  unsigned int options;
+  // Narrowest band, in pixels, that svgtiny_parse() splits a gradient fill into.
+  // Bands are also no finer than one colour level, so that a span between stops
+  // of the same colour is not split at all. 0 splits every gradient vector into
+  // 20 bands whatever its size. Kept by svgtiny_reset().
+  float gradient_tolerance;
+  // Most triangles a gradient fill may be split into, beyond which it is filled
+  // flat with its middle colour. 0 means 4096. Kept by svgtiny_reset().
+  unsigned int gradient_max_triangles;
+  // Largest distance, in pixels, that svgtiny_parse() may move an outline to
+  // simplify its path: segments shorter than this are dropped, curves this flat
+  // become lines, and runs of lines are thinned. 0 keeps paths as they are.
+  // Kept by svgtiny_reset().
+  float simplify_tolerance;
+  // Size, in pixels, below which svgtiny_parse() leaves shapes out: a shape
+  // whose bounds, with its stroke, are both narrower and shorter than this is
+  // dropped, or merged by svgtiny_MERGE_SMALL_SHAPES. A <use> of an element
+  // already found to draw that small is not parsed again. 0 keeps every shape.
+  // Kept by svgtiny_reset().
+  float min_size;
+
+  // Shapes drawn by instances, in the coordinates of the elements they came from.
+  struct svgtiny_shape *symbol_shape;
+  unsigned int symbol_shape_count;
+
+  // Owns the path, text and _internal_extensions of every shape. Freed all at once by svgtiny_free().
+  struct svgtiny_arena *_internal_arena;
+  // Holds the DOM and other temporary memory during a parse. Emptied after each parse.
+  struct svgtiny_arena *_internal_scratch;
+  // Number of slots allocated in shape (>= shape_count).
+  unsigned int _internal_shape_allocated;
+  // Number of slots allocated in symbol_shape (>= symbol_shape_count).
+  unsigned int _internal_symbol_shape_allocated;
 };
 
 typedef enum {
@@ -75,9 +184,34 @@ struct svgtiny_named_color {
 	svgtiny_colour color;
 };
 
+// Called by svgtiny_parse_stream() with each finished shape. The shape and its
+// path and text are only valid until the callback returns. Returning anything
+// but svgtiny_OK stops the parse, and svgtiny_parse_stream() returns that code.
+typedef svgtiny_code (*svgtiny_shape_callback)(const struct svgtiny_shape *shape,
+		void *ctx);
+
+// Memory functions, each called with ctx as the last argument.
+// realloc(NULL, size) must allocate, and none of them is passed NULL to free.
+typedef struct svgtiny_allocator {
+	void *(*alloc)(size_t size, void *ctx);
+	void *(*realloc)(void *ptr, size_t size, void *ctx);
+	void (*free)(void *ptr, void *ctx);
+	void *ctx;
+} svgtiny_allocator;
+
 
 struct svgtiny_diagram *svgtiny_create(void);
 
+// Like svgtiny_create(), but the diagram, its shapes, and everything the library
+// allocates while parsing into it come from allocator, which is copied.
+// NULL means malloc(), realloc() and free().
+struct svgtiny_diagram *svgtiny_create_with_allocator(const svgtiny_allocator *allocator);
+
+// Opt in to routing libxml2's own allocations through allocator as well, via
+// xmlMemSetup(). This is process-wide, so call it once before any parsing.
+// Returns svgtiny_LIBDOM_ERROR if libxml2 refuses, or if not built with libxml2.
+svgtiny_code svgtiny_set_xml_allocator(const svgtiny_allocator *allocator);
+
 svgtiny_code svgtiny_parse(struct svgtiny_diagram *diagram,
 		const char *buffer, size_t size, const char *url,
 		int width, int height);
@@ -86,7 +220,190 @@ svgtiny_code svgtiny_parse(struct svgtiny_diagram *diagram,
 svgtiny_code svgtiny_parse0(struct svgtiny_diagram *diagram,
 		const char *buffer, size_t size);
 
+// Parse without building a diagram: each shape, transformed and with its paint
+// resolved, is passed to callback as soon as it is complete, and then discarded.
+// The document's XML tree is still built in full first, so this saves the
+// memory of the shapes but not of the tree.
+svgtiny_code svgtiny_parse_stream(const char *buffer, size_t size,
+		int viewport_width, int viewport_height,
+		svgtiny_shape_callback callback, void *ctx);
+
+
+// Empty a diagram so it can be parsed into again, as if just created, but keep
+// its shape array and arena chunks for the next svgtiny_parse() to reuse.
+void svgtiny_reset(struct svgtiny_diagram *svg);
 
 void svgtiny_free(struct svgtiny_diagram *svg);
 
+// Returns the gradient of a shape filled with svgtiny_LINEAR_GRADIENT, or NULL
+// if the shape has none (for instance, if svgtiny_KEEP_GRADIENTS was not set).
+const struct svgtiny_linear_gradient *svgtiny_shape_linear_gradient(
+		const struct svgtiny_shape *shape);
+
+// Returns the mesh of a shape tessellated with svgtiny_GRADIENT_MESH, or NULL.
+const struct svgtiny_mesh *svgtiny_shape_mesh(
+		const struct svgtiny_shape *shape);
+
+// A thread-safe cache of parsed diagrams, keyed by the SVG source and viewport,
+// holding about budget bytes. Repeated sources cost a hash and a lookup.
+struct svgtiny_cache;
+struct svgtiny_cache_entry;
+
+struct svgtiny_cache *svgtiny_cache_create(size_t budget);
+
+// Like svgtiny_parse(), but *entry refers to a shared diagram that must not be
+// changed, and that stays valid until svgtiny_cache_release(*entry).
+svgtiny_code svgtiny_cache_parse(struct svgtiny_cache *cache,
+		const char *buffer, size_t size,
+		int viewport_width, int viewport_height,
+		struct svgtiny_cache_entry **entry);
+
+const struct svgtiny_diagram *svgtiny_cache_diagram(
+		const struct svgtiny_cache_entry *entry);
+
+void svgtiny_cache_release(struct svgtiny_cache_entry *entry);
+
+// Entries still in use stay valid until they are released.
+void svgtiny_cache_free(struct svgtiny_cache *cache);
+
+// Writes diagram in a versioned binary form to buffer, if size is large enough,
+// and returns the size of the binary form (0 if the diagram is too big for it).
+size_t svgtiny_save(const struct svgtiny_diagram *diagram,
+		void *buffer, size_t size);
+
+// Adds the shapes saved by svgtiny_save() to diagram, without copying: their
+// paths and text point into buffer (which may be a read-only mmap()), so it
+// must outlive the diagram. Returns svgtiny_NOT_SVG if buffer is not the
+// binary form, svgtiny_SVG_ERROR if it is another version or is damaged.
+svgtiny_code svgtiny_load(struct svgtiny_diagram *diagram,
+		const void *buffer, size_t size);
+
+// Writes the path of shape to out with each svgtiny_PATH_BEZIER replaced by
+// svgtiny_PATH_LINEs no further than tolerance from the curve, if it fits in
+// out_length floats. Returns the number of floats the flattened path takes, or 0
+// if the shape has no path. Call with out NULL to find the size first.
+size_t svgtiny_flatten_shape(const struct svgtiny_shape *shape,
+		float tolerance, float *out, size_t out_length);
+
+// Flattens the path of every shape and symbol shape of diagram in place, as by
+// svgtiny_flatten_shape(), allocating the new paths in the diagram.
+svgtiny_code svgtiny_flatten_diagram(struct svgtiny_diagram *diagram,
+		float tolerance);
+
+// How svgtiny_stroke_to_path() joins segments and ends open subpaths. A mitre
+// longer than miter_limit half stroke widths is bevelled, as in SVG.
+enum {
+  svgtiny_JOIN_MITER,
+  svgtiny_JOIN_ROUND,
+  svgtiny_JOIN_BEVEL
+};
+
+enum {
+  svgtiny_CAP_BUTT,
+  svgtiny_CAP_ROUND,
+  svgtiny_CAP_SQUARE
+};
+
+struct svgtiny_stroke_style {
+  int join;
+  int cap;
+  float miter_limit;
+};
+
+// Writes the outline of the stroke of shape to out, as a path of closed
+// subpaths to be filled by the non-zero rule, if it fits in out_length floats.
+// Curves are offset as curves, each within tolerance of the true offset. style
+// may be NULL for SVG's defaults: mitre joins with a limit of 4 and butt caps.
+// Returns the number of floats the outline takes, or 0 if the shape has no path
+// or stroke width. Call with out NULL to find the size first.
+size_t svgtiny_stroke_to_path(const struct svgtiny_shape *shape,
+		float tolerance, const struct svgtiny_stroke_style *style,
+		float *out, size_t out_length);
+
+// Draws diagram, anti-aliased, into width by height pixels of four bytes each,
+// red, green, blue and alpha (not premultiplied), with rows stride bytes apart
+// and one diagram unit to a pixel. Shapes are filled by the non-zero rule and
+// composited source-over onto what the pixels already hold. Text is not drawn.
+svgtiny_code svgtiny_render(const struct svgtiny_diagram *diagram,
+		unsigned char *pixels, unsigned int width, unsigned int height,
+		size_t stride);
+
+// Threads kept for svgtiny_render_parallel(), so that each call need not start
+// its own. A pool made for threads threads starts threads - 1 of them, as the
+// calling thread draws too; threads 0 means one per processor.
+struct svgtiny_render_pool;
+
+struct svgtiny_render_pool *svgtiny_render_pool_create(unsigned int threads);
+
+// Must not be called while a svgtiny_render_parallel() is using the pool.
+void svgtiny_render_pool_free(struct svgtiny_render_pool *pool);
+
+// Like svgtiny_render(), but the pixels are split into 64 by 64 tiles drawn at
+// once by the calling thread and those of pool, or by the calling thread alone
+// if pool is NULL. A thread that runs out of tiles takes some from another.
+// svgtiny_render() draws on the same tiles, so the pixels are the same as its,
+// whatever the number of threads. Calls sharing a pool take turns with it.
+// Binning the shapes into tiles costs time, so small images draw faster with
+// svgtiny_render().
+svgtiny_code svgtiny_render_parallel(const struct svgtiny_diagram *diagram,
+		unsigned char *pixels, unsigned int width, unsigned int height,
+		size_t stride, struct svgtiny_render_pool *pool);
+
+// Triangles covering the area a path fills by the non-zero rule: vertex holds
+// vertex_count x, y pairs, and index three vertex indices per triangle, all
+// wound the same way. Vertices are shared between the triangles of a shape.
+// shape_triangle and fill are only set for svgtiny_triangulate_diagram(): the
+// triangles of shape i are shape_triangle[i] up to shape_triangle[i + 1], and
+// fill holds the fill colour of each triangle. The triangles of an instance are
+// those of its symbol shapes, so they may differ in fill.
+struct svgtiny_triangles {
+  float *vertex;
+  unsigned int vertex_count;
+  uint32_t *index;
+  unsigned int triangle_count;
+  unsigned int *shape_triangle;
+  svgtiny_colour *fill;
+  svgtiny_allocator _internal_allocator;
+};
+
+// Triangulates the path of shape, with curves flattened to within tolerance,
+// in O(n log n) for n lines and their crossings. Holes and self-intersecting
+// paths are handled; the fill colour is not looked at.
+svgtiny_code svgtiny_triangulate_shape(const struct svgtiny_shape *shape,
+		float tolerance, struct svgtiny_triangles **triangles);
+
+// Triangulates every shape of diagram that has a path and a fill into one set
+// of triangles, allocated by the diagram's allocator. The symbol shapes of each
+// instance are triangulated through its transform. Strokes are left out; see
+// svgtiny_stroke_to_path().
+svgtiny_code svgtiny_triangulate_diagram(const struct svgtiny_diagram *diagram,
+		float tolerance, struct svgtiny_triangles **triangles);
+
+void svgtiny_triangles_free(struct svgtiny_triangles *triangles);
+
+// An immutable spatial index over the shapes of a diagram, safe to query from
+// several threads at once. Build it after parsing; it does not track changes.
+struct svgtiny_index;
+
+struct svgtiny_index *svgtiny_index_create(const struct svgtiny_diagram *diagram);
+
+// Stores in indices, in ascending (painting) order, up to max indices of the
+// shapes whose bounds, grown to allow for any stroke, touch the rectangle.
+// Returns the number of such shapes, which may be more than max.
+unsigned int svgtiny_index_query(const struct svgtiny_index *index,
+		float x0, float y0, float x1, float y1,
+		unsigned int *indices, unsigned int max);
+
+void svgtiny_index_free(struct svgtiny_index *index);
+
+// Stores in indices, topmost first, up to max indices of the shapes painted at
+// (x, y) or within tolerance of it: inside a fill by the non-zero rule, or
+// within half the stroke width of a stroked path. Text is never hit. index may
+// be NULL, or an index over diagram, which makes the cost depend only on the
+// shapes near the point. Returns the number of shapes hit, which may be more
+// than max.
+unsigned int svgtiny_hit_test(const struct svgtiny_diagram *diagram,
+		const struct svgtiny_index *index, float x, float y,
+		float tolerance, unsigned int *indices, unsigned int max);
+
 #endif
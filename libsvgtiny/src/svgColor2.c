@@ -7,6 +7,7 @@
  *
  * Copyright 2016 by David Phillip Oster
  */
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -173,11 +174,18 @@ static struct svgtiny_named_color sSortedColors[] = {
 
 const struct svgtiny_named_color *svgtiny_color_lookup(const char *s, unsigned int len) {
   struct svgtiny_named_color *result = NULL;
-  char *lowerStr = strduplower2((const uint8_t *)s, len);
+  char lowerStr[32];  // longer than the longest name
   int lo = 0;
   int hi = -1 + sizeof(sSortedColors) / sizeof(sSortedColors[0]);
   int mid = lo + (lo + hi) / 2;
   int cmp = -1;
+  if (sizeof lowerStr <= len) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < len; ++i) {
+    lowerStr[i] = tolower((unsigned char)s[i]);
+  }
+  lowerStr[len] = '\0';
   while (0 != (cmp = strcmp(lowerStr, sSortedColors[mid].name)) && lo < hi) {
     int delta = (hi-lo)/2;
     if (delta == 0) {
@@ -193,7 +201,6 @@ const struct svgtiny_named_color *svgtiny_color_lookup(const char *s, unsigned i
   if (0 == cmp || 0 == strcmp(lowerStr, sSortedColors[mid].name)) {
     result = &sSortedColors[mid];
   }
-  free(lowerStr);
   return result;
 }
 
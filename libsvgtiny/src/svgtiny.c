@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <setjmp.h>
 #include <stdbool.h>
@@ -17,6 +18,7 @@
 #ifdef USE_XML2 // Defined in Xcode project.
 #include "xml2dom.h"
 #else
+#include <pthread.h>
 #include <dom/dom.h>
 #include <dom/bindings/xml/xmlparser.h>
 #endif  // USE_XML2
@@ -30,24 +32,77 @@
 
 #define KAPPA		0.5522847498
 
+/* elements that <use> may copy in one parse, so that nested <use> of
+ * <use> cannot multiply a small document into billions of shapes */
+#define SVGTINY_MAX_USE_ELEMENTS 4000000
+
+/**
+ * An element whose children are being walked by svgtiny_parse_tree().
+ * Frames live in a heap-allocated svgtiny_list rather than on the C stack,
+ * so the nesting depth of a document does not affect stack usage.
+ */
+struct svgtiny_parse_frame {
+	dom_element *child;	/* next child to visit, NULL when done */
+	bool text;		/* <text> or <tspan>: children are text */
+	bool single;		/* visit child but not its siblings */
+	float text_x, text_y;	/* transformed position of the text */
+	/* <use>: id of the element it draws, else NULL */
+	char *use_id;
+	/* <use> kept as an instance, whose element is being parsed into the
+	 * shapes from first_shape on, to become ctx->symbols[symbol] */
+	struct svgtiny_instance *instance;
+	unsigned int first_shape;
+	unsigned int symbol;
+	/* <use> being measured for svgtiny_diagram.min_size: index in
+	 * ctx->use_extents, else UINT_MAX, and the shapes seen before it */
+	unsigned int extent;
+	struct svgtiny_detail outer;
+	struct svgtiny_parse_state state;
+};
+
+/**
+ * An element referred to by <use>, already parsed into
+ * diagram->symbol_shape for svgtiny_KEEP_INSTANCES. The shapes depend on
+ * the stroke width the element inherits, so that is part of the key.
+ */
+struct svgtiny_symbol {
+	char *id;
+	int stroke_width;
+	float view_box[4];	/* of a <symbol>; width 0 for none */
+	unsigned int first, count;	/* range of diagram->symbol_shape */
+};
+
+static svgtiny_code svgtiny_parse_tree(dom_element *svg,
+		const struct svgtiny_parse_state *root);
 static svgtiny_code svgtiny_parse_svg(dom_element *svg,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame);
+static svgtiny_code svgtiny_parse_use(dom_element *use,
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame,
+		struct svgtiny_list *stack);
+static svgtiny_code svgtiny_end_frame(struct svgtiny_parse_frame *frame);
+static svgtiny_code svgtiny_parse_view_box(dom_element *node,
+		const struct svgtiny_parse_state *state, float view_box[4]);
 static svgtiny_code svgtiny_parse_path(dom_element *path,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent);
 static svgtiny_code svgtiny_parse_rect(dom_element *rect,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent);
 static svgtiny_code svgtiny_parse_circle(dom_element *circle,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent);
 static svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent);
 static svgtiny_code svgtiny_parse_line(dom_element *line,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent);
 static svgtiny_code svgtiny_parse_poly(dom_element *poly,
-		struct svgtiny_parse_state state, bool polygon);
+		const struct svgtiny_parse_state *parent, bool polygon);
 static svgtiny_code svgtiny_parse_text(dom_element *text,
-		struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame);
+static svgtiny_code svgtiny_parse_text_content(dom_node *node,
+		struct svgtiny_parse_frame *frame);
 static void svgtiny_parse_position_attributes(dom_element *node,
-		const struct svgtiny_parse_state state,
+		const struct svgtiny_parse_state *state,
 		float *x, float *y, float *width, float *height);
 static void svgtiny_parse_paint_attributes(dom_element *node,
 		struct svgtiny_parse_state *state);
@@ -55,77 +110,244 @@ static void svgtiny_parse_font_attributes(dom_element *node,
 		struct svgtiny_parse_state *state);
 static void svgtiny_parse_transform_attributes(dom_element *node,
 		struct svgtiny_parse_state *state);
+static void svgtiny_multiply_ctm(struct svgtiny_parse_state *state,
+		float a, float b, float c, float d, float e, float f);
 static svgtiny_code svgtiny_add_path(float *p, unsigned int n,
 		struct svgtiny_parse_state *state);
 static void _svgtiny_parse_color(const char *s, svgtiny_colour *c,
 		struct svgtiny_parse_state *state);
 
 /**
- * Set the local externally-stored parts of a parse state.
- * Call this in functions that made a new state on the stack.
- * Doesn't make own copy of global state, such as the interned string list.
+ * Set the local parts of a parse state.
+ * Call this in functions that made a new state on the stack from their
+ * parent's. Shared data is reached through state->ctx and is not copied.
  */
 static void svgtiny_setup_state_local(struct svgtiny_parse_state *state)
 {
-	if (state->gradient_x1 != NULL) {
-		dom_string_ref(state->gradient_x1);
-	}
-	if (state->gradient_y1 != NULL) {
-		dom_string_ref(state->gradient_y1);
-	}
-	if (state->gradient_x2 != NULL) {
-		dom_string_ref(state->gradient_x2);
-	}
-	if (state->gradient_y2 != NULL) {
-		dom_string_ref(state->gradient_y2);
-	}
   state->fill = 0;
   state->stroke = 0;
+  state->fill_gradient = NULL;
 }
 
+
+#ifdef USE_XML2
+
+/* Interned strings, built at compile time as static xml2dom strings. */
+#define SVGTINY_STRING_ACTION2(s,n)					\
+	static dom_string svgtiny_string_##s = DOM_STRING_STATIC_INIT(#n);
+#include "svgtiny_strings.h"
+#undef SVGTINY_STRING_ACTION2
+
+static const struct svgtiny_interned_strings svgtiny_interned = {
+#define SVGTINY_STRING_ACTION2(s,n) &svgtiny_string_##s,
+#include "svgtiny_strings.h"
+#undef SVGTINY_STRING_ACTION2
+};
+
 /**
- * Cleanup the local externally-stored parts of a parse state.
- * Call this in functions that made a new state on the stack.
- * Doesn't cleanup global state, such as the interned string list.
+ * Get the process-wide table of interned strings.
  */
-static void svgtiny_cleanup_state_local(struct svgtiny_parse_state *state)
+
+const struct svgtiny_interned_strings *svgtiny_interned_strings(void)
 {
-	if (state->gradient_x1 != NULL) {
-		dom_string_unref(state->gradient_x1);
-		state->gradient_x1 = NULL;
-	}
-	if (state->gradient_y1 != NULL) {
-		dom_string_unref(state->gradient_y1);
-		state->gradient_y1 = NULL;
-	}
-	if (state->gradient_x2 != NULL) {
-		dom_string_unref(state->gradient_x2);
-		state->gradient_x2 = NULL;
-	}
-	if (state->gradient_y2 != NULL) {
-		dom_string_unref(state->gradient_y2);
-		state->gradient_y2 = NULL;
-	}
+	return &svgtiny_interned;
 }
 
+#else
+
+/* Interned strings, created once per process and never freed. */
+static struct svgtiny_interned_strings svgtiny_interned;
+static bool svgtiny_interned_ok;
+static pthread_once_t svgtiny_interned_once = PTHREAD_ONCE_INIT;
+
+static void svgtiny_intern_strings(void)
+{
+#define SVGTINY_STRING_ACTION2(s,n)					\
+	if (dom_string_create_interned((const uint8_t *) #n,		\
+				       strlen(#n), &svgtiny_interned.s)	\
+	    != DOM_NO_ERR)						\
+		return;
+#include "svgtiny_strings.h"
+#undef SVGTINY_STRING_ACTION2
+	svgtiny_interned_ok = true;
+}
+
+/**
+ * Get the process-wide table of interned strings, creating it on first use.
+ * Returns NULL if the strings could not be created.
+ */
+
+const struct svgtiny_interned_strings *svgtiny_interned_strings(void)
+{
+	pthread_once(&svgtiny_interned_once, svgtiny_intern_strings);
+	return svgtiny_interned_ok ? &svgtiny_interned : NULL;
+}
+
+#endif  // USE_XML2
+
 
 /**
  * Create a new svgtiny_diagram structure.
  */
 
 struct svgtiny_diagram *svgtiny_create(void)
+{
+	return svgtiny_create_with_allocator(NULL);
+}
+
+
+/**
+ * Create a new svgtiny_diagram structure whose memory, and all memory used
+ * while parsing into it, comes from allocator. The allocator is copied.
+ * NULL means the C library's malloc(), realloc() and free().
+ */
+
+struct svgtiny_diagram *svgtiny_create_with_allocator(
+		const svgtiny_allocator *allocator)
 {
 	struct svgtiny_diagram *diagram;
 
-	diagram = calloc(sizeof(*diagram), 1);
+	if (allocator == NULL)
+		allocator = &svgtiny_default_allocator;
+
+	diagram = svgtiny_mem_alloc(allocator, sizeof(*diagram));
 	if (!diagram)
 		return 0;
+	memset(diagram, 0, sizeof(*diagram));
+
+	diagram->_internal_arena = svgtiny_arena_create(allocator);
+	if (!diagram->_internal_arena) {
+		svgtiny_mem_free(allocator, diagram);
+		return 0;
+	}
+	diagram->_internal_scratch = svgtiny_arena_create(allocator);
+	if (!diagram->_internal_scratch) {
+		svgtiny_arena_destroy(diagram->_internal_arena);
+		svgtiny_mem_free(allocator, diagram);
+		return 0;
+	}
 
 	return diagram;
-//	free(diagram);
-//	return NULL;
 }
 
+/**
+ * Count the start tags in a buffer, as a cheap upper bound on the number of
+ * shapes that parsing it will add.
+ */
+
+static unsigned int svgtiny_count_elements(const char *buffer, size_t size)
+{
+	const char *p = buffer, *end = buffer + size;
+	unsigned int n = 0;
+
+	while ((p = memchr(p, '<', end - p)) != NULL) {
+		p++;
+		if (p != end && *p != '/' && *p != '!' && *p != '?')
+			n++;
+	}
+	return n;
+}
+
+
+/**
+ * Make room for at least n shapes in diagram->shape.
+ */
+
+svgtiny_code svgtiny_reserve_shapes(struct svgtiny_diagram *diagram,
+		unsigned int n)
+{
+	struct svgtiny_shape *shape;
+
+	if (n <= diagram->_internal_shape_allocated)
+		return svgtiny_OK;
+
+	shape = svgtiny_mem_realloc(
+			svgtiny_arena_allocator(diagram->_internal_arena),
+			diagram->shape, n * sizeof shape[0]);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	diagram->shape = shape;
+	diagram->_internal_shape_allocated = n;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Make room for at least n shapes in diagram->symbol_shape.
+ */
+
+svgtiny_code svgtiny_reserve_symbol_shapes(struct svgtiny_diagram *diagram,
+		unsigned int n)
+{
+	struct svgtiny_shape *shape;
+
+	if (n <= diagram->_internal_symbol_shape_allocated)
+		return svgtiny_OK;
+
+	n = svgtiny_list_capacity(n);
+	shape = svgtiny_mem_realloc(
+			svgtiny_arena_allocator(diagram->_internal_arena),
+			diagram->symbol_shape, n * sizeof shape[0]);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	diagram->symbol_shape = shape;
+	diagram->_internal_symbol_shape_allocated = n;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Free the elements recorded for svgtiny_KEEP_INSTANCES during a parse.
+ */
+
+static void svgtiny_free_symbols(struct svgtiny_parse_context *ctx)
+{
+	unsigned int i;
+
+	if (ctx->symbols == NULL)
+		return;
+	for (i = 0; i != svgtiny_list_size(ctx->symbols); i++) {
+		struct svgtiny_symbol *symbol = svgtiny_list_get(ctx->symbols,
+				i);
+		svgtiny_mem_free(ctx->allocator, symbol->id);
+	}
+	svgtiny_list_free(ctx->symbols);
+	ctx->symbols = NULL;
+}
+
+
+/**
+ * Release the unused slots at the end of diagram->shape.
+ */
+
+static void svgtiny_shrink_shapes(struct svgtiny_parse_context *ctx)
+{
+	struct svgtiny_diagram *diagram = ctx->diagram;
+	const svgtiny_allocator *allocator = svgtiny_arena_allocator(ctx->arena);
+	struct svgtiny_shape *shape;
+
+	if (diagram->shape_count == diagram->_internal_shape_allocated)
+		return;
+
+	if (diagram->shape_count == 0) {
+		svgtiny_mem_free(allocator, diagram->shape);
+		diagram->shape = 0;
+	} else {
+		shape = svgtiny_mem_realloc(allocator, diagram->shape,
+				diagram->shape_count * sizeof shape[0]);
+		if (!shape)
+			return;
+		diagram->shape = shape;
+	}
+	diagram->_internal_shape_allocated = diagram->shape_count;
+}
+
+
+static svgtiny_code svgtiny_parse_document(struct svgtiny_diagram *diagram,
+		const char *buffer, size_t size, const char *url,
+		int viewport_width, int viewport_height,
+		svgtiny_shape_callback callback, void *callback_ctx);
+
 static void ignore_msg(uint32_t severity, void *ctx, const char *msg, ...)
 {
 	UNUSED(severity);
@@ -133,13 +355,42 @@ static void ignore_msg(uint32_t severity, void *ctx, const char *msg, ...)
 	UNUSED(msg);
 }
 
+/**
+ * Parse a block of memory into a svgtiny_diagram, with the DOM's memory
+ * coming from the diagram's scratch arena, which is emptied afterwards.
+ */
+
+static svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
+		const char *buffer, size_t size, const char *url,
+		int viewport_width, int viewport_height,
+		svgtiny_shape_callback callback, void *callback_ctx)
+{
+	svgtiny_code code;
+#ifdef USE_XML2
+	const svgtiny_allocator *previous = dom_set_thread_allocator(
+			svgtiny_arena_scratch_allocator(
+			diagram->_internal_scratch));
+#endif
+
+	code = svgtiny_parse_document(diagram, buffer, size, url,
+			viewport_width, viewport_height, callback, callback_ctx);
+
+#ifdef USE_XML2
+	dom_set_thread_allocator(previous);
+#endif
+	svgtiny_arena_reset(diagram->_internal_scratch);
+	return code;
+}
+
+
 /**
  * Parse a block of memory into a svgtiny_diagram.
  */
 
-svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
+static svgtiny_code svgtiny_parse_document(struct svgtiny_diagram *diagram,
 		const char *buffer, size_t size, const char *url,
-		int viewport_width, int viewport_height)
+		int viewport_width, int viewport_height,
+		svgtiny_shape_callback callback, void *callback_ctx)
 {
 	dom_document *document;
 	dom_exception exc;
@@ -147,9 +398,11 @@ svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
 	dom_xml_error err;
 	dom_element *svg;
 	dom_string *svg_name;
-	lwc_string *svg_name_lwc;
+	const struct svgtiny_interned_strings *interned;
+	struct svgtiny_parse_context ctx;
 	struct svgtiny_parse_state state;
 	float x, y, width, height;
+	bool reused;
 	svgtiny_code code;
 
 	assert(diagram);
@@ -157,10 +410,9 @@ svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
 
 	UNUSED(url);
 
-	state.gradient_x1 = NULL;
-	state.gradient_y1 = NULL;
-	state.gradient_x2 = NULL;
-	state.gradient_y2 = NULL;
+	interned = svgtiny_interned_strings();
+	if (interned == NULL)
+		return svgtiny_LIBDOM_ERROR;
 
 	parser = dom_xml_parser_create(NULL, NULL,
 				       ignore_msg, NULL, &document);
@@ -199,42 +451,42 @@ svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
 		dom_node_unref(document);
 		return svgtiny_LIBDOM_ERROR;
 	}
-	if (lwc_intern_string("svg", 3 /* SLEN("svg") */,
-			      &svg_name_lwc) != lwc_error_ok) {
-		dom_string_unref(svg_name);
-		dom_node_unref(svg);
-		dom_node_unref(document);
-		return svgtiny_LIBDOM_ERROR;
-	}
-	if (!dom_string_caseless_lwc_isequal(svg_name, svg_name_lwc)) {
-		lwc_string_unref(svg_name_lwc);
+	if (!dom_string_caseless_isequal(svg_name, interned->svg)) {
 		dom_string_unref(svg_name);
 		dom_node_unref(svg);
 		dom_node_unref(document);
 		return svgtiny_NOT_SVG;
 	}
 
-	lwc_string_unref(svg_name_lwc);
 	dom_string_unref(svg_name);
 
 	/* get graphic dimensions */
+	memset(&ctx, 0, sizeof(ctx));
 	memset(&state, 0, sizeof(state));
-	state.diagram = diagram;
-	state.document = document;
-	state.viewport_width = viewport_width;
-	state.viewport_height = viewport_height;
-
-#define SVGTINY_STRING_ACTION2(s,n)					\
-	if (dom_string_create_interned((const uint8_t *) #n,		\
-				       strlen(#n), &state.interned_##s)	\
-	    != DOM_NO_ERR) {						\
-		code = svgtiny_LIBDOM_ERROR;				\
-		goto cleanup;						\
-	}
-#include "svgtiny_strings.h"
-#undef SVGTINY_STRING_ACTION2
-
-	svgtiny_parse_position_attributes(svg, state, &x, &y, &width, &height);
+	state.ctx = &ctx;
+	ctx.diagram = diagram;
+	ctx.document = document;
+	ctx.viewport_width = viewport_width;
+	ctx.viewport_height = viewport_height;
+	ctx.callback = callback;
+	ctx.callback_ctx = callback_ctx;
+	ctx.interned = interned;
+	ctx.arena = diagram->_internal_arena;
+	ctx.allocator = svgtiny_arena_scratch_allocator(
+			diagram->_internal_scratch);
+	svgtiny_detail_clear(&ctx.detail);
+
+	/* the array is exactly sized after a parse, so spare slots mean the
+	 * diagram was reset for reuse and should keep them */
+	reused = diagram->shape_count < diagram->_internal_shape_allocated;
+
+	/* a hint only: on failure the array grows as shapes are added.
+	 * When streaming, one slot is reused for every shape. */
+	if (!callback)
+		svgtiny_reserve_shapes(diagram, diagram->shape_count +
+				svgtiny_count_elements(buffer, size));
+
+	svgtiny_parse_position_attributes(svg, &state, &x, &y, &width, &height);
   if (width <= 0 && 0 < height) {
     width = height;
   }
@@ -243,16 +495,16 @@ svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
   }
 	diagram->width = width;
 	diagram->height = height;
-  if (state.viewport_width <= 0) {
-    state.viewport_width = width;
+  if (ctx.viewport_width <= 0) {
+    ctx.viewport_width = width;
   }
-  if (state.viewport_height <= 0) {
-    state.viewport_width = height;
+  if (ctx.viewport_height <= 0) {
+    ctx.viewport_width = height;
   }
 
 	/* set up parsing state */
-	state.viewport_width = width;
-	state.viewport_height = height;
+	ctx.viewport_width = width;
+	ctx.viewport_height = height;
 	state.ctm.a = 1; /*(float) viewport_width / (float) width;*/
 	state.ctm.b = 0;
 	state.ctm.c = 0;
@@ -264,157 +516,683 @@ svgtiny_code svgtiny_parse_inner(struct svgtiny_diagram *diagram,
 	state.fill = 0x000000;
 	state.stroke = svgtiny_TRANSPARENT;
 	state.stroke_width = 1;
-	state.linear_gradient_stop_count = 0;
 
 	/* parse tree */
-	code = svgtiny_parse_svg(svg, state);
+	code = svgtiny_parse_tree(svg, &state);
 
 	dom_node_unref(svg);
 	dom_node_unref(document);
 
-cleanup:
-	svgtiny_cleanup_state_local(&state);
-#define SVGTINY_STRING_ACTION2(s,n)			\
-	if (state.interned_##s != NULL)			\
-		dom_string_unref(state.interned_##s);
-#include "svgtiny_strings.h"
-#undef SVGTINY_STRING_ACTION2
+	if (!reused)
+		svgtiny_shrink_shapes(&ctx);
+	svgtiny_free_symbols(&ctx);
+	svgtiny_detail_free(&ctx);
+	svgtiny_free_gradients(&ctx);
+	return code;
+}
+
+
+/**
+ * Push a frame for an element onto the stack of svgtiny_parse_tree().
+ * Returns NULL if out of memory.
+ */
+
+static struct svgtiny_parse_frame *svgtiny_push_frame(
+		struct svgtiny_list *stack)
+{
+	struct svgtiny_parse_frame *frame = svgtiny_list_push(stack);
+
+	if (frame) {
+		frame->child = NULL;
+		frame->text = false;
+		frame->single = false;
+		frame->use_id = NULL;
+		frame->instance = NULL;
+		frame->extent = UINT_MAX;
+	}
+	return frame;
+}
+
+
+/**
+ * Walk the element tree below the root <svg> element.
+ *
+ * Container elements push a frame onto an explicit stack instead of
+ * recursing, and a frame is popped once its last child has been visited.
+ */
+
+svgtiny_code svgtiny_parse_tree(dom_element *svg,
+		const struct svgtiny_parse_state *root)
+{
+	struct svgtiny_list *stack;
+	struct svgtiny_parse_frame *frame, *parent;
+	svgtiny_code code;
+	unsigned int depth;
+
+	stack = svgtiny_list_create(sizeof *frame, root->ctx->allocator);
+	if (!stack)
+		return svgtiny_OUT_OF_MEMORY;
+
+	frame = svgtiny_push_frame(stack);
+	if (!frame) {
+		svgtiny_list_free(stack);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	code = svgtiny_parse_svg(svg, root, frame);
+
+	while (code == svgtiny_OK && (depth = svgtiny_list_size(stack)) != 0) {
+		dom_element *child, *next;
+		dom_node_type nodetype;
+		dom_string *nodename;
+		dom_exception exc;
+
+		/* streamed shapes have all been passed on, so their paths
+		 * and text can go */
+		if (root->ctx->callback)
+			svgtiny_arena_reset(root->ctx->arena);
+
+		frame = svgtiny_list_get(stack, depth - 1);
+		child = frame->child;
+		if (child == NULL) {
+			code = svgtiny_end_frame(frame);
+			svgtiny_list_resize(stack, depth - 1);
+			continue;
+		}
+
+		if (frame->single) {
+			next = NULL;
+		} else {
+			exc = dom_node_get_next_sibling(child,
+					(dom_node **) (void *) &next);
+			if (exc != DOM_NO_ERR) {
+				code = svgtiny_LIBDOM_ERROR;
+				break;
+			}
+		}
+		frame->child = next;
+
+		exc = dom_node_get_node_type(child, &nodetype);
+		if (exc != DOM_NO_ERR) {
+			dom_node_unref(child);
+			code = svgtiny_LIBDOM_ERROR;
+			break;
+		}
+		if (nodetype == DOM_TEXT_NODE && frame->text) {
+			code = svgtiny_parse_text_content(child, frame);
+			dom_node_unref(child);
+			continue;
+		}
+		if (nodetype != DOM_ELEMENT_NODE) {
+			dom_node_unref(child);
+			continue;
+		}
+		if (root->ctx->open_uses != 0 && SVGTINY_MAX_USE_ELEMENTS <
+				++root->ctx->used_elements) {
+			root->ctx->diagram->error_message =
+					"use: too many elements copied";
+			dom_node_unref(child);
+			code = svgtiny_SVG_ERROR;
+			break;
+		}
+
+		exc = dom_node_get_node_name(child, &nodename);
+		if (exc != DOM_NO_ERR) {
+			dom_node_unref(child);
+			code = svgtiny_LIBDOM_ERROR;
+			break;
+		}
+		if (frame->text) {
+			if (dom_string_caseless_isequal(nodename,
+					frame->state.ctx->interned->tspan)) {
+				frame = svgtiny_push_frame(stack);
+				parent = svgtiny_list_get(stack, depth - 1);
+				if (frame)
+					code = svgtiny_parse_text(child,
+							&parent->state, frame);
+				else
+					code = svgtiny_OUT_OF_MEMORY;
+			}
+		} else if (dom_string_caseless_isequal(frame->state.ctx->interned->svg,
+						nodename) ||
+				dom_string_caseless_isequal(frame->state.ctx->interned->g,
+						nodename) ||
+				dom_string_caseless_isequal(frame->state.ctx->interned->a,
+						nodename)) {
+			frame = svgtiny_push_frame(stack);
+			parent = svgtiny_list_get(stack, depth - 1);
+			if (frame)
+				code = svgtiny_parse_svg(child, &parent->state,
+						frame);
+			else
+				code = svgtiny_OUT_OF_MEMORY;
+		} else if (dom_string_caseless_isequal(frame->state.ctx->interned->text,
+						nodename)) {
+			frame = svgtiny_push_frame(stack);
+			parent = svgtiny_list_get(stack, depth - 1);
+			if (frame)
+				code = svgtiny_parse_text(child, &parent->state,
+						frame);
+			else
+				code = svgtiny_OUT_OF_MEMORY;
+		} else if (dom_string_caseless_isequal(frame->state.ctx->interned->use,
+						nodename)) {
+			frame = svgtiny_push_frame(stack);
+			parent = svgtiny_list_get(stack, depth - 1);
+			if (frame)
+				code = svgtiny_parse_use(child, &parent->state,
+						frame, stack);
+			else
+				code = svgtiny_OUT_OF_MEMORY;
+		} else if (dom_string_caseless_isequal(frame->state.ctx->interned->path,
+						nodename))
+			code = svgtiny_parse_path(child, &frame->state);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->rect,
+						nodename))
+			code = svgtiny_parse_rect(child, &frame->state);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->circle,
+						nodename))
+			code = svgtiny_parse_circle(child, &frame->state);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->ellipse,
+						nodename))
+			code = svgtiny_parse_ellipse(child, &frame->state);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->line,
+						nodename))
+			code = svgtiny_parse_line(child, &frame->state);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->polyline,
+						nodename))
+			code = svgtiny_parse_poly(child, &frame->state, false);
+		else if (dom_string_caseless_isequal(frame->state.ctx->interned->polygon,
+						nodename))
+			code = svgtiny_parse_poly(child, &frame->state, true);
+		dom_string_unref(nodename);
+		dom_node_unref(child);
+	}
+
+	/* on error, drop the children still referenced by open frames, and
+	 * any shapes of an unfinished symbol, which are not in place */
+	for (depth = svgtiny_list_size(stack); depth != 0; depth--) {
+		frame = svgtiny_list_get(stack, depth - 1);
+		if (frame->child != NULL)
+			dom_node_unref(frame->child);
+		if (frame->instance != NULL)
+			root->ctx->diagram->shape_count = frame->first_shape;
+		svgtiny_mem_free(root->ctx->allocator, frame->use_id);
+	}
+	svgtiny_list_free(stack);
+
 	return code;
 }
 
 
 /**
- * Parse a <svg> or <g> element node.
+ * Parse a <svg>, <g> or <a> element node into a new frame.
  */
 
 svgtiny_code svgtiny_parse_svg(dom_element *svg,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame)
 {
+	struct svgtiny_parse_state state = *parent;
 	float x, y, width, height;
-	dom_string *view_box;
-	dom_element *child;
+	float view_box[4];
 	dom_exception exc;
+	svgtiny_code code;
+
+	frame->child = NULL;
+	frame->text = false;
 
 	svgtiny_setup_state_local(&state);
 
-	svgtiny_parse_position_attributes(svg, state, &x, &y, &width, &height);
+	svgtiny_parse_position_attributes(svg, &state, &x, &y, &width, &height);
 	svgtiny_parse_paint_attributes(svg, &state);
 	svgtiny_parse_font_attributes(svg, &state);
 
-	exc = dom_element_get_attribute(svg, state.interned_viewBox,
-					&view_box);
+	code = svgtiny_parse_view_box(svg, &state, view_box);
+	if (code != svgtiny_OK)
+		return code;
+	if (view_box[2] != 0) {
+		state.ctm.a = (float) state.ctx->viewport_width / view_box[2];
+		state.ctm.d = (float) state.ctx->viewport_height / view_box[3];
+		state.ctm.e += -view_box[0] * state.ctm.a;
+		state.ctm.f += -view_box[1] * state.ctm.d;
+	}
+
+	svgtiny_parse_transform_attributes(svg, &state);
+
+	frame->state = state;
+
+	exc = dom_node_get_first_child(svg, &frame->child);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
+		frame->child = NULL;
 		return svgtiny_LIBDOM_ERROR;
 	}
 
-	if (view_box) {
-		char *s = strndup(dom_string_data(view_box),
-				  dom_string_byte_length(view_box));
-		float min_x, min_y, vwidth, vheight;
-		if (sscanf(s, "%f,%f,%f,%f",
-				&min_x, &min_y, &vwidth, &vheight) == 4 ||
-				sscanf(s, "%f %f %f %f",
-				&min_x, &min_y, &vwidth, &vheight) == 4) {
-			state.ctm.a = (float) state.viewport_width / vwidth;
-			state.ctm.d = (float) state.viewport_height / vheight;
-			state.ctm.e += -min_x * state.ctm.a;
-			state.ctm.f += -min_y * state.ctm.d;
+	return svgtiny_OK;
+}
+
+/**
+ * Parse a viewBox attribute, if present, into min x, min y, width and
+ * height. The width is 0 if there is no usable viewBox.
+ */
+
+svgtiny_code svgtiny_parse_view_box(dom_element *node,
+		const struct svgtiny_parse_state *state, float view_box[4])
+{
+	dom_string *attr;
+	dom_exception exc;
+	char *s;
+
+	view_box[2] = 0;
+
+	exc = dom_element_get_attribute(node, state->ctx->interned->viewBox,
+					&attr);
+	if (exc != DOM_NO_ERR)
+		return svgtiny_LIBDOM_ERROR;
+	if (attr == NULL)
+		return svgtiny_OK;
+
+	s = svgtiny_mem_strndup(state->ctx->allocator, dom_string_data(attr),
+			dom_string_byte_length(attr));
+	dom_string_unref(attr);
+	if (s == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	if (sscanf(s, "%f,%f,%f,%f", &view_box[0], &view_box[1],
+			&view_box[2], &view_box[3]) != 4 &&
+			sscanf(s, "%f %f %f %f", &view_box[0], &view_box[1],
+			&view_box[2], &view_box[3]) != 4)
+		view_box[2] = 0;
+	svgtiny_mem_free(state->ctx->allocator, s);
+	return svgtiny_OK;
+}
+
+
+/**
+ * Map the viewBox of a <symbol>, if it has one, onto the width and height
+ * given by its <use>.
+ */
+
+static void svgtiny_fit_view_box(struct svgtiny_parse_state *state,
+		const float view_box[4], float width, float height)
+{
+	if (view_box[2] > 0 && view_box[3] > 0)
+		svgtiny_multiply_ctm(state,
+				width / view_box[2], 0,
+				0, height / view_box[3],
+				-view_box[0] * width / view_box[2],
+				-view_box[1] * height / view_box[3]);
+}
+
+
+/**
+ * Find the symbol made for the element with id when it inherits
+ * stroke_width, or return NULL.
+ */
+
+static struct svgtiny_symbol *svgtiny_find_symbol(
+		struct svgtiny_parse_context *ctx, const char *id,
+		int stroke_width)
+{
+	unsigned int i;
+
+	if (ctx->symbols == NULL)
+		return NULL;
+	for (i = 0; i != svgtiny_list_size(ctx->symbols); i++) {
+		struct svgtiny_symbol *symbol = svgtiny_list_get(ctx->symbols,
+				i);
+		if (symbol->stroke_width == stroke_width &&
+				strcmp(symbol->id, id) == 0)
+			return symbol;
+	}
+	return NULL;
+}
+
+
+/**
+ * Make an instance record for a <use> with the transform and paint of
+ * state, in the diagram's arena. Returns NULL if out of memory.
+ */
+
+static struct svgtiny_instance *svgtiny_create_instance(
+		const struct svgtiny_parse_state *state)
+{
+	struct svgtiny_instance *instance;
+
+	instance = svgtiny_arena_alloc(state->ctx->arena, sizeof *instance);
+	if (instance == NULL)
+		return NULL;
+	instance->first = 0;
+	instance->count = 0;
+	instance->transform.a = state->ctm.a;
+	instance->transform.b = state->ctm.b;
+	instance->transform.c = state->ctm.c;
+	instance->transform.d = state->ctm.d;
+	instance->transform.e = state->ctm.e;
+	instance->transform.f = state->ctm.f;
+	instance->fill = state->fill;
+	instance->stroke = state->stroke;
+	return instance;
+}
+
+
+/**
+ * Add a shape that draws an instance of a symbol.
+ */
+
+static svgtiny_code svgtiny_add_instance(struct svgtiny_parse_state *state,
+		struct svgtiny_instance *instance)
+{
+	struct svgtiny_shape *shape;
+	svgtiny_code code;
+	bool dropped;
+
+	if (instance->count == 0)
+		return svgtiny_OK;
+
+	code = svgtiny_detail_instance(state, instance, &dropped);
+	if (dropped)
+		return code;
+
+	shape = svgtiny_add_shape(state);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	shape->fill = instance->fill;
+	shape->stroke = instance->stroke;
+	shape->instance = instance;
+	svgtiny_instance_bounds(shape, state->ctx->diagram->symbol_shape);
+
+	return svgtiny_finish_shape(state);
+}
+
+
+/**
+ * Parse a <use> element node into a new frame, whose only child is the
+ * element it refers to, or whose children are those of a <symbol>.
+ *
+ * http://www.w3.org/TR/SVG11/struct.html#UseElement
+ *
+ * With svgtiny_KEEP_INSTANCES, each element is parsed just once, without
+ * the transform of the <use>, and moved into diagram->symbol_shape when
+ * the frame ends. Every <use> of it adds an instance shape instead.
+ */
+
+svgtiny_code svgtiny_parse_use(dom_element *use,
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame,
+		struct svgtiny_list *stack)
+{
+	struct svgtiny_parse_context *ctx = parent->ctx;
+	struct svgtiny_parse_state state = *parent;
+	struct svgtiny_symbol *symbol;
+	struct svgtiny_instance *instance;
+	float x, y, width, height;
+	float view_box[4];
+	dom_element *element;
+	dom_string *attr, *name;
+	dom_exception exc;
+	bool keep, is_symbol, skip;
+	unsigned int i;
+	svgtiny_code code;
+
+	frame->child = NULL;
+	frame->text = false;
+
+	svgtiny_setup_state_local(&state);
+
+	svgtiny_parse_position_attributes(use, &state, &x, &y, &width, &height);
+	svgtiny_parse_paint_attributes(use, &state);
+	svgtiny_parse_font_attributes(use, &state);
+	svgtiny_parse_transform_attributes(use, &state);
+	svgtiny_multiply_ctm(&state, 1, 0, 0, 1, x, y);
+
+	/* only references within the document are followed */
+	exc = dom_element_get_attribute(use, ctx->interned->href, &attr);
+	if (exc != DOM_NO_ERR)
+		return svgtiny_LIBDOM_ERROR;
+	if (attr == NULL)
+		return svgtiny_OK;
+	if (dom_string_byte_length(attr) < 2 ||
+			dom_string_data(attr)[0] != '#') {
+		dom_string_unref(attr);
+		return svgtiny_OK;
+	}
+	frame->use_id = svgtiny_mem_strndup(ctx->allocator,
+			dom_string_data(attr) + 1,
+			dom_string_byte_length(attr) - 1);
+	dom_string_unref(attr);
+	if (frame->use_id == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	ctx->open_uses++;
+
+	/* a <use> inside the element it refers to would never end */
+	for (i = 0; i + 1 < svgtiny_list_size(stack); i++) {
+		struct svgtiny_parse_frame *open = svgtiny_list_get(stack, i);
+		if (open->use_id != NULL &&
+				strcmp(open->use_id, frame->use_id) == 0)
+			return svgtiny_OK;
+	}
+
+	/* instances are one level deep: a <use> inside a symbol, or with a
+	 * gradient that needs the final geometry, is expanded */
+	keep = (ctx->diagram->options & svgtiny_KEEP_INSTANCES) &&
+			!ctx->callback && ctx->recording == 0 &&
+			state.fill != svgtiny_LINEAR_GRADIENT;
+
+	/* an element that is already a symbol is not looked up again */
+	if (keep) {
+		symbol = svgtiny_find_symbol(ctx, frame->use_id,
+				state.stroke_width);
+		if (symbol != NULL) {
+			svgtiny_fit_view_box(&state, symbol->view_box,
+					width, height);
+			instance = svgtiny_create_instance(&state);
+			if (instance == NULL)
+				return svgtiny_OUT_OF_MEMORY;
+			instance->first = symbol->first;
+			instance->count = symbol->count;
+			return svgtiny_add_instance(&state, instance);
 		}
-		free(s);
-		dom_string_unref(view_box);
 	}
 
-	svgtiny_parse_transform_attributes(svg, &state);
+	exc = dom_string_create_interned((const uint8_t *) frame->use_id,
+			strlen(frame->use_id), &attr);
+	if (exc != DOM_NO_ERR)
+		return svgtiny_LIBDOM_ERROR;
+	exc = dom_document_get_element_by_id(ctx->document, attr, &element);
+	dom_string_unref(attr);
+	if (exc != DOM_NO_ERR)
+		return svgtiny_LIBDOM_ERROR;
+	if (element == NULL)
+		return svgtiny_OK;
 
-	exc = dom_node_get_first_child(svg, (dom_node **) (void *) &child);
+	exc = dom_node_get_node_name(element, &name);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
+		dom_node_unref(element);
 		return svgtiny_LIBDOM_ERROR;
 	}
-	while (child != NULL) {
-		dom_element *next;
-		dom_node_type nodetype;
-		svgtiny_code code = svgtiny_OK;
+	is_symbol = dom_string_caseless_isequal(name, ctx->interned->symbol);
+	dom_string_unref(name);
 
-		exc = dom_node_get_node_type(child, &nodetype);
-		if (exc != DOM_NO_ERR) {
-			dom_node_unref(child);
-			return svgtiny_LIBDOM_ERROR;
+	view_box[2] = 0;
+	if (is_symbol) {
+		code = svgtiny_parse_view_box(element, &state, view_box);
+		if (code != svgtiny_OK) {
+			dom_node_unref(element);
+			return code;
 		}
-		if (nodetype == DOM_ELEMENT_NODE) {
-			dom_string *nodename;
-			exc = dom_node_get_node_name(child, &nodename);
-			if (exc != DOM_NO_ERR) {
-				dom_node_unref(child);
-				svgtiny_cleanup_state_local(&state);
-				return svgtiny_LIBDOM_ERROR;
+	}
+	svgtiny_fit_view_box(&state, view_box, width, height);
+
+	if (keep) {
+		/* first use: parse the element in its own coordinates */
+		instance = svgtiny_create_instance(&state);
+		if (instance == NULL) {
+			dom_node_unref(element);
+			return svgtiny_OUT_OF_MEMORY;
+		}
+		if (ctx->symbols == NULL) {
+			ctx->symbols = svgtiny_list_create(
+					sizeof (struct svgtiny_symbol),
+					ctx->allocator);
+			if (ctx->symbols == NULL) {
+				dom_node_unref(element);
+				return svgtiny_OUT_OF_MEMORY;
 			}
-			if (dom_string_caseless_isequal(state.interned_svg,
-							nodename))
-				code = svgtiny_parse_svg(child, state);
-			else if (dom_string_caseless_isequal(state.interned_g,
-							     nodename))
-				code = svgtiny_parse_svg(child, state);
-			else if (dom_string_caseless_isequal(state.interned_a,
-							     nodename))
-				code = svgtiny_parse_svg(child, state);
-			else if (dom_string_caseless_isequal(state.interned_path,
-							     nodename))
-				code = svgtiny_parse_path(child, state);
-			else if (dom_string_caseless_isequal(state.interned_rect,
-							     nodename))
-				code = svgtiny_parse_rect(child, state);
-			else if (dom_string_caseless_isequal(state.interned_circle,
-							     nodename))
-				code = svgtiny_parse_circle(child, state);
-			else if (dom_string_caseless_isequal(state.interned_ellipse,
-							     nodename))
-				code = svgtiny_parse_ellipse(child, state);
-			else if (dom_string_caseless_isequal(state.interned_line,
-							     nodename))
-				code = svgtiny_parse_line(child, state);
-			else if (dom_string_caseless_isequal(state.interned_polyline,
-							     nodename))
-				code = svgtiny_parse_poly(child, state, false);
-			else if (dom_string_caseless_isequal(state.interned_polygon,
-							     nodename))
-				code = svgtiny_parse_poly(child, state, true);
-			else if (dom_string_caseless_isequal(state.interned_text,
-							     nodename))
-				code = svgtiny_parse_text(child, state);
-			dom_string_unref(nodename);
 		}
-		if (code != svgtiny_OK) {
-			dom_node_unref(child);
-			svgtiny_cleanup_state_local(&state);
+		i = svgtiny_list_size(ctx->symbols);
+		symbol = svgtiny_list_push(ctx->symbols);
+		if (symbol == NULL) {
+			dom_node_unref(element);
+			return svgtiny_OUT_OF_MEMORY;
+		}
+		symbol->id = svgtiny_mem_strndup(ctx->allocator,
+				frame->use_id, strlen(frame->use_id));
+		if (symbol->id == NULL) {
+			svgtiny_list_resize(ctx->symbols, i);
+			dom_node_unref(element);
+			return svgtiny_OUT_OF_MEMORY;
+		}
+		symbol->stroke_width = state.stroke_width;
+		memcpy(symbol->view_box, view_box, sizeof symbol->view_box);
+		symbol->first = 0;
+		symbol->count = 0;
+
+		frame->instance = instance;
+		frame->first_shape = ctx->diagram->shape_count;
+		frame->symbol = i;
+		ctx->recording++;
+		state.ctm.a = 1;
+		state.ctm.b = 0;
+		state.ctm.c = 0;
+		state.ctm.d = 1;
+		state.ctm.e = 0;
+		state.ctm.f = 0;
+		state.use_fill = 0;
+		state.use_stroke = 0;
+		state.use_fill_gradient = NULL;
+	} else {
+		if (state.fill != 0) {
+			state.use_fill = state.fill;
+			state.use_fill_gradient = state.fill_gradient;
+		}
+		if (state.stroke != 0)
+			state.use_stroke = state.stroke;
+
+		/* an element known to be too small now is not parsed */
+		code = svgtiny_detail_begin_use(&state, frame->use_id,
+				&frame->outer, &frame->extent, &skip);
+		if (code != svgtiny_OK || skip) {
+			frame->state = state;
+			dom_node_unref(element);
 			return code;
 		}
-		exc = dom_node_get_next_sibling(child,
-						(dom_node **) (void *) &next);
-		dom_node_unref(child);
+	}
+
+	if (is_symbol) {
+		svgtiny_setup_state_local(&state);
+		svgtiny_parse_paint_attributes(element, &state);
+		svgtiny_parse_font_attributes(element, &state);
+		frame->state = state;
+		exc = dom_node_get_first_child(element, &frame->child);
+		dom_node_unref(element);
 		if (exc != DOM_NO_ERR) {
-			svgtiny_cleanup_state_local(&state);
+			frame->child = NULL;
 			return svgtiny_LIBDOM_ERROR;
 		}
-		child = next;
+	} else {
+		frame->state = state;
+		frame->child = element;
+		frame->single = true;
 	}
 
-	svgtiny_cleanup_state_local(&state);
 	return svgtiny_OK;
 }
 
+
+/**
+ * Finish a frame whose children have all been visited. A <use> kept as an
+ * instance moves the shapes of its element into diagram->symbol_shape and
+ * adds the instance shape in their place.
+ */
+
+svgtiny_code svgtiny_end_frame(struct svgtiny_parse_frame *frame)
+{
+	struct svgtiny_parse_context *ctx = frame->state.ctx;
+	struct svgtiny_diagram *diagram = ctx->diagram;
+	struct svgtiny_instance *instance = frame->instance;
+	struct svgtiny_symbol *symbol;
+	unsigned int count;
+
+	if (frame->extent != UINT_MAX) {
+		svgtiny_detail_end_use(&frame->state, &frame->outer,
+				frame->extent);
+		frame->extent = UINT_MAX;
+	}
+	if (frame->use_id != NULL)
+		ctx->open_uses--;
+	svgtiny_mem_free(ctx->allocator, frame->use_id);
+	frame->use_id = NULL;
+	if (instance == NULL)
+		return svgtiny_OK;
+
+	frame->instance = NULL;
+	ctx->recording--;
+	count = diagram->shape_count - frame->first_shape;
+	if (svgtiny_reserve_symbol_shapes(diagram,
+			diagram->symbol_shape_count + count) != svgtiny_OK) {
+		diagram->shape_count = frame->first_shape;
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	memcpy(diagram->symbol_shape + diagram->symbol_shape_count,
+			diagram->shape + frame->first_shape,
+			count * sizeof diagram->shape[0]);
+	instance->first = diagram->symbol_shape_count;
+	instance->count = count;
+	diagram->symbol_shape_count += count;
+	diagram->shape_count = frame->first_shape;
+
+	symbol = svgtiny_list_get(ctx->symbols, frame->symbol);
+	symbol->first = instance->first;
+	symbol->count = count;
+
+	return svgtiny_add_instance(&frame->state, instance);
+}
+
+
 svgtiny_code svgtiny_parse(struct svgtiny_diagram *diagram,
 		const char *buffer, size_t size, const char *url,
 		int viewport_width, int viewport_height)
 {
-  return svgtiny_parse_inner(diagram, buffer, size, url, viewport_width, viewport_height);
+  return svgtiny_parse_inner(diagram, buffer, size, url, viewport_width, viewport_height, NULL, NULL);
 }
 
 svgtiny_code svgtiny_parse0(struct svgtiny_diagram *diagram,
 		const char *buffer, size_t size)
 {
-  return svgtiny_parse_inner(diagram, buffer, size, NULL, -1, -1);
+  return svgtiny_parse_inner(diagram, buffer, size, NULL, -1, -1, NULL, NULL);
+}
+
+
+/**
+ * Parse a block of memory, passing each shape to callback as soon as it is
+ * complete instead of collecting them in a diagram.
+ */
+
+svgtiny_code svgtiny_parse_stream(const char *buffer, size_t size,
+		int viewport_width, int viewport_height,
+		svgtiny_shape_callback callback, void *ctx)
+{
+	struct svgtiny_diagram *diagram;
+	svgtiny_code code;
+
+	assert(callback);
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return svgtiny_OUT_OF_MEMORY;
+	code = svgtiny_parse_inner(diagram, buffer, size, NULL,
+			viewport_width, viewport_height, callback, ctx);
+	svgtiny_free(diagram);
+	return code;
 }
 
 
@@ -426,8 +1204,9 @@ svgtiny_code svgtiny_parse0(struct svgtiny_diagram *diagram,
  */
 
 svgtiny_code svgtiny_parse_path(dom_element *path,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	dom_string *path_d_str;
 	dom_exception exc;
@@ -446,33 +1225,30 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
 	svgtiny_parse_transform_attributes(path, &state);
 
 	/* read d attribute */
-	exc = dom_element_get_attribute(path, state.interned_d, &path_d_str);
+	exc = dom_element_get_attribute(path, state.ctx->interned->d, &path_d_str);
 	if (exc != DOM_NO_ERR) {
-		state.diagram->error_line = -1; /* path->line; */
-		state.diagram->error_message = "path: error retrieving d attribute";
-		svgtiny_cleanup_state_local(&state);
+		state.ctx->diagram->error_line = -1; /* path->line; */
+		state.ctx->diagram->error_message = "path: error retrieving d attribute";
 		return svgtiny_SVG_ERROR;
 	}
 
 	if (path_d_str == NULL) {
-		state.diagram->error_line = -1; /* path->line; */
-		state.diagram->error_message = "path: missing d attribute";
-		svgtiny_cleanup_state_local(&state);
+		state.ctx->diagram->error_line = -1; /* path->line; */
+		state.ctx->diagram->error_message = "path: missing d attribute";
 		return svgtiny_SVG_ERROR;
 	}
 
         /* empty path is permitted it just disables the path */
         palloc = dom_string_byte_length(path_d_str);
         if (palloc == 0) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OK;
         }
 
         /* local copy of the path data allowing in-place modification */
-	s = path_d = strndup(dom_string_data(path_d_str), palloc);
+	s = path_d = svgtiny_mem_strndup(state.ctx->allocator,
+			dom_string_data(path_d_str), palloc);
 	dom_string_unref(path_d_str);
 	if (s == NULL) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -484,10 +1260,9 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
         }
 
 	/* allocate initial space for path elements */
-	p = malloc(sizeof p[0] * palloc);
+	p = svgtiny_arena_alloc(state.ctx->arena, sizeof p[0] * palloc);
 	if (p == NULL) {
-		free(path_d);
-		svgtiny_cleanup_state_local(&state);
+		svgtiny_mem_free(state.ctx->allocator, path_d);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -507,12 +1282,14 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
                 do {                                                    \
                         if ((palloc - i) < NUM_ELEMENTS) {              \
                                 float *tp;                              \
+                                unsigned int old_palloc = palloc;       \
                                 palloc = (palloc * 2) + (palloc / 2);   \
-                                tp = realloc(p, sizeof p[0] * palloc);  \
+                                tp = svgtiny_arena_realloc(state.ctx->arena, \
+                                                p, sizeof p[0] * old_palloc, \
+                                                sizeof p[0] * palloc);  \
                                 if (tp == NULL) {                       \
-                                        free(p);                        \
-                                        free(path_d);                   \
-                                        svgtiny_cleanup_state_local(&state); \
+                                        svgtiny_arena_free(state.ctx->arena, p); \
+                                        svgtiny_mem_free(state.ctx->allocator, path_d); \
                                         return svgtiny_OUT_OF_MEMORY;   \
                                 }                                       \
                                 p = tp;                                 \
@@ -720,12 +1497,11 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
 		}
 	}
 
-	free(path_d);
+	svgtiny_mem_free(state.ctx->allocator, path_d);
 
 	if (i <= 4) {
 		/* no real segments in path */
-		free(p);
-		svgtiny_cleanup_state_local(&state);
+		svgtiny_arena_free(state.ctx->arena, p);
 		return svgtiny_OK;
 	}
 
@@ -736,7 +1512,8 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
                 /* try the resize, if it fails just continue to use the old
                  * allocation
                  */
-                tp = realloc(p, sizeof p[0] * i);
+                tp = svgtiny_arena_realloc(state.ctx->arena, p,
+                                sizeof p[0] * palloc, sizeof p[0] * i);
                 if (tp != NULL) {
                         p = tp;
                 }
@@ -744,7 +1521,6 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
 
 	err = svgtiny_add_path(p, i, &state);
 
-	svgtiny_cleanup_state_local(&state);
 
 	return err;
 }
@@ -757,22 +1533,22 @@ svgtiny_code svgtiny_parse_path(dom_element *path,
  */
 
 svgtiny_code svgtiny_parse_rect(dom_element *rect,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	float x, y, width, height;
 	float *p;
 
 	svgtiny_setup_state_local(&state);
 
-	svgtiny_parse_position_attributes(rect, state,
+	svgtiny_parse_position_attributes(rect, &state,
 			&x, &y, &width, &height);
 	svgtiny_parse_paint_attributes(rect, &state);
 	svgtiny_parse_transform_attributes(rect, &state);
 
-	p = malloc(13 * sizeof p[0]);
+	p = svgtiny_arena_alloc(state.ctx->arena, 13 * sizeof p[0]);
 	if (!p) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -792,7 +1568,6 @@ svgtiny_code svgtiny_parse_rect(dom_element *rect,
 
 	err = svgtiny_add_path(p, 13, &state);
 
-	svgtiny_cleanup_state_local(&state);
 
 	return err;
 }
@@ -803,8 +1578,9 @@ svgtiny_code svgtiny_parse_rect(dom_element *rect,
  */
 
 svgtiny_code svgtiny_parse_circle(dom_element *circle,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	float x = 0, y = 0, r = -1;
 	float *p;
@@ -813,33 +1589,30 @@ svgtiny_code svgtiny_parse_circle(dom_element *circle,
 
 	svgtiny_setup_state_local(&state);
 
-	exc = dom_element_get_attribute(circle, state.interned_cx, &attr);
+	exc = dom_element_get_attribute(circle, state.ctx->interned->cx, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		x = svgtiny_parse_length(attr, state.viewport_width, state);
+		x = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(circle, state.interned_cy, &attr);
+	exc = dom_element_get_attribute(circle, state.ctx->interned->cy, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		y = svgtiny_parse_length(attr, state.viewport_height, state);
+		y = svgtiny_parse_length(attr, state.ctx->viewport_height, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(circle, state.interned_r, &attr);
+	exc = dom_element_get_attribute(circle, state.ctx->interned->r, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		r = svgtiny_parse_length(attr, state.viewport_width, state);
+		r = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
@@ -847,19 +1620,16 @@ svgtiny_code svgtiny_parse_circle(dom_element *circle,
 	svgtiny_parse_transform_attributes(circle, &state);
 
 	if (r < 0) {
-		state.diagram->error_line = -1; /* circle->line; */
-		state.diagram->error_message = "circle: r missing or negative";
-		svgtiny_cleanup_state_local(&state);
+		state.ctx->diagram->error_line = -1; /* circle->line; */
+		state.ctx->diagram->error_message = "circle: r missing or negative";
 		return svgtiny_SVG_ERROR;
 	}
 	if (r == 0) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OK;
 	}
 
-	p = malloc(32 * sizeof p[0]);
+	p = svgtiny_arena_alloc(state.ctx->arena, 32 * sizeof p[0]);
 	if (!p) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -898,7 +1668,6 @@ svgtiny_code svgtiny_parse_circle(dom_element *circle,
 
 	err = svgtiny_add_path(p, 32, &state);
 
-	svgtiny_cleanup_state_local(&state);
 	
 	return err;
 }
@@ -909,8 +1678,9 @@ svgtiny_code svgtiny_parse_circle(dom_element *circle,
  */
 
 svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	float x = 0, y = 0, rx = -1, ry = -1;
 	float *p;
@@ -919,43 +1689,39 @@ svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
 
 	svgtiny_setup_state_local(&state);
 
-	exc = dom_element_get_attribute(ellipse, state.interned_cx, &attr);
+	exc = dom_element_get_attribute(ellipse, state.ctx->interned->cx, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		x = svgtiny_parse_length(attr, state.viewport_width, state);
+		x = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(ellipse, state.interned_cy, &attr);
+	exc = dom_element_get_attribute(ellipse, state.ctx->interned->cy, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		y = svgtiny_parse_length(attr, state.viewport_height, state);
+		y = svgtiny_parse_length(attr, state.ctx->viewport_height, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(ellipse, state.interned_rx, &attr);
+	exc = dom_element_get_attribute(ellipse, state.ctx->interned->rx, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		rx = svgtiny_parse_length(attr, state.viewport_width, state);
+		rx = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(ellipse, state.interned_ry, &attr);
+	exc = dom_element_get_attribute(ellipse, state.ctx->interned->ry, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		ry = svgtiny_parse_length(attr, state.viewport_width, state);
+		ry = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
@@ -963,20 +1729,17 @@ svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
 	svgtiny_parse_transform_attributes(ellipse, &state);
 
 	if (rx < 0 || ry < 0) {
-		state.diagram->error_line = -1; /* ellipse->line; */
-		state.diagram->error_message = "ellipse: rx or ry missing "
+		state.ctx->diagram->error_line = -1; /* ellipse->line; */
+		state.ctx->diagram->error_message = "ellipse: rx or ry missing "
 				"or negative";
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_SVG_ERROR;
 	}
 	if (rx == 0 || ry == 0) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OK;
 	}
 
-	p = malloc(32 * sizeof p[0]);
+	p = svgtiny_arena_alloc(state.ctx->arena, 32 * sizeof p[0]);
 	if (!p) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -1015,7 +1778,6 @@ svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
 	
 	err = svgtiny_add_path(p, 32, &state);
 
-	svgtiny_cleanup_state_local(&state);
 
 	return err;
 }
@@ -1026,8 +1788,9 @@ svgtiny_code svgtiny_parse_ellipse(dom_element *ellipse,
  */
 
 svgtiny_code svgtiny_parse_line(dom_element *line,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	float x1 = 0, y1 = 0, x2 = 0, y2 = 0;
 	float *p;
@@ -1036,52 +1799,47 @@ svgtiny_code svgtiny_parse_line(dom_element *line,
 
 	svgtiny_setup_state_local(&state);
 
-	exc = dom_element_get_attribute(line, state.interned_x1, &attr);
+	exc = dom_element_get_attribute(line, state.ctx->interned->x1, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		x1 = svgtiny_parse_length(attr, state.viewport_width, state);
+		x1 = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(line, state.interned_y1, &attr);
+	exc = dom_element_get_attribute(line, state.ctx->interned->y1, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		y1 = svgtiny_parse_length(attr, state.viewport_height, state);
+		y1 = svgtiny_parse_length(attr, state.ctx->viewport_height, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(line, state.interned_x2, &attr);
+	exc = dom_element_get_attribute(line, state.ctx->interned->x2, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		x2 = svgtiny_parse_length(attr, state.viewport_width, state);
+		x2 = svgtiny_parse_length(attr, state.ctx->viewport_width, &state);
 	}
 	dom_string_unref(attr);
 
-	exc = dom_element_get_attribute(line, state.interned_y2, &attr);
+	exc = dom_element_get_attribute(line, state.ctx->interned->y2, &attr);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	if (attr != NULL) {
-		y2 = svgtiny_parse_length(attr, state.viewport_height, state);
+		y2 = svgtiny_parse_length(attr, state.ctx->viewport_height, &state);
 	}
 	dom_string_unref(attr);
 
 	svgtiny_parse_paint_attributes(line, &state);
 	svgtiny_parse_transform_attributes(line, &state);
 
-	p = malloc(6 * sizeof p[0]);
+	p = svgtiny_arena_alloc(state.ctx->arena, 6 * sizeof p[0]);
 	if (!p) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -1094,7 +1852,6 @@ svgtiny_code svgtiny_parse_line(dom_element *line,
 
 	err = svgtiny_add_path(p, 6, &state);
 
-	svgtiny_cleanup_state_local(&state);
 
 	return err;
 }
@@ -1108,48 +1865,49 @@ svgtiny_code svgtiny_parse_line(dom_element *line,
  */
 
 svgtiny_code svgtiny_parse_poly(dom_element *poly,
-		struct svgtiny_parse_state state, bool polygon)
+		const struct svgtiny_parse_state *parent, bool polygon)
 {
+	struct svgtiny_parse_state state = *parent;
 	svgtiny_code err;
 	dom_string *points_str;
 	dom_exception exc;
 	char *s, *points;
 	float *p;
 	unsigned int i;
+	size_t palloc;
 
 	svgtiny_setup_state_local(&state);
 
 	svgtiny_parse_paint_attributes(poly, &state);
 	svgtiny_parse_transform_attributes(poly, &state);
 	
-	exc = dom_element_get_attribute(poly, state.interned_points,
+	exc = dom_element_get_attribute(poly, state.ctx->interned->points,
 					&points_str);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_LIBDOM_ERROR;
 	}
 	
 	if (points_str == NULL) {
-		state.diagram->error_line = -1; /* poly->line; */
-		state.diagram->error_message =
+		state.ctx->diagram->error_line = -1; /* poly->line; */
+		state.ctx->diagram->error_message =
 				"polyline/polygon: missing points attribute";
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_SVG_ERROR;
 	}
 
-	s = points = strndup(dom_string_data(points_str),
-			     dom_string_byte_length(points_str));
+	s = points = svgtiny_mem_strndup(state.ctx->allocator,
+			dom_string_data(points_str),
+			dom_string_byte_length(points_str));
 	dom_string_unref(points_str);
 	/* read points attribute */
 	if (s == NULL) {
-		svgtiny_cleanup_state_local(&state);
 		return svgtiny_OUT_OF_MEMORY;
 	}
-	/* allocate space for path: it will never have more elements than s */
-	p = malloc(sizeof p[0] * strlen(s));
+	/* allocate space for path: it will never have more elements than s,
+	 * plus a close */
+	palloc = strlen(s) + 1;
+	p = svgtiny_arena_alloc(state.ctx->arena, sizeof p[0] * palloc);
 	if (!p) {
-		free(points);
-		svgtiny_cleanup_state_local(&state);
+		svgtiny_mem_free(state.ctx->allocator, points);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 
@@ -1177,115 +1935,93 @@ svgtiny_code svgtiny_parse_poly(dom_element *poly,
         if (polygon)
 		p[i++] = svgtiny_PATH_CLOSE;
 
-	free(points);
+	svgtiny_mem_free(state.ctx->allocator, points);
+
+	/* give back the unused space; p is the most recent allocation, so
+	 * this shrinks it in place */
+	p = svgtiny_arena_realloc(state.ctx->arena, p,
+			sizeof p[0] * palloc, sizeof p[0] * i);
 
 	err = svgtiny_add_path(p, i, &state);
 
-	svgtiny_cleanup_state_local(&state);
 
 	return err;
 }
 
 
 /**
- * Parse a <text> or <tspan> element node.
+ * Parse a <text> or <tspan> element node into a new frame.
  */
 
 svgtiny_code svgtiny_parse_text(dom_element *text,
-		struct svgtiny_parse_state state)
+		const struct svgtiny_parse_state *parent,
+		struct svgtiny_parse_frame *frame)
 {
+	struct svgtiny_parse_state state = *parent;
 	float x, y, width, height;
-	float px, py;
-	dom_node *child;
 	dom_exception exc;
 
+	frame->child = NULL;
+	frame->text = true;
+
 	svgtiny_setup_state_local(&state);
 
-	svgtiny_parse_position_attributes(text, state,
+	svgtiny_parse_position_attributes(text, &state,
 			&x, &y, &width, &height);
 	svgtiny_parse_font_attributes(text, &state);
 	svgtiny_parse_transform_attributes(text, &state);
 
-	px = state.ctm.a * x + state.ctm.c * y + state.ctm.e;
-	py = state.ctm.b * x + state.ctm.d * y + state.ctm.f;
+	frame->text_x = state.ctm.a * x + state.ctm.c * y + state.ctm.e;
+	frame->text_y = state.ctm.b * x + state.ctm.d * y + state.ctm.f;
 /* 	state.ctm.e = px - state.origin_x; */
 /* 	state.ctm.f = py - state.origin_y; */
 
 	/*struct css_style style = state.style;
 	style.font_size.value.length.value *= state.ctm.a;*/
-	
-	exc = dom_node_get_first_child(text, &child);
+
+	frame->state = state;
+
+	exc = dom_node_get_first_child(text, &frame->child);
 	if (exc != DOM_NO_ERR) {
-		svgtiny_cleanup_state_local(&state);
+		frame->child = NULL;
 		return svgtiny_LIBDOM_ERROR;
 	}
-	while (child != NULL) {
-		dom_node *next;
-		dom_node_type nodetype;
-		svgtiny_code code = svgtiny_OK;
 
-		exc = dom_node_get_node_type(child, &nodetype);
-		if (exc != DOM_NO_ERR) {
-			dom_node_unref(child);
-			svgtiny_cleanup_state_local(&state);
-			return svgtiny_LIBDOM_ERROR;
-		}
-		if (nodetype == DOM_ELEMENT_NODE) {
-			dom_string *nodename;
-			exc = dom_node_get_node_name(child, &nodename);
-			if (exc != DOM_NO_ERR) {
-				dom_node_unref(child);
-				svgtiny_cleanup_state_local(&state);
-				return svgtiny_LIBDOM_ERROR;
-			}
-			if (dom_string_caseless_isequal(nodename,
-							state.interned_tspan))
-				code = svgtiny_parse_text((dom_element *)child,
-							  state);
-			dom_string_unref(nodename);
-		} else if (nodetype == DOM_TEXT_NODE) {
-			struct svgtiny_shape *shape = svgtiny_add_shape(&state);
-			dom_string *content;
-			if (shape == NULL) {
-				dom_node_unref(child);
-				svgtiny_cleanup_state_local(&state);
-				return svgtiny_OUT_OF_MEMORY;
-			}
-			exc = dom_text_get_whole_text(child, &content);
-			if (exc != DOM_NO_ERR) {
-				dom_node_unref(child);
-				svgtiny_cleanup_state_local(&state);
-				return svgtiny_LIBDOM_ERROR;
-			}
-			if (content != NULL) {
-				shape->text = strndup(dom_string_data(content),
-						      dom_string_byte_length(content));
-				dom_string_unref(content);
-			} else {
-				shape->text = strdup("");
-			}
-			shape->text_x = px;
-			shape->text_y = py;
-			state.diagram->shape_count++;
-		}
+	return svgtiny_OK;
+}
 
-		if (code != svgtiny_OK) {
-			dom_node_unref(child);
-			svgtiny_cleanup_state_local(&state);
-			return code;
-		}
-		exc = dom_node_get_next_sibling(child, &next);
-		dom_node_unref(child);
-		if (exc != DOM_NO_ERR) {
-			svgtiny_cleanup_state_local(&state);
-			return svgtiny_LIBDOM_ERROR;
-		}
-		child = next;
-	}
 
-	svgtiny_cleanup_state_local(&state);
+/**
+ * Add the content of a text node inside <text> or <tspan> as a text shape.
+ */
 
-	return svgtiny_OK;
+svgtiny_code svgtiny_parse_text_content(dom_node *node,
+		struct svgtiny_parse_frame *frame)
+{
+	struct svgtiny_shape *shape = svgtiny_add_shape(&frame->state);
+	dom_string *content;
+	dom_exception exc;
+
+	if (shape == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	/* the extent of text is not known without its font */
+	frame->state.ctx->detail.unknown = true;
+	exc = dom_text_get_whole_text(node, &content);
+	if (exc != DOM_NO_ERR)
+		return svgtiny_LIBDOM_ERROR;
+	if (content != NULL) {
+		shape->text = svgtiny_arena_strndup(frame->state.ctx->arena,
+				dom_string_data(content),
+				dom_string_byte_length(content));
+		dom_string_unref(content);
+	} else {
+		shape->text = svgtiny_arena_strndup(frame->state.ctx->arena,
+				"", 0);
+	}
+	shape->text_x = frame->text_x;
+	shape->text_y = frame->text_y;
+
+	return svgtiny_finish_shape(&frame->state);
 }
 
 
@@ -1294,7 +2030,7 @@ svgtiny_code svgtiny_parse_text(dom_element *text,
  */
 
 void svgtiny_parse_position_attributes(dom_element *node,
-		const struct svgtiny_parse_state state,
+		const struct svgtiny_parse_state *state,
 		float *x, float *y, float *width, float *height)
 {
 	dom_string *attr;
@@ -1302,31 +2038,31 @@ void svgtiny_parse_position_attributes(dom_element *node,
 
 	*x = 0;
 	*y = 0;
-	*width = state.viewport_width;
-	*height = state.viewport_height;
+	*width = state->ctx->viewport_width;
+	*height = state->ctx->viewport_height;
 
-	exc = dom_element_get_attribute(node, state.interned_x, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->x, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		*x = svgtiny_parse_length(attr, state.viewport_width, state);
+		*x = svgtiny_parse_length(attr, state->ctx->viewport_width, state);
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state.interned_y, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->y, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		*y = svgtiny_parse_length(attr, state.viewport_height, state);
+		*y = svgtiny_parse_length(attr, state->ctx->viewport_height, state);
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state.interned_width, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->width, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		*width = svgtiny_parse_length(attr, state.viewport_width,
+		*width = svgtiny_parse_length(attr, state->ctx->viewport_width,
 					      state);
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state.interned_height, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->height, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		*height = svgtiny_parse_length(attr, state.viewport_height,
+		*height = svgtiny_parse_length(attr, state->ctx->viewport_height,
 					       state);
 		dom_string_unref(attr);
 	}
@@ -1338,15 +2074,22 @@ void svgtiny_parse_position_attributes(dom_element *node,
  */
 
 static float _svgtiny_parse_length(const char *s, int viewport_size,
-				   const struct svgtiny_parse_state state)
+				   const struct svgtiny_parse_state *state)
 {
-	int num_length = (int)strspn(s, "0123456789+-.");
-	const char *unit = s + num_length;
-	float n = atof((const char *) s);
+	int num_length;
+	const char *unit;
+	float n;
 	float font_size = 20; /*css_len2px(&state.style.font_size.value.length, 0);*/
 
 	UNUSED(state);
 
+	/* s is NULL if copying it ran out of memory */
+	if (s == NULL)
+		return 0;
+	num_length = (int)strspn(s, "0123456789+-.");
+	unit = s + num_length;
+	n = atof((const char *) s);
+
 	if (unit[0] == 0) {
 		return n;
 	} else if (unit[0] == '%') {
@@ -1373,11 +2116,12 @@ static float _svgtiny_parse_length(const char *s, int viewport_size,
 }
 
 float svgtiny_parse_length(dom_string *s, int viewport_size,
-			   const struct svgtiny_parse_state state)
+			   const struct svgtiny_parse_state *state)
 {
-	char *ss = strndup(dom_string_data(s), dom_string_byte_length(s));
+	char *ss = svgtiny_mem_strndup(state->ctx->allocator,
+			dom_string_data(s), dom_string_byte_length(s));
 	float ret = _svgtiny_parse_length(ss, viewport_size, state);
-	free(ss);
+	svgtiny_mem_free(state->ctx->allocator, ss);
 	return ret;
 }
 
@@ -1391,21 +2135,22 @@ void svgtiny_parse_paint_attributes(dom_element *node,
 	dom_string *attr;
 	dom_exception exc;
 	
-	exc = dom_element_get_attribute(node, state->interned_fill, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->fill, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
 		svgtiny_parse_color(attr, &state->fill, state);
+		state->fill_gradient = state->ctx->gradient;
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state->interned_stroke, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->stroke, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
 		svgtiny_parse_color(attr, &state->stroke, state);
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state->interned_fill_opacity, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->fill_opacity, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		float f = svgtiny_parse_length(attr, 1, *state);
+		float f = svgtiny_parse_length(attr, 1, state);
     if (0.0f <= f && f <= 1.0f) {
       int alpha = f * 0xff;
       state->fill = (state->fill & 0xFFFFFF) | (alpha << 24);
@@ -1413,9 +2158,9 @@ void svgtiny_parse_paint_attributes(dom_element *node,
     dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state->interned_stroke_opacity, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->stroke_opacity, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		float f = svgtiny_parse_length(attr, 1, *state);
+		float f = svgtiny_parse_length(attr, 1, state);
     if (0.0f <= f && f <= 1.0f) {
       int alpha = f * 0xff;
       state->stroke = (state->stroke & 0xFFFFFF) | (alpha << 24);
@@ -1423,71 +2168,82 @@ void svgtiny_parse_paint_attributes(dom_element *node,
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state->interned_stroke_width, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->stroke_width, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
 		state->stroke_width = svgtiny_parse_length(attr,
-						state->viewport_width, *state);
+						state->ctx->viewport_width, state);
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(node, state->interned_style, &attr);
+	exc = dom_element_get_attribute(node, state->ctx->interned->style, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		char *style = strndup(dom_string_data(attr),
-				      dom_string_byte_length(attr));
+		char *style = svgtiny_mem_strndup(state->ctx->allocator,
+				dom_string_data(attr),
+				dom_string_byte_length(attr));
 		const char *s;
 		char *value;
+		if (style == NULL) {
+			dom_string_unref(attr);
+			return;
+		}
 		if ((s = strstr(style, "fill:"))) {
 			s += 5;
 			while (*s == ' ')
 				s++;
-			value = strndup(s, strcspn(s, "; "));
+			value = svgtiny_mem_strndup(state->ctx->allocator,
+					s, strcspn(s, "; "));
 			_svgtiny_parse_color(value, &state->fill, state);
-			free(value);
+			state->fill_gradient = state->ctx->gradient;
+			svgtiny_mem_free(state->ctx->allocator, value);
 		}
 		if ((s = strstr(style, "stroke:"))) {
 			s += 7;
 			while (*s == ' ')
 				s++;
-			value = strndup(s, strcspn(s, "; "));
+			value = svgtiny_mem_strndup(state->ctx->allocator,
+					s, strcspn(s, "; "));
 			_svgtiny_parse_color(value, &state->stroke, state);
-			free(value);
+			svgtiny_mem_free(state->ctx->allocator, value);
 		}
 		if ((s = strstr(style, "stroke-width:"))) {
 			s += 13;
 			while (*s == ' ')
 				s++;
-			value = strndup(s, strcspn(s, "; "));
+			value = svgtiny_mem_strndup(state->ctx->allocator,
+					s, strcspn(s, "; "));
 			state->stroke_width = _svgtiny_parse_length(value,
-						state->viewport_width, *state);
-			free(value);
+						state->ctx->viewport_width, state);
+			svgtiny_mem_free(state->ctx->allocator, value);
 		}
 		if ((s = strstr(style, "fill-opacity:"))) {
       float f;
 			s += 13;
 			while (*s == ' ')
 				s++;
-			value = strndup(s, strcspn(s, "; "));
-      f = _svgtiny_parse_length(value, 1, *state);
+			value = svgtiny_mem_strndup(state->ctx->allocator,
+					s, strcspn(s, "; "));
+      f = _svgtiny_parse_length(value, 1, state);
       if (0.0f <= f && f <= 1.0f) {
         int alpha = f * 0xff;
         state->fill = (state->fill & 0xFFFFFF) | (alpha << 24);
       }
-			free(value);
+			svgtiny_mem_free(state->ctx->allocator, value);
     }
 		if ((s = strstr(style, "stroke-opacity:"))) {
       float f;
  			s += 15;
 			while (*s == ' ')
 				s++;
-			value = strndup(s, strcspn(s, "; "));
-      f = _svgtiny_parse_length(value, 1, *state);
+			value = svgtiny_mem_strndup(state->ctx->allocator,
+					s, strcspn(s, "; "));
+      f = _svgtiny_parse_length(value, 1, state);
       if (0.0f <= f && f <= 1.0f) {
         int alpha = f * 0xff;
         state->stroke = (state->stroke & 0xFFFFFF) | (alpha << 24);
       }
-			free(value);
+			svgtiny_mem_free(state->ctx->allocator, value);
     }
-		free(style);
+		svgtiny_mem_free(state->ctx->allocator, style);
 		dom_string_unref(attr);
 	}
 }
@@ -1530,18 +2286,20 @@ static void _svgtiny_parse_color_inner(const char *s, svgtiny_colour *c,
 	} else if (5 < len && s[0] == 'u' && s[1] == 'r' && s[2] == 'l' &&
 			s[3] == '(') {
 		if (s[4] == '#') {
-			id = strdup(s + 5);
+			id = svgtiny_mem_strndup(state->ctx->allocator,
+					s + 5, len - 5);
 			if (!id)
 				return;
 			rparen = strchr(id, ')');
 			if (rparen)
 				*rparen = 0;
 			svgtiny_find_gradient(id, state);
-			free(id);
-			if (state->linear_gradient_stop_count == 0)
+			svgtiny_mem_free(state->ctx->allocator, id);
+			if (state->ctx->gradient == NULL ||
+					state->ctx->gradient->stop_count == 0)
 				*c = svgtiny_TRANSPARENT;
-			else if (state->linear_gradient_stop_count == 1)
-				*c = state->gradient_stop[0].color;
+			else if (state->ctx->gradient->stop_count == 1)
+				*c = state->ctx->gradient->stop[0].color;
 			else
 				*c = svgtiny_LINEAR_GRADIENT;
 		}
@@ -1558,6 +2316,9 @@ static void _svgtiny_parse_color(const char *s, svgtiny_colour *c,
 		struct svgtiny_parse_state *state)
 {
   svgtiny_colour innerColor;
+  if (s == NULL) {
+    return;
+  }
   _svgtiny_parse_color_inner(s, &innerColor, state);
   if (innerColor == svgtiny_TRANSPARENT || innerColor == svgtiny_LINEAR_GRADIENT) {
     *c = innerColor;
@@ -1572,9 +2333,10 @@ static void _svgtiny_parse_color(const char *s, svgtiny_colour *c,
 void svgtiny_parse_color(dom_string *s, svgtiny_colour *c,
 		struct svgtiny_parse_state *state)
 {
-	char *ss = strndup(dom_string_data(s), dom_string_byte_length(s));
+	char *ss = svgtiny_mem_strndup(state->ctx->allocator,
+			dom_string_data(s), dom_string_byte_length(s));
 	_svgtiny_parse_color(ss, c, state);
-	free(ss);
+	svgtiny_mem_free(state->ctx->allocator, ss);
 }
 
 /**
@@ -1620,20 +2382,47 @@ void svgtiny_parse_transform_attributes(dom_element *node,
 	dom_string *attr;
 	dom_exception exc;
 	
-	exc = dom_element_get_attribute(node, state->interned_transform,
+	exc = dom_element_get_attribute(node, state->ctx->interned->transform,
 					&attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		transform = strndup(dom_string_data(attr),
-				    dom_string_byte_length(attr));
-		svgtiny_parse_transform(transform, &state->ctm.a, &state->ctm.b,
-				&state->ctm.c, &state->ctm.d,
-				&state->ctm.e, &state->ctm.f);
-		free(transform);
+		transform = svgtiny_mem_strndup(state->ctx->allocator,
+				dom_string_data(attr),
+				dom_string_byte_length(attr));
+		if (transform != NULL)
+			svgtiny_parse_transform(transform,
+					&state->ctm.a, &state->ctm.b,
+					&state->ctm.c, &state->ctm.d,
+					&state->ctm.e, &state->ctm.f);
+		svgtiny_mem_free(state->ctx->allocator, transform);
 		dom_string_unref(attr);
 	}
 }
 
 
+/**
+ * Multiply the current transformation matrix by another, which applies
+ * first.
+ */
+
+void svgtiny_multiply_ctm(struct svgtiny_parse_state *state,
+		float a, float b, float c, float d, float e, float f)
+{
+	float za = state->ctm.a * a + state->ctm.c * b;
+	float zb = state->ctm.b * a + state->ctm.d * b;
+	float zc = state->ctm.a * c + state->ctm.c * d;
+	float zd = state->ctm.b * c + state->ctm.d * d;
+	float ze = state->ctm.a * e + state->ctm.c * f + state->ctm.e;
+	float zf = state->ctm.b * e + state->ctm.d * f + state->ctm.f;
+
+	state->ctm.a = za;
+	state->ctm.b = zb;
+	state->ctm.c = zc;
+	state->ctm.d = zd;
+	state->ctm.e = ze;
+	state->ctm.f = zf;
+}
+
+
 /**
  * Parse a transform string.
  */
@@ -1713,6 +2502,21 @@ void svgtiny_parse_transform(char *s, float *ma, float *mb,
 }
 
 
+/**
+ * Give a shape inside a <use> the paint of the <use> where it sets none.
+ */
+
+static void svgtiny_use_paint(struct svgtiny_parse_state *state)
+{
+	if (state->fill == 0 && state->use_fill != 0) {
+		state->fill = state->use_fill;
+		state->fill_gradient = state->use_fill_gradient;
+	}
+	if (state->stroke == 0)
+		state->stroke = state->use_stroke;
+}
+
+
 /**
  * Add a path to the svgtiny_diagram.
  */
@@ -1721,22 +2525,38 @@ svgtiny_code svgtiny_add_path(float *p, unsigned int n,
 		struct svgtiny_parse_state *state)
 {
 	struct svgtiny_shape *shape;
+	svgtiny_code code;
+	bool dropped;
+
+	svgtiny_use_paint(state);
+
+	n = svgtiny_simplify_path(p, n, state);
+
+	code = svgtiny_detail_path(p, n, state, &dropped);
+	if (dropped)
+		return code;
 
-	if (state->fill == svgtiny_LINEAR_GRADIENT)
-		return svgtiny_add_path_linear_gradient(p, n, state);
+	if (state->fill == svgtiny_LINEAR_GRADIENT) {
+		if (state->fill_gradient != NULL &&
+				(state->ctx->diagram->options &
+				svgtiny_KEEP_GRADIENTS))
+			return svgtiny_add_path_gradient_fill(p, n, state);
+		if (state->fill_gradient != NULL)
+			return svgtiny_add_path_linear_gradient(p, n, state);
+		state->fill = svgtiny_TRANSPARENT;
+	}
 
 	svgtiny_transform_path(p, n, state);
 
 	shape = svgtiny_add_shape(state);
 	if (!shape) {
-		free(p);
+		svgtiny_arena_free(state->ctx->arena, p);
 		return svgtiny_OUT_OF_MEMORY;
 	}
 	shape->path = p;
 	shape->path_length = n;
-	state->diagram->shape_count++;
 
-	return svgtiny_OK;
+	return svgtiny_finish_shape(state);
 }
 
 
@@ -1746,14 +2566,18 @@ svgtiny_code svgtiny_add_path(float *p, unsigned int n,
 
 struct svgtiny_shape *svgtiny_add_shape(struct svgtiny_parse_state *state)
 {
-	struct svgtiny_shape *shape = realloc(state->diagram->shape,
-			(state->diagram->shape_count + 1) *
-			sizeof (state->diagram->shape[0]));
-	if (!shape)
+	struct svgtiny_diagram *diagram = state->ctx->diagram;
+	struct svgtiny_shape *shape;
+
+	if (diagram->shape_count == diagram->_internal_shape_allocated &&
+			svgtiny_reserve_shapes(diagram,
+			svgtiny_list_capacity(diagram->shape_count + 1))
+			!= svgtiny_OK)
 		return 0;
-	state->diagram->shape = shape;
 
-	shape += state->diagram->shape_count;
+	svgtiny_use_paint(state);
+
+	shape = diagram->shape + diagram->shape_count;
 	shape->path = 0;
 	shape->path_length = 0;
 	shape->text = 0;
@@ -1764,11 +2588,33 @@ struct svgtiny_shape *svgtiny_add_shape(struct svgtiny_parse_state *state)
 	if (0 < state->stroke_width && shape->stroke_width == 0) {
 		shape->stroke_width = 1;
   }
+  shape->instance = 0;
   shape->_internal_extensions = 0;
 	return shape;
 }
 
 
+/**
+ * Complete the shape returned by the last svgtiny_add_shape(), either keeping
+ * it in the diagram or, when streaming, handing it to the callback.
+ */
+
+svgtiny_code svgtiny_finish_shape(struct svgtiny_parse_state *state)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	struct svgtiny_diagram *diagram = ctx->diagram;
+	struct svgtiny_shape *shape = diagram->shape + diagram->shape_count;
+
+	svgtiny_shape_bounds(shape);
+
+	if (ctx->callback)
+		return ctx->callback(shape, ctx->callback_ctx);
+
+	diagram->shape_count++;
+	return svgtiny_OK;
+}
+
+
 /**
  * Apply the current transformation matrix to a path.
  */
@@ -1810,28 +2656,99 @@ void svgtiny_transform_path(float *p, unsigned int n,
 }
 
 
+/**
+ * Empty a diagram for another svgtiny_parse(), keeping the shape array and
+ * the arena's chunks so that parsing a similar document allocates little.
+ */
+
+void svgtiny_reset(struct svgtiny_diagram *svg)
+{
+	assert(svg);
+
+	svgtiny_arena_reset(svg->_internal_arena);
+	svg->width = 0;
+	svg->height = 0;
+	svg->shape_count = 0;
+	svg->symbol_shape_count = 0;
+	svg->error_line = 0;
+	svg->error_message = 0;
+}
+
+
 /**
  * Free all memory used by a diagram.
  */
 
 void svgtiny_free(struct svgtiny_diagram *svg)
 {
-	unsigned int i;
+	svgtiny_allocator allocator;
 	assert(svg);
 
-	for (i = 0; i != svg->shape_count; i++) {
-		free(svg->shape[i].path);
-		free(svg->shape[i].text);
-		free(svg->shape[i]._internal_extensions);
-	}
-	
-	free(svg->shape);
+	/* the arena holds the diagram's allocator, so copy it out first */
+	allocator = *svgtiny_arena_allocator(svg->_internal_arena);
+
+	/* the shapes' paths and text all live in the arena */
+	svgtiny_arena_destroy(svg->_internal_scratch);
+	svgtiny_arena_destroy(svg->_internal_arena);
+	svgtiny_mem_free(&allocator, svg->shape);
+	svgtiny_mem_free(&allocator, svg->symbol_shape);
 
-	free(svg);
+	svgtiny_mem_free(&allocator, svg);
 }
 
-#ifndef HAVE_STRNDUP
-char *svgtiny_strndup(const char *s, size_t n)
+
+static void *svgtiny_default_alloc(size_t size, void *ctx)
+{
+	UNUSED(ctx);
+	return malloc(size);
+}
+
+static void *svgtiny_default_realloc(void *ptr, size_t size, void *ctx)
+{
+	UNUSED(ctx);
+	return realloc(ptr, size);
+}
+
+static void svgtiny_default_free(void *ptr, void *ctx)
+{
+	UNUSED(ctx);
+	free(ptr);
+}
+
+const svgtiny_allocator svgtiny_default_allocator = {
+	svgtiny_default_alloc,
+	svgtiny_default_realloc,
+	svgtiny_default_free,
+	NULL
+};
+
+#ifndef USE_XML2
+/* libdom has no allocator hooks. See xml2dom.c for the libxml2 version. */
+svgtiny_code svgtiny_set_xml_allocator(const svgtiny_allocator *allocator)
+{
+	UNUSED(allocator);
+	return svgtiny_LIBDOM_ERROR;
+}
+#endif
+
+
+/**
+ * Free memory from an allocator. Does nothing for NULL.
+ */
+
+void svgtiny_mem_free(const svgtiny_allocator *allocator, void *ptr)
+{
+	if (ptr != NULL)
+		allocator->free(ptr, allocator->ctx);
+}
+
+
+/**
+ * Copy at most n characters of a string into memory from an allocator.
+ */
+
+char *svgtiny_mem_strndup(const svgtiny_allocator *allocator,
+		const char *s, size_t n)
 {
 	size_t len;
 	char *s2;
@@ -1839,7 +2756,7 @@ char *svgtiny_strndup(const char *s, size_t n)
 	for (len = 0; len != n && s[len]; len++)
 		continue;
 
-	s2 = malloc(len + 1);
+	s2 = svgtiny_mem_alloc(allocator, len + 1);
 	if (s2 == NULL)
 		return NULL;
 
@@ -1848,5 +2765,4 @@ char *svgtiny_strndup(const char *s, size_t n)
 
 	return s2;
 }
-#endif
 
@@ -0,0 +1,420 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * A svgtiny_arena is a bump allocator that owns the memory of a diagram's
+ * shapes: paths, text, and extension blocks. Objects are carved out of large
+ * chunks one after another, so shapes parsed together sit together in
+ * memory, and destroying the arena frees a few chunks however many shapes
+ * there are. Objects are never freed individually, except that the most
+ * recent allocation may be grown, shrunk, or given back. Resetting an arena
+ * empties it but keeps its chunks as spares for the allocations that follow.
+ *
+ * The scratch allocator of an arena serves the short-lived memory of a
+ * parse from the same chunks. Its blocks are rounded up to a power of two,
+ * and freed blocks are kept on a list for their size, so that the DOM
+ * wrappers and strings made and dropped while walking a document reuse
+ * each other's memory instead of piling up until the parse ends.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#define SVGTINY_ARENA_ALIGN 8
+#define SVGTINY_ARENA_ALIGN_UP(n) \
+	(((n) + SVGTINY_ARENA_ALIGN - 1) & ~(size_t) (SVGTINY_ARENA_ALIGN - 1))
+
+/* scratch blocks hold 1 << class bytes, for class from the smallest up */
+#define SVGTINY_ARENA_SMALLEST_CLASS 4
+#define SVGTINY_ARENA_CLASSES (sizeof (size_t) * 8)
+
+/* size of the first chunk, doubled for each new chunk up to the maximum */
+#define SVGTINY_ARENA_FIRST_CHUNK 16384
+#define SVGTINY_ARENA_MAX_CHUNK (1024 * 1024)
+
+
+struct svgtiny_arena_chunk {
+	struct svgtiny_arena_chunk *next;	/* chunk allocated before */
+	size_t size;	/* bytes of data in the chunk */
+	size_t used;	/* bytes of data handed out (<= size) */
+};
+
+struct svgtiny_arena {
+	struct svgtiny_arena_chunk *chunk;	/* chunk being filled */
+	struct svgtiny_arena_chunk *spare;	/* emptied chunks, for reuse */
+	char *last;	/* most recent allocation in chunk, or 0 */
+	size_t chunk_size;	/* size of the next chunk / bytes */
+	svgtiny_allocator allocator;	/* source of the chunks */
+	svgtiny_allocator scratch;	/* allocates from this arena */
+	/* freed scratch blocks, linked through their data, by size class */
+	void *scratch_free[SVGTINY_ARENA_CLASSES];
+};
+
+#define SVGTINY_ARENA_HEADER \
+	SVGTINY_ARENA_ALIGN_UP(sizeof (struct svgtiny_arena_chunk))
+
+/* size class prefix of each block given out by the scratch allocator */
+#define SVGTINY_ARENA_BLOCK_HEADER SVGTINY_ARENA_ALIGN_UP(sizeof (size_t))
+
+static void *svgtiny_arena_scratch_alloc(size_t size, void *ctx);
+static void *svgtiny_arena_scratch_realloc(void *ptr, size_t size, void *ctx);
+static void svgtiny_arena_scratch_free(void *ptr, void *ctx);
+
+
+static char *svgtiny_arena_data(struct svgtiny_arena_chunk *chunk)
+{
+	return (char *) chunk + SVGTINY_ARENA_HEADER;
+}
+
+
+/**
+ * Get an empty chunk of at least size bytes, preferring a spare one.
+ */
+
+static struct svgtiny_arena_chunk *svgtiny_arena_chunk_create(
+		struct svgtiny_arena *arena, size_t size)
+{
+	struct svgtiny_arena_chunk *chunk, **prev;
+
+	for (prev = &arena->spare; *prev; prev = &(*prev)->next) {
+		if (size <= (*prev)->size) {
+			chunk = *prev;
+			*prev = chunk->next;
+			chunk->next = 0;
+			chunk->used = 0;
+			return chunk;
+		}
+	}
+
+	chunk = svgtiny_mem_alloc(&arena->allocator,
+			SVGTINY_ARENA_HEADER + size);
+	if (!chunk)
+		return 0;
+	chunk->next = 0;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+
+/**
+ * Create an empty svgtiny_arena that takes its chunks from allocator, which
+ * is copied. No chunk is allocated until first use.
+ */
+
+struct svgtiny_arena *svgtiny_arena_create(const svgtiny_allocator *allocator)
+{
+	struct svgtiny_arena *arena = svgtiny_mem_alloc(allocator,
+			sizeof *arena);
+	if (!arena)
+		return 0;
+	arena->chunk = 0;
+	arena->spare = 0;
+	arena->last = 0;
+	arena->chunk_size = SVGTINY_ARENA_FIRST_CHUNK;
+	arena->allocator = *allocator;
+	arena->scratch.alloc = svgtiny_arena_scratch_alloc;
+	arena->scratch.realloc = svgtiny_arena_scratch_realloc;
+	arena->scratch.free = svgtiny_arena_scratch_free;
+	arena->scratch.ctx = arena;
+	memset(arena->scratch_free, 0, sizeof arena->scratch_free);
+	return arena;
+}
+
+
+/**
+ * Return the allocator an arena takes its chunks from.
+ */
+
+const svgtiny_allocator *svgtiny_arena_allocator(struct svgtiny_arena *arena)
+{
+	return &arena->allocator;
+}
+
+
+/**
+ * Replace the allocator an arena takes its chunks from. The new allocator
+ * must be able to reallocate and free the chunks the old one gave.
+ */
+
+void svgtiny_arena_set_allocator(struct svgtiny_arena *arena,
+		const svgtiny_allocator *allocator)
+{
+	arena->allocator = *allocator;
+}
+
+
+/**
+ * Return an allocator that hands out blocks from the arena itself, for
+ * short-lived memory that is all dropped by svgtiny_arena_reset(). A freed
+ * block is reused by a later allocation of the same size class.
+ */
+
+const svgtiny_allocator *svgtiny_arena_scratch_allocator(
+		struct svgtiny_arena *arena)
+{
+	return &arena->scratch;
+}
+
+
+/**
+ * Allocate size bytes, aligned for any of the types stored in a diagram.
+ */
+
+void *svgtiny_arena_alloc(struct svgtiny_arena *arena, size_t size)
+{
+	struct svgtiny_arena_chunk *chunk = arena->chunk;
+	char *p;
+
+	size = SVGTINY_ARENA_ALIGN_UP(size);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		if (arena->chunk_size / 4 < size) {
+			/* large object: give it a chunk of its own, behind
+			 * the one being filled */
+			chunk = svgtiny_arena_chunk_create(arena, size);
+			if (!chunk)
+				return 0;
+			chunk->used = chunk->size;
+			if (arena->chunk) {
+				chunk->next = arena->chunk->next;
+				arena->chunk->next = chunk;
+			} else {
+				arena->chunk = chunk;
+				arena->last = 0;
+			}
+			return svgtiny_arena_data(chunk);
+		}
+
+		if (arena->spare && size <= arena->spare->size) {
+			/* refill a chunk kept by svgtiny_arena_reset() */
+			chunk = svgtiny_arena_chunk_create(arena,
+					arena->spare->size);
+		} else {
+			chunk = svgtiny_arena_chunk_create(arena,
+					arena->chunk_size);
+			if (chunk && chunk->size == arena->chunk_size &&
+					arena->chunk_size <
+					SVGTINY_ARENA_MAX_CHUNK)
+				arena->chunk_size *= 2;
+		}
+		if (!chunk)
+			return 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+
+	p = svgtiny_arena_data(chunk) + chunk->used;
+	chunk->used += size;
+	arena->last = p;
+	return p;
+}
+
+
+/**
+ * Resize an allocation of old_size bytes to size bytes. The most recent
+ * allocation is resized in place when it fits; any other allocation is
+ * copied. Returns 0 on failure, leaving p untouched.
+ */
+
+void *svgtiny_arena_realloc(struct svgtiny_arena *arena, void *p,
+		size_t old_size, size_t size)
+{
+	void *q;
+
+	if (!p)
+		return svgtiny_arena_alloc(arena, size);
+
+	if (p == arena->last) {
+		struct svgtiny_arena_chunk *chunk = arena->chunk;
+		size_t offset = arena->last - svgtiny_arena_data(chunk);
+		if (SVGTINY_ARENA_ALIGN_UP(size) <= chunk->size - offset) {
+			chunk->used = offset + SVGTINY_ARENA_ALIGN_UP(size);
+			return p;
+		}
+	}
+
+	q = svgtiny_arena_alloc(arena, size);
+	if (!q)
+		return 0;
+	memcpy(q, p, old_size < size ? old_size : size);
+	return q;
+}
+
+
+/**
+ * Give back an allocation. Only the most recent allocation is reused; the
+ * space of any other is reclaimed when the arena is destroyed.
+ */
+
+void svgtiny_arena_free(struct svgtiny_arena *arena, void *p)
+{
+	if (p && p == arena->last) {
+		arena->chunk->used = arena->last -
+				svgtiny_arena_data(arena->chunk);
+		arena->last = 0;
+	}
+}
+
+
+/**
+ * Copy at most n characters of a string into the arena.
+ */
+
+char *svgtiny_arena_strndup(struct svgtiny_arena *arena, const char *s,
+		size_t n)
+{
+	size_t len;
+	char *s2;
+
+	for (len = 0; len != n && s[len]; len++)
+		continue;
+
+	s2 = svgtiny_arena_alloc(arena, len + 1);
+	if (!s2)
+		return 0;
+
+	memcpy(s2, s, len);
+	s2[len] = '\0';
+	return s2;
+}
+
+
+/**
+ * The smallest scratch size class that holds size bytes, or
+ * SVGTINY_ARENA_CLASSES if none does.
+ */
+
+static unsigned int svgtiny_arena_class(size_t size)
+{
+	unsigned int class = SVGTINY_ARENA_SMALLEST_CLASS;
+
+	while (class != SVGTINY_ARENA_CLASSES && ((size_t) 1 << class) < size)
+		class++;
+	return class;
+}
+
+
+static void *svgtiny_arena_scratch_alloc(size_t size, void *ctx)
+{
+	struct svgtiny_arena *arena = ctx;
+	unsigned int class = svgtiny_arena_class(size);
+	size_t *block;
+
+	if (class == SVGTINY_ARENA_CLASSES ||
+			SIZE_MAX - SVGTINY_ARENA_BLOCK_HEADER <
+			(size_t) 1 << class)
+		return 0;
+
+	if (arena->scratch_free[class]) {
+		block = (size_t *) ((char *) arena->scratch_free[class] -
+				SVGTINY_ARENA_BLOCK_HEADER);
+		arena->scratch_free[class] = *(void **)
+				arena->scratch_free[class];
+		return (char *) block + SVGTINY_ARENA_BLOCK_HEADER;
+	}
+
+	block = svgtiny_arena_alloc(arena,
+			SVGTINY_ARENA_BLOCK_HEADER + ((size_t) 1 << class));
+	if (!block)
+		return 0;
+	*block = class;
+	return (char *) block + SVGTINY_ARENA_BLOCK_HEADER;
+}
+
+
+static void *svgtiny_arena_scratch_realloc(void *ptr, size_t size, void *ctx)
+{
+	size_t capacity;
+	void *copy;
+
+	if (!ptr)
+		return svgtiny_arena_scratch_alloc(size, ctx);
+
+	capacity = (size_t) 1 << *(size_t *) ((char *) ptr -
+			SVGTINY_ARENA_BLOCK_HEADER);
+	if (size <= capacity)
+		return ptr;
+
+	copy = svgtiny_arena_scratch_alloc(size, ctx);
+	if (!copy)
+		return 0;
+	memcpy(copy, ptr, capacity);
+	svgtiny_arena_scratch_free(ptr, ctx);
+	return copy;
+}
+
+
+static void svgtiny_arena_scratch_free(void *ptr, void *ctx)
+{
+	struct svgtiny_arena *arena = ctx;
+	size_t class;
+
+	if (!ptr)
+		return;
+	class = *(size_t *) ((char *) ptr - SVGTINY_ARENA_BLOCK_HEADER);
+	*(void **) ptr = arena->scratch_free[class];
+	arena->scratch_free[class] = ptr;
+}
+
+
+/**
+ * Discard every object allocated from an arena, keeping its chunks to be
+ * filled again by later allocations.
+ */
+
+void svgtiny_arena_reset(struct svgtiny_arena *arena)
+{
+	struct svgtiny_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunk; chunk; chunk = next) {
+		next = chunk->next;
+		chunk->next = arena->spare;
+		arena->spare = chunk;
+	}
+	arena->chunk = 0;
+	arena->last = 0;
+	memset(arena->scratch_free, 0, sizeof arena->scratch_free);
+}
+
+
+/**
+ * Free the spare chunks of an arena, which svgtiny_arena_reset() keeps for
+ * reuse.
+ */
+
+void svgtiny_arena_trim(struct svgtiny_arena *arena)
+{
+	struct svgtiny_arena_chunk *chunk, *next;
+
+	for (chunk = arena->spare; chunk; chunk = next) {
+		next = chunk->next;
+		svgtiny_mem_free(&arena->allocator, chunk);
+	}
+	arena->spare = 0;
+}
+
+
+/**
+ * Free an arena and every object allocated from it.
+ */
+
+void svgtiny_arena_destroy(struct svgtiny_arena *arena)
+{
+	svgtiny_allocator allocator;
+
+	if (!arena)
+		return;
+
+	allocator = arena->allocator;
+	svgtiny_arena_reset(arena);
+	svgtiny_arena_trim(arena);
+	svgtiny_mem_free(&allocator, arena);
+}
@@ -0,0 +1,784 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Binary form of a svgtiny_diagram, for caching parsed results.
+ *
+ * Every value is a 32-bit word in the byte order of the machine that saved
+ * it, and every reference is an offset from the start of the data, so the
+ * data can be loaded from wherever it sits, including a read-only mmap().
+ *
+ *   header     magic "svgtinyB", version, byte order mark 0x01020304,
+ *              width, height, shape count, total size, symbol shape count
+ *   shapes     one record per shape: path offset, path length, text
+ *              offset (0 for none), text x, text y, fill, stroke, stroke
+ *              width, bounds x0, y0, x1, y1, instance offset (0 for none),
+ *              gradient offset (0 for none), mesh offset (0 for none)
+ *   symbols    one record per symbol shape, as for shapes
+ *   instances  one record per instance shape: first, count, transform a,
+ *              b, c, d, e, f, fill, stroke
+ *   extensions one record per kept linear gradient or gradient mesh, in
+ *              shape order
+ *     gradient x1, y1, x2, y2, transform a, b, c, d, e, f, stop count,
+ *              and the offset and colour of each stop
+ *     mesh     vertex count, triangle count, the x and y of each vertex,
+ *              the colour of each vertex, and the three vertex indices of
+ *              each triangle
+ *   paths      the float arrays of every path
+ *   text       the NUL-terminated UTF-8 of every text shape
+ *
+ * A loaded diagram's paths and text point straight into the data.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#define SVGTINY_BINARY_MAGIC "svgtinyB"
+#define SVGTINY_BINARY_VERSION 4
+#define SVGTINY_BINARY_BYTE_ORDER 0x01020304
+
+/* sizes in 32-bit words */
+#define SVGTINY_BINARY_HEADER_WORDS 9
+#define SVGTINY_BINARY_SHAPE_WORDS 15
+#define SVGTINY_BINARY_INSTANCE_WORDS 10
+#define SVGTINY_BINARY_GRADIENT_WORDS(stops) (11 + 2 * (size_t) (stops))
+#define SVGTINY_BINARY_MESH_WORDS(vertices, triangles) \
+	(2 + 3 * (size_t) (vertices) + 3 * (size_t) (triangles))
+
+enum {
+	SVGTINY_HEADER_VERSION = 2,
+	SVGTINY_HEADER_BYTE_ORDER,
+	SVGTINY_HEADER_WIDTH,
+	SVGTINY_HEADER_HEIGHT,
+	SVGTINY_HEADER_SHAPE_COUNT,
+	SVGTINY_HEADER_SIZE,
+	SVGTINY_HEADER_SYMBOL_SHAPE_COUNT
+};
+
+enum {
+	SVGTINY_SHAPE_PATH,
+	SVGTINY_SHAPE_PATH_LENGTH,
+	SVGTINY_SHAPE_TEXT,
+	SVGTINY_SHAPE_TEXT_X,
+	SVGTINY_SHAPE_TEXT_Y,
+	SVGTINY_SHAPE_FILL,
+	SVGTINY_SHAPE_STROKE,
+	SVGTINY_SHAPE_STROKE_WIDTH,
+	SVGTINY_SHAPE_BOUNDS,
+	SVGTINY_SHAPE_INSTANCE = SVGTINY_SHAPE_BOUNDS + 4,
+	SVGTINY_SHAPE_GRADIENT,
+	SVGTINY_SHAPE_MESH
+};
+
+enum {
+	SVGTINY_INSTANCE_FIRST,
+	SVGTINY_INSTANCE_COUNT,
+	SVGTINY_INSTANCE_TRANSFORM,
+	SVGTINY_INSTANCE_FILL = SVGTINY_INSTANCE_TRANSFORM + 6,
+	SVGTINY_INSTANCE_STROKE
+};
+
+enum {
+	SVGTINY_GRADIENT_VECTOR,
+	SVGTINY_GRADIENT_TRANSFORM = SVGTINY_GRADIENT_VECTOR + 4,
+	SVGTINY_GRADIENT_STOP_COUNT = SVGTINY_GRADIENT_TRANSFORM + 6,
+	SVGTINY_GRADIENT_STOPS
+};
+
+enum {
+	SVGTINY_MESH_VERTEX_COUNT,
+	SVGTINY_MESH_TRIANGLE_COUNT,
+	SVGTINY_MESH_VERTICES
+};
+
+
+static void svgtiny_put_word(char *data, size_t word, uint32_t value)
+{
+	memcpy(data + word * 4, &value, 4);
+}
+
+
+static void svgtiny_put_float(char *data, size_t word, float value)
+{
+	memcpy(data + word * 4, &value, 4);
+}
+
+
+static uint32_t svgtiny_get_word(const char *data, size_t word)
+{
+	uint32_t value;
+	memcpy(&value, data + word * 4, 4);
+	return value;
+}
+
+
+static float svgtiny_get_float(const char *data, size_t word)
+{
+	float value;
+	memcpy(&value, data + word * 4, 4);
+	return value;
+}
+
+
+
+
+/**
+ * Add up the space that the paths, text and extensions (gradients and
+ * meshes) of shapes take in binary form, and count their instances.
+ */
+
+static void svgtiny_binary_measure(const struct svgtiny_shape *shape,
+		unsigned int n, size_t *paths, size_t *text,
+		size_t *extensions, unsigned int *instances)
+{
+	const struct svgtiny_linear_gradient *gradient;
+	const struct svgtiny_mesh *mesh;
+	unsigned int i;
+
+	for (i = 0; i != n; i++) {
+		if (shape[i].path)
+			*paths += (size_t) shape[i].path_length * 4;
+		if (shape[i].text)
+			*text += strlen(shape[i].text) + 1;
+		if (shape[i].instance)
+			(*instances)++;
+		gradient = svgtiny_shape_linear_gradient(&shape[i]);
+		if (gradient)
+			*extensions += SVGTINY_BINARY_GRADIENT_WORDS(
+					gradient->stop_count) * 4;
+		mesh = svgtiny_shape_mesh(&shape[i]);
+		if (mesh)
+			*extensions += SVGTINY_BINARY_MESH_WORDS(
+					mesh->vertex_count,
+					mesh->triangle_count) * 4;
+	}
+}
+
+
+/**
+ * Write a gradient record at the offset given, which is advanced past it.
+ */
+
+static uint32_t svgtiny_save_gradient(char *data, size_t *extensions,
+		const struct svgtiny_linear_gradient *gradient)
+{
+	char *g = data + *extensions;
+	uint32_t offset = *extensions;
+	unsigned int i;
+
+	svgtiny_put_float(g, SVGTINY_GRADIENT_VECTOR, gradient->x1);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_VECTOR + 1, gradient->y1);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_VECTOR + 2, gradient->x2);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_VECTOR + 3, gradient->y2);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM, gradient->transform.a);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM + 1,
+			gradient->transform.b);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM + 2,
+			gradient->transform.c);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM + 3,
+			gradient->transform.d);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM + 4,
+			gradient->transform.e);
+	svgtiny_put_float(g, SVGTINY_GRADIENT_TRANSFORM + 5,
+			gradient->transform.f);
+	svgtiny_put_word(g, SVGTINY_GRADIENT_STOP_COUNT, gradient->stop_count);
+	for (i = 0; i != gradient->stop_count; i++) {
+		svgtiny_put_float(g, SVGTINY_GRADIENT_STOPS + 2 * i,
+				gradient->stop[i].offset);
+		svgtiny_put_word(g, SVGTINY_GRADIENT_STOPS + 2 * i + 1,
+				gradient->stop[i].color);
+	}
+	*extensions += SVGTINY_BINARY_GRADIENT_WORDS(gradient->stop_count) * 4;
+	return offset;
+}
+
+
+/**
+ * Write a mesh record at the offset given, which is advanced past it.
+ */
+
+static uint32_t svgtiny_save_mesh(char *data, size_t *meshes,
+		const struct svgtiny_mesh *mesh)
+{
+	char *m = data + *meshes;
+	uint32_t offset = *meshes;
+	size_t colours = SVGTINY_MESH_VERTICES + 2 * (size_t) mesh->vertex_count;
+	size_t indices = colours + mesh->vertex_count;
+	unsigned int i;
+
+	svgtiny_put_word(m, SVGTINY_MESH_VERTEX_COUNT, mesh->vertex_count);
+	svgtiny_put_word(m, SVGTINY_MESH_TRIANGLE_COUNT, mesh->triangle_count);
+	for (i = 0; i != mesh->vertex_count; i++) {
+		svgtiny_put_float(m, SVGTINY_MESH_VERTICES + 2 * i,
+				mesh->vertex[2 * i]);
+		svgtiny_put_float(m, SVGTINY_MESH_VERTICES + 2 * i + 1,
+				mesh->vertex[2 * i + 1]);
+		svgtiny_put_word(m, colours + i, mesh->colour[i]);
+	}
+	for (i = 0; i != mesh->triangle_count * 3; i++)
+		svgtiny_put_word(m, indices + i, mesh->index[i]);
+	*meshes += SVGTINY_BINARY_MESH_WORDS(mesh->vertex_count,
+			mesh->triangle_count) * 4;
+	return offset;
+}
+
+
+/**
+ * Write the records of n shapes, with their paths, text, instances and
+ * extensions at the offsets given, which are advanced past them.
+ */
+
+static void svgtiny_save_shapes(char *data, size_t record,
+		const struct svgtiny_shape *shape, unsigned int n,
+		size_t *paths, size_t *text, size_t *instances,
+		size_t *extensions)
+{
+	const struct svgtiny_linear_gradient *gradient;
+	const struct svgtiny_mesh *mesh;
+	unsigned int i;
+
+	for (i = 0; i != n; i++, shape++,
+			record += SVGTINY_BINARY_SHAPE_WORDS * 4) {
+		char *r = data + record;
+		uint32_t path = 0, path_length = 0, text_offset = 0;
+		uint32_t instance = 0, gradient_offset = 0, mesh_offset = 0;
+
+		if (shape->path) {
+			path = *paths;
+			path_length = shape->path_length;
+			memcpy(data + *paths, shape->path, path_length * 4);
+			*paths += path_length * 4;
+		}
+		if (shape->text) {
+			size_t length = strlen(shape->text) + 1;
+			text_offset = *text;
+			memcpy(data + *text, shape->text, length);
+			*text += length;
+		}
+		if (shape->instance) {
+			const struct svgtiny_instance *in = shape->instance;
+			char *ir = data + *instances;
+			instance = *instances;
+			svgtiny_put_word(ir, SVGTINY_INSTANCE_FIRST, in->first);
+			svgtiny_put_word(ir, SVGTINY_INSTANCE_COUNT, in->count);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM,
+					in->transform.a);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM + 1,
+					in->transform.b);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM + 2,
+					in->transform.c);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM + 3,
+					in->transform.d);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM + 4,
+					in->transform.e);
+			svgtiny_put_float(ir, SVGTINY_INSTANCE_TRANSFORM + 5,
+					in->transform.f);
+			svgtiny_put_word(ir, SVGTINY_INSTANCE_FILL, in->fill);
+			svgtiny_put_word(ir, SVGTINY_INSTANCE_STROKE,
+					in->stroke);
+			*instances += SVGTINY_BINARY_INSTANCE_WORDS * 4;
+		}
+		gradient = svgtiny_shape_linear_gradient(shape);
+		if (gradient)
+			gradient_offset = svgtiny_save_gradient(data, extensions,
+					gradient);
+		mesh = svgtiny_shape_mesh(shape);
+		if (mesh)
+			mesh_offset = svgtiny_save_mesh(data, extensions, mesh);
+
+		svgtiny_put_word(r, SVGTINY_SHAPE_PATH, path);
+		svgtiny_put_word(r, SVGTINY_SHAPE_PATH_LENGTH, path_length);
+		svgtiny_put_word(r, SVGTINY_SHAPE_TEXT, text_offset);
+		svgtiny_put_float(r, SVGTINY_SHAPE_TEXT_X, shape->text_x);
+		svgtiny_put_float(r, SVGTINY_SHAPE_TEXT_Y, shape->text_y);
+		svgtiny_put_word(r, SVGTINY_SHAPE_FILL, shape->fill);
+		svgtiny_put_word(r, SVGTINY_SHAPE_STROKE, shape->stroke);
+		svgtiny_put_float(r, SVGTINY_SHAPE_STROKE_WIDTH,
+				shape->stroke_width);
+		svgtiny_put_float(r, SVGTINY_SHAPE_BOUNDS, shape->bounds.x0);
+		svgtiny_put_float(r, SVGTINY_SHAPE_BOUNDS + 1,
+				shape->bounds.y0);
+		svgtiny_put_float(r, SVGTINY_SHAPE_BOUNDS + 2,
+				shape->bounds.x1);
+		svgtiny_put_float(r, SVGTINY_SHAPE_BOUNDS + 3,
+				shape->bounds.y1);
+		svgtiny_put_word(r, SVGTINY_SHAPE_INSTANCE, instance);
+		svgtiny_put_word(r, SVGTINY_SHAPE_GRADIENT, gradient_offset);
+		svgtiny_put_word(r, SVGTINY_SHAPE_MESH, mesh_offset);
+	}
+}
+
+
+/**
+ * Write a diagram in binary form to buffer, if it is at least size bytes.
+ *
+ * Returns the number of bytes the binary form takes, which is written only
+ * if it fits, or 0 if the diagram is too large for the format.
+ */
+
+size_t svgtiny_save(const struct svgtiny_diagram *diagram,
+		void *buffer, size_t size)
+{
+	char *data = buffer;
+	size_t shapes, symbol_shapes, instances, extensions, paths, text, total;
+	size_t path_size = 0, text_size = 0, extension_size = 0;
+	unsigned int instance_count = 0;
+
+	assert(diagram);
+
+	/* lay out the sections */
+	svgtiny_binary_measure(diagram->shape, diagram->shape_count,
+			&path_size, &text_size, &extension_size,
+			&instance_count);
+	svgtiny_binary_measure(diagram->symbol_shape,
+			diagram->symbol_shape_count,
+			&path_size, &text_size, &extension_size,
+			&instance_count);
+	shapes = SVGTINY_BINARY_HEADER_WORDS * 4;
+	symbol_shapes = shapes + (size_t) diagram->shape_count *
+			SVGTINY_BINARY_SHAPE_WORDS * 4;
+	instances = symbol_shapes + (size_t) diagram->symbol_shape_count *
+			SVGTINY_BINARY_SHAPE_WORDS * 4;
+	extensions = instances + (size_t) instance_count *
+			SVGTINY_BINARY_INSTANCE_WORDS * 4;
+	paths = extensions + extension_size;
+	text = paths + path_size;
+	total = text + text_size;
+	if (UINT32_MAX < total)
+		return 0;
+	if (size < total)
+		return total;
+
+	memcpy(data, SVGTINY_BINARY_MAGIC, 8);
+	svgtiny_put_word(data, SVGTINY_HEADER_VERSION, SVGTINY_BINARY_VERSION);
+	svgtiny_put_word(data, SVGTINY_HEADER_BYTE_ORDER,
+			SVGTINY_BINARY_BYTE_ORDER);
+	svgtiny_put_word(data, SVGTINY_HEADER_WIDTH, diagram->width);
+	svgtiny_put_word(data, SVGTINY_HEADER_HEIGHT, diagram->height);
+	svgtiny_put_word(data, SVGTINY_HEADER_SHAPE_COUNT,
+			diagram->shape_count);
+	svgtiny_put_word(data, SVGTINY_HEADER_SIZE, total);
+	svgtiny_put_word(data, SVGTINY_HEADER_SYMBOL_SHAPE_COUNT,
+			diagram->symbol_shape_count);
+
+	svgtiny_save_shapes(data, shapes, diagram->shape,
+			diagram->shape_count, &paths, &text, &instances,
+			&extensions);
+	svgtiny_save_shapes(data, symbol_shapes, diagram->symbol_shape,
+			diagram->symbol_shape_count, &paths, &text, &instances,
+			&extensions);
+	return total;
+}
+
+
+/**
+ * Check that a path in binary data is a sequence of whole commands.
+ */
+
+static bool svgtiny_binary_path_ok(const float *p, uint32_t n)
+{
+	uint32_t j = 0;
+
+	while (j != n) {
+		uint32_t points;
+		/* compared as floats, as casting garbage to int is undefined */
+		if (p[j] == svgtiny_PATH_MOVE || p[j] == svgtiny_PATH_LINE)
+			points = 1;
+		else if (p[j] == svgtiny_PATH_CLOSE)
+			points = 0;
+		else if (p[j] == svgtiny_PATH_BEZIER)
+			points = 3;
+		else
+			return false;
+		if (n - j - 1 < points * 2)
+			return false;
+		j += 1 + points * 2;
+	}
+	return true;
+}
+
+
+static svgtiny_code svgtiny_binary_error(struct svgtiny_diagram *diagram,
+		const char *message)
+{
+	diagram->error_line = 0;
+	diagram->error_message = message;
+	return svgtiny_SVG_ERROR;
+}
+
+
+/**
+ * Check the records of n shapes in binary data of total bytes whose
+ * records start at shapes. Instances must draw a range of the
+ * symbol_count symbol shapes, and symbol shapes may not be instances.
+ *
+ * Returns an error message, or 0 if the records are sound.
+ */
+
+static const char *svgtiny_binary_shapes_ok(const char *data, uint32_t total,
+		size_t shapes, size_t record, uint32_t n, bool symbols,
+		uint32_t symbol_count, uint32_t *instance_count,
+		size_t *extension_size)
+{
+	uint32_t i;
+
+	for (i = 0; i != n; i++, record += SVGTINY_BINARY_SHAPE_WORDS * 4) {
+		const char *r = data + record;
+		uint32_t path = svgtiny_get_word(r, SVGTINY_SHAPE_PATH);
+		uint32_t path_length = svgtiny_get_word(r,
+				SVGTINY_SHAPE_PATH_LENGTH);
+		uint32_t text = svgtiny_get_word(r, SVGTINY_SHAPE_TEXT);
+		uint32_t instance = svgtiny_get_word(r,
+				SVGTINY_SHAPE_INSTANCE);
+		uint32_t gradient = svgtiny_get_word(r,
+				SVGTINY_SHAPE_GRADIENT);
+		uint32_t mesh = svgtiny_get_word(r, SVGTINY_SHAPE_MESH);
+
+		if (path != 0 && (path % 4 != 0 || path < shapes ||
+				total < path ||
+				(total - path) / 4 < path_length ||
+				!svgtiny_binary_path_ok(
+				(const float *) (data + path), path_length)))
+			return "binary diagram: bad path";
+		if (text != 0 && (text < shapes || total <= text ||
+				!memchr(data + text, 0, total - text)))
+			return "binary diagram: bad text";
+		if (instance != 0) {
+			uint32_t first, count;
+			if (symbols || instance % 4 != 0 ||
+					instance < shapes || total < instance ||
+					(total - instance) / 4 <
+					SVGTINY_BINARY_INSTANCE_WORDS)
+				return "binary diagram: bad instance";
+			first = svgtiny_get_word(data + instance,
+					SVGTINY_INSTANCE_FIRST);
+			count = svgtiny_get_word(data + instance,
+					SVGTINY_INSTANCE_COUNT);
+			if (symbol_count < first || symbol_count - first < count)
+				return "binary diagram: bad instance";
+			(*instance_count)++;
+		}
+		if (gradient != 0) {
+			uint32_t stop_count;
+			if (gradient % 4 != 0 || gradient < shapes ||
+					total < gradient ||
+					(total - gradient) / 4 <
+					SVGTINY_BINARY_GRADIENT_WORDS(0))
+				return "binary diagram: bad gradient";
+			stop_count = svgtiny_get_word(data + gradient,
+					SVGTINY_GRADIENT_STOP_COUNT);
+			if ((total - gradient) / 4 <
+					SVGTINY_BINARY_GRADIENT_WORDS(
+					stop_count))
+				return "binary diagram: bad gradient";
+			*extension_size += sizeof (struct
+					svgtiny_gradient_extension) +
+					stop_count * sizeof (struct
+					svgtiny_gradient_stop);
+		}
+		if (mesh != 0) {
+			uint32_t vertex_count, triangle_count, j;
+			size_t indices;
+			if (mesh % 4 != 0 || mesh < shapes || total < mesh ||
+					(total - mesh) / 4 <
+					SVGTINY_BINARY_MESH_WORDS(0, 0))
+				return "binary diagram: bad mesh";
+			vertex_count = svgtiny_get_word(data + mesh,
+					SVGTINY_MESH_VERTEX_COUNT);
+			triangle_count = svgtiny_get_word(data + mesh,
+					SVGTINY_MESH_TRIANGLE_COUNT);
+			if ((total - mesh) / 4 < SVGTINY_BINARY_MESH_WORDS(
+					vertex_count, triangle_count))
+				return "binary diagram: bad mesh";
+			indices = SVGTINY_MESH_VERTICES +
+					3 * (size_t) vertex_count;
+			for (j = 0; j != triangle_count * 3; j++)
+				if (vertex_count <= svgtiny_get_word(
+						data + mesh, indices + j))
+					return "binary diagram: bad mesh";
+			*extension_size += svgtiny_mesh_extension_size(
+					vertex_count, triangle_count);
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Copy a gradient record into an extension block at *block, which is
+ * advanced past it.
+ */
+
+static struct svgtiny_extension *svgtiny_load_gradient(const char *g,
+		char **block)
+{
+	struct svgtiny_gradient_extension *extension =
+			(struct svgtiny_gradient_extension *) *block;
+	struct svgtiny_gradient_stop *stop;
+	uint32_t i, stop_count = svgtiny_get_word(g,
+			SVGTINY_GRADIENT_STOP_COUNT);
+
+	extension->extension.next = 0;
+	extension->extension.type = svgtiny_EXTENSION_LINEAR_GRADIENT;
+	extension->gradient.x1 = svgtiny_get_float(g, SVGTINY_GRADIENT_VECTOR);
+	extension->gradient.y1 = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_VECTOR + 1);
+	extension->gradient.x2 = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_VECTOR + 2);
+	extension->gradient.y2 = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_VECTOR + 3);
+	extension->gradient.transform.a = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM);
+	extension->gradient.transform.b = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM + 1);
+	extension->gradient.transform.c = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM + 2);
+	extension->gradient.transform.d = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM + 3);
+	extension->gradient.transform.e = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM + 4);
+	extension->gradient.transform.f = svgtiny_get_float(g,
+			SVGTINY_GRADIENT_TRANSFORM + 5);
+	extension->gradient.stop_count = stop_count;
+	stop = (struct svgtiny_gradient_stop *) (extension + 1);
+	for (i = 0; i != stop_count; i++) {
+		stop[i].offset = svgtiny_get_float(g,
+				SVGTINY_GRADIENT_STOPS + 2 * i);
+		stop[i].color = svgtiny_get_word(g,
+				SVGTINY_GRADIENT_STOPS + 2 * i + 1);
+	}
+	extension->gradient.stop = stop;
+	*block = (char *) (stop + stop_count);
+	return &extension->extension;
+}
+
+
+/**
+ * Copy a mesh record into an extension block at *block, which is advanced
+ * past it.
+ */
+
+static struct svgtiny_extension *svgtiny_load_mesh(const char *m,
+		char **block)
+{
+	struct svgtiny_mesh_extension *extension =
+			(struct svgtiny_mesh_extension *) *block;
+	uint32_t vertex_count = svgtiny_get_word(m, SVGTINY_MESH_VERTEX_COUNT);
+	uint32_t triangle_count = svgtiny_get_word(m,
+			SVGTINY_MESH_TRIANGLE_COUNT);
+	size_t colours = SVGTINY_MESH_VERTICES + 2 * (size_t) vertex_count;
+	size_t indices = colours + vertex_count;
+	float *vertex;
+	svgtiny_colour *colour;
+	unsigned int *index;
+	uint32_t i;
+
+	svgtiny_mesh_extension_init(extension, vertex_count, triangle_count);
+	vertex = (float *) extension->mesh.vertex;
+	colour = (svgtiny_colour *) extension->mesh.colour;
+	index = (unsigned int *) extension->mesh.index;
+	memcpy(vertex, m + SVGTINY_MESH_VERTICES * 4,
+			(size_t) vertex_count * 2 * 4);
+	memcpy(colour, m + colours * 4, (size_t) vertex_count * 4);
+	for (i = 0; i != triangle_count * 3; i++)
+		index[i] = svgtiny_get_word(m, indices + i);
+	*block += svgtiny_mesh_extension_size(vertex_count, triangle_count);
+	return &extension->extension;
+}
+
+
+/**
+ * Add n shapes from their records in binary data to the end of shape,
+ * taking their instances from *instance and their gradients and meshes
+ * from *block, which are advanced past them. Instances are moved past the
+ * first symbol_base symbol shapes.
+ */
+
+static void svgtiny_load_shapes(const char *data, size_t record,
+		struct svgtiny_shape *shape, uint32_t n,
+		struct svgtiny_instance **instance, char **block,
+		unsigned int symbol_base)
+{
+	uint32_t i;
+
+	for (i = 0; i != n; i++, shape++,
+			record += SVGTINY_BINARY_SHAPE_WORDS * 4) {
+		const char *r = data + record;
+		uint32_t path = svgtiny_get_word(r, SVGTINY_SHAPE_PATH);
+		uint32_t text = svgtiny_get_word(r, SVGTINY_SHAPE_TEXT);
+		uint32_t offset = svgtiny_get_word(r, SVGTINY_SHAPE_INSTANCE);
+		uint32_t gradient = svgtiny_get_word(r, SVGTINY_SHAPE_GRADIENT);
+		uint32_t mesh = svgtiny_get_word(r, SVGTINY_SHAPE_MESH);
+		struct svgtiny_extension **extension;
+
+		shape->path = path ? (float *) (data + path) : 0;
+		shape->path_length = svgtiny_get_word(r,
+				SVGTINY_SHAPE_PATH_LENGTH);
+		shape->text = text ? (char *) (data + text) : 0;
+		shape->text_x = svgtiny_get_float(r, SVGTINY_SHAPE_TEXT_X);
+		shape->text_y = svgtiny_get_float(r, SVGTINY_SHAPE_TEXT_Y);
+		shape->fill = svgtiny_get_word(r, SVGTINY_SHAPE_FILL);
+		shape->stroke = svgtiny_get_word(r, SVGTINY_SHAPE_STROKE);
+		shape->stroke_width = svgtiny_get_float(r,
+				SVGTINY_SHAPE_STROKE_WIDTH);
+		shape->bounds.x0 = svgtiny_get_float(r, SVGTINY_SHAPE_BOUNDS);
+		shape->bounds.y0 = svgtiny_get_float(r,
+				SVGTINY_SHAPE_BOUNDS + 1);
+		shape->bounds.x1 = svgtiny_get_float(r,
+				SVGTINY_SHAPE_BOUNDS + 2);
+		shape->bounds.y1 = svgtiny_get_float(r,
+				SVGTINY_SHAPE_BOUNDS + 3);
+		shape->instance = 0;
+		shape->_internal_extensions = 0;
+		extension = (struct svgtiny_extension **)
+				&shape->_internal_extensions;
+		if (gradient) {
+			*extension = svgtiny_load_gradient(data + gradient,
+					block);
+			extension = &(*extension)->next;
+		}
+		if (mesh)
+			*extension = svgtiny_load_mesh(data + mesh, block);
+
+		if (offset != 0) {
+			const char *ir = data + offset;
+			struct svgtiny_instance *in = (*instance)++;
+			in->first = symbol_base + svgtiny_get_word(ir,
+					SVGTINY_INSTANCE_FIRST);
+			in->count = svgtiny_get_word(ir,
+					SVGTINY_INSTANCE_COUNT);
+			in->transform.a = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM);
+			in->transform.b = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM + 1);
+			in->transform.c = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM + 2);
+			in->transform.d = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM + 3);
+			in->transform.e = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM + 4);
+			in->transform.f = svgtiny_get_float(ir,
+					SVGTINY_INSTANCE_TRANSFORM + 5);
+			in->fill = svgtiny_get_word(ir, SVGTINY_INSTANCE_FILL);
+			in->stroke = svgtiny_get_word(ir,
+					SVGTINY_INSTANCE_STROKE);
+			shape->instance = in;
+		}
+	}
+}
+
+
+/**
+ * Add the shapes in binary data written by svgtiny_save() to a diagram.
+ *
+ * The paths and text of the new shapes point into buffer, which must stay
+ * unchanged until the diagram is freed or reset. If buffer is not aligned
+ * for floats, it is copied into the diagram instead. Instance, gradient
+ * and mesh records are always copied.
+ *
+ * Returns svgtiny_NOT_SVG if buffer does not hold the binary form, and
+ * svgtiny_SVG_ERROR if it is of another version or byte order, or damaged.
+ */
+
+svgtiny_code svgtiny_load(struct svgtiny_diagram *diagram,
+		const void *buffer, size_t size)
+{
+	const char *data = buffer;
+	uint32_t shape_count, symbol_count, instance_count = 0, total;
+	size_t shapes, symbol_shapes;
+	struct svgtiny_instance *instance = 0;
+	size_t extension_size = 0;
+	char *block = 0;
+	const char *message;
+	svgtiny_code code;
+
+	assert(diagram);
+	assert(buffer);
+
+	if (size < SVGTINY_BINARY_HEADER_WORDS * 4 ||
+			memcmp(data, SVGTINY_BINARY_MAGIC, 8) != 0)
+		return svgtiny_NOT_SVG;
+	if (svgtiny_get_word(data, SVGTINY_HEADER_VERSION) !=
+			SVGTINY_BINARY_VERSION)
+		return svgtiny_binary_error(diagram,
+				"binary diagram: unknown version");
+	if (svgtiny_get_word(data, SVGTINY_HEADER_BYTE_ORDER) !=
+			SVGTINY_BINARY_BYTE_ORDER)
+		return svgtiny_binary_error(diagram,
+				"binary diagram: wrong byte order");
+
+	total = svgtiny_get_word(data, SVGTINY_HEADER_SIZE);
+	shape_count = svgtiny_get_word(data, SVGTINY_HEADER_SHAPE_COUNT);
+	symbol_count = svgtiny_get_word(data,
+			SVGTINY_HEADER_SYMBOL_SHAPE_COUNT);
+	shapes = SVGTINY_BINARY_HEADER_WORDS * 4;
+	if (size < total || total < shapes ||
+			(uint64_t) shapes + ((uint64_t) shape_count +
+			symbol_count) * SVGTINY_BINARY_SHAPE_WORDS * 4 >
+			total)
+		return svgtiny_binary_error(diagram,
+				"binary diagram: truncated");
+	symbol_shapes = shapes + (size_t) shape_count *
+			SVGTINY_BINARY_SHAPE_WORDS * 4;
+
+	if ((uintptr_t) data % sizeof (float) != 0) {
+		char *copy = svgtiny_arena_alloc(diagram->_internal_arena,
+				total);
+		if (!copy)
+			return svgtiny_OUT_OF_MEMORY;
+		memcpy(copy, data, total);
+		data = copy;
+	}
+
+	/* check every record before changing the diagram */
+	message = svgtiny_binary_shapes_ok(data, total, shapes, shapes,
+			shape_count, false, symbol_count, &instance_count,
+			&extension_size);
+	if (!message)
+		message = svgtiny_binary_shapes_ok(data, total, shapes,
+				symbol_shapes, symbol_count, true,
+				symbol_count, &instance_count, &extension_size);
+	if (message)
+		return svgtiny_binary_error(diagram, message);
+
+	code = svgtiny_reserve_shapes(diagram,
+			diagram->shape_count + shape_count);
+	if (code != svgtiny_OK)
+		return code;
+	code = svgtiny_reserve_symbol_shapes(diagram,
+			diagram->symbol_shape_count + symbol_count);
+	if (code != svgtiny_OK)
+		return code;
+	if (instance_count != 0) {
+		instance = svgtiny_arena_alloc(diagram->_internal_arena,
+				instance_count * sizeof *instance);
+		if (!instance)
+			return svgtiny_OUT_OF_MEMORY;
+	}
+	if (extension_size != 0) {
+		block = svgtiny_arena_alloc(diagram->_internal_arena,
+				extension_size);
+		if (!block)
+			return svgtiny_OUT_OF_MEMORY;
+	}
+
+	diagram->width = (int) svgtiny_get_word(data, SVGTINY_HEADER_WIDTH);
+	diagram->height = (int) svgtiny_get_word(data, SVGTINY_HEADER_HEIGHT);
+
+	svgtiny_load_shapes(data, shapes,
+			diagram->shape + diagram->shape_count, shape_count,
+			&instance, &block, diagram->symbol_shape_count);
+	svgtiny_load_shapes(data, symbol_shapes,
+			diagram->symbol_shape + diagram->symbol_shape_count,
+			symbol_count, &instance, &block, 0);
+	diagram->shape_count += shape_count;
+	diagram->symbol_shape_count += symbol_count;
+
+	return svgtiny_OK;
+}
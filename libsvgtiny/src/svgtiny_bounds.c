@@ -0,0 +1,483 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Shape bounds, and a svgtiny_index over them.
+ *
+ * A svgtiny_index is a packed R-tree: the shapes are sorted along a Hilbert
+ * curve through their centres, and every run of SVGTINY_INDEX_NODE_SIZE
+ * boxes on one level is enclosed by one box on the level above, up to a
+ * single root. All levels live in flat arrays, so the tree is built in
+ * O(n log n) with a handful of allocations, and it is never modified once
+ * built, which lets any number of threads query it at once.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#define SVGTINY_INDEX_NODE_SIZE 16
+/* enough levels for 16^8 = 2^32 shapes */
+#define SVGTINY_INDEX_MAX_LEVELS 9
+
+
+struct svgtiny_index {
+	unsigned int shape_count;	/* leaves, on level 0 */
+	unsigned int node_count;	/* leaves and internal nodes */
+	unsigned int levels;
+	/* index in box and id one past the end of each level */
+	unsigned int level_end[SVGTINY_INDEX_MAX_LEVELS];
+	/* x0, y0, x1, y1 of each leaf and node, level by level */
+	float *box;
+	/* for a leaf, its shape index; for a node, its first child */
+	unsigned int *id;
+	svgtiny_allocator allocator;
+};
+
+struct svgtiny_index_leaf {
+	uint32_t hilbert;
+	unsigned int shape;
+};
+
+
+/**
+ * Extend a range to take in the extrema of one coordinate of a cubic Bézier
+ * from a through control points b and c to d.
+ */
+
+static void svgtiny_bezier_extend(float a, float b, float c, float d,
+		float *min, float *max)
+{
+	/* B'(t) / 3 = qa t^2 + qb t + qc */
+	float qa = -a + 3 * b - 3 * c + d;
+	float qb = 2 * (a - 2 * b + c);
+	float qc = b - a;
+	float t[2];
+	unsigned int roots = 0, i;
+
+	if (fabsf(qa) < 1e-12f) {
+		if (fabsf(qb) >= 1e-12f)
+			t[roots++] = -qc / qb;
+	} else {
+		float discriminant = qb * qb - 4 * qa * qc;
+		if (0 <= discriminant) {
+			float root = sqrtf(discriminant);
+			t[roots++] = (-qb + root) / (2 * qa);
+			t[roots++] = (-qb - root) / (2 * qa);
+		}
+	}
+
+	for (i = 0; i != roots; i++) {
+		float u, v;
+		if (t[i] <= 0 || 1 <= t[i])
+			continue;
+		u = 1 - t[i];
+		v = u * u * u * a + 3 * u * u * t[i] * b +
+				3 * u * t[i] * t[i] * c + t[i] * t[i] * t[i] * d;
+		if (v < *min)
+			*min = v;
+		if (*max < v)
+			*max = v;
+	}
+}
+
+
+/**
+ * Get the bounding box of path. Curves are bounded by their extrema, not
+ * their control points. An empty path has an empty box at the origin.
+ */
+
+void svgtiny_path_bbox(const float *p, unsigned int n,
+		float *x0, float *y0, float *x1, float *y1)
+{
+	float last_x = 0, last_y = 0, start_x = 0, start_y = 0;
+	unsigned int j;
+
+	if (n < 3) {
+		*x0 = *y0 = *x1 = *y1 = 0;
+		return;
+	}
+
+	*x0 = *x1 = p[1];
+	*y0 = *y1 = p[2];
+
+	for (j = 0; j != n; ) {
+		unsigned int points = 0;
+		unsigned int k;
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			start_x = p[j + 1];
+			start_y = p[j + 2];
+			points = 1;
+			break;
+		case svgtiny_PATH_LINE:
+			points = 1;
+			break;
+		case svgtiny_PATH_CLOSE:
+			last_x = start_x;
+			last_y = start_y;
+			points = 0;
+			break;
+		case svgtiny_PATH_BEZIER:
+			points = 3;
+			svgtiny_bezier_extend(last_x, p[j + 1], p[j + 3],
+					p[j + 5], x0, x1);
+			svgtiny_bezier_extend(last_y, p[j + 2], p[j + 4],
+					p[j + 6], y0, y1);
+			break;
+		default:
+			assert(0);
+		}
+		j++;
+		for (k = 0; k != points; k++) {
+			float x = p[j], y = p[j + 1];
+			/* control points only count through the extrema */
+			if (k + 1 == points) {
+				if (x < *x0)
+					*x0 = x;
+				else if (*x1 < x)
+					*x1 = x;
+				if (y < *y0)
+					*y0 = y;
+				else if (*y1 < y)
+					*y1 = y;
+				last_x = x;
+				last_y = y;
+			}
+			j += 2;
+		}
+	}
+}
+
+
+/**
+ * Set the bounds of a finished shape: the box of its path, or the anchor
+ * point of its text.
+ */
+
+void svgtiny_shape_bounds(struct svgtiny_shape *shape)
+{
+	if (shape->instance) {
+		/* set by svgtiny_instance_bounds() */
+	} else if (shape->path) {
+		svgtiny_path_bbox(shape->path, shape->path_length,
+				&shape->bounds.x0, &shape->bounds.y0,
+				&shape->bounds.x1, &shape->bounds.y1);
+	} else {
+		shape->bounds.x0 = shape->bounds.x1 = shape->text_x;
+		shape->bounds.y0 = shape->bounds.y1 = shape->text_y;
+	}
+}
+
+
+/**
+ * Set the bounds of an instance shape to the box of its symbol's shapes
+ * once transformed, and its stroke width to the widest of theirs.
+ */
+
+void svgtiny_instance_bounds(struct svgtiny_shape *shape,
+		const struct svgtiny_shape *symbol_shape)
+{
+	const struct svgtiny_instance *instance = shape->instance;
+	float a = instance->transform.a, b = instance->transform.b;
+	float c = instance->transform.c, d = instance->transform.d;
+	float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+	float stroke_width = 0;
+	unsigned int i, k;
+
+	for (i = instance->first; i != instance->first + instance->count;
+			i++) {
+		const struct svgtiny_shape *s = &symbol_shape[i];
+		float corner[4][2] = {
+			{ s->bounds.x0, s->bounds.y0 },
+			{ s->bounds.x1, s->bounds.y0 },
+			{ s->bounds.x0, s->bounds.y1 },
+			{ s->bounds.x1, s->bounds.y1 }
+		};
+		for (k = 0; k != 4; k++) {
+			float x = a * corner[k][0] + c * corner[k][1] +
+					instance->transform.e;
+			float y = b * corner[k][0] + d * corner[k][1] +
+					instance->transform.f;
+			x0 = fminf(x0, x);
+			y0 = fminf(y0, y);
+			x1 = fmaxf(x1, x);
+			y1 = fmaxf(y1, y);
+		}
+		stroke_width = fmaxf(stroke_width, s->stroke_width);
+	}
+
+	shape->bounds.x0 = x0;
+	shape->bounds.y0 = y0;
+	shape->bounds.x1 = x1;
+	shape->bounds.y1 = y1;
+	shape->stroke_width = stroke_width * sqrtf(fabsf(a * d - b * c));
+}
+
+
+/**
+ * Position of (x, y) along a Hilbert curve filling a 2^16 by 2^16 grid.
+ */
+
+static uint32_t svgtiny_hilbert(uint32_t x, uint32_t y)
+{
+	uint32_t rx, ry, s, d = 0;
+
+	for (s = 1 << 15; s != 0; s >>= 1) {
+		rx = (x & s) != 0;
+		ry = (y & s) != 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			x ^= y;
+			y ^= x;
+			x ^= y;
+		}
+	}
+	return d;
+}
+
+
+static int svgtiny_index_leaf_compare(const void *a, const void *b)
+{
+	const struct svgtiny_index_leaf *la = a, *lb = b;
+	if (la->hilbert != lb->hilbert)
+		return la->hilbert < lb->hilbert ? -1 : 1;
+	return la->shape < lb->shape ? -1 : la->shape != lb->shape;
+}
+
+
+static int svgtiny_index_id_compare(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int *) a;
+	unsigned int ib = *(const unsigned int *) b;
+	return ia < ib ? -1 : ia != ib;
+}
+
+
+/**
+ * Get the box a shape may paint into: its bounds, grown by the reach of its
+ * stroke.
+ */
+
+static void svgtiny_index_shape_box(const struct svgtiny_shape *shape,
+		float *box)
+{
+	float reach = 0;
+
+	if (shape->stroke != svgtiny_TRANSPARENT)
+		reach = shape->stroke_width * SVGTINY_STROKE_REACH;
+	box[0] = shape->bounds.x0 - reach;
+	box[1] = shape->bounds.y0 - reach;
+	box[2] = shape->bounds.x1 + reach;
+	box[3] = shape->bounds.y1 + reach;
+}
+
+
+/**
+ * Build a svgtiny_index over the shapes of a diagram, using the diagram's
+ * allocator. The index is not updated if the diagram changes.
+ */
+
+struct svgtiny_index *svgtiny_index_create(
+		const struct svgtiny_diagram *diagram)
+{
+	const svgtiny_allocator *allocator =
+			svgtiny_arena_allocator(diagram->_internal_arena);
+	unsigned int n = diagram->shape_count;
+	unsigned int count, total, level, i;
+	struct svgtiny_index_leaf *leaf;
+	struct svgtiny_index *index;
+	float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+	float scale_x, scale_y;
+
+	index = svgtiny_mem_alloc(allocator, sizeof *index);
+	if (!index)
+		return 0;
+	index->shape_count = n;
+	index->allocator = *allocator;
+	index->levels = 0;
+	index->box = 0;
+	index->id = 0;
+
+	/* count the nodes on each level */
+	total = count = n;
+	if (n != 0) {
+		index->level_end[index->levels++] = n;
+		do {
+			count = (count + SVGTINY_INDEX_NODE_SIZE - 1) /
+					SVGTINY_INDEX_NODE_SIZE;
+			total += count;
+			index->level_end[index->levels++] = total;
+		} while (count != 1);
+	}
+	index->node_count = total;
+	if (n == 0)
+		return index;
+
+	index->box = svgtiny_mem_alloc(allocator,
+			(size_t) total * 4 * sizeof index->box[0]);
+	index->id = svgtiny_mem_alloc(allocator,
+			(size_t) total * sizeof index->id[0]);
+	leaf = svgtiny_mem_alloc(allocator, (size_t) n * sizeof leaf[0]);
+	if (!index->box || !index->id || !leaf) {
+		svgtiny_mem_free(allocator, leaf);
+		svgtiny_index_free(index);
+		return 0;
+	}
+
+	/* order the leaves along a Hilbert curve through the diagram */
+	for (i = 0; i != n; i++) {
+		float box[4];
+		svgtiny_index_shape_box(&diagram->shape[i], box);
+		if (i == 0 || box[0] < min_x)
+			min_x = box[0];
+		if (i == 0 || box[1] < min_y)
+			min_y = box[1];
+		if (i == 0 || max_x < box[2])
+			max_x = box[2];
+		if (i == 0 || max_y < box[3])
+			max_y = box[3];
+	}
+	scale_x = max_x != min_x ? 65535 / (max_x - min_x) : 0;
+	scale_y = max_y != min_y ? 65535 / (max_y - min_y) : 0;
+	for (i = 0; i != n; i++) {
+		float box[4];
+		svgtiny_index_shape_box(&diagram->shape[i], box);
+		leaf[i].hilbert = svgtiny_hilbert(
+				((box[0] + box[2]) / 2 - min_x) * scale_x,
+				((box[1] + box[3]) / 2 - min_y) * scale_y);
+		leaf[i].shape = i;
+	}
+	qsort(leaf, n, sizeof leaf[0], svgtiny_index_leaf_compare);
+	for (i = 0; i != n; i++) {
+		svgtiny_index_shape_box(&diagram->shape[leaf[i].shape],
+				&index->box[i * 4]);
+		index->id[i] = leaf[i].shape;
+	}
+	svgtiny_mem_free(allocator, leaf);
+
+	/* enclose each run of boxes in a node on the level above */
+	for (level = 1; level != index->levels; level++) {
+		unsigned int child = level == 1 ? 0 :
+				index->level_end[level - 2];
+		unsigned int end = index->level_end[level - 1];
+		unsigned int node = end;
+		for (; child != end; node++) {
+			unsigned int last = child + SVGTINY_INDEX_NODE_SIZE;
+			float *box = &index->box[node * 4];
+			if (end < last)
+				last = end;
+			index->id[node] = child;
+			box[0] = index->box[child * 4];
+			box[1] = index->box[child * 4 + 1];
+			box[2] = index->box[child * 4 + 2];
+			box[3] = index->box[child * 4 + 3];
+			for (child++; child != last; child++) {
+				const float *c = &index->box[child * 4];
+				if (c[0] < box[0])
+					box[0] = c[0];
+				if (c[1] < box[1])
+					box[1] = c[1];
+				if (box[2] < c[2])
+					box[2] = c[2];
+				if (box[3] < c[3])
+					box[3] = c[3];
+			}
+		}
+		assert(node == index->level_end[level]);
+	}
+
+	return index;
+}
+
+
+/**
+ * Find the shapes that may paint into the rectangle from (x0, y0) to
+ * (x1, y1), in O(log n + k) for k matches.
+ *
+ * Up to max shape indices are stored in indices. The number of matching
+ * shapes is returned; if it is at most max, the indices are in ascending
+ * order, which is painting order. Otherwise only the first max found are
+ * stored, in no particular order, and the query should be repeated with a
+ * larger array.
+ */
+
+unsigned int svgtiny_index_query(const struct svgtiny_index *index,
+		float x0, float y0, float x1, float y1,
+		unsigned int *indices, unsigned int max)
+{
+	struct {
+		unsigned int node;
+		unsigned int level;
+	} stack[SVGTINY_INDEX_MAX_LEVELS * SVGTINY_INDEX_NODE_SIZE];
+	unsigned int depth = 0, found = 0;
+
+	if (index->shape_count == 0)
+		return 0;
+
+	stack[depth].node = index->node_count - 1;
+	stack[depth].level = index->levels - 1;
+	depth++;
+
+	while (depth != 0) {
+		unsigned int node, level, child, end;
+
+		depth--;
+		node = stack[depth].node;
+		level = stack[depth].level;
+
+		child = index->id[node];
+		end = child + SVGTINY_INDEX_NODE_SIZE;
+		if (index->level_end[level - 1] < end)
+			end = index->level_end[level - 1];
+		for (; child != end; child++) {
+			const float *box = &index->box[child * 4];
+			if (x1 < box[0] || box[2] < x0 ||
+					y1 < box[1] || box[3] < y0)
+				continue;
+			if (level == 1) {
+				if (found < max)
+					indices[found] = index->id[child];
+				found++;
+				continue;
+			}
+			assert(depth != sizeof stack / sizeof stack[0]);
+			stack[depth].node = child;
+			stack[depth].level = level - 1;
+			depth++;
+		}
+	}
+
+	if (found <= max)
+		qsort(indices, found, sizeof indices[0],
+				svgtiny_index_id_compare);
+	return found;
+}
+
+
+/**
+ * Free a svgtiny_index.
+ */
+
+void svgtiny_index_free(struct svgtiny_index *index)
+{
+	svgtiny_allocator allocator;
+
+	if (!index)
+		return;
+
+	allocator = index->allocator;
+	svgtiny_mem_free(&allocator, index->box);
+	svgtiny_mem_free(&allocator, index->id);
+	svgtiny_mem_free(&allocator, index);
+}
@@ -0,0 +1,572 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * A svgtiny_cache maps SVG source and viewport to the parsed diagram.
+ *
+ * Entries are found by a 64-bit XXH64 hash of the source, seeded with the
+ * viewport, and confirmed by comparing the source itself, which each entry
+ * keeps. The cache is split into shards, each with its own lock, hash table
+ * and least-recently-used list, so that workers looking up different
+ * documents rarely wait for each other. Parsing happens outside any lock.
+ *
+ * An entry is reference counted: the cache holds one reference while the
+ * entry is in its table, and each caller of svgtiny_cache_parse() holds one
+ * until svgtiny_cache_release(). An entry evicted while in use is freed by
+ * its last release. The diagram of an entry is never changed after it is
+ * parsed, so any number of threads may read it at once.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#define SVGTINY_CACHE_SHARDS 16
+#define SVGTINY_CACHE_FIRST_BUCKETS 64
+
+/* size prefix of each block counted against the budget */
+#define SVGTINY_CACHE_BLOCK_HEADER 16
+
+
+struct svgtiny_cache_entry {
+	/* key */
+	uint64_t hash;
+	char *source;
+	size_t size;
+	int viewport_width, viewport_height;
+
+	struct svgtiny_diagram *diagram;
+	svgtiny_code code;
+	/* bytes of source, entry and diagram, counted against the budget */
+	size_t bytes;
+	atomic_uint refs;
+
+	/* links, protected by the shard lock */
+	struct svgtiny_cache_entry *next_in_bucket;
+	struct svgtiny_cache_entry *newer, *older;
+};
+
+struct svgtiny_cache_shard {
+	pthread_mutex_t lock;
+	struct svgtiny_cache_entry **bucket;
+	unsigned int bucket_count;	/* power of 2 */
+	unsigned int entry_count;
+	/* most and least recently used entries */
+	struct svgtiny_cache_entry *newest, *oldest;
+	size_t bytes;
+	size_t budget;
+};
+
+struct svgtiny_cache {
+	struct svgtiny_cache_shard shard[SVGTINY_CACHE_SHARDS];
+};
+
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t svgtiny_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t svgtiny_read64(const unsigned char *p)
+{
+	return (uint64_t) p[0] | (uint64_t) p[1] << 8 |
+			(uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+			(uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+			(uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+
+static uint32_t svgtiny_read32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+			(uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+static uint64_t svgtiny_xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = svgtiny_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+
+static uint64_t svgtiny_xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= svgtiny_xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+/**
+ * The XXH64 hash of size bytes at data.
+ */
+
+static uint64_t svgtiny_xxh64(const void *data, size_t size, uint64_t seed)
+{
+	const unsigned char *p = data, *end = p + size;
+	uint64_t h;
+
+	if (32 <= size) {
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = svgtiny_xxh64_round(v1, svgtiny_read64(p));
+			v2 = svgtiny_xxh64_round(v2, svgtiny_read64(p + 8));
+			v3 = svgtiny_xxh64_round(v3, svgtiny_read64(p + 16));
+			v4 = svgtiny_xxh64_round(v4, svgtiny_read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+		h = svgtiny_rotl64(v1, 1) + svgtiny_rotl64(v2, 7) +
+				svgtiny_rotl64(v3, 12) + svgtiny_rotl64(v4, 18);
+		h = svgtiny_xxh64_merge(h, v1);
+		h = svgtiny_xxh64_merge(h, v2);
+		h = svgtiny_xxh64_merge(h, v3);
+		h = svgtiny_xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+	h += size;
+
+	for (; 8 <= end - p; p += 8) {
+		h ^= svgtiny_xxh64_round(0, svgtiny_read64(p));
+		h = svgtiny_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (4 <= end - p) {
+		h ^= (uint64_t) svgtiny_read32(p) * XXH_PRIME64_1;
+		h = svgtiny_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p != end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = svgtiny_rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+/*
+ * Memory of an entry's diagram. Each block has a size prefix, so that the
+ * blocks allocated while parsing can be counted in entry->bytes. Once the
+ * parse finishes the diagram is switched to the uncounted allocator, which
+ * handles the same blocks, and entry->bytes no longer changes: readers of
+ * a shared diagram may allocate through it from any thread.
+ */
+
+static void *svgtiny_cache_alloc(size_t size, void *ctx)
+{
+	size_t *block = malloc(SVGTINY_CACHE_BLOCK_HEADER + size);
+	(void) ctx;
+	if (!block)
+		return 0;
+	*block = size;
+	return (char *) block + SVGTINY_CACHE_BLOCK_HEADER;
+}
+
+
+static void *svgtiny_cache_realloc(void *ptr, size_t size, void *ctx)
+{
+	size_t *block;
+
+	if (!ptr)
+		return svgtiny_cache_alloc(size, ctx);
+
+	block = (size_t *) ((char *) ptr - SVGTINY_CACHE_BLOCK_HEADER);
+	block = realloc(block, SVGTINY_CACHE_BLOCK_HEADER + size);
+	if (!block)
+		return 0;
+	*block = size;
+	return (char *) block + SVGTINY_CACHE_BLOCK_HEADER;
+}
+
+
+static void svgtiny_cache_free_block(void *ptr, void *ctx)
+{
+	(void) ctx;
+	free((char *) ptr - SVGTINY_CACHE_BLOCK_HEADER);
+}
+
+
+static size_t svgtiny_cache_block_size(void *ptr)
+{
+	return *(size_t *) ((char *) ptr - SVGTINY_CACHE_BLOCK_HEADER);
+}
+
+
+static void *svgtiny_cache_counted_alloc(size_t size, void *ctx)
+{
+	struct svgtiny_cache_entry *entry = ctx;
+	void *ptr = svgtiny_cache_alloc(size, ctx);
+	if (ptr)
+		entry->bytes += size;
+	return ptr;
+}
+
+
+static void *svgtiny_cache_counted_realloc(void *ptr, size_t size, void *ctx)
+{
+	struct svgtiny_cache_entry *entry = ctx;
+	size_t old_size = ptr ? svgtiny_cache_block_size(ptr) : 0;
+
+	ptr = svgtiny_cache_realloc(ptr, size, ctx);
+	if (ptr)
+		entry->bytes = entry->bytes - old_size + size;
+	return ptr;
+}
+
+
+static void svgtiny_cache_counted_free(void *ptr, void *ctx)
+{
+	struct svgtiny_cache_entry *entry = ctx;
+
+	entry->bytes -= svgtiny_cache_block_size(ptr);
+	svgtiny_cache_free_block(ptr, ctx);
+}
+
+
+static void svgtiny_cache_entry_free(struct svgtiny_cache_entry *entry)
+{
+	if (entry->diagram)
+		svgtiny_free(entry->diagram);
+	free(entry->source);
+	free(entry);
+}
+
+
+/**
+ * Create a svgtiny_cache which keeps at most about budget bytes of parsed
+ * diagrams and their sources, not counting entries still in use.
+ */
+
+struct svgtiny_cache *svgtiny_cache_create(size_t budget)
+{
+	struct svgtiny_cache *cache;
+	unsigned int i;
+
+	cache = malloc(sizeof *cache);
+	if (!cache)
+		return 0;
+
+	for (i = 0; i != SVGTINY_CACHE_SHARDS; i++) {
+		struct svgtiny_cache_shard *shard = &cache->shard[i];
+		shard->bucket = calloc(SVGTINY_CACHE_FIRST_BUCKETS,
+				sizeof shard->bucket[0]);
+		if (!shard->bucket ||
+				pthread_mutex_init(&shard->lock, NULL) != 0) {
+			free(shard->bucket);
+			while (i--) {
+				pthread_mutex_destroy(&cache->shard[i].lock);
+				free(cache->shard[i].bucket);
+			}
+			free(cache);
+			return 0;
+		}
+		shard->bucket_count = SVGTINY_CACHE_FIRST_BUCKETS;
+		shard->entry_count = 0;
+		shard->newest = shard->oldest = 0;
+		shard->bytes = 0;
+		shard->budget = budget / SVGTINY_CACHE_SHARDS;
+	}
+
+	return cache;
+}
+
+
+static struct svgtiny_cache_entry **svgtiny_cache_find(
+		struct svgtiny_cache_shard *shard, uint64_t hash,
+		const char *buffer, size_t size,
+		int viewport_width, int viewport_height)
+{
+	struct svgtiny_cache_entry **link;
+
+	for (link = &shard->bucket[hash & (shard->bucket_count - 1)]; *link;
+			link = &(*link)->next_in_bucket) {
+		struct svgtiny_cache_entry *entry = *link;
+		if (entry->hash == hash && entry->size == size &&
+				entry->viewport_width == viewport_width &&
+				entry->viewport_height == viewport_height &&
+				memcmp(entry->source, buffer, size) == 0)
+			return link;
+	}
+	return link;
+}
+
+
+static void svgtiny_cache_unlink_lru(struct svgtiny_cache_shard *shard,
+		struct svgtiny_cache_entry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		shard->newest = entry->older;
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		shard->oldest = entry->newer;
+}
+
+
+static void svgtiny_cache_push_lru(struct svgtiny_cache_shard *shard,
+		struct svgtiny_cache_entry *entry)
+{
+	entry->newer = 0;
+	entry->older = shard->newest;
+	if (shard->newest)
+		shard->newest->newer = entry;
+	else
+		shard->oldest = entry;
+	shard->newest = entry;
+}
+
+
+/**
+ * Double the hash table of a shard, if it is getting full.
+ */
+
+static void svgtiny_cache_grow(struct svgtiny_cache_shard *shard)
+{
+	struct svgtiny_cache_entry **bucket;
+	unsigned int count = shard->bucket_count * 2, i;
+
+	if (shard->entry_count < shard->bucket_count)
+		return;
+
+	bucket = calloc(count, sizeof bucket[0]);
+	if (!bucket)
+		return;
+	for (i = 0; i != shard->bucket_count; i++) {
+		struct svgtiny_cache_entry *entry, *next;
+		for (entry = shard->bucket[i]; entry; entry = next) {
+			struct svgtiny_cache_entry **link =
+					&bucket[entry->hash & (count - 1)];
+			next = entry->next_in_bucket;
+			entry->next_in_bucket = *link;
+			*link = entry;
+		}
+	}
+	free(shard->bucket);
+	shard->bucket = bucket;
+	shard->bucket_count = count;
+}
+
+
+/**
+ * Take the least recently used entries out of a shard until it is within
+ * budget, keeping keep. Returns a list, linked by next_in_bucket, of the
+ * entries taken out, whose references the caller must drop.
+ */
+
+static struct svgtiny_cache_entry *svgtiny_cache_evict(
+		struct svgtiny_cache_shard *shard,
+		const struct svgtiny_cache_entry *keep)
+{
+	struct svgtiny_cache_entry *evicted = 0;
+
+	while (shard->budget < shard->bytes && shard->oldest &&
+			shard->oldest != keep) {
+		struct svgtiny_cache_entry *entry = shard->oldest;
+		struct svgtiny_cache_entry **link = &shard->bucket[
+				entry->hash & (shard->bucket_count - 1)];
+		while (*link != entry)
+			link = &(*link)->next_in_bucket;
+		*link = entry->next_in_bucket;
+		svgtiny_cache_unlink_lru(shard, entry);
+		shard->entry_count--;
+		shard->bytes -= entry->bytes;
+		entry->next_in_bucket = evicted;
+		evicted = entry;
+	}
+	return evicted;
+}
+
+
+/**
+ * Parse SVG source, or find the diagram from an earlier parse of the same
+ * source and viewport.
+ *
+ * On return *entry refers to the result, which must be given back with
+ * svgtiny_cache_release(); its diagram is shared and must not be changed.
+ * The code is the one svgtiny_parse() gave. Results of running out of
+ * memory are not kept. *entry is NULL only if even the entry could not be
+ * allocated.
+ */
+
+svgtiny_code svgtiny_cache_parse(struct svgtiny_cache *cache,
+		const char *buffer, size_t size,
+		int viewport_width, int viewport_height,
+		struct svgtiny_cache_entry **entry)
+{
+	static const svgtiny_allocator counting = {
+		svgtiny_cache_counted_alloc,
+		svgtiny_cache_counted_realloc,
+		svgtiny_cache_counted_free,
+		0
+	};
+	static const svgtiny_allocator uncounted = {
+		svgtiny_cache_alloc,
+		svgtiny_cache_realloc,
+		svgtiny_cache_free_block,
+		0
+	};
+	svgtiny_allocator counted = counting;
+	uint64_t hash = svgtiny_xxh64(buffer, size,
+			(uint64_t) (uint32_t) viewport_width << 32 |
+			(uint32_t) viewport_height);
+	struct svgtiny_cache_shard *shard =
+			&cache->shard[hash >> 60 & (SVGTINY_CACHE_SHARDS - 1)];
+	struct svgtiny_cache_entry **link, *found, *parsed, *evicted, *next;
+
+	assert(entry);
+
+	pthread_mutex_lock(&shard->lock);
+	found = *svgtiny_cache_find(shard, hash, buffer, size,
+			viewport_width, viewport_height);
+	if (found) {
+		atomic_fetch_add(&found->refs, 1);
+		svgtiny_cache_unlink_lru(shard, found);
+		svgtiny_cache_push_lru(shard, found);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (found) {
+		*entry = found;
+		return found->code;
+	}
+
+	/* parse without holding the lock */
+	*entry = 0;
+	parsed = malloc(sizeof *parsed);
+	if (!parsed)
+		return svgtiny_OUT_OF_MEMORY;
+	parsed->hash = hash;
+	parsed->size = size;
+	parsed->viewport_width = viewport_width;
+	parsed->viewport_height = viewport_height;
+	parsed->bytes = sizeof *parsed + size;
+	atomic_init(&parsed->refs, 1);
+	parsed->next_in_bucket = parsed->newer = parsed->older = 0;
+	parsed->source = malloc(size ? size : 1);
+	counted.ctx = parsed;
+	parsed->diagram = svgtiny_create_with_allocator(&counted);
+	if (!parsed->source || !parsed->diagram) {
+		svgtiny_cache_entry_free(parsed);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	memcpy(parsed->source, buffer, size);
+	parsed->code = svgtiny_parse(parsed->diagram, buffer, size, NULL,
+			viewport_width, viewport_height);
+	/* the memory kept for reparsing into the diagram is not needed */
+	svgtiny_arena_trim(parsed->diagram->_internal_scratch);
+	/* freeze entry->bytes before the diagram is shared */
+	svgtiny_arena_set_allocator(parsed->diagram->_internal_arena,
+			&uncounted);
+	svgtiny_arena_set_allocator(parsed->diagram->_internal_scratch,
+			&uncounted);
+	*entry = parsed;
+	if (parsed->code == svgtiny_OUT_OF_MEMORY)
+		return parsed->code;
+
+	pthread_mutex_lock(&shard->lock);
+	link = svgtiny_cache_find(shard, hash, buffer, size,
+			viewport_width, viewport_height);
+	found = *link;
+	if (found) {
+		/* another thread parsed the same source meanwhile */
+		atomic_fetch_add(&found->refs, 1);
+		svgtiny_cache_unlink_lru(shard, found);
+		svgtiny_cache_push_lru(shard, found);
+		evicted = 0;
+	} else {
+		/* the reference of the table */
+		atomic_fetch_add(&parsed->refs, 1);
+		*link = parsed;
+		svgtiny_cache_push_lru(shard, parsed);
+		shard->entry_count++;
+		shard->bytes += parsed->bytes;
+		svgtiny_cache_grow(shard);
+		evicted = svgtiny_cache_evict(shard, parsed);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	for (; evicted; evicted = next) {
+		next = evicted->next_in_bucket;
+		svgtiny_cache_release(evicted);
+	}
+	if (found) {
+		svgtiny_cache_release(parsed);
+		*entry = found;
+	}
+	return (*entry)->code;
+}
+
+
+/**
+ * Get the diagram of a cache entry.
+ */
+
+const struct svgtiny_diagram *svgtiny_cache_diagram(
+		const struct svgtiny_cache_entry *entry)
+{
+	return entry->diagram;
+}
+
+
+/**
+ * Give back a cache entry from svgtiny_cache_parse().
+ */
+
+void svgtiny_cache_release(struct svgtiny_cache_entry *entry)
+{
+	if (!entry)
+		return;
+	if (atomic_fetch_sub(&entry->refs, 1) == 1)
+		svgtiny_cache_entry_free(entry);
+}
+
+
+/**
+ * Free a svgtiny_cache. Entries still in use stay valid until released.
+ */
+
+void svgtiny_cache_free(struct svgtiny_cache *cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i != SVGTINY_CACHE_SHARDS; i++) {
+		struct svgtiny_cache_shard *shard = &cache->shard[i];
+		struct svgtiny_cache_entry *entry, *older;
+		for (entry = shard->newest; entry; entry = older) {
+			older = entry->older;
+			svgtiny_cache_release(entry);
+		}
+		pthread_mutex_destroy(&shard->lock);
+		free(shard->bucket);
+	}
+	free(cache);
+}
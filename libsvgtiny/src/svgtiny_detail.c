@@ -0,0 +1,839 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Level of detail for svgtiny_diagram.min_size.
+ *
+ * Each path is measured in diagram coordinates before it is added, by the
+ * box of its points and control points grown by half its stroke width. A
+ * path both narrower and shorter than min_size is dropped or, with
+ * svgtiny_MERGE_SMALL_SHAPES, merged into a rectangle around the small
+ * shapes whose centres are in the same min_size square of the diagram. The
+ * rectangle has their average colour, and an opacity that falls with how
+ * little of it they cover, so that it looks much as they would in the
+ * pixel it lands on. To keep the paint order, a rectangle takes no more
+ * shapes once a shape that overlaps it has been kept, and any other shape
+ * that is not measured, such as text, starts afresh.
+ *
+ * The first time an element is drawn by <use>, its extent and paint are
+ * kept in the coordinates of the <use>. A later <use> that would draw it
+ * small is taken as one small shape, without parsing the element again.
+ * The extent of a <g> is only known once it has been parsed, so groups are
+ * still parsed shape by shape.
+ *
+ * Shapes parsed into symbols for svgtiny_KEEP_INSTANCES are in the
+ * coordinates of their element, so they are all kept, and each instance
+ * shape is measured instead.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+/**
+ * The extent and paint of an element drawn by <use>, in the coordinates of
+ * the <use>. Its shapes depend on the paint they inherit, so that is part
+ * of the key.
+ */
+struct svgtiny_use_extent {
+	char *id;
+	int stroke_width;
+	svgtiny_colour fill, stroke;
+	svgtiny_colour use_fill, use_stroke;
+	const struct svgtiny_gradient *fill_gradient;
+	const struct svgtiny_gradient *use_fill_gradient;
+	bool measured;	/* detail is set, once the element has been parsed */
+	struct svgtiny_detail detail;
+};
+
+/**
+ * A min_size square of the diagram, and the small shapes merged into its
+ * rectangle.
+ */
+struct svgtiny_merge_cell {
+	int x, y;		/* position, in min_size units */
+	unsigned int slot;	/* in svgtiny_merge.table */
+	unsigned int shape;	/* the rectangle, in diagram->shape */
+	bool closed;		/* a later shape overlaps the rectangle */
+	struct svgtiny_detail detail;
+};
+
+/**
+ * The rectangles that small shapes are merged into, since the last shape
+ * that was not measured. Cells are found by position in an open-addressed
+ * hash table, where a closed cell is replaced by a new one at its position.
+ */
+struct svgtiny_merge {
+	/* diagram->shape_count once the last shape measured is added */
+	unsigned int end;
+	struct svgtiny_list *cells;
+	unsigned int *table;	/* 1 + index in cells, or 0 if free */
+	unsigned int table_size;	/* a power of two */
+	const svgtiny_allocator *allocator;
+};
+
+/* slots in a new svgtiny_merge.table */
+#define SVGTINY_MERGE_TABLE_SIZE 64
+
+static bool svgtiny_detail_active(const struct svgtiny_parse_state *state);
+static bool svgtiny_detail_small(const struct svgtiny_diagram *diagram,
+		const struct svgtiny_detail *detail);
+static void svgtiny_detail_union(struct svgtiny_detail *detail,
+		const struct svgtiny_detail *other);
+static void svgtiny_detail_transform(const struct svgtiny_detail *from,
+		const float m[6], struct svgtiny_detail *to);
+static float svgtiny_detail_area(const struct svgtiny_diagram *diagram,
+		float x0, float y0, float x1, float y1);
+static void svgtiny_detail_paint(struct svgtiny_detail *detail,
+		svgtiny_colour fill, const struct svgtiny_gradient *gradient,
+		svgtiny_colour stroke, bool stroked, float area);
+static void svgtiny_detail_colour(struct svgtiny_detail *detail,
+		svgtiny_colour colour, float area);
+static svgtiny_code svgtiny_detail_add(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *shape, bool small);
+static svgtiny_code svgtiny_detail_merge(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *shape);
+static void svgtiny_detail_cover(struct svgtiny_parse_context *ctx,
+		const struct svgtiny_detail *shape);
+static bool svgtiny_detail_overlap(const struct svgtiny_detail *a,
+		const struct svgtiny_detail *b);
+static int svgtiny_merge_position(const struct svgtiny_diagram *diagram,
+		float x);
+static struct svgtiny_merge *svgtiny_merge_create(
+		const svgtiny_allocator *allocator);
+static unsigned int svgtiny_merge_slot(struct svgtiny_merge *merge,
+		int x, int y);
+static svgtiny_code svgtiny_merge_grow(struct svgtiny_merge *merge);
+static void svgtiny_detail_rect(struct svgtiny_shape *shape,
+		const struct svgtiny_detail *detail);
+static bool svgtiny_detail_same_use(const struct svgtiny_use_extent *extent,
+		const struct svgtiny_parse_state *state, const char *id);
+
+
+/**
+ * Empty a svgtiny_detail.
+ */
+
+void svgtiny_detail_clear(struct svgtiny_detail *detail)
+{
+	detail->x0 = INFINITY;
+	detail->y0 = INFINITY;
+	detail->x1 = -INFINITY;
+	detail->y1 = -INFINITY;
+	detail->unknown = false;
+	detail->area = 0;
+	detail->red = 0;
+	detail->green = 0;
+	detail->blue = 0;
+	detail->opacity = 0;
+}
+
+
+/**
+ * Measure a path in user space about to be added to the diagram. If it is
+ * smaller than svgtiny_diagram.min_size, it is freed, any merging is done,
+ * and dropped is set.
+ */
+
+svgtiny_code svgtiny_detail_path(float *p, unsigned int n,
+		struct svgtiny_parse_state *state, bool *dropped)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	float a = state->ctm.a, b = state->ctm.b;
+	float c = state->ctm.c, d = state->ctm.d;
+	bool stroked = state->stroke != 0 &&
+			state->stroke != svgtiny_TRANSPARENT &&
+			0 < state->stroke_width;
+	struct svgtiny_detail detail;
+	unsigned int j, k, points;
+
+	*dropped = false;
+	if (!svgtiny_detail_active(state))
+		return svgtiny_OK;
+
+	svgtiny_detail_clear(&detail);
+	for (j = 0; j != n; ) {
+		points = (int) p[j] == svgtiny_PATH_CLOSE ? 0 :
+				(int) p[j] == svgtiny_PATH_BEZIER ? 3 : 1;
+		j++;
+		for (k = 0; k != points; k++, j += 2) {
+			float x = a * p[j] + c * p[j + 1] + state->ctm.e;
+			float y = b * p[j] + d * p[j + 1] + state->ctm.f;
+			detail.x0 = fminf(detail.x0, x);
+			detail.y0 = fminf(detail.y0, y);
+			detail.x1 = fmaxf(detail.x1, x);
+			detail.y1 = fmaxf(detail.y1, y);
+		}
+	}
+	if (stroked) {
+		float half_width = state->stroke_width *
+				sqrtf(fabsf(a * d - b * c)) / 2;
+		detail.x0 -= half_width;
+		detail.y0 -= half_width;
+		detail.x1 += half_width;
+		detail.y1 += half_width;
+	}
+	svgtiny_detail_paint(&detail, state->fill, state->fill_gradient,
+			state->stroke, stroked,
+			svgtiny_detail_area(ctx->diagram, detail.x0, detail.y0,
+			detail.x1, detail.y1));
+
+	*dropped = svgtiny_detail_small(ctx->diagram, &detail);
+	if (*dropped)
+		svgtiny_arena_free(ctx->arena, p);
+	return svgtiny_detail_add(state, &detail, *dropped);
+}
+
+
+/**
+ * Measure an instance shape about to be added to the diagram. If it is
+ * smaller than svgtiny_diagram.min_size, any merging is done, and dropped
+ * is set. An instance that draws text is always kept.
+ */
+
+svgtiny_code svgtiny_detail_instance(struct svgtiny_parse_state *state,
+		const struct svgtiny_instance *instance, bool *dropped)
+{
+	struct svgtiny_diagram *diagram = state->ctx->diagram;
+	float scale = fabsf(instance->transform.a * instance->transform.d -
+			instance->transform.b * instance->transform.c);
+	struct svgtiny_shape shape;
+	struct svgtiny_detail detail;
+	unsigned int i;
+
+	*dropped = false;
+	if (!svgtiny_detail_active(state))
+		return svgtiny_OK;
+
+	shape.instance = instance;
+	svgtiny_instance_bounds(&shape, diagram->symbol_shape);
+	svgtiny_detail_clear(&detail);
+	detail.x0 = shape.bounds.x0 - shape.stroke_width / 2;
+	detail.y0 = shape.bounds.y0 - shape.stroke_width / 2;
+	detail.x1 = shape.bounds.x1 + shape.stroke_width / 2;
+	detail.y1 = shape.bounds.y1 + shape.stroke_width / 2;
+
+	for (i = instance->first; i != instance->first + instance->count;
+			i++) {
+		const struct svgtiny_shape *s = &diagram->symbol_shape[i];
+		svgtiny_colour fill = s->fill ? s->fill : instance->fill;
+		svgtiny_colour stroke = s->stroke ? s->stroke :
+				instance->stroke;
+		float grow = s->stroke_width / 2;
+
+		if (s->text)
+			detail.unknown = true;
+		svgtiny_detail_paint(&detail, fill, NULL, stroke,
+				stroke != 0 && stroke != svgtiny_TRANSPARENT &&
+				0 < s->stroke_width,
+				scale * svgtiny_detail_area(diagram,
+				s->bounds.x0 - grow, s->bounds.y0 - grow,
+				s->bounds.x1 + grow, s->bounds.y1 + grow));
+	}
+
+	*dropped = !detail.unknown && svgtiny_detail_small(diagram, &detail);
+	return svgtiny_detail_add(state, &detail, *dropped);
+}
+
+
+/**
+ * Start a <use> of the element with id, whose frame has state. If the
+ * element has been drawn before and would now be small, it is taken as one
+ * small shape and skip is set. If it has not, the shapes seen so far are
+ * put in outer and extent is set, for svgtiny_detail_end_use() to measure
+ * it; otherwise extent is UINT_MAX.
+ */
+
+svgtiny_code svgtiny_detail_begin_use(struct svgtiny_parse_state *state,
+		const char *id, struct svgtiny_detail *outer,
+		unsigned int *extent, bool *skip)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	struct svgtiny_use_extent *use_extent;
+	struct svgtiny_detail detail;
+	float m[6] = { state->ctm.a, state->ctm.b, state->ctm.c,
+			state->ctm.d, state->ctm.e, state->ctm.f };
+	unsigned int i, count;
+
+	*extent = UINT_MAX;
+	*skip = false;
+	if (!svgtiny_detail_active(state))
+		return svgtiny_OK;
+
+	if (ctx->use_extents == NULL) {
+		ctx->use_extents = svgtiny_list_create(
+				sizeof (struct svgtiny_use_extent),
+				ctx->allocator);
+		if (ctx->use_extents == NULL)
+			return svgtiny_OUT_OF_MEMORY;
+	}
+
+	count = svgtiny_list_size(ctx->use_extents);
+	for (i = 0; i != count; i++) {
+		use_extent = svgtiny_list_get(ctx->use_extents, i);
+		if (!svgtiny_detail_same_use(use_extent, state, id))
+			continue;
+		if (!use_extent->measured || use_extent->detail.unknown)
+			return svgtiny_OK;
+		svgtiny_detail_transform(&use_extent->detail, m, &detail);
+		if (!svgtiny_detail_small(ctx->diagram, &detail))
+			return svgtiny_OK;
+		*skip = true;
+		return svgtiny_detail_add(state, &detail, true);
+	}
+
+	use_extent = svgtiny_list_push(ctx->use_extents);
+	if (use_extent == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	use_extent->id = svgtiny_mem_strndup(ctx->allocator, id, strlen(id));
+	if (use_extent->id == NULL) {
+		svgtiny_list_resize(ctx->use_extents, count);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	use_extent->stroke_width = state->stroke_width;
+	use_extent->fill = state->fill;
+	use_extent->stroke = state->stroke;
+	use_extent->use_fill = state->use_fill;
+	use_extent->use_stroke = state->use_stroke;
+	use_extent->fill_gradient = state->fill_gradient;
+	use_extent->use_fill_gradient = state->use_fill_gradient;
+	use_extent->measured = false;
+
+	*outer = ctx->detail;
+	svgtiny_detail_clear(&ctx->detail);
+	*extent = i;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Finish a <use> started by svgtiny_detail_begin_use() with an extent:
+ * keep what its element drew, in the coordinates of the <use>, and add it
+ * to the shapes seen before, in outer.
+ */
+
+void svgtiny_detail_end_use(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *outer, unsigned int extent)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	struct svgtiny_use_extent *use_extent = svgtiny_list_get(
+			ctx->use_extents, extent);
+	struct svgtiny_detail inner = ctx->detail;
+	float a = state->ctm.a, b = state->ctm.b;
+	float c = state->ctm.c, d = state->ctm.d;
+	float e = state->ctm.e, f = state->ctm.f;
+	float det = a * d - b * c;
+
+	if (det != 0) {
+		float inverse[6] = { d / det, -b / det, -c / det, a / det,
+				(c * f - d * e) / det, (b * e - a * f) / det };
+		svgtiny_detail_transform(&inner, inverse, &use_extent->detail);
+		use_extent->measured = true;
+	}
+
+	ctx->detail = *outer;
+	svgtiny_detail_union(&ctx->detail, &inner);
+}
+
+
+/**
+ * Free the extents of elements drawn by <use> and the merged rectangles
+ * recorded during a parse.
+ */
+
+void svgtiny_detail_free(struct svgtiny_parse_context *ctx)
+{
+	unsigned int i;
+
+	if (ctx->merge != NULL) {
+		svgtiny_list_free(ctx->merge->cells);
+		svgtiny_mem_free(ctx->allocator, ctx->merge->table);
+		svgtiny_mem_free(ctx->allocator, ctx->merge);
+		ctx->merge = NULL;
+	}
+	if (ctx->use_extents == NULL)
+		return;
+	for (i = 0; i != svgtiny_list_size(ctx->use_extents); i++) {
+		struct svgtiny_use_extent *use_extent = svgtiny_list_get(
+				ctx->use_extents, i);
+		svgtiny_mem_free(ctx->allocator, use_extent->id);
+	}
+	svgtiny_list_free(ctx->use_extents);
+	ctx->use_extents = NULL;
+}
+
+
+/**
+ * Whether shapes are measured: the diagram has a min_size, and shapes are
+ * not being parsed into a symbol.
+ */
+
+bool svgtiny_detail_active(const struct svgtiny_parse_state *state)
+{
+	return 0 < state->ctx->diagram->min_size &&
+			state->ctx->recording == 0;
+}
+
+
+/**
+ * Whether a box is both narrower and shorter than min_size. An empty box,
+ * which draws nothing, is.
+ */
+
+bool svgtiny_detail_small(const struct svgtiny_diagram *diagram,
+		const struct svgtiny_detail *detail)
+{
+	return detail->x1 - detail->x0 < diagram->min_size &&
+			detail->y1 - detail->y0 < diagram->min_size;
+}
+
+
+/**
+ * Add other to detail.
+ */
+
+void svgtiny_detail_union(struct svgtiny_detail *detail,
+		const struct svgtiny_detail *other)
+{
+	detail->x0 = fminf(detail->x0, other->x0);
+	detail->y0 = fminf(detail->y0, other->y0);
+	detail->x1 = fmaxf(detail->x1, other->x1);
+	detail->y1 = fmaxf(detail->y1, other->y1);
+	detail->unknown = detail->unknown || other->unknown;
+	detail->area += other->area;
+	detail->red += other->red;
+	detail->green += other->green;
+	detail->blue += other->blue;
+	detail->opacity += other->opacity;
+}
+
+
+/**
+ * Map a svgtiny_detail through the matrix m (a, b, c, d, e, f). The box
+ * becomes the box around its transformed corners, and the sums scale with
+ * the area.
+ */
+
+void svgtiny_detail_transform(const struct svgtiny_detail *from,
+		const float m[6], struct svgtiny_detail *to)
+{
+	float corner[4][2] = {
+		{ from->x0, from->y0 },
+		{ from->x1, from->y0 },
+		{ from->x0, from->y1 },
+		{ from->x1, from->y1 }
+	};
+	float scale = fabsf(m[0] * m[3] - m[1] * m[2]);
+	unsigned int k;
+
+	svgtiny_detail_clear(to);
+	to->unknown = from->unknown;
+	if (from->x1 < from->x0)
+		return;
+	for (k = 0; k != 4; k++) {
+		float x = m[0] * corner[k][0] + m[2] * corner[k][1] + m[4];
+		float y = m[1] * corner[k][0] + m[3] * corner[k][1] + m[5];
+		to->x0 = fminf(to->x0, x);
+		to->y0 = fminf(to->y0, y);
+		to->x1 = fmaxf(to->x1, x);
+		to->y1 = fmaxf(to->y1, y);
+	}
+	to->area = from->area * scale;
+	to->red = from->red * scale;
+	to->green = from->green * scale;
+	to->blue = from->blue * scale;
+	to->opacity = from->opacity * scale;
+}
+
+
+/**
+ * Area of a box, with a floor so that a shape of no area still has weight.
+ */
+
+float svgtiny_detail_area(const struct svgtiny_diagram *diagram,
+		float x0, float y0, float x1, float y1)
+{
+	float floor = diagram->min_size * diagram->min_size * 1e-6f;
+	float area = (x1 - x0) * (y1 - y0);
+
+	return floor < area ? area : floor;
+}
+
+
+/**
+ * Add the paint of a shape covering area to detail: its fill, or the
+ * average of the stops of its gradient, or else its stroke.
+ */
+
+void svgtiny_detail_paint(struct svgtiny_detail *detail,
+		svgtiny_colour fill, const struct svgtiny_gradient *gradient,
+		svgtiny_colour stroke, bool stroked, float area)
+{
+	unsigned int i;
+
+	detail->area += area;
+	if (fill == svgtiny_LINEAR_GRADIENT && gradient != NULL &&
+			gradient->stop_count != 0) {
+		for (i = 0; i != gradient->stop_count; i++)
+			svgtiny_detail_colour(detail, gradient->stop[i].color,
+					area / gradient->stop_count);
+	} else if (fill != svgtiny_TRANSPARENT &&
+			fill != svgtiny_LINEAR_GRADIENT) {
+		svgtiny_detail_colour(detail, fill, area);
+	} else if (stroked) {
+		svgtiny_detail_colour(detail, stroke, area);
+	}
+}
+
+
+/**
+ * Add a colour covering area to the sums of detail. A colour of 0 is an
+ * unset fill, which is opaque black.
+ */
+
+void svgtiny_detail_colour(struct svgtiny_detail *detail,
+		svgtiny_colour colour, float area)
+{
+	float opacity = area * (colour == 0 ? 255 : svgtiny_ALPHA(colour)) /
+			255;
+
+	detail->red += opacity * svgtiny_RED(colour);
+	detail->green += opacity * svgtiny_GREEN(colour);
+	detail->blue += opacity * svgtiny_BLUE(colour);
+	detail->opacity += opacity;
+}
+
+
+/**
+ * Note a measured shape among the shapes seen. With
+ * svgtiny_MERGE_SMALL_SHAPES, merge it into the rectangle of its square if
+ * it is small, or else close the rectangles it overlaps.
+ */
+
+svgtiny_code svgtiny_detail_add(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *shape, bool small)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+
+	svgtiny_detail_union(&ctx->detail, shape);
+	if (!(ctx->diagram->options & svgtiny_MERGE_SMALL_SHAPES))
+		return svgtiny_OK;
+	if (!small) {
+		svgtiny_detail_cover(ctx, shape);
+		return svgtiny_OK;
+	}
+	if (!(0 < shape->opacity))
+		return svgtiny_OK;
+	return svgtiny_detail_merge(state, shape);
+}
+
+
+/**
+ * Merge a small shape into the rectangle of the square its centre is in,
+ * adding a rectangle if the square has none open.
+ */
+
+svgtiny_code svgtiny_detail_merge(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *shape)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	struct svgtiny_diagram *diagram = ctx->diagram;
+	struct svgtiny_merge *merge = ctx->merge;
+	struct svgtiny_merge_cell *cell;
+	struct svgtiny_shape *rect;
+	int x = svgtiny_merge_position(diagram, (shape->x0 + shape->x1) / 2);
+	int y = svgtiny_merge_position(diagram, (shape->y0 + shape->y1) / 2);
+	unsigned int i, slot, count;
+	float *p;
+	svgtiny_code code;
+
+	if (merge == NULL) {
+		merge = ctx->merge = svgtiny_merge_create(ctx->allocator);
+		if (merge == NULL)
+			return svgtiny_OUT_OF_MEMORY;
+	}
+
+	/* a shape that was not measured was added: start afresh */
+	count = svgtiny_list_size(merge->cells);
+	if (merge->end != diagram->shape_count) {
+		for (i = 0; i != count; i++) {
+			cell = svgtiny_list_get(merge->cells, i);
+			merge->table[cell->slot] = 0;
+		}
+		svgtiny_list_resize(merge->cells, 0);
+		count = 0;
+		merge->end = diagram->shape_count;
+	}
+
+	slot = svgtiny_merge_slot(merge, x, y);
+	if (merge->table[slot] != 0) {
+		cell = svgtiny_list_get(merge->cells, merge->table[slot] - 1);
+		if (!cell->closed) {
+			svgtiny_detail_union(&cell->detail, shape);
+			svgtiny_detail_rect(&diagram->shape[cell->shape],
+					&cell->detail);
+			return svgtiny_OK;
+		}
+	}
+
+	if (merge->table_size < 2 * (count + 1)) {
+		if (svgtiny_merge_grow(merge) != svgtiny_OK)
+			return svgtiny_OUT_OF_MEMORY;
+		slot = svgtiny_merge_slot(merge, x, y);
+	}
+	cell = svgtiny_list_push(merge->cells);
+	if (cell == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	cell->x = x;
+	cell->y = y;
+	cell->slot = slot;
+	cell->shape = diagram->shape_count;
+	cell->closed = false;
+	cell->detail = *shape;
+
+	p = svgtiny_arena_alloc(ctx->arena, 13 * sizeof p[0]);
+	if (p == NULL) {
+		svgtiny_list_resize(merge->cells, count);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	rect = svgtiny_add_shape(state);
+	if (rect == NULL) {
+		svgtiny_arena_free(ctx->arena, p);
+		svgtiny_list_resize(merge->cells, count);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	rect->path = p;
+	rect->path_length = 13;
+	rect->stroke = svgtiny_TRANSPARENT;
+	rect->stroke_width = 0;
+	svgtiny_detail_rect(rect, &cell->detail);
+
+	code = svgtiny_finish_shape(state);
+	if (code != svgtiny_OK) {
+		svgtiny_list_resize(merge->cells, count);
+		return code;
+	}
+	merge->table[slot] = count + 1;
+	merge->end = diagram->shape_count;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Close the rectangles that a shape about to be kept overlaps, so that
+ * small shapes after it are not drawn under it.
+ */
+
+void svgtiny_detail_cover(struct svgtiny_parse_context *ctx,
+		const struct svgtiny_detail *shape)
+{
+	struct svgtiny_diagram *diagram = ctx->diagram;
+	struct svgtiny_merge *merge = ctx->merge;
+	struct svgtiny_merge_cell *cell;
+	unsigned int i, count, slot;
+	int x, y, x0, y0, x1, y1;
+
+	if (merge == NULL || merge->end != diagram->shape_count)
+		return;
+	merge->end = diagram->shape_count + 1;
+
+	/* a rectangle reaches at most one square past its own */
+	x0 = svgtiny_merge_position(diagram, shape->x0) - 1;
+	y0 = svgtiny_merge_position(diagram, shape->y0) - 1;
+	x1 = svgtiny_merge_position(diagram, shape->x1) + 1;
+	y1 = svgtiny_merge_position(diagram, shape->y1) + 1;
+	count = svgtiny_list_size(merge->cells);
+
+	if ((float) (x1 - x0 + 1) * (y1 - y0 + 1) < count) {
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				slot = svgtiny_merge_slot(merge, x, y);
+				if (merge->table[slot] == 0)
+					continue;
+				cell = svgtiny_list_get(merge->cells,
+						merge->table[slot] - 1);
+				if (svgtiny_detail_overlap(&cell->detail,
+						shape))
+					cell->closed = true;
+			}
+		}
+	} else {
+		for (i = 0; i != count; i++) {
+			cell = svgtiny_list_get(merge->cells, i);
+			if (svgtiny_detail_overlap(&cell->detail, shape))
+				cell->closed = true;
+		}
+	}
+}
+
+
+/**
+ * Whether the boxes of two svgtiny_detail overlap.
+ */
+
+bool svgtiny_detail_overlap(const struct svgtiny_detail *a,
+		const struct svgtiny_detail *b)
+{
+	return a->x0 <= b->x1 && b->x0 <= a->x1 &&
+			a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+
+/**
+ * The square of min_size that a coordinate is in. Far off squares share a
+ * position, which only makes for wider rectangles.
+ */
+
+int svgtiny_merge_position(const struct svgtiny_diagram *diagram, float x)
+{
+	return fmaxf(-1e9f, fminf(floorf(x / diagram->min_size), 1e9f));
+}
+
+
+/**
+ * Make an empty svgtiny_merge. Returns NULL if out of memory.
+ */
+
+struct svgtiny_merge *svgtiny_merge_create(const svgtiny_allocator *allocator)
+{
+	struct svgtiny_merge *merge;
+
+	merge = svgtiny_mem_alloc(allocator, sizeof *merge);
+	if (merge == NULL)
+		return NULL;
+	merge->end = UINT_MAX;
+	merge->allocator = allocator;
+	merge->table_size = SVGTINY_MERGE_TABLE_SIZE;
+	merge->table = svgtiny_mem_alloc(allocator,
+			merge->table_size * sizeof merge->table[0]);
+	merge->cells = svgtiny_list_create(sizeof (struct svgtiny_merge_cell),
+			allocator);
+	if (merge->table == NULL || merge->cells == NULL) {
+		if (merge->cells != NULL)
+			svgtiny_list_free(merge->cells);
+		svgtiny_mem_free(allocator, merge->table);
+		svgtiny_mem_free(allocator, merge);
+		return NULL;
+	}
+	memset(merge->table, 0, merge->table_size * sizeof merge->table[0]);
+	return merge;
+}
+
+
+/**
+ * Find the slot of the cell at x, y in the hash table, or the free slot
+ * where it would go.
+ */
+
+unsigned int svgtiny_merge_slot(struct svgtiny_merge *merge, int x, int y)
+{
+	uint32_t hash = (uint32_t) x * 73856093u ^ (uint32_t) y * 19349663u;
+	unsigned int slot = (hash ^ hash >> 16) & (merge->table_size - 1);
+
+	while (merge->table[slot] != 0) {
+		const struct svgtiny_merge_cell *cell = svgtiny_list_get(
+				merge->cells, merge->table[slot] - 1);
+		if (cell->x == x && cell->y == y)
+			break;
+		slot = (slot + 1) & (merge->table_size - 1);
+	}
+	return slot;
+}
+
+
+/**
+ * Double the size of the hash table.
+ */
+
+svgtiny_code svgtiny_merge_grow(struct svgtiny_merge *merge)
+{
+	unsigned int *table;
+	unsigned int i, count = svgtiny_list_size(merge->cells);
+
+	table = svgtiny_mem_alloc(merge->allocator,
+			2 * merge->table_size * sizeof table[0]);
+	if (table == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	memset(table, 0, 2 * merge->table_size * sizeof table[0]);
+	svgtiny_mem_free(merge->allocator, merge->table);
+	merge->table = table;
+	merge->table_size *= 2;
+	for (i = 0; i != count; i++) {
+		struct svgtiny_merge_cell *cell = svgtiny_list_get(
+				merge->cells, i);
+		cell->slot = svgtiny_merge_slot(merge, cell->x, cell->y);
+		table[cell->slot] = i + 1;
+	}
+	return svgtiny_OK;
+}
+
+
+/**
+ * Set a rectangle shape to the box of detail, filled with its average
+ * colour at the opacity of its shapes times the part of the box they cover.
+ */
+
+void svgtiny_detail_rect(struct svgtiny_shape *shape,
+		const struct svgtiny_detail *detail)
+{
+	float *p = shape->path;
+	float box = (detail->x1 - detail->x0) * (detail->y1 - detail->y0);
+	float cover = detail->area < box ? detail->area / box : 1;
+	unsigned int red = lroundf(fminf(detail->red / detail->opacity, 255));
+	unsigned int green = lroundf(fminf(detail->green / detail->opacity,
+			255));
+	unsigned int blue = lroundf(fminf(detail->blue / detail->opacity,
+			255));
+	unsigned int alpha = lroundf(255 * cover * detail->opacity /
+			detail->area);
+
+	/* lower alphas of black are svgtiny_TRANSPARENT and
+	 * svgtiny_LINEAR_GRADIENT */
+	if (alpha < 3)
+		alpha = 3;
+	if (255 < alpha)
+		alpha = 255;
+
+	p[0] = svgtiny_PATH_MOVE;
+	p[1] = detail->x0;
+	p[2] = detail->y0;
+	p[3] = svgtiny_PATH_LINE;
+	p[4] = detail->x1;
+	p[5] = detail->y0;
+	p[6] = svgtiny_PATH_LINE;
+	p[7] = detail->x1;
+	p[8] = detail->y1;
+	p[9] = svgtiny_PATH_LINE;
+	p[10] = detail->x0;
+	p[11] = detail->y1;
+	p[12] = svgtiny_PATH_CLOSE;
+	shape->fill = (svgtiny_RGB(red, green, blue) & 0xffffff) |
+			alpha << 24;
+	svgtiny_shape_bounds(shape);
+}
+
+
+/**
+ * Whether a recorded extent is for the element with id drawn with the
+ * paint of state.
+ */
+
+bool svgtiny_detail_same_use(const struct svgtiny_use_extent *extent,
+		const struct svgtiny_parse_state *state, const char *id)
+{
+	return extent->stroke_width == state->stroke_width &&
+			extent->fill == state->fill &&
+			extent->stroke == state->stroke &&
+			extent->use_fill == state->use_fill &&
+			extent->use_stroke == state->use_stroke &&
+			extent->fill_gradient == state->fill_gradient &&
+			extent->use_fill_gradient ==
+			state->use_fill_gradient &&
+			strcmp(extent->id, id) == 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Flattening of paths: each cubic Bézier is replaced by a run of lines.
+ *
+ * The number of lines for a curve is chosen up front by Wang's formula: a
+ * cubic from p0 through p1 and p2 to p3, split evenly in t into
+ *
+ *   n = ceil(sqrt(3/4 * max(|p0 - 2 p1 + p2|, |p1 - 2 p2 + p3|) / tolerance))
+ *
+ * lines, is nowhere further than tolerance from them. Knowing n first lets
+ * a path be measured and then written in one pass without recursion, and
+ * makes the points of a curve independent of each other, so the loop that
+ * finds them can be vectorised.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+
+/**
+ * Choose the number of lines to replace a cubic Bézier from (x0, y0)
+ * through (c[0], c[1]) and (c[2], c[3]) to (c[4], c[5]) with, so that the
+ * curve is within tolerance of them.
+ */
+
+unsigned int svgtiny_flatten_bezier_lines(float x0, float y0, const float *c,
+		float tolerance)
+{
+	float ddx0 = x0 - 2 * c[0] + c[2], ddy0 = y0 - 2 * c[1] + c[3];
+	float ddx1 = c[0] - 2 * c[2] + c[4], ddy1 = c[1] - 2 * c[3] + c[5];
+	float dd = sqrtf(ddx0 * ddx0 + ddy0 * ddy0);
+	float dd1 = sqrtf(ddx1 * ddx1 + ddy1 * ddy1);
+	float n;
+
+	if (dd < dd1)
+		dd = dd1;
+	if (!(0 < tolerance))
+		return SVGTINY_FLATTEN_MAX_LINES;
+	n = ceilf(sqrtf(0.75f * dd / tolerance));
+	if (!(n < SVGTINY_FLATTEN_MAX_LINES))
+		return SVGTINY_FLATTEN_MAX_LINES;
+	if (n < 1)
+		return 1;
+	return n;
+}
+
+
+/**
+ * Write lines svgtiny_PATH_LINE commands to out, following the cubic Bézier
+ * from (x0, y0) through (c[0], c[1]) and (c[2], c[3]) to (c[4], c[5]) at
+ * even steps of t. The last line ends exactly at (c[4], c[5]).
+ */
+
+void svgtiny_flatten_bezier(float x0, float y0, const float *c,
+		unsigned int lines, float *out)
+{
+	/* the curve as a + b t + c t^2 + d t^3 */
+	float ax = x0, bx = 3 * (c[0] - x0);
+	float cx = 3 * (x0 - 2 * c[0] + c[2]);
+	float dx = -x0 + 3 * (c[0] - c[2]) + c[4];
+	float ay = y0, by = 3 * (c[1] - y0);
+	float cy = 3 * (y0 - 2 * c[1] + c[3]);
+	float dy = -y0 + 3 * (c[1] - c[3]) + c[5];
+	float h = 1.0f / lines;
+	unsigned int i;
+
+	for (i = 1; i < lines; i++) {
+		float t = i * h;
+		out[3 * (i - 1)] = svgtiny_PATH_LINE;
+		out[3 * (i - 1) + 1] = ((dx * t + cx) * t + bx) * t + ax;
+		out[3 * (i - 1) + 2] = ((dy * t + cy) * t + by) * t + ay;
+	}
+	out[3 * (lines - 1)] = svgtiny_PATH_LINE;
+	out[3 * (lines - 1) + 1] = c[4];
+	out[3 * (lines - 1) + 2] = c[5];
+}
+
+
+/**
+ * Flatten the path of a shape, with every curve within tolerance of the
+ * lines that replace it.
+ *
+ * The flattened path is written to out if it fits in out_length floats.
+ * Returns the number of floats it takes, or 0 if the shape has no path.
+ */
+
+size_t svgtiny_flatten_shape(const struct svgtiny_shape *shape,
+		float tolerance, float *out, size_t out_length)
+{
+	const float *p = shape->path;
+	unsigned int n = shape->path_length;
+	float x, y, start_x, start_y;
+	size_t length;
+	unsigned int j, lines;
+	bool write;
+
+	if (!p)
+		return 0;
+
+	/* measure, then write if it fits */
+	for (write = false; ; write = true) {
+		x = y = start_x = start_y = 0;
+		for (j = 0, length = 0; j != n; ) {
+			switch ((int) p[j]) {
+			case svgtiny_PATH_MOVE:
+			case svgtiny_PATH_LINE:
+				if (write) {
+					out[length] = p[j];
+					out[length + 1] = p[j + 1];
+					out[length + 2] = p[j + 2];
+				}
+				x = p[j + 1];
+				y = p[j + 2];
+				if ((int) p[j] == svgtiny_PATH_MOVE) {
+					start_x = x;
+					start_y = y;
+				}
+				length += 3;
+				j += 3;
+				break;
+			case svgtiny_PATH_CLOSE:
+				if (write)
+					out[length] = p[j];
+				x = start_x;
+				y = start_y;
+				length++;
+				j++;
+				break;
+			case svgtiny_PATH_BEZIER:
+				lines = svgtiny_flatten_bezier_lines(x, y,
+						p + j + 1, tolerance);
+				if (write)
+					svgtiny_flatten_bezier(x, y, p + j + 1,
+							lines, out + length);
+				x = p[j + 5];
+				y = p[j + 6];
+				length += 3 * (size_t) lines;
+				j += 7;
+				break;
+			default:
+				assert(0);
+				return 0;
+			}
+		}
+		if (write || !out || out_length < length)
+			return length;
+	}
+}
+
+
+/**
+ * Flatten the paths of every shape and symbol shape of a diagram, with
+ * every curve within tolerance of the lines that replace it. The new paths
+ * are allocated in the diagram; paths without curves are kept as they are.
+ */
+
+svgtiny_code svgtiny_flatten_diagram(struct svgtiny_diagram *diagram,
+		float tolerance)
+{
+	struct svgtiny_shape *shapes[2] = { diagram->shape,
+			diagram->symbol_shape };
+	unsigned int counts[2] = { diagram->shape_count,
+			diagram->symbol_shape_count };
+	unsigned int k, i, j;
+
+	for (k = 0; k != 2; k++) {
+		for (i = 0; i != counts[k]; i++) {
+			struct svgtiny_shape *shape = &shapes[k][i];
+			bool curved = false;
+			size_t length;
+			float *path;
+
+			for (j = 0; j != shape->path_length && !curved; ) {
+				switch ((int) shape->path[j]) {
+				case svgtiny_PATH_MOVE:
+				case svgtiny_PATH_LINE:
+					j += 3;
+					break;
+				case svgtiny_PATH_CLOSE:
+					j++;
+					break;
+				default:
+					curved = true;
+				}
+			}
+			if (!curved)
+				continue;
+
+			length = svgtiny_flatten_shape(shape, tolerance, 0, 0);
+			if (UINT_MAX < length)
+				return svgtiny_OUT_OF_MEMORY;
+			path = svgtiny_arena_alloc(diagram->_internal_arena,
+					length * sizeof path[0]);
+			if (!path)
+				return svgtiny_OUT_OF_MEMORY;
+			svgtiny_flatten_shape(shape, tolerance, path, length);
+			shape->path = path;
+			shape->path_length = length;
+			svgtiny_shape_bounds(shape);
+		}
+	}
+
+	return svgtiny_OK;
+}
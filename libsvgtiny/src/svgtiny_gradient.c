@@ -6,6 +6,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,90 +17,229 @@
 
 #undef GRADIENT_DEBUG
 
+/* a point of an outline being tessellated, with r its distance along the
+ * gradient vector */
+struct grad_point {
+	float x, y, r;
+};
+
+/* the projection of user space onto a gradient vector from (x0, y0) to
+ * (x0 + dx, y0 + dy) in gradient space, trans mapping user space to
+ * gradient space */
+struct svgtiny_gradient_map {
+	float trans[6];
+	float x0, y0, dx, dy, norm_squared;
+};
+
+/* a segment of an outline being tessellated, from (x0, y0) to (x1, y1),
+ * through (c0x, c0y) and (c1x, c1y) if it is a bezier */
+struct svgtiny_gradient_segment {
+	bool bezier;
+	float x0, y0, c0x, c0y, c1x, c1y, x1, y1;
+};
+
+static struct svgtiny_gradient *svgtiny_resolve_gradient(const char *id,
+		struct svgtiny_parse_state *state);
 static svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
+		struct svgtiny_gradient *gradient,
 		struct svgtiny_parse_state *state);
 static float svgtiny_parse_gradient_offset(const char *s);
-static void svgtiny_path_bbox(float *p, unsigned int n,
-		float *x0, float *y0, float *x1, float *y1);
-static void svgtiny_invert_matrix(float *m, float *inv);
+static void svgtiny_gradient_vector(const struct svgtiny_gradient *gradient,
+		const float *p, unsigned int n,
+		const struct svgtiny_parse_state *state, float vector[4]);
+static const struct svgtiny_extension *svgtiny_find_extension(
+		const struct svgtiny_shape *shape,
+		enum svgtiny_extension_type type);
+static svgtiny_colour svgtiny_gradient_colour(
+		const struct svgtiny_gradient *gradient, float r);
+static float svgtiny_device_length(float dx, float dy,
+		const struct svgtiny_parse_state *state);
+static unsigned int svgtiny_gradient_steps(
+		const struct svgtiny_gradient *gradient, float r0, float r1,
+		float length, float tolerance, unsigned int max_steps);
+static float svgtiny_gradient_r(const struct svgtiny_gradient_map *map,
+		float x, float y);
+static bool svgtiny_gradient_segment(const float *p, unsigned int *j,
+		struct svgtiny_gradient_segment *segment);
+static unsigned int svgtiny_gradient_segment_steps(
+		const struct svgtiny_gradient_segment *segment,
+		const struct svgtiny_gradient_map *map,
+		float scale, unsigned int max_steps,
+		const struct svgtiny_parse_state *state);
+static void svgtiny_gradient_segment_points(
+		const struct svgtiny_gradient_segment *segment,
+		unsigned int steps, struct grad_point *point);
+static svgtiny_code svgtiny_gradient_points(const float *p, unsigned int n,
+		const float trans[6], const float vector[4],
+		unsigned int max_triangles, struct svgtiny_parse_state *state,
+		struct svgtiny_list *pts, unsigned int *min_pt);
+static unsigned int svgtiny_gradient_point_count(const float *p,
+		unsigned int n, const struct svgtiny_gradient_map *map, float scale,
+		unsigned int max_steps, const struct svgtiny_parse_state *state);
+static svgtiny_code svgtiny_add_path_flat_gradient(float *p,
+		unsigned int n, struct svgtiny_parse_state *state);
+static svgtiny_code svgtiny_add_gradient_mesh(float *p, unsigned int n,
+		struct svgtiny_list *pts, unsigned int min_pt,
+		struct svgtiny_parse_state *state);
+static void svgtiny_invert_matrix(const float *m, float *inv);
 
 
 /**
- * Find a gradient by id and parse it.
+ * Find a gradient by id and make it the current gradient.
+ *
+ * On failure, or if the id is part of an xlink:href cycle, the current
+ * gradient is NULL.
  */
 
 void svgtiny_find_gradient(const char *id, struct svgtiny_parse_state *state)
 {
-	dom_element *gradient;
-	dom_string *id_str, *name;
-	dom_exception exc;
-
 	#ifdef GRADIENT_DEBUG
 	fprintf(stderr, "svgtiny_find_gradient: id \"%s\"\n", id);
 	#endif
 
-	state->linear_gradient_stop_count = 0;
-	if (state->gradient_x1 != NULL)
-		dom_string_unref(state->gradient_x1);
-	if (state->gradient_y1 != NULL)
-		dom_string_unref(state->gradient_y1);
-	if (state->gradient_x2 != NULL)
-		dom_string_unref(state->gradient_x2);
-	if (state->gradient_y2 != NULL)
-		dom_string_unref(state->gradient_y2);
-	state->gradient_x1 = dom_string_ref(state->interned_zero_percent);
-	state->gradient_y1 = dom_string_ref(state->interned_zero_percent);
-	state->gradient_x2 = dom_string_ref(state->interned_hundred_percent);
-	state->gradient_y2 = dom_string_ref(state->interned_zero_percent);
-	state->gradient_user_space_on_use = false;
-	state->gradient_transform.a = 1;
-	state->gradient_transform.b = 0;
-	state->gradient_transform.c = 0;
-	state->gradient_transform.d = 1;
-	state->gradient_transform.e = 0;
-	state->gradient_transform.f = 0;
-	
+	state->ctx->gradient = svgtiny_resolve_gradient(id, state);
+
+	#ifdef GRADIENT_DEBUG
+	if (state->ctx->gradient != NULL)
+		fprintf(stderr, "linear_gradient_stop_count %i\n",
+				state->ctx->gradient->stop_count);
+	#endif
+}
+
+
+/**
+ * Free the gradients resolved during a parse.
+ */
+
+void svgtiny_free_gradients(struct svgtiny_parse_context *ctx)
+{
+	unsigned int i, n;
+
+	if (ctx->gradients == NULL)
+		return;
+
+	n = svgtiny_list_size(ctx->gradients);
+	for (i = 0; i != n; i++) {
+		struct svgtiny_gradient *gradient = *(struct svgtiny_gradient **)
+				svgtiny_list_get(ctx->gradients, i);
+		dom_string_unref(gradient->x1);
+		dom_string_unref(gradient->y1);
+		dom_string_unref(gradient->x2);
+		dom_string_unref(gradient->y2);
+		svgtiny_mem_free(ctx->allocator, gradient->id);
+		svgtiny_mem_free(ctx->allocator, gradient);
+	}
+	svgtiny_list_free(ctx->gradients);
+	ctx->gradients = NULL;
+	ctx->gradient = NULL;
+}
+
+
+/**
+ * Look up a gradient by id, resolving and caching it on first use.
+ *
+ * Ids that are missing or not a <linearGradient> are cached too, with no
+ * stops. Returns NULL if out of memory, or if the id is already being
+ * resolved further up the xlink:href chain.
+ */
+
+struct svgtiny_gradient *svgtiny_resolve_gradient(const char *id,
+		struct svgtiny_parse_state *state)
+{
+	struct svgtiny_parse_context *ctx = state->ctx;
+	struct svgtiny_gradient *gradient, **slot;
+	dom_element *element;
+	dom_string *id_str, *name;
+	dom_exception exc;
+	unsigned int i, n;
+
+	if (ctx->gradients == NULL) {
+		ctx->gradients = svgtiny_list_create(
+				sizeof (struct svgtiny_gradient *),
+				ctx->allocator);
+		if (ctx->gradients == NULL)
+			return NULL;
+	}
+
+	n = svgtiny_list_size(ctx->gradients);
+	for (i = 0; i != n; i++) {
+		gradient = *(struct svgtiny_gradient **)
+				svgtiny_list_get(ctx->gradients, i);
+		if (strcmp(gradient->id, id) == 0) {
+			#ifdef GRADIENT_DEBUG
+			if (gradient->resolving)
+				fprintf(stderr, "gradient \"%s\" href cycle\n", id);
+			#endif
+			return gradient->resolving ? NULL : gradient;
+		}
+	}
+
+	gradient = svgtiny_mem_alloc(ctx->allocator, sizeof *gradient);
+	if (gradient == NULL)
+		return NULL;
+	memset(gradient, 0, sizeof *gradient);
+	gradient->id = svgtiny_mem_strndup(ctx->allocator, id, strlen(id));
+	if (gradient->id == NULL) {
+		svgtiny_mem_free(ctx->allocator, gradient);
+		return NULL;
+	}
+	slot = svgtiny_list_push(ctx->gradients);
+	if (slot == NULL) {
+		svgtiny_mem_free(ctx->allocator, gradient->id);
+		svgtiny_mem_free(ctx->allocator, gradient);
+		return NULL;
+	}
+	*slot = gradient;
+
+	gradient->x1 = dom_string_ref(ctx->interned->zero_percent);
+	gradient->y1 = dom_string_ref(ctx->interned->zero_percent);
+	gradient->x2 = dom_string_ref(ctx->interned->hundred_percent);
+	gradient->y2 = dom_string_ref(ctx->interned->zero_percent);
+	gradient->transform.a = 1;
+	gradient->transform.d = 1;
+
 	exc = dom_string_create_interned((const uint8_t *) id,
 			strlen(id), &id_str);
 	if (exc != DOM_NO_ERR)
-		return;
-	
-	exc = dom_document_get_element_by_id(state->document, id_str,
-					     &gradient);
+		return gradient;
+
+	exc = dom_document_get_element_by_id(ctx->document, id_str, &element);
 	dom_string_unref(id_str);
-	if (exc != DOM_NO_ERR || gradient == NULL) {
+	if (exc != DOM_NO_ERR || element == NULL) {
 		#ifdef GRADIENT_DEBUG
 		fprintf(stderr, "gradient \"%s\" not found\n", id);
 		#endif
-		return;
+		return gradient;
 	}
-	
-	exc = dom_node_get_node_name(gradient, &name);
+
+	exc = dom_node_get_node_name(element, &name);
 	if (exc != DOM_NO_ERR) {
-		dom_node_unref(gradient);
-		return;
+		dom_node_unref(element);
+		return gradient;
 	}
-	
-	if (dom_string_isequal(name, state->interned_linearGradient))
-		svgtiny_parse_linear_gradient(gradient, state);
-	
-	dom_node_unref(gradient);
+
+	if (dom_string_isequal(name, ctx->interned->linearGradient)) {
+		gradient->resolving = true;
+		svgtiny_parse_linear_gradient(element, gradient, state);
+		gradient->resolving = false;
+	}
+
+	dom_node_unref(element);
 	dom_string_unref(name);
 
-	#ifdef GRADIENT_DEBUG
-	fprintf(stderr, "linear_gradient_stop_count %i\n",
-			state->linear_gradient_stop_count);
-	#endif
+	return gradient;
 }
 
 
 /**
- * Parse a <linearGradient> element node.
+ * Parse a <linearGradient> element node into gradient, on top of the
+ * gradient its xlink:href refers to.
  *
  * http://www.w3.org/TR/SVG11/pservers#LinearGradients
  */
 
 svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
+		struct svgtiny_gradient *gradient,
 		struct svgtiny_parse_state *state)
 {
 	unsigned int i = 0;
@@ -107,82 +247,101 @@ svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
 	dom_exception exc;
 	dom_nodelist *stops;
 	
-	exc = dom_element_get_attribute(linear, state->interned_href, &attr);
+	exc = dom_element_get_attribute(linear, state->ctx->interned->href, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
 		if (dom_string_data(attr)[0] == (uint8_t) '#') {
-			char *s = strndup(dom_string_data(attr) + 1,
-					  dom_string_byte_length(attr) - 1);
-			svgtiny_find_gradient(s, state);
-			free(s);
+			const struct svgtiny_gradient *base;
+			char *s = svgtiny_mem_strndup(state->ctx->allocator,
+					dom_string_data(attr) + 1,
+					dom_string_byte_length(attr) - 1);
+			base = s ? svgtiny_resolve_gradient(s, state) : NULL;
+			svgtiny_mem_free(state->ctx->allocator, s);
+			if (base != NULL) {
+				gradient->stop_count = base->stop_count;
+				memcpy(gradient->stop, base->stop,
+						sizeof gradient->stop);
+				dom_string_unref(gradient->x1);
+				gradient->x1 = dom_string_ref(base->x1);
+				dom_string_unref(gradient->y1);
+				gradient->y1 = dom_string_ref(base->y1);
+				dom_string_unref(gradient->x2);
+				gradient->x2 = dom_string_ref(base->x2);
+				dom_string_unref(gradient->y2);
+				gradient->y2 = dom_string_ref(base->y2);
+				gradient->user_space_on_use =
+						base->user_space_on_use;
+				gradient->transform = base->transform;
+			}
 		}
 		dom_string_unref(attr);
 	}
 
-	exc = dom_element_get_attribute(linear, state->interned_x1, &attr);
+	exc = dom_element_get_attribute(linear, state->ctx->interned->x1, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		dom_string_unref(state->gradient_x1);
-		state->gradient_x1 = attr;
+		dom_string_unref(gradient->x1);
+		gradient->x1 = attr;
 		attr = NULL;
 	}
 
-	exc = dom_element_get_attribute(linear, state->interned_y1, &attr);
+	exc = dom_element_get_attribute(linear, state->ctx->interned->y1, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		dom_string_unref(state->gradient_y1);
-		state->gradient_y1 = attr;
+		dom_string_unref(gradient->y1);
+		gradient->y1 = attr;
 		attr = NULL;
 	}
 
-	exc = dom_element_get_attribute(linear, state->interned_x2, &attr);
+	exc = dom_element_get_attribute(linear, state->ctx->interned->x2, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		dom_string_unref(state->gradient_x2);
-		state->gradient_x2 = attr;
+		dom_string_unref(gradient->x2);
+		gradient->x2 = attr;
 		attr = NULL;
 	}
 
-	exc = dom_element_get_attribute(linear, state->interned_y2, &attr);
+	exc = dom_element_get_attribute(linear, state->ctx->interned->y2, &attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		dom_string_unref(state->gradient_y2);
-		state->gradient_y2 = attr;
+		dom_string_unref(gradient->y2);
+		gradient->y2 = attr;
 		attr = NULL;
 	}
 	
-	exc = dom_element_get_attribute(linear, state->interned_gradientUnits,
+	exc = dom_element_get_attribute(linear, state->ctx->interned->gradientUnits,
 					&attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
-		state->gradient_user_space_on_use = 
+		gradient->user_space_on_use = 
 			dom_string_isequal(attr,
-					   state->interned_userSpaceOnUse);
+					   state->ctx->interned->userSpaceOnUse);
 		dom_string_unref(attr);
 	}
 	
 	exc = dom_element_get_attribute(linear,
-					state->interned_gradientTransform,
+					state->ctx->interned->gradientTransform,
 					&attr);
 	if (exc == DOM_NO_ERR && attr != NULL) {
 		float a = 1, b = 0, c = 0, d = 1, e = 0, f = 0;
-		char *s = strndup(dom_string_data(attr),
-				  dom_string_byte_length(attr));
+		char *s = svgtiny_mem_strndup(state->ctx->allocator,
+				dom_string_data(attr),
+				dom_string_byte_length(attr));
 		if (s == NULL) {
 			dom_string_unref(attr);
 			return svgtiny_OUT_OF_MEMORY;
 		}
 		svgtiny_parse_transform(s, &a, &b, &c, &d, &e, &f);
-		free(s);
+		svgtiny_mem_free(state->ctx->allocator, s);
 		#ifdef GRADIENT_DEBUG
 		fprintf(stderr, "transform %g %g %g %g %g %g\n",
 			a, b, c, d, e, f);
 		#endif
-		state->gradient_transform.a = a;
-		state->gradient_transform.b = b;
-		state->gradient_transform.c = c;
-		state->gradient_transform.d = d;
-		state->gradient_transform.e = e;
-		state->gradient_transform.f = f;
+		gradient->transform.a = a;
+		gradient->transform.b = b;
+		gradient->transform.c = c;
+		gradient->transform.d = d;
+		gradient->transform.e = e;
+		gradient->transform.f = f;
 		dom_string_unref(attr);
         }
 	
 	exc = dom_element_get_elements_by_tag_name(linear,
-						   state->interned_stop,
+						   state->ctx->interned->stop,
 						   &stops);
 	if (exc == DOM_NO_ERR && stops != NULL) {
 		uint32_t listlen, stopnr;
@@ -201,30 +360,41 @@ svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
 			if (exc != DOM_NO_ERR)
 				continue;
 			exc = dom_element_get_attribute(stop,
-							state->interned_offset,
+							state->ctx->interned->offset,
 							&attr);
 			if (exc == DOM_NO_ERR && attr != NULL) {
-				char *s = strndup(dom_string_data(attr),
-						  dom_string_byte_length(attr));
-				offset = svgtiny_parse_gradient_offset(s);
-				free(s);
+				char *s = svgtiny_mem_strndup(
+						state->ctx->allocator,
+						dom_string_data(attr),
+						dom_string_byte_length(attr));
+				if (s != NULL)
+					offset = svgtiny_parse_gradient_offset(s);
+				svgtiny_mem_free(state->ctx->allocator, s);
 				dom_string_unref(attr);
 			}
 			exc = dom_element_get_attribute(stop,
-							state->interned_stop_color,
+							state->ctx->interned->stop_color,
 							&attr);
 			if (exc == DOM_NO_ERR && attr != NULL) {
 				svgtiny_parse_color(attr, &color, state);
 				dom_string_unref(attr);
 			}
 			exc = dom_element_get_attribute(stop,
-							state->interned_style,
+							state->ctx->interned->style,
 							&attr);
 			if (exc == DOM_NO_ERR && attr != NULL) {
-				char *content = strndup(dom_string_data(attr),
-							dom_string_byte_length(attr));
+				char *content = svgtiny_mem_strndup(
+						state->ctx->allocator,
+						dom_string_data(attr),
+						dom_string_byte_length(attr));
 				const char *s;
 				dom_string *value;
+				if (content == NULL) {
+					dom_string_unref(attr);
+					dom_node_unref(stop);
+					dom_nodelist_unref(stops);
+					return svgtiny_OUT_OF_MEMORY;
+				}
 				if ((s = strstr(content, "stop-color:"))) {
 					s += 11;
 					while (*s == ' ')
@@ -243,7 +413,7 @@ svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
 					exc = dom_string_create_interned(
 						(const uint8_t *) s, strcspn(s, "; "), &value);
 					if (exc == DOM_NO_ERR && value != NULL) {
-            float f = svgtiny_parse_length(value, 1, *state);
+            float f = svgtiny_parse_length(value, 1, state);
             if (0.0f <= f && f <= 1.0f) {
               int alpha = f * 0xff;
               color = (color & 0xFFFFFF) | (alpha << 24);
@@ -251,15 +421,15 @@ svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
             dom_string_unref(value);
           }
         }
-				free(content);
+				svgtiny_mem_free(state->ctx->allocator, content);
 				dom_string_unref(attr);
 			}
 			if (offset != -1 && color != svgtiny_TRANSPARENT) {
 				#ifdef GRADIENT_DEBUG
 				fprintf(stderr, "stop %g %x\n", offset, color);
 				#endif
-				state->gradient_stop[i].offset = offset;
-				state->gradient_stop[i].color = color;
+				gradient->stop[i].offset = offset;
+				gradient->stop[i].color = color;
 				i++;
 			}
 			dom_node_unref(stop);
@@ -271,7 +441,7 @@ svgtiny_code svgtiny_parse_linear_gradient(dom_element *linear,
 	}
 no_more_stops:	
 	if (i > 0)
-		state->linear_gradient_stop_count = i;
+		gradient->stop_count = i;
 
 	return svgtiny_OK;
 }
@@ -298,6 +468,711 @@ float svgtiny_parse_gradient_offset(const char *s)
 }
 
 
+/**
+ * Find the gradient vector for filling a path, in user space before the
+ * gradient transform: the points at offsets 0 and 1, as x0, y0, x1, y1.
+ */
+
+void svgtiny_gradient_vector(const struct svgtiny_gradient *gradient,
+		const float *p, unsigned int n,
+		const struct svgtiny_parse_state *state, float vector[4])
+{
+	float object_x0, object_y0, object_x1, object_y1;
+
+	if (!gradient->user_space_on_use) {
+		/* determine object bounding box */
+		svgtiny_path_bbox(p, n, &object_x0, &object_y0,
+				&object_x1, &object_y1);
+		#ifdef GRADIENT_DEBUG
+		fprintf(stderr, "object bbox: (%g %g) (%g %g)\n",
+				object_x0, object_y0, object_x1, object_y1);
+		#endif
+		vector[0] = object_x0 +
+				svgtiny_parse_length(gradient->x1,
+					object_x1 - object_x0, state);
+		vector[1] = object_y0 +
+				svgtiny_parse_length(gradient->y1,
+					object_y1 - object_y0, state);
+		vector[2] = object_x0 +
+				svgtiny_parse_length(gradient->x2,
+					object_x1 - object_x0, state);
+		vector[3] = object_y0 +
+				svgtiny_parse_length(gradient->y2,
+					object_y1 - object_y0, state);
+	} else {
+		vector[0] = svgtiny_parse_length(gradient->x1,
+				state->ctx->viewport_width, state);
+		vector[1] = svgtiny_parse_length(gradient->y1,
+				state->ctx->viewport_height, state);
+		vector[2] = svgtiny_parse_length(gradient->x2,
+				state->ctx->viewport_width, state);
+		vector[3] = svgtiny_parse_length(gradient->y2,
+				state->ctx->viewport_height, state);
+	}
+	#ifdef GRADIENT_DEBUG
+	fprintf(stderr, "gradient vector: (%g %g) => (%g %g)\n",
+			vector[0], vector[1], vector[2], vector[3]);
+	#endif
+}
+
+
+/**
+ * Allocate an extension block for a linear gradient with stop_count stops
+ * in arena. Returns NULL if out of memory.
+ */
+
+struct svgtiny_gradient_extension *svgtiny_create_gradient_extension(
+		struct svgtiny_arena *arena, unsigned int stop_count)
+{
+	struct svgtiny_gradient_extension *extension;
+
+	extension = svgtiny_arena_alloc(arena, sizeof *extension +
+			stop_count * sizeof (struct svgtiny_gradient_stop));
+	if (extension == NULL)
+		return NULL;
+	extension->extension.next = NULL;
+	extension->extension.type = svgtiny_EXTENSION_LINEAR_GRADIENT;
+	extension->gradient.stop_count = stop_count;
+	extension->gradient.stop = (struct svgtiny_gradient_stop *)
+			(extension + 1);
+	return extension;
+}
+
+
+/**
+ * Add a path with a linear gradient fill to the svgtiny_diagram as a
+ * single shape, describing the gradient in an extension block.
+ */
+
+svgtiny_code svgtiny_add_path_gradient_fill(float *p, unsigned int n,
+		struct svgtiny_parse_state *state)
+{
+	const struct svgtiny_gradient *gradient = state->fill_gradient;
+	struct svgtiny_gradient_extension *extension;
+	struct svgtiny_linear_gradient *kept;
+	struct svgtiny_shape *shape;
+	float vector[4];
+
+	svgtiny_gradient_vector(gradient, p, n, state, vector);
+
+	extension = svgtiny_create_gradient_extension(state->ctx->arena,
+			gradient->stop_count);
+	if (extension == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	kept = &extension->gradient;
+	kept->x1 = vector[0];
+	kept->y1 = vector[1];
+	kept->x2 = vector[2];
+	kept->y2 = vector[3];
+	/* gradient space to user space, then to diagram coordinates */
+	kept->transform.a = state->ctm.a * gradient->transform.a +
+			state->ctm.c * gradient->transform.b;
+	kept->transform.b = state->ctm.b * gradient->transform.a +
+			state->ctm.d * gradient->transform.b;
+	kept->transform.c = state->ctm.a * gradient->transform.c +
+			state->ctm.c * gradient->transform.d;
+	kept->transform.d = state->ctm.b * gradient->transform.c +
+			state->ctm.d * gradient->transform.d;
+	kept->transform.e = state->ctm.a * gradient->transform.e +
+			state->ctm.c * gradient->transform.f + state->ctm.e;
+	kept->transform.f = state->ctm.b * gradient->transform.e +
+			state->ctm.d * gradient->transform.f + state->ctm.f;
+	memcpy((struct svgtiny_gradient_stop *) kept->stop, gradient->stop,
+			gradient->stop_count * sizeof gradient->stop[0]);
+
+	svgtiny_transform_path(p, n, state);
+
+	shape = svgtiny_add_shape(state);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	shape->path = p;
+	shape->path_length = n;
+	shape->_internal_extensions = &extension->extension;
+
+	return svgtiny_finish_shape(state);
+}
+
+
+/**
+ * Size of the extension block of a mesh, rounded up so that another block
+ * may follow it.
+ */
+
+size_t svgtiny_mesh_extension_size(unsigned int vertex_count,
+		unsigned int triangle_count)
+{
+	size_t size = sizeof (struct svgtiny_mesh_extension) +
+			(size_t) vertex_count * 2 * sizeof (float) +
+			(size_t) vertex_count * sizeof (svgtiny_colour) +
+			(size_t) triangle_count * 3 * sizeof (unsigned int);
+	return (size + 7) & ~(size_t) 7;
+}
+
+
+/**
+ * Set up the header of the extension block of a mesh, pointing its arrays
+ * into the rest of the block.
+ */
+
+void svgtiny_mesh_extension_init(struct svgtiny_mesh_extension *extension,
+		unsigned int vertex_count, unsigned int triangle_count)
+{
+	float *vertex = (float *) (extension + 1);
+	svgtiny_colour *colour = (svgtiny_colour *) (vertex + vertex_count * 2);
+
+	extension->extension.next = NULL;
+	extension->extension.type = svgtiny_EXTENSION_MESH;
+	extension->mesh.vertex_count = vertex_count;
+	extension->mesh.vertex = vertex;
+	extension->mesh.colour = colour;
+	extension->mesh.triangle_count = triangle_count;
+	extension->mesh.index = (unsigned int *) (colour + vertex_count);
+}
+
+
+/**
+ * Allocate an extension block for a mesh in arena. Returns NULL if out of
+ * memory.
+ */
+
+struct svgtiny_mesh_extension *svgtiny_create_mesh_extension(
+		struct svgtiny_arena *arena, unsigned int vertex_count,
+		unsigned int triangle_count)
+{
+	struct svgtiny_mesh_extension *extension;
+
+	extension = svgtiny_arena_alloc(arena, svgtiny_mesh_extension_size(
+			vertex_count, triangle_count));
+	if (extension == NULL)
+		return NULL;
+	svgtiny_mesh_extension_init(extension, vertex_count, triangle_count);
+	return extension;
+}
+
+
+/**
+ * Find the extension block of a type in the chain of a shape.
+ */
+
+const struct svgtiny_extension *svgtiny_find_extension(
+		const struct svgtiny_shape *shape,
+		enum svgtiny_extension_type type)
+{
+	const struct svgtiny_extension *extension;
+
+	for (extension = shape->_internal_extensions; extension != NULL;
+			extension = extension->next)
+		if (extension->type == type)
+			return extension;
+	return NULL;
+}
+
+
+/**
+ * Find the linear gradient of a shape, if it has one.
+ */
+
+const struct svgtiny_linear_gradient *svgtiny_shape_linear_gradient(
+		const struct svgtiny_shape *shape)
+{
+	const struct svgtiny_extension *extension = svgtiny_find_extension(
+			shape, svgtiny_EXTENSION_LINEAR_GRADIENT);
+
+	if (extension == NULL)
+		return NULL;
+	return &((const struct svgtiny_gradient_extension *) extension)->
+			gradient;
+}
+
+
+/**
+ * Find the gradient mesh of a shape, if it has one.
+ */
+
+const struct svgtiny_mesh *svgtiny_shape_mesh(
+		const struct svgtiny_shape *shape)
+{
+	const struct svgtiny_extension *extension = svgtiny_find_extension(
+			shape, svgtiny_EXTENSION_MESH);
+
+	if (extension == NULL)
+		return NULL;
+	return &((const struct svgtiny_mesh_extension *) extension)->mesh;
+}
+
+
+/**
+ * Find the colour of a gradient at distance r along its vector, padded
+ * with the first and last stops.
+ */
+
+svgtiny_colour svgtiny_gradient_colour(
+		const struct svgtiny_gradient *gradient, float r)
+{
+	const struct svgtiny_gradient_stop *stop = gradient->stop;
+	unsigned int i;
+	float f;
+
+	if (isnan(r) || r <= stop[0].offset)
+		return svgtiny_RGB(svgtiny_RED(stop[0].color),
+				svgtiny_GREEN(stop[0].color),
+				svgtiny_BLUE(stop[0].color));
+	for (i = 1; i != gradient->stop_count && stop[i].offset < r; i++)
+		continue;
+	if (i == gradient->stop_count)
+		return svgtiny_RGB(svgtiny_RED(stop[i - 1].color),
+				svgtiny_GREEN(stop[i - 1].color),
+				svgtiny_BLUE(stop[i - 1].color));
+	f = (r - stop[i - 1].offset) / (stop[i].offset - stop[i - 1].offset);
+	return svgtiny_RGB(
+		(int) ((1 - f) * svgtiny_RED(stop[i - 1].color) +
+				f * svgtiny_RED(stop[i].color)),
+		(int) ((1 - f) * svgtiny_GREEN(stop[i - 1].color) +
+				f * svgtiny_GREEN(stop[i].color)),
+		(int) ((1 - f) * svgtiny_BLUE(stop[i - 1].color) +
+				f * svgtiny_BLUE(stop[i].color)));
+}
+
+
+/**
+ * Add a path with a linear gradient fill to the svgtiny_diagram as one
+ * shape with a mesh, made of the triangles the points pts of its outline
+ * are cut into, starting from the point min_pt nearest the start of the
+ * gradient vector.
+ */
+
+svgtiny_code svgtiny_add_gradient_mesh(float *p, unsigned int n,
+		struct svgtiny_list *pts, unsigned int min_pt,
+		struct svgtiny_parse_state *state)
+{
+	const struct grad_point *point;
+	unsigned int size = svgtiny_list_size(pts);
+	unsigned int triangles = 2 < size ? size - 2 : 0;
+	struct svgtiny_mesh_extension *extension;
+	struct svgtiny_shape *shape;
+	float *vertex;
+	svgtiny_colour *colour;
+	unsigned int *index;
+	unsigned int i, t, a, b;
+
+	extension = svgtiny_create_mesh_extension(state->ctx->arena, size,
+			triangles);
+	if (extension == NULL)
+		return svgtiny_OUT_OF_MEMORY;
+	vertex = (float *) extension->mesh.vertex;
+	colour = (svgtiny_colour *) extension->mesh.colour;
+	index = (unsigned int *) extension->mesh.index;
+
+	for (i = 0; i != size; i++) {
+		point = svgtiny_list_get(pts, i);
+		vertex[2 * i] = state->ctm.a * point->x +
+				state->ctm.c * point->y + state->ctm.e;
+		vertex[2 * i + 1] = state->ctm.b * point->x +
+				state->ctm.d * point->y + state->ctm.f;
+		colour[i] = svgtiny_gradient_colour(state->fill_gradient,
+				point->r);
+	}
+
+	/* the same fan of triangles as svgtiny_add_path_linear_gradient() */
+	t = min_pt;
+	a = triangles ? (min_pt + 1) % size : 0;
+	b = min_pt == 0 ? size - 1 : min_pt - 1;
+	for (i = 0; i != triangles; i++) {
+		const struct grad_point *point_a = svgtiny_list_get(pts, a);
+		const struct grad_point *point_b = svgtiny_list_get(pts, b);
+		index[3 * i] = t;
+		index[3 * i + 1] = a;
+		index[3 * i + 2] = b;
+		if (point_a->r < point_b->r) {
+			t = a;
+			a = (a + 1) % size;
+		} else {
+			t = b;
+			b = b == 0 ? size - 1 : b - 1;
+		}
+	}
+
+	svgtiny_transform_path(p, n, state);
+
+	shape = svgtiny_add_shape(state);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	shape->path = p;
+	shape->path_length = n;
+	shape->_internal_extensions = &extension->extension;
+
+	return svgtiny_finish_shape(state);
+}
+
+
+/**
+ * Length in the diagram of the vector (dx, dy) of user space.
+ */
+
+float svgtiny_device_length(float dx, float dy,
+		const struct svgtiny_parse_state *state)
+{
+	return hypotf(state->ctm.a * dx + state->ctm.c * dy,
+			state->ctm.b * dx + state->ctm.d * dy);
+}
+
+
+/**
+ * Choose the number of steps to split a segment of an outline into, given
+ * that it runs from r0 to r1 along the gradient vector and is length long
+ * in the diagram.
+ *
+ * With a tolerance, a step is no shorter than tolerance, and no smaller
+ * than one colour level of the stops it crosses, so a segment across
+ * stops of the same colour, or beyond the first or last stop, is one step.
+ * With a tolerance of 0, there is a step for every 0.05 of r.
+ */
+
+unsigned int svgtiny_gradient_steps(const struct svgtiny_gradient *gradient,
+		float r0, float r1, float length, float tolerance,
+		unsigned int max_steps)
+{
+	const struct svgtiny_gradient_stop *stop = gradient->stop;
+	float lo = r0 < r1 ? r0 : r1, hi = r0 < r1 ? r1 : r0;
+	float steps, levels = 0;
+	unsigned int i;
+
+	if (isnan(r0) || isnan(r1))
+		return 1;
+
+	if (tolerance <= 0) {
+		steps = ceilf((hi - lo) / 0.05);
+	} else {
+		for (i = 1; i != gradient->stop_count; i++) {
+			float a = stop[i - 1].offset, b = stop[i].offset;
+			float overlap = (hi < b ? hi : b) - (a < lo ? lo : a);
+			int delta, d;
+			if (overlap <= 0 || b <= a)
+				continue;
+			delta = abs((int) svgtiny_RED(stop[i].color) -
+					(int) svgtiny_RED(stop[i - 1].color));
+			d = abs((int) svgtiny_GREEN(stop[i].color) -
+					(int) svgtiny_GREEN(stop[i - 1].color));
+			if (delta < d)
+				delta = d;
+			d = abs((int) svgtiny_BLUE(stop[i].color) -
+					(int) svgtiny_BLUE(stop[i - 1].color));
+			if (delta < d)
+				delta = d;
+			levels += overlap / (b - a) * delta;
+		}
+		steps = ceilf(levels < length / tolerance ?
+				levels : length / tolerance);
+	}
+
+	if (!(steps < max_steps))
+		return max_steps;
+	if (steps < 1)
+		return 1;
+	return steps;
+}
+
+
+/**
+ * Read the segment of an outline that starts at p[*j], advancing *j past
+ * it. Move segments only set the start point (x0, y0) of the next segment,
+ * and return false; other segments return true, with the segment as a
+ * cubic from (x0, y0) through (c0x, c0y) and (c1x, c1y) to (x1, y1).
+ */
+
+bool svgtiny_gradient_segment(const float *p, unsigned int *j,
+		struct svgtiny_gradient_segment *segment)
+{
+	int segment_type = (int) p[*j];
+
+	if (segment_type == svgtiny_PATH_MOVE) {
+		segment->x0 = p[*j + 1];
+		segment->y0 = p[*j + 2];
+		*j += 3;
+		return false;
+	}
+
+	assert(segment_type == svgtiny_PATH_CLOSE ||
+			segment_type == svgtiny_PATH_LINE ||
+			segment_type == svgtiny_PATH_BEZIER);
+
+	segment->bezier = segment_type == svgtiny_PATH_BEZIER;
+	if (segment_type == svgtiny_PATH_LINE) {
+		segment->x1 = p[*j + 1];
+		segment->y1 = p[*j + 2];
+		*j += 3;
+	} else if (segment_type == svgtiny_PATH_CLOSE) {
+		segment->x1 = p[1];
+		segment->y1 = p[2];
+		*j += 1;
+	} else /* svgtiny_PATH_BEZIER */ {
+		segment->c0x = p[*j + 1];
+		segment->c0y = p[*j + 2];
+		segment->c1x = p[*j + 3];
+		segment->c1y = p[*j + 4];
+		segment->x1 = p[*j + 5];
+		segment->y1 = p[*j + 6];
+		*j += 7;
+	}
+	return true;
+}
+
+
+/**
+ * Find r, the distance along the gradient vector of map, of a point.
+ */
+
+float svgtiny_gradient_r(const struct svgtiny_gradient_map *map,
+		float x, float y)
+{
+	float x_trans = map->trans[0] * x + map->trans[2] * y + map->trans[4];
+	float y_trans = map->trans[1] * x + map->trans[3] * y + map->trans[5];
+	return ((x_trans - map->x0) * map->dx + (y_trans - map->y0) * map->dy) /
+			map->norm_squared;
+}
+
+
+/**
+ * Choose the number of steps for a segment, multiplied by scale.
+ */
+
+unsigned int svgtiny_gradient_segment_steps(
+		const struct svgtiny_gradient_segment *segment,
+		const struct svgtiny_gradient_map *map,
+		float scale, unsigned int max_steps,
+		const struct svgtiny_parse_state *state)
+{
+	const struct svgtiny_gradient_segment *s = segment;
+	float r0 = svgtiny_gradient_r(map, s->x0, s->y0);
+	float r1 = svgtiny_gradient_r(map, s->x1, s->y1);
+	float length;
+	unsigned int steps;
+
+	if (s->bezier)
+		/* the control polygon is at least as long as the curve */
+		length = svgtiny_device_length(s->c0x - s->x0, s->c0y - s->y0,
+				state) +
+			svgtiny_device_length(s->c1x - s->c0x,
+				s->c1y - s->c0y, state) +
+			svgtiny_device_length(s->x1 - s->c1x, s->y1 - s->c1y,
+				state);
+	else
+		length = svgtiny_device_length(s->x1 - s->x0, s->y1 - s->y0,
+				state);
+
+	steps = svgtiny_gradient_steps(state->fill_gradient, r0, r1, length,
+			state->ctx->diagram->gradient_tolerance, max_steps);
+	if (scale < 1)
+		steps = steps * scale < 1 ? 1 : steps * scale;
+	#ifdef GRADIENT_DEBUG
+	fprintf(stderr, "r0 %g, r1 %g, steps %i\n", r0, r1, steps);
+	#endif
+	return steps;
+}
+
+
+/**
+ * Count the points that splitting an outline into segments of the given
+ * steps makes.
+ */
+
+unsigned int svgtiny_gradient_point_count(const float *p,
+		unsigned int n, const struct svgtiny_gradient_map *map, float scale,
+		unsigned int max_steps, const struct svgtiny_parse_state *state)
+{
+	struct svgtiny_gradient_segment segment = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned int j, count = 0, steps;
+
+	for (j = 0; j != n; ) {
+		if (!svgtiny_gradient_segment(p, &j, &segment))
+			continue;
+		steps = svgtiny_gradient_segment_steps(&segment, map, scale,
+				max_steps, state);
+		count = UINT_MAX - count < steps ? UINT_MAX : count + steps;
+		segment.x0 = segment.x1;
+		segment.y0 = segment.y1;
+	}
+	return count;
+}
+
+
+/**
+ * Write the x and y of the steps - 1 points strictly inside a segment, at
+ * t = z / steps for z from 1 to steps - 1, to point.
+ *
+ * x and y are cubics in t, so they are forward differenced: each point
+ * costs a few additions rather than evaluating the Bernstein form. The
+ * points are made SVGTINY_LANES at a time, each lane stepping
+ * SVGTINY_LANES steps, so that the lanes are independent and the compiler
+ * may evaluate them in parallel; this also keeps the rounding error of
+ * each difference chain small.
+ */
+
+#define SVGTINY_LANES 4
+
+void svgtiny_gradient_segment_points(
+		const struct svgtiny_gradient_segment *segment,
+		unsigned int steps, struct grad_point *point)
+{
+	const struct svgtiny_gradient_segment *s = segment;
+	double coef[2][4];	/* x, y as coef[.][0] + coef[.][1] t + ... */
+	double f[2][4][SVGTINY_LANES];	/* value and differences per lane */
+	double h = 1.0 / steps, hh = SVGTINY_LANES * h;
+	unsigned int c, z, lane;
+
+	if (steps < 2)
+		return;
+
+	if (s->bezier) {
+		coef[0][0] = s->x0;
+		coef[0][1] = 3.0 * (s->c0x - s->x0);
+		coef[0][2] = 3.0 * (s->x0 - 2.0 * s->c0x + s->c1x);
+		coef[0][3] = -s->x0 + 3.0 * (s->c0x - s->c1x) + s->x1;
+		coef[1][0] = s->y0;
+		coef[1][1] = 3.0 * (s->c0y - s->y0);
+		coef[1][2] = 3.0 * (s->y0 - 2.0 * s->c0y + s->c1y);
+		coef[1][3] = -s->y0 + 3.0 * (s->c0y - s->c1y) + s->y1;
+	} else {
+		coef[0][0] = s->x0;
+		coef[0][1] = (double) s->x1 - s->x0;
+		coef[0][2] = coef[0][3] = 0;
+		coef[1][0] = s->y0;
+		coef[1][1] = (double) s->y1 - s->y0;
+		coef[1][2] = coef[1][3] = 0;
+	}
+	/* start lane l at t = (l + 1) h, stepping hh */
+	for (c = 0; c != 2; c++) {
+		double a = coef[c][3], b = coef[c][2], d = coef[c][1];
+		for (lane = 0; lane != SVGTINY_LANES; lane++) {
+			double t = (lane + 1) * h;
+			f[c][0][lane] = ((a * t + b) * t + d) * t + coef[c][0];
+			f[c][1][lane] = a * (3 * t * t * hh + 3 * t * hh * hh +
+					hh * hh * hh) +
+					b * (2 * t * hh + hh * hh) + d * hh;
+			f[c][2][lane] = a * (6 * t * hh * hh +
+					6 * hh * hh * hh) + b * 2 * hh * hh;
+			f[c][3][lane] = a * 6 * hh * hh * hh;
+		}
+	}
+
+	for (z = 1; z < steps; z += SVGTINY_LANES) {
+		for (lane = 0; lane != SVGTINY_LANES && z + lane < steps;
+				lane++) {
+			point[z + lane - 1].x = f[0][0][lane];
+			point[z + lane - 1].y = f[1][0][lane];
+		}
+		for (c = 0; c != 2; c++) {
+			for (lane = 0; lane != SVGTINY_LANES; lane++) {
+				f[c][0][lane] += f[c][1][lane];
+				f[c][1][lane] += f[c][2][lane];
+				f[c][2][lane] += f[c][3][lane];
+			}
+		}
+	}
+}
+
+
+/**
+ * Find points along an outline for the vertices of the triangles that
+ * fill it with a gradient, as the struct grad_point items of pts, and the
+ * index min_pt of the point nearest the start of the gradient vector.
+ * trans maps user space to gradient space. If the points would make more
+ * than max_triangles triangles, each segment takes proportionally fewer
+ * steps.
+ */
+
+svgtiny_code svgtiny_gradient_points(const float *p, unsigned int n,
+		const float trans[6], const float vector[4],
+		unsigned int max_triangles, struct svgtiny_parse_state *state,
+		struct svgtiny_list *pts, unsigned int *min_pt)
+{
+	struct svgtiny_gradient_segment segment = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	struct svgtiny_gradient_map map;
+	float scale = 1;
+	float min_r = 1000;
+	unsigned int count, steps, i, j, z;
+	struct grad_point *point;
+	svgtiny_code code;
+
+	memcpy(map.trans, trans, sizeof map.trans);
+	map.x0 = vector[0];
+	map.y0 = vector[1];
+	map.dx = vector[2] - vector[0];
+	map.dy = vector[3] - vector[1];
+	map.norm_squared = map.dx * map.dx + map.dy * map.dy;
+
+	/* count the points first, so that they are allocated at once */
+	count = svgtiny_gradient_point_count(p, n, &map, 1, max_triangles,
+			state);
+	if (max_triangles + 2 < count) {
+		scale = (float) max_triangles / count;
+		count = svgtiny_gradient_point_count(p, n, &map, scale,
+				max_triangles, state);
+	}
+	code = svgtiny_list_resize(pts, count);
+	if (code != svgtiny_OK)
+		return code;
+	*min_pt = 0;
+	if (count == 0)
+		return svgtiny_OK;
+	point = svgtiny_list_get(pts, 0);
+
+	for (i = 0, j = 0; j != n; ) {
+		if (!svgtiny_gradient_segment(p, &j, &segment))
+			continue;
+		steps = svgtiny_gradient_segment_steps(&segment, &map, scale,
+				max_triangles, state);
+
+		/* start point, then the points inside the segment */
+		point[i].x = segment.x0;
+		point[i].y = segment.y0;
+		svgtiny_gradient_segment_points(&segment, steps, point + i + 1);
+		for (z = 0; z != steps; z++, i++) {
+			point[i].r = svgtiny_gradient_r(&map, point[i].x,
+					point[i].y);
+			if (point[i].r < min_r) {
+				min_r = point[i].r;
+				*min_pt = i;
+			}
+		}
+
+		/* next segment start point is this segment end point */
+		segment.x0 = segment.x1;
+		segment.y0 = segment.y1;
+	}
+	#ifdef GRADIENT_DEBUG
+	fprintf(stderr, "pts size %i, min_pt %i, min_r %.3f\n",
+			svgtiny_list_size(pts), *min_pt, min_r);
+	#endif
+
+	return svgtiny_OK;
+}
+
+
+/**
+ * Add a path with a linear gradient fill to the svgtiny_diagram as one
+ * flat-filled shape, in the colour of the middle of the gradient, for
+ * when it would take more than the most triangles allowed.
+ */
+
+svgtiny_code svgtiny_add_path_flat_gradient(float *p, unsigned int n,
+		struct svgtiny_parse_state *state)
+{
+	struct svgtiny_shape *shape;
+
+	svgtiny_transform_path(p, n, state);
+
+	shape = svgtiny_add_shape(state);
+	if (!shape)
+		return svgtiny_OUT_OF_MEMORY;
+	shape->path = p;
+	shape->path_length = n;
+	shape->fill = svgtiny_gradient_colour(state->fill_gradient, 0.5);
+
+	return svgtiny_finish_shape(state);
+}
+
+
 /**
  * Add a path with a linear gradient fill to the svgtiny_diagram.
  */
@@ -305,66 +1180,21 @@ float svgtiny_parse_gradient_offset(const char *s)
 svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		struct svgtiny_parse_state *state)
 {
-	struct grad_point {
-		float x, y, r;
-	};
-	float object_x0, object_y0, object_x1, object_y1;
-	float gradient_x0, gradient_y0, gradient_x1, gradient_y1,
-	      gradient_dx, gradient_dy;
+	const struct svgtiny_gradient *gradient = state->fill_gradient;
+	float vector[4];
 	float trans[6];
-	unsigned int steps = 10;
-	float x0 = 0, y0 = 0, x0_trans, y0_trans, r0; /* segment start point */
-	float x1, y1, x1_trans, y1_trans, r1; /* segment end point */
-	/* segment control points (beziers only) */
-	float c0x = 0, c0y = 0, c1x = 0, c1y = 0;
-	float gradient_norm_squared;
 	struct svgtiny_list *pts;
-	float min_r = 1000;
 	unsigned int min_pt = 0;
-	unsigned int j;
+	unsigned int max_triangles = state->ctx->diagram->gradient_max_triangles;
 	unsigned int stop_count;
 	unsigned int current_stop;
 	float last_stop_r;
 	float current_stop_r;
 	int red0, green0, blue0, red1, green1, blue1;
 	unsigned int t, a, b;
+	svgtiny_code code = svgtiny_OK;
 
-	/* determine object bounding box */
-	svgtiny_path_bbox(p, n, &object_x0, &object_y0, &object_x1, &object_y1);
-	#ifdef GRADIENT_DEBUG
-	fprintf(stderr, "object bbox: (%g %g) (%g %g)\n",
-			object_x0, object_y0, object_x1, object_y1);
-	#endif
-
-	if (!state->gradient_user_space_on_use) {
-		gradient_x0 = object_x0 +
-				svgtiny_parse_length(state->gradient_x1,
-					object_x1 - object_x0, *state);
-		gradient_y0 = object_y0 +
-				svgtiny_parse_length(state->gradient_y1,
-					object_y1 - object_y0, *state);
-		gradient_x1 = object_x0 +
-				svgtiny_parse_length(state->gradient_x2,
-					object_x1 - object_x0, *state);
-		gradient_y1 = object_y0 +
-				svgtiny_parse_length(state->gradient_y2,
-					object_y1 - object_y0, *state);
-	} else {
-		gradient_x0 = svgtiny_parse_length(state->gradient_x1,
-				state->viewport_width, *state);
-		gradient_y0 = svgtiny_parse_length(state->gradient_y1,
-				state->viewport_height, *state);
-		gradient_x1 = svgtiny_parse_length(state->gradient_x2,
-				state->viewport_width, *state);
-		gradient_y1 = svgtiny_parse_length(state->gradient_y2,
-				state->viewport_height, *state);
-	}
-	gradient_dx = gradient_x1 - gradient_x0;
-	gradient_dy = gradient_y1 - gradient_y0;
-	#ifdef GRADIENT_DEBUG
-	fprintf(stderr, "gradient vector: (%g %g) => (%g %g)\n",
-			gradient_x0, gradient_y0, gradient_x1, gradient_y1);
-	#endif
+	svgtiny_gradient_vector(gradient, p, n, state, vector);
 
 	/* show theoretical gradient strips for debugging */
 	/*unsigned int strips = 10;
@@ -379,7 +1209,8 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		fprintf(stderr, "strip %i vector: (%g %g) + (%g %g)\n",
 				z, strip_x0, strip_y0, strip_dx, strip_dy);
 
-		float *p = malloc(13 * sizeof p[0]);
+		float *p = svgtiny_arena_alloc(state->ctx->arena,
+				13 * sizeof p[0]);
 		if (!p)
 			return svgtiny_OUT_OF_MEMORY;
 		p[0] = svgtiny_PATH_MOVE;
@@ -398,18 +1229,18 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		svgtiny_transform_path(p, 13, state);
 		struct svgtiny_shape *shape = svgtiny_add_shape(state);
 		if (!shape) {
-			free(p);
+			svgtiny_arena_free(state->ctx->arena, p);
 			return svgtiny_OUT_OF_MEMORY;
 		}
 		shape->path = p;
 		shape->path_length = 13;
 		shape->fill = svgtiny_TRANSPARENT;
 		shape->stroke = svgtiny_RGB(0, 0xff, 0);
-		state->diagram->shape_count++;
+		state->ctx->diagram->shape_count++;
 	}*/
 
 	/* invert gradient transform for applying to vertices */
-	svgtiny_invert_matrix(&state->gradient_transform.a, trans);
+	svgtiny_invert_matrix(&gradient->transform.a, trans);
 	#ifdef GRADIENT_DEBUG
 	fprintf(stderr, "inverse transform %g %g %g %g %g %g\n",
 			trans[0], trans[1], trans[2], trans[3],
@@ -417,148 +1248,39 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 	#endif
 
 	/* compute points on the path for triangle vertices */
-	/* r, r0, r1 are distance along gradient vector */
-	gradient_norm_squared = gradient_dx * gradient_dx +
-	                              gradient_dy * gradient_dy;
+	if (max_triangles == 0)
+		max_triangles = svgtiny_GRADIENT_MAX_TRIANGLES;
 	pts = svgtiny_list_create(
-			sizeof (struct grad_point));
+			sizeof (struct grad_point), state->ctx->allocator);
 	if (!pts)
 		return svgtiny_OUT_OF_MEMORY;
-	for (j = 0; j != n; ) {
-		int segment_type = (int) p[j];
-		struct grad_point *point;
-		unsigned int z;
-
-		if (segment_type == svgtiny_PATH_MOVE) {
-			x0 = p[j + 1];
-			y0 = p[j + 2];
-			j += 3;
-			continue;
-		}
-
-		assert(segment_type == svgtiny_PATH_CLOSE ||
-				segment_type == svgtiny_PATH_LINE ||
-				segment_type == svgtiny_PATH_BEZIER);
-
-		/* start point (x0, y0) */
-		x0_trans = trans[0]*x0 + trans[2]*y0 + trans[4];
-		y0_trans = trans[1]*x0 + trans[3]*y0 + trans[5];
-		r0 = ((x0_trans - gradient_x0) * gradient_dx +
-				(y0_trans - gradient_y0) * gradient_dy) /
-				gradient_norm_squared;
-		point = svgtiny_list_push(pts);
-		if (!point) {
-			svgtiny_list_free(pts);
-			return svgtiny_OUT_OF_MEMORY;
-		}
-		point->x = x0;
-		point->y = y0;
-		point->r = r0;
-		if (r0 < min_r) {
-			min_r = r0;
-			min_pt = svgtiny_list_size(pts) - 1;
-		}
-
-		/* end point (x1, y1) */
-		if (segment_type == svgtiny_PATH_LINE) {
-			x1 = p[j + 1];
-			y1 = p[j + 2];
-			j += 3;
-		} else if (segment_type == svgtiny_PATH_CLOSE) {
-			x1 = p[1];
-			y1 = p[2];
-			j++;
-		} else /* svgtiny_PATH_BEZIER */ {
-			c0x = p[j + 1];
-			c0y = p[j + 2];
-			c1x = p[j + 3];
-			c1y = p[j + 4];
-			x1 = p[j + 5];
-			y1 = p[j + 6];
-			j += 7;
-		}
-		x1_trans = trans[0]*x1 + trans[2]*y1 + trans[4];
-		y1_trans = trans[1]*x1 + trans[3]*y1 + trans[5];
-		r1 = ((x1_trans - gradient_x0) * gradient_dx +
-				(y1_trans - gradient_y0) * gradient_dy) /
-				gradient_norm_squared;
-
-		/* determine steps from change in r */
-
-		if(isnan(r0) || isnan(r1)) {
-			steps = 1;
-		} else {
-			steps = ceilf(fabsf(r1 - r0) / 0.05);
-		}
-
-		if (steps == 0)
-			steps = 1;
-		#ifdef GRADIENT_DEBUG
-		fprintf(stderr, "r0 %g, r1 %g, steps %i\n",
-				r0, r1, steps);
-		#endif
-
-		/* loop through intermediate points */
-		for (z = 1; z != steps; z++) {
-			float t, x, y, x_trans, y_trans, r;
-			struct grad_point *point;
-			t = (float) z / (float) steps;
-			if (segment_type == svgtiny_PATH_BEZIER) {
-				x = (1-t) * (1-t) * (1-t) * x0 +
-					3 * t * (1-t) * (1-t) * c0x +
-					3 * t * t * (1-t) * c1x +
-					t * t * t * x1;
-				y = (1-t) * (1-t) * (1-t) * y0 +
-					3 * t * (1-t) * (1-t) * c0y +
-					3 * t * t * (1-t) * c1y +
-					t * t * t * y1;
-			} else {
-				x = (1-t) * x0 + t * x1;
-				y = (1-t) * y0 + t * y1;
-			}
-			x_trans = trans[0]*x + trans[2]*y + trans[4];
-			y_trans = trans[1]*x + trans[3]*y + trans[5];
-			r = ((x_trans - gradient_x0) * gradient_dx +
-					(y_trans - gradient_y0) * gradient_dy) /
-					gradient_norm_squared;
-			#ifdef GRADIENT_DEBUG
-			fprintf(stderr, "(%g %g [%g]) ", x, y, r);
-			#endif
-			point = svgtiny_list_push(pts);
-			if (!point) {
-				svgtiny_list_free(pts);
-				return svgtiny_OUT_OF_MEMORY;
-			}
-			point->x = x;
-			point->y = y;
-			point->r = r;
-			if (r < min_r) {
-				min_r = r;
-				min_pt = svgtiny_list_size(pts) - 1;
-			}
-		}
-		#ifdef GRADIENT_DEBUG
-		fprintf(stderr, "\n");
-		#endif
+	code = svgtiny_gradient_points(p, n, trans, vector, max_triangles,
+			state, pts, &min_pt);
+	if (code != svgtiny_OK) {
+		svgtiny_list_free(pts);
+		return code;
+	}
+	if (max_triangles + 2 < svgtiny_list_size(pts)) {
+		/* more segments than triangles: fill flat */
+		svgtiny_list_free(pts);
+		return svgtiny_add_path_flat_gradient(p, n, state);
+	}
 
-		/* next segment start point is this segment end point */
-		x0 = x1;
-		y0 = y1;
+	if (state->ctx->diagram->options & svgtiny_GRADIENT_MESH) {
+		code = svgtiny_add_gradient_mesh(p, n, pts, min_pt, state);
+		svgtiny_list_free(pts);
+		return code;
 	}
-	#ifdef GRADIENT_DEBUG
-	fprintf(stderr, "pts size %i, min_pt %i, min_r %.3f\n",
-			svgtiny_list_size(pts), min_pt, min_r);
-	#endif
 
 	/* render triangles */
-	stop_count = state->linear_gradient_stop_count;
+	stop_count = gradient->stop_count;
 	assert(2 <= stop_count);
 	current_stop = 0;
 	last_stop_r = 0;
-	current_stop_r = state->gradient_stop[0].offset;
-	red0 = red1 = svgtiny_RED(state->gradient_stop[0].color);
-	green0 = green1 = svgtiny_GREEN(state->gradient_stop[0].color);
-	blue0 = blue1 = svgtiny_BLUE(state->gradient_stop[0].color);
+	current_stop_r = gradient->stop[0].offset;
+	red0 = red1 = svgtiny_RED(gradient->stop[0].color);
+	green0 = green1 = svgtiny_GREEN(gradient->stop[0].color);
+	blue0 = blue1 = svgtiny_BLUE(gradient->stop[0].color);
 	t = min_pt;
 	a = (min_pt + 1) % svgtiny_list_size(pts);
 	b = min_pt == 0 ? svgtiny_list_size(pts) - 1 : min_pt - 1;
@@ -580,19 +1302,17 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 			red0 = red1;
 			green0 = green1;
 			blue0 = blue1;
-			red1 = svgtiny_RED(state->
-					gradient_stop[current_stop].color);
-			green1 = svgtiny_GREEN(state->
-					gradient_stop[current_stop].color);
-			blue1 = svgtiny_BLUE(state->
-					gradient_stop[current_stop].color);
+			red1 = svgtiny_RED(gradient->stop[current_stop].color);
+			green1 = svgtiny_GREEN(gradient->stop[current_stop].color);
+			blue1 = svgtiny_BLUE(gradient->stop[current_stop].color);
 			last_stop_r = current_stop_r;
-			current_stop_r = state->
-					gradient_stop[current_stop].offset;
+			current_stop_r = gradient->stop[current_stop].offset;
 		}
-		p = malloc(10 * sizeof p[0]);
-		if (!p)
+		p = svgtiny_arena_alloc(state->ctx->arena, 10 * sizeof p[0]);
+		if (!p) {
+			svgtiny_list_free(pts);
 			return svgtiny_OUT_OF_MEMORY;
+		}
 		p[0] = svgtiny_PATH_MOVE;
 		p[1] = point_t->x;
 		p[2] = point_t->y;
@@ -606,17 +1326,17 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		svgtiny_transform_path(p, 10, state);
 		shape = svgtiny_add_shape(state);
 		if (!shape) {
-			free(p);
+			svgtiny_arena_free(state->ctx->arena, p);
+			svgtiny_list_free(pts);
 			return svgtiny_OUT_OF_MEMORY;
 		}
 		shape->path = p;
 		shape->path_length = 10;
 		/*shape->fill = svgtiny_TRANSPARENT;*/
 		if (current_stop == 0)
-			shape->fill = state->gradient_stop[0].color;
+			shape->fill = gradient->stop[0].color;
 		else if (current_stop == stop_count)
-			shape->fill = state->
-					gradient_stop[stop_count - 1].color;
+			shape->fill = gradient->stop[stop_count - 1].color;
 		else {
 			float stop_r = (mean_r - last_stop_r) /
 				(current_stop_r - last_stop_r);
@@ -629,7 +1349,11 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		#ifdef GRADIENT_DEBUG
 		shape->stroke = svgtiny_RGB(0, 0, 0xff);
 		#endif
-		state->diagram->shape_count++;
+		code = svgtiny_finish_shape(state);
+		if (code != svgtiny_OK) {
+			svgtiny_list_free(pts);
+			return code;
+		}
 		if (point_a->r < point_b->r) {
 			t = a;
 			a = (a + 1) % svgtiny_list_size(pts);
@@ -642,27 +1366,28 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 	/* render gradient vector for debugging */
 	#ifdef GRADIENT_DEBUG
 	{
-		float *p = malloc(7 * sizeof p[0]);
+		float *p = svgtiny_arena_alloc(state->ctx->arena,
+				7 * sizeof p[0]);
 		if (!p)
 			return svgtiny_OUT_OF_MEMORY;
 		p[0] = svgtiny_PATH_MOVE;
-		p[1] = gradient_x0;
-		p[2] = gradient_y0;
+		p[1] = vector[0];
+		p[2] = vector[1];
 		p[3] = svgtiny_PATH_LINE;
-		p[4] = gradient_x1;
-		p[5] = gradient_y1;
+		p[4] = vector[2];
+		p[5] = vector[3];
 		p[6] = svgtiny_PATH_CLOSE;
 		svgtiny_transform_path(p, 7, state);
 		struct svgtiny_shape *shape = svgtiny_add_shape(state);
 		if (!shape) {
-			free(p);
+			svgtiny_arena_free(state->ctx->arena, p);
 			return svgtiny_OUT_OF_MEMORY;
 		}
 		shape->path = p;
 		shape->path_length = 7;
 		shape->fill = svgtiny_TRANSPARENT;
 		shape->stroke = svgtiny_RGB(0xff, 0, 0);
-		state->diagram->shape_count++;
+		svgtiny_finish_shape(state);
 	}
 	#endif
 
@@ -673,7 +1398,7 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		struct svgtiny_shape *shape = svgtiny_add_shape(state);
 		if (!shape)
 			return svgtiny_OUT_OF_MEMORY;
-		char *text = malloc(20);
+		char *text = svgtiny_arena_alloc(state->ctx->arena, 20);
 		if (!text)
 			return svgtiny_OUT_OF_MEMORY;
 		sprintf(text, "%i=%.3f", i, point->r);
@@ -684,7 +1409,7 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 				state->ctm.d * point->y + state->ctm.f;
 		shape->fill = svgtiny_RGB(0, 0, 0);
 		shape->stroke = svgtiny_TRANSPARENT;
-		state->diagram->shape_count++;
+		svgtiny_finish_shape(state);
 	}
 	#endif
 
@@ -695,73 +1420,28 @@ svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 
 		shape = svgtiny_add_shape(state);
 		if (!shape) {
-			free(p);
+			svgtiny_arena_free(state->ctx->arena, p);
+			svgtiny_list_free(pts);
 			return svgtiny_OUT_OF_MEMORY;
 		}
 		shape->path = p;
 		shape->path_length = n;
 		shape->fill = svgtiny_TRANSPARENT;
-		state->diagram->shape_count++;
+		code = svgtiny_finish_shape(state);
 	} else {
-		free(p);
+		svgtiny_arena_free(state->ctx->arena, p);
 	}
 
 	svgtiny_list_free(pts);
 
-	return svgtiny_OK;
-}
-
-
-/**
- * Get the bounding box of path.
- */
-
-void svgtiny_path_bbox(float *p, unsigned int n,
-		float *x0, float *y0, float *x1, float *y1)
-{
-	unsigned int j;
-
-	*x0 = *x1 = p[1];
-	*y0 = *y1 = p[2];
-
-	for (j = 0; j != n; ) {
-		unsigned int points = 0;
-		unsigned int k;
-		switch ((int) p[j]) {
-		case svgtiny_PATH_MOVE:
-		case svgtiny_PATH_LINE:
-			points = 1;
-			break;
-		case svgtiny_PATH_CLOSE:
-			points = 0;
-			break;
-		case svgtiny_PATH_BEZIER:
-			points = 3;
-			break;
-		default:
-			assert(0);
-		}
-		j++;
-		for (k = 0; k != points; k++) {
-			float x = p[j], y = p[j + 1];
-			if (x < *x0)
-				*x0 = x;
-			else if (*x1 < x)
-				*x1 = x;
-			if (y < *y0)
-				*y0 = y;
-			else if (*y1 < y)
-				*y1 = y;
-			j += 2;
-		}
-	}
+	return code;
 }
 
 
 /**
  * Invert a transformation matrix.
  */
-void svgtiny_invert_matrix(float *m, float *inv)
+void svgtiny_invert_matrix(const float *m, float *inv)
 {
 	float determinant = m[0]*m[3] - m[1]*m[2];
 	inv[0] = m[3] / determinant;
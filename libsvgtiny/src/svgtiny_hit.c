@@ -0,0 +1,480 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Hit testing: which shapes paint a point.
+ *
+ * A fill is hit where the winding number of its path around the point is not
+ * 0. Crossings are counted along a ray to the right of the point: a curve is
+ * cut where its y turns, and each piece, being monotone in y, is solved for
+ * the ray's y by bisection. Most curves are settled by their control points
+ * alone. A stroke is hit within half its width of the path, as if its joins
+ * and caps were round, and curves close enough to matter are flattened to a
+ * small part of that distance. Either is also hit within the tolerance of
+ * its outline.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+/* shapes taken from a svgtiny_index without allocating */
+#define SVGTINY_HIT_CANDIDATES 256
+/* flattening tolerance of curves in distance tests, as a part of the
+ * distance */
+#define SVGTINY_HIT_FLATNESS 0.05f
+/* bisection steps solving a curve for y, enough for a float's precision */
+#define SVGTINY_HIT_STEPS 30
+
+static bool svgtiny_hit_diagram_shape(const struct svgtiny_diagram *diagram,
+		unsigned int i, float x, float y, float tolerance);
+static bool svgtiny_hit_shape(const struct svgtiny_shape *shape,
+		const float *m, float x, float y, float tolerance,
+		svgtiny_colour fill, svgtiny_colour stroke);
+static int svgtiny_hit_winding(const float *p, unsigned int n,
+		float x, float y);
+static int svgtiny_hit_line_winding(float x0, float y0, float x1, float y1,
+		float x, float y);
+static int svgtiny_hit_bezier_winding(float x0, float y0, const float *c,
+		float x, float y);
+static bool svgtiny_hit_near(const float *p, unsigned int n,
+		float x, float y, float distance, bool close);
+static bool svgtiny_hit_line_near(float x0, float y0, float x1, float y1,
+		float x, float y, float distance);
+static bool svgtiny_hit_bezier_near(float x0, float y0, const float *c,
+		float x, float y, float distance);
+
+
+/**
+ * Find the shapes of a diagram painted at a point, or within tolerance of
+ * it, topmost first.
+ */
+
+unsigned int svgtiny_hit_test(const struct svgtiny_diagram *diagram,
+		const struct svgtiny_index *index, float x, float y,
+		float tolerance, unsigned int *indices, unsigned int max)
+{
+	const svgtiny_allocator *allocator =
+			svgtiny_arena_allocator(diagram->_internal_arena);
+	unsigned int candidate[SVGTINY_HIT_CANDIDATES];
+	unsigned int *shape = candidate;
+	unsigned int count = 0, found = 0, i;
+
+	if (index) {
+		count = svgtiny_index_query(index, x - tolerance,
+				y - tolerance, x + tolerance, y + tolerance,
+				candidate, SVGTINY_HIT_CANDIDATES);
+		if (SVGTINY_HIT_CANDIDATES < count) {
+			/* without the memory, every shape is tried */
+			shape = svgtiny_mem_alloc(allocator,
+					count * sizeof shape[0]);
+			if (shape)
+				svgtiny_index_query(index, x - tolerance,
+						y - tolerance, x + tolerance,
+						y + tolerance, shape, count);
+			else
+				index = 0;
+		}
+	}
+
+	if (index) {
+		/* the candidates are in painting order */
+		for (i = count; i-- != 0; ) {
+			if (!svgtiny_hit_diagram_shape(diagram, shape[i],
+					x, y, tolerance))
+				continue;
+			if (found < max)
+				indices[found] = shape[i];
+			found++;
+		}
+	} else {
+		for (i = diagram->shape_count; i-- != 0; ) {
+			if (!svgtiny_hit_diagram_shape(diagram, i,
+					x, y, tolerance))
+				continue;
+			if (found < max)
+				indices[found] = i;
+			found++;
+		}
+	}
+
+	if (shape != candidate)
+		svgtiny_mem_free(allocator, shape);
+	return found;
+}
+
+
+/**
+ * Test shape i of a diagram, or for an instance, each of its symbol shapes.
+ */
+
+bool svgtiny_hit_diagram_shape(const struct svgtiny_diagram *diagram,
+		unsigned int i, float x, float y, float tolerance)
+{
+	const struct svgtiny_shape *shape = &diagram->shape[i];
+	const struct svgtiny_instance *instance = shape->instance;
+	float reach = shape->stroke_width / 2 + tolerance;
+	unsigned int k;
+	float m[6];
+
+	if (x < shape->bounds.x0 - reach || shape->bounds.x1 + reach < x ||
+			y < shape->bounds.y0 - reach ||
+			shape->bounds.y1 + reach < y)
+		return false;
+
+	if (!instance)
+		return svgtiny_hit_shape(shape, 0, x, y, tolerance,
+				shape->fill, shape->stroke);
+
+	m[0] = instance->transform.a;
+	m[1] = instance->transform.b;
+	m[2] = instance->transform.c;
+	m[3] = instance->transform.d;
+	m[4] = instance->transform.e;
+	m[5] = instance->transform.f;
+	for (k = instance->first; k != instance->first + instance->count;
+			k++) {
+		const struct svgtiny_shape *s = &diagram->symbol_shape[k];
+		if (svgtiny_hit_shape(s, m, x, y, tolerance,
+				s->fill ? s->fill : instance->fill,
+				s->stroke ? s->stroke : instance->stroke))
+			return true;
+	}
+	return false;
+}
+
+
+/**
+ * Test one shape, drawn through the transformation m if it is not NULL,
+ * with the given paint.
+ */
+
+bool svgtiny_hit_shape(const struct svgtiny_shape *shape,
+		const float *m, float x, float y, float tolerance,
+		svgtiny_colour fill, svgtiny_colour stroke)
+{
+	float half_width = shape->stroke_width / 2, reach;
+	bool filled, stroked;
+
+	if (!shape->path)
+		return false;
+
+	if (m) {
+		/* test the point in the shape's own coordinates, and distances
+		 * scaled by the mean scale of m */
+		float det = m[0] * m[3] - m[1] * m[2];
+		float dx = x - m[4], dy = y - m[5];
+		if (det == 0)
+			return false;
+		x = (m[3] * dx - m[2] * dy) / det;
+		y = (m[0] * dy - m[1] * dx) / det;
+		tolerance /= sqrtf(fabsf(det));
+	}
+
+	/* a paint of 0 was never set: the fill defaults to black, and the
+	 * stroke to none */
+	filled = fill != svgtiny_TRANSPARENT;
+	stroked = stroke != svgtiny_TRANSPARENT && stroke != 0 &&
+			0 < half_width;
+	if (!filled && !stroked)
+		return false;
+
+	reach = (stroked ? half_width : 0) + tolerance;
+	if (x < shape->bounds.x0 - reach || shape->bounds.x1 + reach < x ||
+			y < shape->bounds.y0 - reach ||
+			shape->bounds.y1 + reach < y)
+		return false;
+
+	if (filled && svgtiny_hit_winding(shape->path, shape->path_length,
+			x, y) != 0)
+		return true;
+	if (stroked && svgtiny_hit_near(shape->path, shape->path_length,
+			x, y, half_width + tolerance, false))
+		return true;
+	if (filled && 0 < tolerance && svgtiny_hit_near(shape->path,
+			shape->path_length, x, y, tolerance, true))
+		return true;
+	return false;
+}
+
+
+/**
+ * Find the winding number of a path around a point, with every subpath
+ * closed.
+ */
+
+int svgtiny_hit_winding(const float *p, unsigned int n, float x, float y)
+{
+	float last_x = 0, last_y = 0, start_x = 0, start_y = 0;
+	int winding = 0;
+	unsigned int j;
+
+	for (j = 0; j != n; ) {
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			winding += svgtiny_hit_line_winding(last_x, last_y,
+					start_x, start_y, x, y);
+			start_x = last_x = p[j + 1];
+			start_y = last_y = p[j + 2];
+			j += 3;
+			break;
+		case svgtiny_PATH_CLOSE:
+			winding += svgtiny_hit_line_winding(last_x, last_y,
+					start_x, start_y, x, y);
+			last_x = start_x;
+			last_y = start_y;
+			j++;
+			break;
+		case svgtiny_PATH_LINE:
+			winding += svgtiny_hit_line_winding(last_x, last_y,
+					p[j + 1], p[j + 2], x, y);
+			last_x = p[j + 1];
+			last_y = p[j + 2];
+			j += 3;
+			break;
+		case svgtiny_PATH_BEZIER:
+			winding += svgtiny_hit_bezier_winding(last_x, last_y,
+					p + j + 1, x, y);
+			last_x = p[j + 5];
+			last_y = p[j + 6];
+			j += 7;
+			break;
+		default:
+			assert(0);
+			return winding;
+		}
+	}
+	return winding + svgtiny_hit_line_winding(last_x, last_y,
+			start_x, start_y, x, y);
+}
+
+
+/**
+ * Find how a line from (x0, y0) to (x1, y1) adds to the winding number
+ * around a point: by its direction if it crosses the ray to the right of the
+ * point. Each line takes in its lower end and not its upper one, so a ray
+ * through a vertex counts it once.
+ */
+
+int svgtiny_hit_line_winding(float x0, float y0, float x1, float y1,
+		float x, float y)
+{
+	double cross;
+
+	if ((y0 <= y) == (y1 <= y))
+		return 0;
+	cross = x0 + ((double) y - y0) * ((double) x1 - x0) /
+			((double) y1 - y0);
+	if (cross <= x)
+		return 0;
+	return y0 < y1 ? 1 : -1;
+}
+
+
+/**
+ * Find how a cubic Bézier from (x0, y0) through control points c adds to the
+ * winding number around a point.
+ */
+
+int svgtiny_hit_bezier_winding(float x0, float y0, const float *c,
+		float x, float y)
+{
+	double px[4] = { x0, c[0], c[2], c[4] };
+	double py[4] = { y0, c[1], c[3], c[5] };
+	double t[4], qa, qb, qc;
+	unsigned int pieces = 0, k;
+	int winding = 0;
+	bool below = y0 <= y;
+
+	/* settled by the control points, which the curve stays within */
+	if (below == (c[1] <= y) && below == (c[3] <= y) &&
+			below == (c[5] <= y))
+		return 0;
+	if (x0 <= x && c[0] <= x && c[2] <= x && c[4] <= x)
+		return 0;
+	if (x < x0 && x < c[0] && x < c[2] && x < c[4])
+		return svgtiny_hit_line_winding(x0, y0, c[4], c[5], x, y);
+
+	/* cut where y turns: B'(t) / 3 = qa t^2 + qb t + qc */
+	qa = -py[0] + 3 * py[1] - 3 * py[2] + py[3];
+	qb = 2 * (py[0] - 2 * py[1] + py[2]);
+	qc = py[1] - py[0];
+	t[pieces++] = 0;
+	if (qa == 0) {
+		if (qb != 0 && 0 < -qc / qb && -qc / qb < 1)
+			t[pieces++] = -qc / qb;
+	} else {
+		double discriminant = qb * qb - 4 * qa * qc;
+		if (0 < discriminant) {
+			double root = sqrt(discriminant);
+			double t1 = (-qb - root) / (2 * qa);
+			double t2 = (-qb + root) / (2 * qa);
+			if (t2 < t1) {
+				double swap = t1;
+				t1 = t2;
+				t2 = swap;
+			}
+			if (0 < t1 && t1 < 1)
+				t[pieces++] = t1;
+			if (0 < t2 && t2 < 1)
+				t[pieces++] = t2;
+		}
+	}
+	t[pieces] = 1;
+
+	for (k = 0; k != pieces; k++) {
+		double ta = t[k], tb = t[k + 1], ya, yb, u, v, cross;
+		unsigned int step;
+		u = 1 - ta;
+		ya = u * u * u * py[0] + 3 * u * u * ta * py[1] +
+				3 * u * ta * ta * py[2] + ta * ta * ta * py[3];
+		u = 1 - tb;
+		yb = u * u * u * py[0] + 3 * u * u * tb * py[1] +
+				3 * u * tb * tb * py[2] + tb * tb * tb * py[3];
+		if ((ya <= y) == (yb <= y))
+			continue;
+		/* the piece is monotone in y: bisect for the ray's y */
+		for (step = 0; step != SVGTINY_HIT_STEPS; step++) {
+			double tm = (ta + tb) / 2, ym;
+			u = 1 - tm;
+			ym = u * u * u * py[0] + 3 * u * u * tm * py[1] +
+					3 * u * tm * tm * py[2] +
+					tm * tm * tm * py[3];
+			if ((ym <= y) == (ya <= y))
+				ta = tm;
+			else
+				tb = tm;
+		}
+		v = (ta + tb) / 2;
+		u = 1 - v;
+		cross = u * u * u * px[0] + 3 * u * u * v * px[1] +
+				3 * u * v * v * px[2] + v * v * v * px[3];
+		if (x < cross)
+			winding += ya < yb ? 1 : -1;
+	}
+	return winding;
+}
+
+
+/**
+ * Test whether a point is within distance of a path, including the lines
+ * that close each subpath if close is true, and otherwise only those of
+ * svgtiny_PATH_CLOSE.
+ */
+
+bool svgtiny_hit_near(const float *p, unsigned int n, float x, float y,
+		float distance, bool close)
+{
+	float last_x = 0, last_y = 0, start_x = 0, start_y = 0;
+	unsigned int j;
+
+	for (j = 0; j != n; ) {
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			if (close && j != 0 && svgtiny_hit_line_near(
+					last_x, last_y,
+					start_x, start_y, x, y, distance))
+				return true;
+			start_x = last_x = p[j + 1];
+			start_y = last_y = p[j + 2];
+			j += 3;
+			break;
+		case svgtiny_PATH_CLOSE:
+			if (svgtiny_hit_line_near(last_x, last_y,
+					start_x, start_y, x, y, distance))
+				return true;
+			last_x = start_x;
+			last_y = start_y;
+			j++;
+			break;
+		case svgtiny_PATH_LINE:
+			if (svgtiny_hit_line_near(last_x, last_y,
+					p[j + 1], p[j + 2], x, y, distance))
+				return true;
+			last_x = p[j + 1];
+			last_y = p[j + 2];
+			j += 3;
+			break;
+		case svgtiny_PATH_BEZIER:
+			if (svgtiny_hit_bezier_near(last_x, last_y,
+					p + j + 1, x, y, distance))
+				return true;
+			last_x = p[j + 5];
+			last_y = p[j + 6];
+			j += 7;
+			break;
+		default:
+			assert(0);
+			return false;
+		}
+	}
+	return close && svgtiny_hit_line_near(last_x, last_y,
+			start_x, start_y, x, y, distance);
+}
+
+
+/**
+ * Test whether a point is within distance of a line.
+ */
+
+bool svgtiny_hit_line_near(float x0, float y0, float x1, float y1,
+		float x, float y, float distance)
+{
+	double dx = (double) x1 - x0, dy = (double) y1 - y0;
+	double ex = (double) x - x0, ey = (double) y - y0;
+	double length2 = dx * dx + dy * dy, t = 0;
+
+	if (0 < length2) {
+		t = (ex * dx + ey * dy) / length2;
+		if (t < 0)
+			t = 0;
+		else if (1 < t)
+			t = 1;
+	}
+	ex -= t * dx;
+	ey -= t * dy;
+	return ex * ex + ey * ey <= (double) distance * distance;
+}
+
+
+/**
+ * Test whether a point is within distance of a cubic Bézier from (x0, y0)
+ * through control points c.
+ */
+
+bool svgtiny_hit_bezier_near(float x0, float y0, const float *c,
+		float x, float y, float distance)
+{
+	float line[3 * SVGTINY_FLATTEN_MAX_LINES];
+	unsigned int lines, k;
+
+	/* the curve stays within the box of its control points */
+	if (x + distance < x0 && x + distance < c[0] &&
+			x + distance < c[2] && x + distance < c[4])
+		return false;
+	if (x0 < x - distance && c[0] < x - distance &&
+			c[2] < x - distance && c[4] < x - distance)
+		return false;
+	if (y + distance < y0 && y + distance < c[1] &&
+			y + distance < c[3] && y + distance < c[5])
+		return false;
+	if (y0 < y - distance && c[1] < y - distance &&
+			c[3] < y - distance && c[5] < y - distance)
+		return false;
+
+	lines = svgtiny_flatten_bezier_lines(x0, y0, c,
+			distance * SVGTINY_HIT_FLATNESS);
+	svgtiny_flatten_bezier(x0, y0, c, lines, line);
+	for (k = 0; k != lines; k++) {
+		if (svgtiny_hit_line_near(x0, y0, line[3 * k + 1],
+				line[3 * k + 2], x, y, distance))
+			return true;
+		x0 = line[3 * k + 1];
+		y0 = line[3 * k + 2];
+	}
+	return false;
+}
@@ -20,20 +20,140 @@
 #define UNUSED(x) ((void) (x))
 #endif
 
-struct svgtiny_gradient_stop {
-	float offset;
-	svgtiny_colour color;
+#define svgtiny_MAX_STOPS 10
+/* default for svgtiny_diagram.gradient_max_triangles */
+#define svgtiny_GRADIENT_MAX_TRIANGLES 4096
+/* distance a stroke may reach past the path, in stroke widths: miters up to
+ * the default stroke-miterlimit of 4 reach 4 half stroke widths from the
+ * vertex */
+#define SVGTINY_STROKE_REACH 2
+
+/**
+ * A gradient definition, with its xlink:href chain already applied.
+ * Resolved once per document and id by svgtiny_find_gradient().
+ */
+struct svgtiny_gradient {
+	char *id;
+	bool resolving;  /* true while its href chain is being followed */
+	unsigned int stop_count;
+	struct svgtiny_gradient_stop stop[svgtiny_MAX_STOPS];
+	dom_string *x1, *y1, *x2, *y2;
+	bool user_space_on_use;
+	struct {
+		float a, b, c, d, e, f;
+	} transform;
 };
 
-#define svgtiny_MAX_STOPS 10
+/**
+ * Extra data of a shape, in the diagram's arena, reached through
+ * svgtiny_shape._internal_extensions. Blocks of different kinds are
+ * chained through next.
+ */
+enum svgtiny_extension_type {
+	svgtiny_EXTENSION_LINEAR_GRADIENT,
+	svgtiny_EXTENSION_MESH
+};
 
-struct svgtiny_parse_state {
+struct svgtiny_extension {
+	struct svgtiny_extension *next;
+	enum svgtiny_extension_type type;
+};
+
+/**
+ * A svgtiny_linear_gradient, with its stops following it in the block.
+ */
+struct svgtiny_gradient_extension {
+	struct svgtiny_extension extension;
+	struct svgtiny_linear_gradient gradient;
+};
+
+/**
+ * A svgtiny_mesh, with its vertices, colours and indices following it in the
+ * block.
+ */
+struct svgtiny_mesh_extension {
+	struct svgtiny_extension extension;
+	struct svgtiny_mesh mesh;
+};
+
+/**
+ * Strings compared against element and attribute names. One immutable table
+ * is shared by all parses; see svgtiny_interned_strings().
+ */
+struct svgtiny_interned_strings {
+#define SVGTINY_STRING_ACTION2(n,nn) dom_string *n;
+#include "svgtiny_strings.h"
+#undef SVGTINY_STRING_ACTION2
+};
+
+/**
+ * Extent and paint of some shapes in diagram coordinates, gathered for
+ * svgtiny_diagram.min_size. Colours are summed weighted by area and opacity.
+ */
+struct svgtiny_detail {
+	float x0, y0, x1, y1;	/* bounding box, empty while x0 > x1 */
+	bool unknown;		/* holds text, whose extent is not known */
+	float area;		/* sum of the areas of the shapes' boxes */
+	float red, green, blue;
+	float opacity;		/* sum of area times opacity */
+};
+
+struct svgtiny_merge;
+
+/**
+ * Data shared by every element of one parse. Lives in svgtiny_parse_inner()
+ * for the duration of the parse and is reached through
+ * svgtiny_parse_state.ctx, so it is never copied per element.
+ */
+struct svgtiny_parse_context {
 	struct svgtiny_diagram *diagram;
 	dom_document *document;
+	/* diagram->_internal_arena, which owns every path and text */
+	struct svgtiny_arena *arena;
+	/* diagram->_internal_scratch, for memory needed only while parsing */
+	const svgtiny_allocator *allocator;
 
 	float viewport_width;
 	float viewport_height;
 
+	/* if set, shapes are passed to this as they are finished instead of
+	 * being kept in the diagram */
+	svgtiny_shape_callback callback;
+	void *callback_ctx;
+
+	/* resolved gradients of this document (struct svgtiny_gradient *) */
+	struct svgtiny_list *gradients;
+	/* gradient most recently found by svgtiny_find_gradient(), or NULL */
+	const struct svgtiny_gradient *gradient;
+
+	/* elements already parsed into diagram->symbol_shape for
+	 * svgtiny_KEEP_INSTANCES (struct svgtiny_symbol) */
+	struct svgtiny_list *symbols;
+	/* number of open <use> frames whose shapes become a symbol */
+	unsigned int recording;
+	/* number of open <use> frames, and elements visited inside them,
+	 * limited to SVGTINY_MAX_USE_ELEMENTS */
+	unsigned int open_uses;
+	unsigned long used_elements;
+
+	/* shapes seen since the innermost measured <use> began */
+	struct svgtiny_detail detail;
+	/* rectangles that small shapes are being merged into, or NULL */
+	struct svgtiny_merge *merge;
+	/* extents of elements drawn by <use> (struct svgtiny_use_extent) */
+	struct svgtiny_list *use_extents;
+
+	/* Interned strings */
+	const struct svgtiny_interned_strings *interned;
+};
+
+/**
+ * Graphics state inherited from parent to child elements. Kept small, as
+ * each element handler takes a copy of its parent's state.
+ */
+struct svgtiny_parse_state {
+	struct svgtiny_parse_context *ctx;
+
 	/* current transformation matrix */
 	struct {
 		float a, b, c, d, e, f;
@@ -45,50 +165,126 @@ struct svgtiny_parse_state {
 	svgtiny_colour fill;
 	svgtiny_colour stroke;
 	int stroke_width;
-
-	/* gradients */
-	unsigned int linear_gradient_stop_count;
-	dom_string *gradient_x1, *gradient_y1, *gradient_x2, *gradient_y2;
-	struct svgtiny_gradient_stop gradient_stop[svgtiny_MAX_STOPS];
-	bool gradient_user_space_on_use;
-	struct {
-		float a, b, c, d, e, f;
-	} gradient_transform;
-
-	/* Interned strings */
-#define SVGTINY_STRING_ACTION2(n,nn) dom_string *interned_##n;
-#include "svgtiny_strings.h"
-#undef SVGTINY_STRING_ACTION2
-
+	/* gradient used when fill is svgtiny_LINEAR_GRADIENT */
+	const struct svgtiny_gradient *fill_gradient;
+	/* paint of the enclosing <use>, for shapes that set none, or 0 */
+	svgtiny_colour use_fill;
+	svgtiny_colour use_stroke;
+	const struct svgtiny_gradient *use_fill_gradient;
 };
 
 struct svgtiny_list;
 
 /* svgtiny.c */
+const struct svgtiny_interned_strings *svgtiny_interned_strings(void);
 float svgtiny_parse_length(dom_string *s, int viewport_size,
-		const struct svgtiny_parse_state state);
+		const struct svgtiny_parse_state *state);
 void svgtiny_parse_color(dom_string *s, svgtiny_colour *c,
 		struct svgtiny_parse_state *state);
 void svgtiny_parse_transform(char *s, float *ma, float *mb,
 		float *mc, float *md, float *me, float *mf);
+svgtiny_code svgtiny_reserve_shapes(struct svgtiny_diagram *diagram,
+		unsigned int n);
+svgtiny_code svgtiny_reserve_symbol_shapes(struct svgtiny_diagram *diagram,
+		unsigned int n);
 struct svgtiny_shape *svgtiny_add_shape(struct svgtiny_parse_state *state);
+svgtiny_code svgtiny_finish_shape(struct svgtiny_parse_state *state);
 void svgtiny_transform_path(float *p, unsigned int n,
 		struct svgtiny_parse_state *state);
-#if (defined(_GNU_SOURCE) && !defined(__APPLE__) || defined(__amigaos4__) || defined(__HAIKU__) || (defined(_POSIX_C_SOURCE) && ((_POSIX_C_SOURCE - 0) >= 200809L)))
-#define HAVE_STRNDUP
-#else
-#undef HAVE_STRNDUP
-char *svgtiny_strndup(const char *s, size_t n);
-#define strndup svgtiny_strndup
-#endif
+extern const svgtiny_allocator svgtiny_default_allocator;
+#define svgtiny_mem_alloc(a, size) ((a)->alloc((size), (a)->ctx))
+#define svgtiny_mem_realloc(a, ptr, size) ((a)->realloc((ptr), (size), (a)->ctx))
+void svgtiny_mem_free(const svgtiny_allocator *allocator, void *ptr);
+char *svgtiny_mem_strndup(const svgtiny_allocator *allocator,
+		const char *s, size_t n);
+
+/* svgtiny_arena.c */
+struct svgtiny_arena *svgtiny_arena_create(const svgtiny_allocator *allocator);
+const svgtiny_allocator *svgtiny_arena_allocator(struct svgtiny_arena *arena);
+void svgtiny_arena_set_allocator(struct svgtiny_arena *arena,
+		const svgtiny_allocator *allocator);
+const svgtiny_allocator *svgtiny_arena_scratch_allocator(
+		struct svgtiny_arena *arena);
+void *svgtiny_arena_alloc(struct svgtiny_arena *arena, size_t size);
+void *svgtiny_arena_realloc(struct svgtiny_arena *arena, void *p,
+		size_t old_size, size_t size);
+void svgtiny_arena_free(struct svgtiny_arena *arena, void *p);
+char *svgtiny_arena_strndup(struct svgtiny_arena *arena, const char *s,
+		size_t n);
+void svgtiny_arena_reset(struct svgtiny_arena *arena);
+void svgtiny_arena_trim(struct svgtiny_arena *arena);
+void svgtiny_arena_destroy(struct svgtiny_arena *arena);
+
+/* svgtiny_bounds.c */
+void svgtiny_path_bbox(const float *p, unsigned int n,
+		float *x0, float *y0, float *x1, float *y1);
+void svgtiny_shape_bounds(struct svgtiny_shape *shape);
+void svgtiny_instance_bounds(struct svgtiny_shape *shape,
+		const struct svgtiny_shape *symbol_shape);
+
+/* svgtiny_detail.c */
+void svgtiny_detail_clear(struct svgtiny_detail *detail);
+svgtiny_code svgtiny_detail_path(float *p, unsigned int n,
+		struct svgtiny_parse_state *state, bool *dropped);
+svgtiny_code svgtiny_detail_instance(struct svgtiny_parse_state *state,
+		const struct svgtiny_instance *instance, bool *dropped);
+svgtiny_code svgtiny_detail_begin_use(struct svgtiny_parse_state *state,
+		const char *id, struct svgtiny_detail *outer,
+		unsigned int *extent, bool *skip);
+void svgtiny_detail_end_use(struct svgtiny_parse_state *state,
+		const struct svgtiny_detail *outer, unsigned int extent);
+void svgtiny_detail_free(struct svgtiny_parse_context *ctx);
+
+/* svgtiny_flatten.c */
+/* most lines one curve is split into, whatever the tolerance */
+#define SVGTINY_FLATTEN_MAX_LINES 1024
+unsigned int svgtiny_flatten_bezier_lines(float x0, float y0, const float *c,
+		float tolerance);
+void svgtiny_flatten_bezier(float x0, float y0, const float *c,
+		unsigned int lines, float *out);
 
 /* svgtiny_gradient.c */
 void svgtiny_find_gradient(const char *id, struct svgtiny_parse_state *state);
+void svgtiny_free_gradients(struct svgtiny_parse_context *ctx);
 svgtiny_code svgtiny_add_path_linear_gradient(float *p, unsigned int n,
 		struct svgtiny_parse_state *state);
+svgtiny_code svgtiny_add_path_gradient_fill(float *p, unsigned int n,
+		struct svgtiny_parse_state *state);
+struct svgtiny_gradient_extension *svgtiny_create_gradient_extension(
+		struct svgtiny_arena *arena, unsigned int stop_count);
+size_t svgtiny_mesh_extension_size(unsigned int vertex_count,
+		unsigned int triangle_count);
+void svgtiny_mesh_extension_init(struct svgtiny_mesh_extension *extension,
+		unsigned int vertex_count, unsigned int triangle_count);
+struct svgtiny_mesh_extension *svgtiny_create_mesh_extension(
+		struct svgtiny_arena *arena, unsigned int vertex_count,
+		unsigned int triangle_count);
+
+/* svgtiny_simplify.c */
+unsigned int svgtiny_simplify_path(float *p, unsigned int n,
+		const struct svgtiny_parse_state *state);
+
+/* svgtiny_stroke.c */
+/**
+ * Receives a path a command at a time: point is one point for
+ * svgtiny_PATH_MOVE and svgtiny_PATH_LINE, the two control points and end
+ * for svgtiny_PATH_BEZIER, and unused for svgtiny_PATH_CLOSE. If outside is
+ * not NULL, curves within a box x0, y0, x1, y1 it returns true for may be
+ * passed as a line between their ends instead.
+ */
+struct svgtiny_path_sink {
+	void (*command)(struct svgtiny_path_sink *sink, int command,
+			const float *point);
+	bool (*outside)(struct svgtiny_path_sink *sink, const float *box);
+};
+void svgtiny_stroke_path(const float *p, unsigned int n, const float *m,
+		float half_width, const struct svgtiny_stroke_style *style,
+		float tolerance, struct svgtiny_path_sink *sink);
 
 /* svgtiny_list.c */
-struct svgtiny_list *svgtiny_list_create(size_t item_size);
+struct svgtiny_list *svgtiny_list_create(size_t item_size,
+		const svgtiny_allocator *allocator);
+unsigned int svgtiny_list_capacity(unsigned int new_size);
 unsigned int svgtiny_list_size(struct svgtiny_list *list);
 svgtiny_code svgtiny_list_resize(struct svgtiny_list *list,
 		unsigned int new_size);
@@ -21,22 +21,25 @@ struct svgtiny_list {
 	unsigned int allocated;	/* number of slots allocated (>= size) */
 	size_t item_size;	/* size of each slot / bytes */
 	char *items;		/* array of slots */
+	const svgtiny_allocator *allocator;
 };
 
 
 /**
- * Create an empty svgtiny_list.
+ * Create an empty svgtiny_list, whose memory comes from allocator.
  */
 
-struct svgtiny_list *svgtiny_list_create(size_t item_size)
+struct svgtiny_list *svgtiny_list_create(size_t item_size,
+		const svgtiny_allocator *allocator)
 {
-	struct svgtiny_list *list = malloc(sizeof *list);
+	struct svgtiny_list *list = svgtiny_mem_alloc(allocator, sizeof *list);
 	if (!list)
 		return 0;
 	list->size = 0;
 	list->allocated = 0;
 	list->item_size = item_size;
 	list->items = 0;
+	list->allocator = allocator;
 	return list;
 }
 
@@ -52,11 +55,24 @@ unsigned int svgtiny_list_size(struct svgtiny_list *list)
 
 
 /**
- * Set the number of objects in a list. If the size is increased, the new
- * objects are not initialized in any way.
+ * Return the number of slots to allocate for an array that must hold
+ * new_size objects. Grows geometrically, so appending is amortized O(1).
  *
  * The allocation size formula is taken from Python's list:
  * http://svn.python.org/view/python/trunk/Objects/listobject.c?view=markup
+ */
+
+unsigned int svgtiny_list_capacity(unsigned int new_size)
+{
+	if (new_size == 0)
+		return 0;
+	return (new_size >> 3) + (new_size < 9 ? 3 : 6) + new_size;
+}
+
+
+/**
+ * Set the number of objects in a list. If the size is increased, the new
+ * objects are not initialized in any way.
  *
  * Objects may have moved after this call. Use svgtiny_list_get() to get new
  * pointers.
@@ -73,10 +89,9 @@ svgtiny_code svgtiny_list_resize(struct svgtiny_list *list,
 		return svgtiny_OK;
 	}
 
-	new_allocated = (new_size >> 3) + (new_size < 9 ? 3 : 6) + new_size;
-	if (new_size == 0)
-		new_allocated = 0;
-	new_items = realloc(list->items, new_allocated * list->item_size);
+	new_allocated = svgtiny_list_capacity(new_size);
+	new_items = svgtiny_mem_realloc(list->allocator, list->items,
+			new_allocated * list->item_size);
 	if (!new_items)
 		return svgtiny_OUT_OF_MEMORY;
 
@@ -120,7 +135,7 @@ void *svgtiny_list_push(struct svgtiny_list *list)
 
 void svgtiny_list_free(struct svgtiny_list *list)
 {
-	free(list->items);
-	free(list);
+	svgtiny_mem_free(list->allocator, list->items);
+	svgtiny_mem_free(list->allocator, list);
 }
 
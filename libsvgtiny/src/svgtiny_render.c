@@ -0,0 +1,1230 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * An anti-aliased rasterizer for diagrams, writing RGBA8 pixels.
+ *
+ * Each shape is drawn by signed-area accumulation. Every edge of its
+ * outline adds, to the cells it crosses, the area of the cell to the right
+ * of it that it covers, signed by its direction; a running sum along each
+ * row then gives the winding-weighted coverage of every pixel, which is
+ * clamped to 1 for the non-zero rule. The accumulation buffer only spans
+ * the shape's box, so a shape costs its edges plus its pixels, however big
+ * the image is. Shapes are drawn one SVGTINY_RENDER_TILE square tile at a
+ * time, by svgtiny_render() as by svgtiny_render_parallel(), which bounds
+ * the buffer and gives both the same pixels.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+/* largest distance, in pixels, of a flattened curve from the curve */
+#define SVGTINY_RENDER_TOLERANCE 0.2f
+/* width and height of the tiles the image is drawn in */
+#define SVGTINY_RENDER_TILE 64
+/* floats in the accumulation buffer for one tile */
+#define SVGTINY_RENDER_TILE_COVER \
+		((SVGTINY_RENDER_TILE + 2) * SVGTINY_RENDER_TILE)
+
+/**
+ * State of one thread drawing: the pixels, the clip rectangle (a tile), and
+ * the accumulation buffer with the band of pixels it covers.
+ */
+struct svgtiny_raster {
+	unsigned char *pixels;
+	size_t stride;
+	int clip_x0, clip_y0, clip_x1, clip_y1;
+
+	/* SVGTINY_RENDER_TILE_COVER floats, always left zeroed, used as
+	 * cover_width floats per row */
+	float *cover;
+	size_t cover_width;
+	int band_x0, band_y0, band_width, band_height;
+};
+
+/**
+ * A svgtiny_render_parallel(): the shapes binned into each tile, and the
+ * threads drawing them.
+ */
+struct svgtiny_render_job {
+	const struct svgtiny_diagram *diagram;
+	unsigned char *pixels;
+	size_t stride;
+	unsigned int width, height;
+	unsigned int tiles_x, tiles_y;
+	/* tile t draws the shapes tile_shape[tile_start[t]] up to
+	 * tile_shape[tile_start[t + 1]], in painting order */
+	size_t *tile_start;
+	unsigned int *tile_shape;
+	struct svgtiny_render_worker *worker;
+	unsigned int workers;
+};
+
+struct svgtiny_render_worker {
+	struct svgtiny_render_job *job;
+	unsigned int index;
+	/* tiles left to draw: the first in the low 32 bits, and one past
+	 * the last in the high 32 bits, so both change together */
+	_Atomic uint64_t range;
+	/* accumulation buffer for one tile */
+	float *cover;
+	svgtiny_code code;
+};
+
+/**
+ * Threads kept waiting for the jobs of svgtiny_render_parallel(). The
+ * calling thread is worker 0 of each job, and thread k worker k + 1.
+ */
+struct svgtiny_render_pool {
+	/* held by a svgtiny_render_parallel() for its whole job */
+	pthread_mutex_t call;
+	/* guards the fields below */
+	pthread_mutex_t lock;
+	/* signalled when a job is posted, or the pool is freed */
+	pthread_cond_t post;
+	/* signalled when the last thread is done with a job */
+	pthread_cond_t done;
+	struct svgtiny_render_job *job;
+	unsigned int workers;
+	/* counts the jobs posted, so a thread sees each once */
+	unsigned long generation;
+	/* threads of the current job not yet done with it */
+	unsigned int busy;
+	bool quit;
+	struct svgtiny_render_thread *thread;
+	unsigned int threads;
+};
+
+struct svgtiny_render_thread {
+	struct svgtiny_render_pool *pool;
+	/* the worker it is in each job */
+	unsigned int index;
+	pthread_t thread;
+};
+
+/**
+ * How a shape's coverage is painted: in one colour, or with a linear
+ * gradient, whose offset at pixel (x, y) is r0 + rx x + ry y.
+ */
+struct svgtiny_render_paint {
+	svgtiny_colour colour;
+	const struct svgtiny_linear_gradient *gradient;
+	float r0, rx, ry;
+};
+
+/**
+ * Accumulates an outline passed to it into the current band of r.
+ */
+struct svgtiny_render_pen {
+	struct svgtiny_path_sink sink;
+	struct svgtiny_raster *r;
+	float x, y, start_x, start_y;
+};
+
+static svgtiny_code svgtiny_render_diagram_shape(struct svgtiny_raster *r,
+		const struct svgtiny_diagram *diagram, unsigned int i);
+static bool svgtiny_render_tiles(const struct svgtiny_shape *shape,
+		unsigned int width, unsigned int height, unsigned int *tile);
+static void svgtiny_render_clip(struct svgtiny_raster *r,
+		unsigned int width, unsigned int height,
+		unsigned int tx, unsigned int ty);
+static void svgtiny_render_bin(struct svgtiny_render_job *job, size_t *next,
+		bool place);
+static void *svgtiny_render_pool_main(void *data);
+static void svgtiny_render_worker_main(struct svgtiny_render_worker *worker);
+static bool svgtiny_render_take(struct svgtiny_render_worker *worker,
+		unsigned int *tile);
+static bool svgtiny_render_steal(struct svgtiny_render_worker *worker,
+		unsigned int *tile);
+static svgtiny_code svgtiny_render_shape(struct svgtiny_raster *r,
+		const struct svgtiny_shape *shape, const float *m,
+		svgtiny_colour fill, svgtiny_colour stroke);
+static void svgtiny_render_outline(struct svgtiny_raster *r,
+		const struct svgtiny_shape *shape, const float *m,
+		float half_width);
+static void svgtiny_render_command(struct svgtiny_path_sink *sink,
+		int command, const float *point);
+static bool svgtiny_render_outside(struct svgtiny_path_sink *sink,
+		const float *box);
+static void svgtiny_render_line(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1);
+static void svgtiny_render_clipped_line(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1);
+static void svgtiny_render_accumulate(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1);
+static bool svgtiny_render_fill_paint(const struct svgtiny_shape *shape,
+		const float *m, svgtiny_colour fill,
+		struct svgtiny_render_paint *paint);
+static svgtiny_colour svgtiny_render_gradient_colour(
+		const struct svgtiny_linear_gradient *gradient, float r);
+static void svgtiny_render_composite(struct svgtiny_raster *r,
+		const struct svgtiny_render_paint *paint);
+
+
+/**
+ * Draw a diagram into width by height RGBA8 pixels, with rows stride bytes
+ * apart, one diagram unit to a pixel.
+ *
+ * Each shape is drawn in turn, one tile at a time, clipped to each tile its
+ * box touches; this is the grid svgtiny_render_parallel() draws on, so the
+ * pixels are the same.
+ */
+
+svgtiny_code svgtiny_render(const struct svgtiny_diagram *diagram,
+		unsigned char *pixels, unsigned int width, unsigned int height,
+		size_t stride)
+{
+	const svgtiny_allocator *allocator =
+			svgtiny_arena_allocator(diagram->_internal_arena);
+	struct svgtiny_raster r;
+	svgtiny_code code = svgtiny_OK;
+	unsigned int i, tx, ty, tile[4];
+
+	if (INT_MAX - SVGTINY_RENDER_TILE < width ||
+			INT_MAX - SVGTINY_RENDER_TILE < height)
+		return svgtiny_SVG_ERROR;
+
+	r.pixels = pixels;
+	r.stride = stride;
+	r.cover = svgtiny_mem_alloc(allocator,
+			SVGTINY_RENDER_TILE_COVER * sizeof r.cover[0]);
+	if (!r.cover)
+		return svgtiny_OUT_OF_MEMORY;
+	memset(r.cover, 0, SVGTINY_RENDER_TILE_COVER * sizeof r.cover[0]);
+
+	for (i = 0; i != diagram->shape_count && code == svgtiny_OK; i++) {
+		if (!svgtiny_render_tiles(&diagram->shape[i], width, height,
+				tile))
+			continue;
+		for (ty = tile[1]; ty <= tile[3] && code == svgtiny_OK; ty++) {
+			for (tx = tile[0]; tx <= tile[2] &&
+					code == svgtiny_OK; tx++) {
+				svgtiny_render_clip(&r, width, height, tx, ty);
+				code = svgtiny_render_diagram_shape(&r,
+						diagram, i);
+			}
+		}
+	}
+
+	svgtiny_mem_free(allocator, r.cover);
+	return code;
+}
+
+
+/**
+ * Draw shape i of a diagram, or for an instance, each of its symbol shapes.
+ */
+
+svgtiny_code svgtiny_render_diagram_shape(struct svgtiny_raster *r,
+		const struct svgtiny_diagram *diagram, unsigned int i)
+{
+	const struct svgtiny_shape *shape = &diagram->shape[i];
+	const struct svgtiny_instance *instance = shape->instance;
+	svgtiny_code code = svgtiny_OK;
+	unsigned int k;
+	float m[6];
+
+	if (!instance)
+		return svgtiny_render_shape(r, shape, 0, shape->fill,
+				shape->stroke);
+
+	m[0] = instance->transform.a;
+	m[1] = instance->transform.b;
+	m[2] = instance->transform.c;
+	m[3] = instance->transform.d;
+	m[4] = instance->transform.e;
+	m[5] = instance->transform.f;
+	for (k = instance->first; k != instance->first + instance->count &&
+			code == svgtiny_OK; k++) {
+		const struct svgtiny_shape *s = &diagram->symbol_shape[k];
+		code = svgtiny_render_shape(r, s, m,
+				s->fill ? s->fill : instance->fill,
+				s->stroke ? s->stroke : instance->stroke);
+	}
+	return code;
+}
+
+
+/**
+ * Draw a diagram like svgtiny_render(), but in SVGTINY_RENDER_TILE square
+ * tiles shared among the calling thread and those of a pool.
+ *
+ * Each shape is first binned, in painting order, into the tiles its box
+ * touches. Each thread then starts with an even share of the tiles and
+ * draws them one at a time, each clipped to its tile, so that no two
+ * threads touch the same pixel. A thread that runs out steals half of the
+ * tiles another has left. As a tile's pixels depend only on its own shapes,
+ * the result is the same whatever the number of threads.
+ */
+
+svgtiny_code svgtiny_render_parallel(const struct svgtiny_diagram *diagram,
+		unsigned char *pixels, unsigned int width, unsigned int height,
+		size_t stride, struct svgtiny_render_pool *pool)
+{
+	const svgtiny_allocator *allocator =
+			svgtiny_arena_allocator(diagram->_internal_arena);
+	struct svgtiny_render_job job;
+	unsigned int tiles, threads, i, w;
+	svgtiny_code code = svgtiny_OK;
+	size_t *next = 0;
+
+	if (INT_MAX - SVGTINY_RENDER_TILE < width ||
+			INT_MAX - SVGTINY_RENDER_TILE < height)
+		return svgtiny_SVG_ERROR;
+
+	job.diagram = diagram;
+	job.pixels = pixels;
+	job.stride = stride;
+	job.width = width;
+	job.height = height;
+	job.tiles_x = (width + SVGTINY_RENDER_TILE - 1) / SVGTINY_RENDER_TILE;
+	job.tiles_y = (height + SVGTINY_RENDER_TILE - 1) /
+			SVGTINY_RENDER_TILE;
+	tiles = job.tiles_x * job.tiles_y;
+	if (tiles == 0)
+		return svgtiny_OK;
+	threads = pool ? pool->threads + 1 : 1;
+	if (tiles < threads)
+		threads = tiles;
+
+	job.tile_start = svgtiny_mem_alloc(allocator,
+			((size_t) tiles + 1) * sizeof job.tile_start[0]);
+	next = svgtiny_mem_alloc(allocator,
+			(size_t) tiles * sizeof next[0]);
+	job.tile_shape = 0;
+	job.worker = svgtiny_mem_alloc(allocator,
+			(size_t) threads * sizeof job.worker[0]);
+	job.workers = 0;
+	if (!job.tile_start || !next || !job.worker) {
+		code = svgtiny_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* bin the shapes: count, then place them */
+	for (i = 0; i != tiles; i++)
+		next[i] = 0;
+	svgtiny_render_bin(&job, next, false);
+	job.tile_start[0] = 0;
+	for (i = 0; i != tiles; i++) {
+		job.tile_start[i + 1] = job.tile_start[i] + next[i];
+		next[i] = job.tile_start[i];
+	}
+	if (job.tile_start[tiles] != 0) {
+		job.tile_shape = svgtiny_mem_alloc(allocator,
+				job.tile_start[tiles] *
+				sizeof job.tile_shape[0]);
+		if (!job.tile_shape) {
+			code = svgtiny_OUT_OF_MEMORY;
+			goto out;
+		}
+		svgtiny_render_bin(&job, next, true);
+	}
+
+	/* an even share of the tiles, and a tile's buffer, for each */
+	for (w = 0; w != threads; w++) {
+		struct svgtiny_render_worker *worker = &job.worker[w];
+		uint64_t first = (uint64_t) tiles * w / threads;
+		uint64_t end = (uint64_t) tiles * (w + 1) / threads;
+		worker->job = &job;
+		worker->index = w;
+		worker->code = svgtiny_OK;
+		atomic_init(&worker->range, first | end << 32);
+		worker->cover = svgtiny_mem_alloc(allocator,
+				SVGTINY_RENDER_TILE_COVER *
+				sizeof worker->cover[0]);
+		if (!worker->cover) {
+			code = svgtiny_OUT_OF_MEMORY;
+			goto out;
+		}
+		memset(worker->cover, 0, SVGTINY_RENDER_TILE_COVER *
+				sizeof worker->cover[0]);
+		job.workers++;
+	}
+
+	/* the calling thread is worker 0, and the pool's threads the rest;
+	 * one call at a time has the pool */
+	if (1 < threads) {
+		pthread_mutex_lock(&pool->call);
+		pthread_mutex_lock(&pool->lock);
+		pool->job = &job;
+		pool->workers = threads;
+		pool->generation++;
+		pool->busy = threads - 1;
+		pthread_cond_broadcast(&pool->post);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	svgtiny_render_worker_main(&job.worker[0]);
+	if (1 < threads) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->busy != 0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pool->job = 0;
+		pthread_mutex_unlock(&pool->lock);
+		pthread_mutex_unlock(&pool->call);
+	}
+	for (w = 0; w != threads; w++)
+		if (job.worker[w].code != svgtiny_OK)
+			code = job.worker[w].code;
+
+out:
+	if (job.worker)
+		for (w = 0; w != job.workers; w++)
+			svgtiny_mem_free(allocator, job.worker[w].cover);
+	svgtiny_mem_free(allocator, job.worker);
+	svgtiny_mem_free(allocator, job.tile_shape);
+	svgtiny_mem_free(allocator, next);
+	svgtiny_mem_free(allocator, job.tile_start);
+	return code;
+}
+
+
+/**
+ * Start threads - 1 threads for svgtiny_render_parallel(), or one fewer
+ * than there are processors if threads is 0. A thread that fails to start
+ * leaves the pool smaller.
+ */
+
+struct svgtiny_render_pool *svgtiny_render_pool_create(unsigned int threads)
+{
+	struct svgtiny_render_pool *pool;
+	unsigned int k;
+
+	if (threads == 0) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = 0 < processors ? processors : 1;
+	}
+
+	pool = malloc(sizeof *pool);
+	if (!pool)
+		return 0;
+	pool->thread = malloc(threads * sizeof pool->thread[0]);
+	if (!pool->thread)
+		goto no_thread;
+	if (pthread_mutex_init(&pool->call, NULL) != 0)
+		goto no_call;
+	if (pthread_mutex_init(&pool->lock, NULL) != 0)
+		goto no_lock;
+	if (pthread_cond_init(&pool->post, NULL) != 0)
+		goto no_post;
+	if (pthread_cond_init(&pool->done, NULL) != 0)
+		goto no_done;
+	pool->job = 0;
+	pool->workers = 0;
+	pool->generation = 0;
+	pool->busy = 0;
+	pool->quit = false;
+	pool->threads = 0;
+
+	for (k = 1; k != threads; k++) {
+		struct svgtiny_render_thread *thread =
+				&pool->thread[pool->threads];
+		thread->pool = pool;
+		thread->index = pool->threads + 1;
+		if (pthread_create(&thread->thread, NULL,
+				svgtiny_render_pool_main, thread) != 0)
+			break;
+		pool->threads++;
+	}
+	return pool;
+
+no_done:
+	pthread_cond_destroy(&pool->post);
+no_post:
+	pthread_mutex_destroy(&pool->lock);
+no_lock:
+	pthread_mutex_destroy(&pool->call);
+no_call:
+	free(pool->thread);
+no_thread:
+	free(pool);
+	return 0;
+}
+
+
+/**
+ * Stop and join the threads of a pool, and free it.
+ */
+
+void svgtiny_render_pool_free(struct svgtiny_render_pool *pool)
+{
+	unsigned int k;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->post);
+	pthread_mutex_unlock(&pool->lock);
+	for (k = 0; k != pool->threads; k++)
+		pthread_join(pool->thread[k].thread, NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->post);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->call);
+	free(pool->thread);
+	free(pool);
+}
+
+
+/**
+ * Wait for each job posted to a pool, and be its worker thread->index if
+ * the job has that many, until the pool is freed.
+ */
+
+void *svgtiny_render_pool_main(void *data)
+{
+	struct svgtiny_render_thread *thread = data;
+	struct svgtiny_render_pool *pool = thread->pool;
+	struct svgtiny_render_job *job;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen)
+			pthread_cond_wait(&pool->post, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		/* a job with fewer tiles than threads leaves some idle */
+		if (pool->workers <= thread->index)
+			continue;
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		svgtiny_render_worker_main(&job->worker[thread->index]);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/**
+ * Find the tiles, from (tile[0], tile[1]) to (tile[2], tile[3]) inclusive,
+ * of a width by height image that the box of a shape, grown to allow for
+ * any stroke, touches. Returns false if there are none.
+ */
+
+bool svgtiny_render_tiles(const struct svgtiny_shape *shape,
+		unsigned int width, unsigned int height, unsigned int *tile)
+{
+	float reach = 0, x0, y0, x1, y1;
+
+	if (!shape->path && !shape->instance)
+		return false;
+	if (shape->stroke != svgtiny_TRANSPARENT)
+		reach = shape->stroke_width * SVGTINY_STROKE_REACH;
+	x0 = fmaxf(floorf(shape->bounds.x0 - reach), 0);
+	y0 = fmaxf(floorf(shape->bounds.y0 - reach), 0);
+	x1 = fminf(ceilf(shape->bounds.x1 + reach), width);
+	y1 = fminf(ceilf(shape->bounds.y1 + reach), height);
+	if (!(x0 < x1 && y0 < y1))
+		return false;
+	tile[0] = (unsigned int) x0 / SVGTINY_RENDER_TILE;
+	tile[1] = (unsigned int) y0 / SVGTINY_RENDER_TILE;
+	tile[2] = ((unsigned int) x1 - 1) / SVGTINY_RENDER_TILE;
+	tile[3] = ((unsigned int) y1 - 1) / SVGTINY_RENDER_TILE;
+	return true;
+}
+
+
+/**
+ * Set the clip rectangle to tile (tx, ty) of a width by height image.
+ */
+
+void svgtiny_render_clip(struct svgtiny_raster *r,
+		unsigned int width, unsigned int height,
+		unsigned int tx, unsigned int ty)
+{
+	r->clip_x0 = tx * SVGTINY_RENDER_TILE;
+	r->clip_y0 = ty * SVGTINY_RENDER_TILE;
+	r->clip_x1 = r->clip_x0 + SVGTINY_RENDER_TILE;
+	r->clip_y1 = r->clip_y0 + SVGTINY_RENDER_TILE;
+	if ((int) width < r->clip_x1)
+		r->clip_x1 = width;
+	if ((int) height < r->clip_y1)
+		r->clip_y1 = height;
+}
+
+
+/**
+ * Bin every shape of a diagram into the tiles its box touches: count them
+ * in next[tile], or if place is set, store them at tile_shape[next[tile]++].
+ */
+
+void svgtiny_render_bin(struct svgtiny_render_job *job, size_t *next,
+		bool place)
+{
+	const struct svgtiny_diagram *diagram = job->diagram;
+	unsigned int i, tx, ty, tile[4];
+
+	for (i = 0; i != diagram->shape_count; i++) {
+		if (!svgtiny_render_tiles(&diagram->shape[i], job->width,
+				job->height, tile))
+			continue;
+		for (ty = tile[1]; ty <= tile[3]; ty++) {
+			for (tx = tile[0]; tx <= tile[2]; tx++) {
+				unsigned int t = ty * job->tiles_x + tx;
+				if (place)
+					job->tile_shape[next[t]++] = i;
+				else
+					next[t]++;
+			}
+		}
+	}
+}
+
+
+/**
+ * Draw tiles until there are none left to take or steal.
+ */
+
+void svgtiny_render_worker_main(struct svgtiny_render_worker *worker)
+{
+	struct svgtiny_render_job *job = worker->job;
+	struct svgtiny_raster r;
+	unsigned int tile;
+
+	r.pixels = job->pixels;
+	r.stride = job->stride;
+	r.cover = worker->cover;
+
+	while (svgtiny_render_take(worker, &tile) ||
+			svgtiny_render_steal(worker, &tile)) {
+		unsigned int tx = tile % job->tiles_x, ty = tile / job->tiles_x;
+		size_t k;
+		svgtiny_render_clip(&r, job->width, job->height, tx, ty);
+		for (k = job->tile_start[tile]; k != job->tile_start[tile + 1];
+				k++) {
+			svgtiny_code code = svgtiny_render_diagram_shape(&r,
+					job->diagram, job->tile_shape[k]);
+			if (code != svgtiny_OK)
+				worker->code = code;
+		}
+	}
+}
+
+
+/**
+ * Take the next tile of a worker's own range.
+ */
+
+bool svgtiny_render_take(struct svgtiny_render_worker *worker,
+		unsigned int *tile)
+{
+	uint64_t range = atomic_load(&worker->range);
+	uint32_t first, end;
+
+	do {
+		first = range & 0xffffffff;
+		end = range >> 32;
+		if (first == end)
+			return false;
+	} while (!atomic_compare_exchange_weak(&worker->range, &range,
+			(uint64_t) (first + 1) | (uint64_t) end << 32));
+	*tile = first;
+	return true;
+}
+
+
+/**
+ * Steal the later half of another worker's remaining tiles, keeping the
+ * first of them and making the rest the worker's own range.
+ */
+
+bool svgtiny_render_steal(struct svgtiny_render_worker *worker,
+		unsigned int *tile)
+{
+	struct svgtiny_render_job *job = worker->job;
+	unsigned int k;
+
+	for (k = 1; k != job->workers; k++) {
+		struct svgtiny_render_worker *victim =
+				&job->worker[(worker->index + k) % job->workers];
+		uint64_t range = atomic_load(&victim->range);
+		uint32_t first, end, half;
+
+		do {
+			first = range & 0xffffffff;
+			end = range >> 32;
+			if (first == end)
+				break;
+			half = (end - first + 1) / 2;
+		} while (!atomic_compare_exchange_weak(&victim->range,
+				&range, (uint64_t) first |
+				(uint64_t) (end - half) << 32));
+		if (first == end)
+			continue;
+
+		/* only this worker fills its own range, and it is empty */
+		*tile = end - half;
+		atomic_store(&worker->range, (uint64_t) (end - half + 1) |
+				(uint64_t) end << 32);
+		return true;
+	}
+	return false;
+}
+
+
+/**
+ * Draw one shape, transformed by m (a, b, c, d, e, f) if not NULL, with the
+ * given paint.
+ */
+
+svgtiny_code svgtiny_render_shape(struct svgtiny_raster *r,
+		const struct svgtiny_shape *shape, const float *m,
+		svgtiny_colour fill, svgtiny_colour stroke)
+{
+	struct svgtiny_render_paint fill_paint, stroke_paint;
+	float x0 = shape->bounds.x0, y0 = shape->bounds.y0;
+	float x1 = shape->bounds.x1, y1 = shape->bounds.y1;
+	float half_width = shape->stroke_width / 2, reach = 0;
+	bool filled, stroked;
+	int box_x0, box_y0, box_x1, box_y1;
+
+	if (!shape->path)
+		return svgtiny_OK;
+
+	if (m) {
+		float corner[4][2] = { { x0, y0 }, { x1, y0 },
+				{ x0, y1 }, { x1, y1 } };
+		unsigned int k;
+		x0 = y0 = INFINITY;
+		x1 = y1 = -INFINITY;
+		for (k = 0; k != 4; k++) {
+			float x = m[0] * corner[k][0] + m[2] * corner[k][1] +
+					m[4];
+			float y = m[1] * corner[k][0] + m[3] * corner[k][1] +
+					m[5];
+			x0 = fminf(x0, x);
+			y0 = fminf(y0, y);
+			x1 = fmaxf(x1, x);
+			y1 = fmaxf(y1, y);
+		}
+		half_width *= sqrtf(fabsf(m[0] * m[3] - m[1] * m[2]));
+	}
+
+	filled = svgtiny_render_fill_paint(shape, m, fill, &fill_paint);
+	/* a paint of 0 was never set: the fill defaults to black, and the
+	 * stroke to none */
+	stroked = stroke != svgtiny_TRANSPARENT && stroke != 0 &&
+			0 < half_width;
+	if (!filled && !stroked)
+		return svgtiny_OK;
+	if (stroked) {
+		stroke_paint.colour = stroke;
+		stroke_paint.gradient = 0;
+		reach = 2 * half_width * SVGTINY_STROKE_REACH;
+	}
+
+	/* the pixels the shape may touch, within the clip rectangle */
+	x0 = fmaxf(floorf(x0 - reach), r->clip_x0);
+	y0 = fmaxf(floorf(y0 - reach), r->clip_y0);
+	x1 = fminf(ceilf(x1 + reach), r->clip_x1);
+	y1 = fminf(ceilf(y1 + reach), r->clip_y1);
+	if (!(x0 < x1 && y0 < y1))
+		return svgtiny_OK;
+	box_x0 = x0;
+	box_y0 = y0;
+	box_x1 = x1;
+	box_y1 = y1;
+
+	/* two more columns than pixels take the edges' spill to the right;
+	 * the clip rectangle is a tile, so the box fits the buffer */
+	r->cover_width = (size_t) (box_x1 - box_x0) + 2;
+	assert(r->cover_width * (box_y1 - box_y0) <=
+			SVGTINY_RENDER_TILE_COVER);
+
+	r->band_x0 = box_x0;
+	r->band_y0 = box_y0;
+	r->band_width = box_x1 - box_x0;
+	r->band_height = box_y1 - box_y0;
+	if (filled) {
+		svgtiny_render_outline(r, shape, m, 0);
+		svgtiny_render_composite(r, &fill_paint);
+	}
+	if (stroked) {
+		svgtiny_render_outline(r, shape, m, half_width);
+		svgtiny_render_composite(r, &stroke_paint);
+	}
+
+	return svgtiny_OK;
+}
+
+
+/**
+ * Accumulate the outline of a shape's path, transformed by m if not NULL,
+ * into the current band: the path itself if half_width is 0, or else its
+ * stroke, with mitre joins and butt caps.
+ */
+
+void svgtiny_render_outline(struct svgtiny_raster *r,
+		const struct svgtiny_shape *shape, const float *m,
+		float half_width)
+{
+	const float *p = shape->path;
+	unsigned int n = shape->path_length;
+	struct svgtiny_render_pen pen;
+	unsigned int j, k;
+
+	pen.sink.command = svgtiny_render_command;
+	pen.sink.outside = svgtiny_render_outside;
+	pen.r = r;
+	pen.x = pen.y = pen.start_x = pen.start_y = 0;
+
+	if (half_width != 0) {
+		svgtiny_stroke_path(p, n, m, half_width, 0,
+				SVGTINY_RENDER_TOLERANCE, &pen.sink);
+		return;
+	}
+
+	for (j = 0; j != n; ) {
+		int command = p[j];
+		float point[6];
+		unsigned int size;
+		switch (command) {
+		case svgtiny_PATH_MOVE:
+		case svgtiny_PATH_LINE:
+			size = 2;
+			break;
+		case svgtiny_PATH_BEZIER:
+			size = 6;
+			break;
+		case svgtiny_PATH_CLOSE:
+			size = 0;
+			break;
+		default:
+			assert(0);
+			return;
+		}
+		for (k = 0; k != size; k += 2) {
+			float x = p[j + 1 + k], y = p[j + 2 + k];
+			point[k] = m ? m[0] * x + m[2] * y + m[4] : x;
+			point[k + 1] = m ? m[1] * x + m[3] * y + m[5] : y;
+		}
+		svgtiny_render_command(&pen.sink, command, point);
+		j += 1 + size;
+	}
+	svgtiny_render_command(&pen.sink, svgtiny_PATH_MOVE, &pen.x);
+}
+
+
+/**
+ * Continue an outline with a command, in pixels. A move closes the
+ * subpath before it, as filling does.
+ */
+
+void svgtiny_render_command(struct svgtiny_path_sink *sink,
+		int command, const float *point)
+{
+	struct svgtiny_render_pen *pen = (struct svgtiny_render_pen *) sink;
+	struct svgtiny_raster *r = pen->r;
+	float line[3 * SVGTINY_FLATTEN_MAX_LINES];
+	float x = pen->x, y = pen->y;
+	unsigned int k, lines;
+
+	switch (command) {
+	case svgtiny_PATH_MOVE:
+		svgtiny_render_line(r, x, y, pen->start_x, pen->start_y);
+		/* point may be &pen->x */
+		x = point[0];
+		y = point[1];
+		pen->start_x = x;
+		pen->start_y = y;
+		break;
+	case svgtiny_PATH_CLOSE:
+		svgtiny_render_line(r, x, y, pen->start_x, pen->start_y);
+		x = pen->start_x;
+		y = pen->start_y;
+		break;
+	case svgtiny_PATH_LINE:
+		svgtiny_render_line(r, x, y, point[0], point[1]);
+		x = point[0];
+		y = point[1];
+		break;
+	case svgtiny_PATH_BEZIER: {
+		float box[4] = {
+			fminf(fminf(x, point[0]), fminf(point[2], point[4])),
+			fminf(fminf(y, point[1]), fminf(point[3], point[5])),
+			fmaxf(fmaxf(x, point[0]), fmaxf(point[2], point[4])),
+			fmaxf(fmaxf(y, point[1]), fmaxf(point[3], point[5])) };
+		if (svgtiny_render_outside(sink, box)) {
+			/* a line adds the same to the band */
+			svgtiny_render_line(r, x, y, point[4], point[5]);
+		} else {
+			lines = svgtiny_flatten_bezier_lines(x, y, point,
+					SVGTINY_RENDER_TOLERANCE);
+			assert(3 * lines <= sizeof line / sizeof line[0]);
+			svgtiny_flatten_bezier(x, y, point, lines, line);
+			for (k = 0; k != lines; k++) {
+				svgtiny_render_line(r, x, y, line[3 * k + 1],
+						line[3 * k + 2]);
+				x = line[3 * k + 1];
+				y = line[3 * k + 2];
+			}
+		}
+		x = point[4];
+		y = point[5];
+		break;
+	}
+	default:
+		assert(0);
+		return;
+	}
+	pen->x = x;
+	pen->y = y;
+}
+
+
+/**
+ * Check whether the box x0, y0, x1, y1 is wholly above, below, left or
+ * right of the band. A curve within it adds to the band only what the line
+ * between its ends does, so need not be flattened.
+ */
+
+bool svgtiny_render_outside(struct svgtiny_path_sink *sink, const float *box)
+{
+	const struct svgtiny_raster *r =
+			((struct svgtiny_render_pen *) sink)->r;
+
+	return box[3] <= r->band_y0 || r->band_y0 + r->band_height <= box[1] ||
+			box[2] <= r->band_x0 ||
+			r->band_x0 + r->band_width <= box[0];
+}
+
+
+/**
+ * Accumulate an edge from (x0, y0) to (x1, y1) in pixels into the band.
+ */
+
+void svgtiny_render_line(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1)
+{
+	x0 -= r->band_x0;
+	x1 -= r->band_x0;
+	y0 -= r->band_y0;
+	y1 -= r->band_y0;
+	if (!(isfinite(x0) && isfinite(y0) && isfinite(x1) && isfinite(y1)))
+		return;
+	if ((y0 <= 0 && y1 <= 0) ||
+			(r->band_height <= y0 && r->band_height <= y1))
+		return;
+	svgtiny_render_clipped_line(r, x0, y0, x1, y1);
+}
+
+
+/**
+ * Accumulate an edge in band coordinates, clipped to the band's columns.
+ * Parts to the left of the band still cover every pixel of their rows, so
+ * they are moved onto its left side; parts to its right cover none.
+ */
+
+void svgtiny_render_clipped_line(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1)
+{
+	float width = r->band_width, y;
+
+	if ((x0 < 0 && 0 < x1) || (x1 < 0 && 0 < x0)) {
+		y = y0 + (0 - x0) * (y1 - y0) / (x1 - x0);
+		svgtiny_render_clipped_line(r, x0, y0, 0, y);
+		svgtiny_render_clipped_line(r, 0, y, x1, y1);
+		return;
+	}
+	if ((x0 < width && width < x1) || (x1 < width && width < x0)) {
+		y = y0 + (width - x0) * (y1 - y0) / (x1 - x0);
+		svgtiny_render_clipped_line(r, x0, y0, width, y);
+		svgtiny_render_clipped_line(r, width, y, x1, y1);
+		return;
+	}
+	if (width <= x0 && width <= x1)
+		return;
+	if (x0 <= 0 && x1 <= 0)
+		x0 = x1 = 0;
+	svgtiny_render_accumulate(r, x0, y0, x1, y1);
+}
+
+
+/**
+ * Add the signed area an edge within the band's columns covers to the
+ * cells it crosses.
+ */
+
+void svgtiny_render_accumulate(struct svgtiny_raster *r,
+		float x0, float y0, float x1, float y1)
+{
+	float width = r->band_width;
+	float dir = 1, dxdy, x;
+	int y, y_end;
+
+	if (y0 == y1)
+		return;
+	if (y1 < y0) {
+		float t = x0;
+		x0 = x1;
+		x1 = t;
+		t = y0;
+		y0 = y1;
+		y1 = t;
+		dir = -1;
+	}
+	dxdy = (x1 - x0) / (y1 - y0);
+	x = x0;
+	y = 0;
+	if (y0 < 0)
+		x -= y0 * dxdy;
+	else
+		y = y0;
+	y_end = r->band_height < y1 ? r->band_height : (int) ceilf(y1);
+
+	for (; y < y_end; y++) {
+		float *cover = r->cover + (size_t) y * r->cover_width;
+		float dy = fminf(y + 1, y1) - fmaxf(y, y0);
+		float x_next = x + dxdy * dy;
+		float d = dy * dir;
+		float xa = fminf(x, x_next), xb = fmaxf(x, x_next);
+		float xa_floor, xb_ceil;
+		int xai, xbi;
+
+		/* keep rounding from stepping outside the band */
+		xa = fminf(fmaxf(xa, 0), width);
+		xb = fminf(fmaxf(xb, 0), width);
+		xa_floor = floorf(xa);
+		xb_ceil = ceilf(xb);
+		xai = xa_floor;
+		xbi = xb_ceil;
+		if (xbi <= xai + 1) {
+			/* within one cell: split by the mean x */
+			float xmf = 0.5f * (xa + xb) - xa_floor;
+			cover[xai] += d - d * xmf;
+			cover[xai + 1] += d * xmf;
+		} else {
+			/* across several cells: a triangle in the first,
+			 * a trapezium in each between, and a triangle in
+			 * the last */
+			float s = 1 / (xb - xa);
+			float xa_fraction = xa - xa_floor;
+			float a0 = 0.5f * s * (1 - xa_fraction) *
+					(1 - xa_fraction);
+			float xb_fraction = xb - xb_ceil + 1;
+			float am = 0.5f * s * xb_fraction * xb_fraction;
+			int xi;
+			cover[xai] += d * a0;
+			if (xbi == xai + 2) {
+				cover[xai + 1] += d * (1 - a0 - am);
+			} else {
+				float a1 = s * (1.5f - xa_fraction);
+				float a2;
+				cover[xai + 1] += d * (a1 - a0);
+				for (xi = xai + 2; xi < xbi - 1; xi++)
+					cover[xi] += d * s;
+				a2 = a1 + (xbi - xai - 3) * s;
+				cover[xbi - 1] += d * (1 - a2 - am);
+			}
+			cover[xbi] += d * am;
+		}
+		x = x_next;
+	}
+}
+
+
+/**
+ * Find how to paint the fill of a shape, if it has one.
+ *
+ * A gradient kept by svgtiny_KEEP_GRADIENTS is followed per pixel. A
+ * gradient tessellated by svgtiny_GRADIENT_MESH is filled flat with the
+ * mean of its vertex colours.
+ */
+
+bool svgtiny_render_fill_paint(const struct svgtiny_shape *shape,
+		const float *m, svgtiny_colour fill,
+		struct svgtiny_render_paint *paint)
+{
+	const struct svgtiny_linear_gradient *gradient;
+	const struct svgtiny_mesh *mesh;
+
+	paint->colour = fill;
+	paint->gradient = 0;
+	if (fill == svgtiny_TRANSPARENT)
+		return false;
+	if (fill != svgtiny_LINEAR_GRADIENT)
+		return true;
+
+	gradient = svgtiny_shape_linear_gradient(shape);
+	if (gradient && gradient->stop_count != 0) {
+		/* pixels to gradient space: the inverse of m * transform */
+		float t[6] = { gradient->transform.a, gradient->transform.b,
+				gradient->transform.c, gradient->transform.d,
+				gradient->transform.e, gradient->transform.f };
+		float vx = gradient->x2 - gradient->x1;
+		float vy = gradient->y2 - gradient->y1;
+		float norm = vx * vx + vy * vy;
+		float det, ia, ib, ic, id, ie, iff;
+		if (m) {
+			float u[6] = {
+				m[0] * t[0] + m[2] * t[1],
+				m[1] * t[0] + m[3] * t[1],
+				m[0] * t[2] + m[2] * t[3],
+				m[1] * t[2] + m[3] * t[3],
+				m[0] * t[4] + m[2] * t[5] + m[4],
+				m[1] * t[4] + m[3] * t[5] + m[5] };
+			memcpy(t, u, sizeof t);
+		}
+		det = t[0] * t[3] - t[1] * t[2];
+		paint->gradient = gradient;
+		if (det == 0 || norm == 0) {
+			/* degenerate: the colour of the first stop */
+			paint->r0 = 0;
+			paint->rx = paint->ry = 0;
+			return true;
+		}
+		ia = t[3] / det;
+		ib = -t[1] / det;
+		ic = -t[2] / det;
+		id = t[0] / det;
+		ie = -(ia * t[4] + ic * t[5]);
+		iff = -(ib * t[4] + id * t[5]);
+		/* r = ((gx - x1) vx + (gy - y1) vy) / norm, with
+		 * gx = ia x + ic y + ie and gy = ib x + id y + iff */
+		paint->rx = (ia * vx + ib * vy) / norm;
+		paint->ry = (ic * vx + id * vy) / norm;
+		paint->r0 = ((ie - gradient->x1) * vx +
+				(iff - gradient->y1) * vy) / norm;
+		return true;
+	}
+
+	mesh = svgtiny_shape_mesh(shape);
+	if (mesh && mesh->vertex_count != 0) {
+		unsigned long red = 0, green = 0, blue = 0;
+		unsigned int i;
+		for (i = 0; i != mesh->vertex_count; i++) {
+			red += svgtiny_RED(mesh->colour[i]);
+			green += svgtiny_GREEN(mesh->colour[i]);
+			blue += svgtiny_BLUE(mesh->colour[i]);
+		}
+		paint->colour = svgtiny_RGB(
+				(unsigned int) (red / mesh->vertex_count),
+				(unsigned int) (green / mesh->vertex_count),
+				(unsigned int) (blue / mesh->vertex_count));
+		return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Colour of a gradient at offset r, interpolated between its stops and
+ * padded at both ends. Gradients are drawn opaque, as when tessellated.
+ */
+
+svgtiny_colour svgtiny_render_gradient_colour(
+		const struct svgtiny_linear_gradient *gradient, float r)
+{
+	const struct svgtiny_gradient_stop *stop = gradient->stop;
+	unsigned int i;
+	float f;
+
+	if (!(stop[0].offset < r))
+		return svgtiny_RGB(svgtiny_RED(stop[0].color),
+				svgtiny_GREEN(stop[0].color),
+				svgtiny_BLUE(stop[0].color));
+	for (i = 1; i != gradient->stop_count && stop[i].offset < r; i++)
+		continue;
+	if (i == gradient->stop_count)
+		return svgtiny_RGB(svgtiny_RED(stop[i - 1].color),
+				svgtiny_GREEN(stop[i - 1].color),
+				svgtiny_BLUE(stop[i - 1].color));
+	f = (r - stop[i - 1].offset) / (stop[i].offset - stop[i - 1].offset);
+	return svgtiny_RGB(
+		(unsigned int) ((1 - f) * svgtiny_RED(stop[i - 1].color) +
+				f * svgtiny_RED(stop[i].color)),
+		(unsigned int) ((1 - f) * svgtiny_GREEN(stop[i - 1].color) +
+				f * svgtiny_GREEN(stop[i].color)),
+		(unsigned int) ((1 - f) * svgtiny_BLUE(stop[i - 1].color) +
+				f * svgtiny_BLUE(stop[i].color)));
+}
+
+
+/**
+ * Sum the accumulated coverage along each row of the band, composite the
+ * paint source-over onto the pixels it covers, and zero the buffer again.
+ */
+
+void svgtiny_render_composite(struct svgtiny_raster *r,
+		const struct svgtiny_render_paint *paint)
+{
+	svgtiny_colour colour = paint->colour;
+	float alpha = svgtiny_ALPHA(colour) / 255.0f;
+	int x, y;
+
+	/* an unset fill is opaque black */
+	if (paint->gradient || colour == 0)
+		alpha = 1;
+
+	for (y = 0; y != r->band_height; y++) {
+		float *cover = r->cover + (size_t) y * r->cover_width;
+		unsigned char *pixel = r->pixels +
+				(size_t) (r->band_y0 + y) * r->stride +
+				(size_t) r->band_x0 * 4;
+		float sum = 0;
+
+		for (x = 0; x != r->band_width; x++, pixel += 4) {
+			float a, da, oa;
+			sum += cover[x];
+			cover[x] = 0;
+			a = fabsf(sum);
+			if (1 < a)
+				a = 1;
+			a *= alpha;
+			if (a < 0.5f / 255)
+				continue;
+
+			if (paint->gradient)
+				colour = svgtiny_render_gradient_colour(
+						paint->gradient, paint->r0 +
+						paint->rx * (r->band_x0 + x +
+						0.5f) + paint->ry *
+						(r->band_y0 + y + 0.5f));
+
+			/* non-premultiplied source-over */
+			if (pixel[3] == 255) {
+				pixel[0] += ((int) svgtiny_RED(colour) -
+						pixel[0]) * a + 0.5f;
+				pixel[1] += ((int) svgtiny_GREEN(colour) -
+						pixel[1]) * a + 0.5f;
+				pixel[2] += ((int) svgtiny_BLUE(colour) -
+						pixel[2]) * a + 0.5f;
+				continue;
+			}
+			da = pixel[3] / 255.0f * (1 - a);
+			oa = a + da;
+			pixel[0] = (svgtiny_RED(colour) * a + pixel[0] * da) /
+					oa + 0.5f;
+			pixel[1] = (svgtiny_GREEN(colour) * a +
+					pixel[1] * da) / oa + 0.5f;
+			pixel[2] = (svgtiny_BLUE(colour) * a + pixel[2] * da) /
+					oa + 0.5f;
+			pixel[3] = oa * 255 + 0.5f;
+		}
+		/* the spill columns */
+		cover[x] = 0;
+		cover[x + 1] = 0;
+	}
+}
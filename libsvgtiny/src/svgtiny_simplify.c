@@ -0,0 +1,299 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Simplification of paths within a tolerance, for svgtiny_diagram.
+ * simplify_tolerance.
+ *
+ * A path is simplified in place, in two passes. The first drops segments
+ * that end within tolerance of where they start, consecutive moves, and
+ * closing lines that only return to the start, and turns each Bézier whose
+ * control points are within tolerance of its chord into a line. The second
+ * runs Ramer–Douglas–Peucker over each run of lines, which also merges
+ * collinear ones. Each pass may move the outline by half the tolerance, so
+ * no point of the result is further than tolerance from the original. The
+ * path never grows, so no memory is needed.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+/* marks a line dropped by svgtiny_simplify_lines() until the path is
+ * compacted */
+#define SVGTINY_SIMPLIFY_DROPPED -1
+
+static unsigned int svgtiny_simplify(float *p, unsigned int n,
+		float tolerance);
+static float svgtiny_simplify_distance_squared(float x, float y,
+		float x0, float y0, float x1, float y1);
+static void svgtiny_simplify_lines(float x0, float y0, float *p,
+		unsigned int lines, float tolerance_squared);
+
+
+/**
+ * Simplify a path of n floats in user space in place, if the diagram has a
+ * simplify_tolerance. Returns its new length.
+ *
+ * The tolerance is taken into user space by the largest scale of the
+ * current transformation, so it holds in every direction in the diagram.
+ */
+
+unsigned int svgtiny_simplify_path(float *p, unsigned int n,
+		const struct svgtiny_parse_state *state)
+{
+	float tolerance = state->ctx->diagram->simplify_tolerance;
+	float a = state->ctm.a, b = state->ctm.b;
+	float c = state->ctm.c, d = state->ctm.d;
+	float e = a * a + b * b + c * c + d * d;
+	float det = a * d - b * c;
+	float root = e * e - 4 * det * det;
+	float scale;
+
+	if (!(0 < tolerance))
+		return n;
+	scale = sqrtf((e + sqrtf(0 < root ? root : 0)) / 2);
+	if (!(0 < scale))
+		return n;
+	return svgtiny_simplify(p, n, tolerance / scale);
+}
+
+
+/**
+ * Simplify a path of n floats in place, so that it is nowhere further than
+ * tolerance from the original. Returns its new length.
+ */
+
+unsigned int svgtiny_simplify(float *p, unsigned int n, float tolerance)
+{
+	/* half of the tolerance for each pass, as their errors add up */
+	float tolerance_squared = tolerance * tolerance / 4;
+	float x = 0, y = 0, start_x = 0, start_y = 0;
+	float run_x = 0, run_y = 0;
+	unsigned int i, j, last = 0, run = 0, run_lines = 0;
+	bool have_last = false;
+
+	if (!(0 < tolerance))
+		return n;
+
+	/* first pass: degenerate segments and flat curves */
+	for (i = 0, j = 0; i != n; ) {
+		switch ((int) p[i]) {
+		case svgtiny_PATH_MOVE:
+			if (have_last && (int) p[last] == svgtiny_PATH_MOVE)
+				j = last;
+			last = j;
+			have_last = true;
+			x = start_x = p[j + 1] = p[i + 1];
+			y = start_y = p[j + 2] = p[i + 2];
+			p[j] = svgtiny_PATH_MOVE;
+			i += 3;
+			j += 3;
+			break;
+		case svgtiny_PATH_CLOSE:
+			/* a line back to the start is drawn by the close */
+			if (have_last && (int) p[last] == svgtiny_PATH_LINE &&
+					svgtiny_simplify_distance_squared(
+					start_x, start_y, x, y, x, y) <=
+					tolerance_squared)
+				j = last;
+			last = j;
+			have_last = true;
+			p[j++] = svgtiny_PATH_CLOSE;
+			x = start_x;
+			y = start_y;
+			i++;
+			break;
+		case svgtiny_PATH_BEZIER:
+			if (tolerance_squared <
+					svgtiny_simplify_distance_squared(
+					p[i + 1], p[i + 2],
+					x, y, p[i + 5], p[i + 6]) ||
+					tolerance_squared <
+					svgtiny_simplify_distance_squared(
+					p[i + 3], p[i + 4],
+					x, y, p[i + 5], p[i + 6])) {
+				if (j != i)
+					memmove(p + j, p + i, 7 * sizeof p[0]);
+				x = p[j + 5];
+				y = p[j + 6];
+				last = j;
+				have_last = true;
+				i += 7;
+				j += 7;
+				break;
+			}
+			/* the curve is within its control points' hull, so
+			 * within tolerance of the chord: a line will do */
+			i += 4;
+			p[i] = svgtiny_PATH_LINE;
+			/* fall through */
+		case svgtiny_PATH_LINE:
+			if (svgtiny_simplify_distance_squared(p[i + 1],
+					p[i + 2], x, y, x, y) <=
+					tolerance_squared) {
+				i += 3;
+				break;
+			}
+			x = p[j + 1] = p[i + 1];
+			y = p[j + 2] = p[i + 2];
+			p[j] = svgtiny_PATH_LINE;
+			last = j;
+			have_last = true;
+			i += 3;
+			j += 3;
+			break;
+		default:
+			assert(0);
+			return n;
+		}
+	}
+	n = j;
+
+	/* second pass: runs of lines */
+	x = y = start_x = start_y = 0;
+	for (i = 0; i <= n; ) {
+		if (i != n && (int) p[i] == svgtiny_PATH_LINE) {
+			if (run_lines++ == 0) {
+				run = i;
+				run_x = x;
+				run_y = y;
+			}
+			x = p[i + 1];
+			y = p[i + 2];
+			i += 3;
+			continue;
+		}
+		if (2 <= run_lines)
+			svgtiny_simplify_lines(run_x, run_y, p + run, run_lines,
+					tolerance_squared);
+		run_lines = 0;
+		if (i == n)
+			break;
+		switch ((int) p[i]) {
+		case svgtiny_PATH_MOVE:
+			x = start_x = p[i + 1];
+			y = start_y = p[i + 2];
+			i += 3;
+			break;
+		case svgtiny_PATH_CLOSE:
+			x = start_x;
+			y = start_y;
+			i++;
+			break;
+		case svgtiny_PATH_BEZIER:
+			x = p[i + 5];
+			y = p[i + 6];
+			i += 7;
+			break;
+		}
+	}
+
+	/* drop the lines marked by svgtiny_simplify_lines() */
+	for (i = 0, j = 0; i != n; ) {
+		unsigned int size;
+		switch ((int) p[i]) {
+		case SVGTINY_SIMPLIFY_DROPPED:
+			i += 3;
+			continue;
+		case svgtiny_PATH_CLOSE:
+			size = 1;
+			break;
+		case svgtiny_PATH_BEZIER:
+			size = 7;
+			break;
+		default:
+			size = 3;
+		}
+		if (j != i)
+			memmove(p + j, p + i, size * sizeof p[0]);
+		i += size;
+		j += size;
+	}
+
+	return j;
+}
+
+
+/**
+ * Squared distance from (x, y) to the segment from (x0, y0) to (x1, y1).
+ */
+
+float svgtiny_simplify_distance_squared(float x, float y,
+		float x0, float y0, float x1, float y1)
+{
+	float dx = x1 - x0, dy = y1 - y0;
+	float length_squared = dx * dx + dy * dy;
+	float t = 0;
+
+	if (0 < length_squared) {
+		t = ((x - x0) * dx + (y - y0) * dy) / length_squared;
+		if (t < 0)
+			t = 0;
+		else if (1 < t)
+			t = 1;
+	}
+	dx = x0 + t * dx - x;
+	dy = y0 + t * dy - y;
+	return dx * dx + dy * dy;
+}
+
+
+/**
+ * Ramer–Douglas–Peucker over a run of lines svgtiny_PATH_LINE commands at p,
+ * starting from (x0, y0). Lines that are not needed to keep the run within
+ * tolerance are marked SVGTINY_SIMPLIFY_DROPPED; the last is always kept.
+ *
+ * Instead of a stack of ranges, the lines kept so far delimit them: the
+ * range from a kept point runs to the next kept point, and is split at its
+ * farthest point until every point in it is within tolerance of its chord.
+ */
+
+void svgtiny_simplify_lines(float x0, float y0, float *p,
+		unsigned int lines, float tolerance_squared)
+{
+	unsigned int first, last, i, farthest;
+	float fx = x0, fy = y0;
+
+	for (i = 0; i + 1 != lines; i++)
+		p[3 * i] = SVGTINY_SIMPLIFY_DROPPED;
+
+	/* first is the line ending at the start of the range, or lines for
+	 * (x0, y0) */
+	first = lines;
+	while (first == lines || first + 1 != lines) {
+		float worst = tolerance_squared;
+		float lx, ly;
+
+		for (last = first == lines ? 0 : first + 1;
+				(int) p[3 * last] == SVGTINY_SIMPLIFY_DROPPED;
+				last++)
+			;
+		lx = p[3 * last + 1];
+		ly = p[3 * last + 2];
+
+		farthest = last;
+		for (i = first == lines ? 0 : first + 1; i != last; i++) {
+			float d = svgtiny_simplify_distance_squared(
+					p[3 * i + 1], p[3 * i + 2],
+					fx, fy, lx, ly);
+			if (worst < d) {
+				worst = d;
+				farthest = i;
+			}
+		}
+
+		if (farthest != last) {
+			p[3 * farthest] = svgtiny_PATH_LINE;
+			continue;
+		}
+		first = last;
+		fx = lx;
+		fy = ly;
+	}
+}
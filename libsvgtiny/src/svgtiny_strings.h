@@ -38,6 +38,8 @@ SVGTINY_STRING_ACTION(polyline)
 SVGTINY_STRING_ACTION(polygon)
 SVGTINY_STRING_ACTION(text)
 SVGTINY_STRING_ACTION(tspan)
+SVGTINY_STRING_ACTION(use)
+SVGTINY_STRING_ACTION(symbol)
 SVGTINY_STRING_ACTION(fill)
 SVGTINY_STRING_ACTION2(fill_opacity,fill-opacity)
 SVGTINY_STRING_ACTION(stroke)
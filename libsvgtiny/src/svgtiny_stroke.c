@@ -0,0 +1,801 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Expansion of strokes into outlines to be filled by the non-zero rule.
+ *
+ * A subpath's outline runs forward along the left side of the path, around
+ * the end cap, back along the right side and around the start cap; a closed
+ * subpath has one loop for each side instead. Joins on the outside of a
+ * turn are mitred, rounded or bevelled, and on the inside pass through the
+ * vertex, so that the overlaps they make add up rather than cancel. Every
+ * outline winds the same way, so overlapping subpaths add up too.
+ *
+ * A cubic Bézier's offset is itself approximated by cubics, each found by
+ * offsetting the legs of the control polygon and intersecting them
+ * (Tiller and Hanson), and split in half until it is within tolerance of
+ * the true offset at a few points. Round joins and caps are circular arcs
+ * of at most a quarter turn, each one cubic.
+ *
+ * The segments of a subpath are read SVGTINY_STROKE_CHUNK at a time, so
+ * that no memory is needed: a longer subpath is outlined in pieces, which
+ * meet with a separate join.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+
+/* segments outlined as one piece */
+#define SVGTINY_STROKE_CHUNK 128
+/* most times the offset of a curve is split in half */
+#define SVGTINY_STROKE_MAX_DEPTH 8
+
+/**
+ * A segment of a subpath, from (x0, y0) through (c[0], c[1]) and
+ * (c[2], c[3]) to (c[4], c[5]) if a curve, or straight to (c[4], c[5]), with
+ * its unit directions at each end.
+ */
+struct svgtiny_stroke_segment {
+	bool bezier;
+	float x0, y0;
+	float c[6];
+	float dx0, dy0, dx1, dy1;
+};
+
+struct svgtiny_stroker {
+	struct svgtiny_path_sink *sink;
+	float half_width;
+	int join, cap;
+	float miter_limit;
+	float tolerance;
+
+	/* segments read but not yet outlined */
+	struct svgtiny_stroke_segment segment[SVGTINY_STROKE_CHUNK];
+	unsigned int count;
+	/* whether some of the subpath was outlined already, and the
+	 * directions at its start and at the end of the last piece */
+	bool continued;
+	float first_dx, first_dy, last_dx, last_dy;
+	/* whether the subpath has any segment, even of length 0 */
+	bool drawn;
+};
+
+/**
+ * Floats written by svgtiny_stroke_to_path(), or counted if out is NULL.
+ */
+struct svgtiny_stroke_buffer {
+	struct svgtiny_path_sink sink;
+	float *out;
+	size_t length;
+};
+
+static void svgtiny_stroke_add(struct svgtiny_stroker *s,
+		const struct svgtiny_stroke_segment *segment);
+static void svgtiny_stroke_finish(struct svgtiny_stroker *s, bool closed,
+		float x, float y);
+static void svgtiny_stroke_piece(struct svgtiny_stroker *s,
+		bool start_cap, bool end_cap);
+static void svgtiny_stroke_loops(struct svgtiny_stroker *s);
+static void svgtiny_stroke_forward(struct svgtiny_stroker *s);
+static void svgtiny_stroke_backward(struct svgtiny_stroker *s);
+static void svgtiny_stroke_offset(struct svgtiny_stroker *s,
+		const float *q, unsigned int depth);
+static bool svgtiny_stroke_direction(const float *q, bool end,
+		float *dx, float *dy);
+static void svgtiny_stroke_join(struct svgtiny_stroker *s, int join,
+		float x, float y, float ax, float ay, float bx, float by);
+static void svgtiny_stroke_outer_join(struct svgtiny_stroker *s, int join,
+		float x, float y, float ax, float ay, float bx, float by);
+static void svgtiny_stroke_wedge(struct svgtiny_stroker *s,
+		float x, float y, float ax, float ay, float bx, float by);
+static void svgtiny_stroke_cap(struct svgtiny_stroker *s,
+		float x, float y, float dx, float dy);
+static void svgtiny_stroke_arc(struct svgtiny_stroker *s,
+		float x, float y, float ux, float uy, float sweep);
+static void svgtiny_stroke_point(struct svgtiny_stroker *s, int command,
+		float x, float y);
+static void svgtiny_stroke_buffer_command(struct svgtiny_path_sink *sink,
+		int command, const float *point);
+
+
+/**
+ * Pass the outline of the stroke of the path of n floats at p, transformed
+ * by m if not NULL, to sink. half_width is in the units after transforming,
+ * and style may be NULL for a mitre limit of 4 and butt caps, the defaults
+ * of SVG.
+ *
+ * The outline is a path of svgtiny_PATH_MOVE, svgtiny_PATH_LINE,
+ * svgtiny_PATH_BEZIER and svgtiny_PATH_CLOSE commands in which every subpath
+ * is closed.
+ */
+
+void svgtiny_stroke_path(const float *p, unsigned int n, const float *m,
+		float half_width, const struct svgtiny_stroke_style *style,
+		float tolerance, struct svgtiny_path_sink *sink)
+{
+	static const float identity[6] = { 1, 0, 0, 1, 0, 0 };
+	struct svgtiny_stroker s;
+	struct svgtiny_stroke_segment segment;
+	float x = 0, y = 0, start_x = 0, start_y = 0;
+	unsigned int j, k;
+
+	if (!(0 < half_width))
+		return;
+	if (!m)
+		m = identity;
+	s.sink = sink;
+	s.half_width = half_width;
+	s.join = style ? style->join : svgtiny_JOIN_MITER;
+	s.cap = style ? style->cap : svgtiny_CAP_BUTT;
+	s.miter_limit = style ? style->miter_limit : 4;
+	s.tolerance = tolerance;
+	s.count = 0;
+	s.continued = false;
+	s.drawn = false;
+
+	for (j = 0; j != n; ) {
+		segment.x0 = x;
+		segment.y0 = y;
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			svgtiny_stroke_finish(&s, false, start_x, start_y);
+			x = start_x = m[0] * p[j + 1] + m[2] * p[j + 2] + m[4];
+			y = start_y = m[1] * p[j + 1] + m[3] * p[j + 2] + m[5];
+			j += 3;
+			continue;
+		case svgtiny_PATH_CLOSE:
+			segment.bezier = false;
+			segment.c[4] = start_x;
+			segment.c[5] = start_y;
+			svgtiny_stroke_add(&s, &segment);
+			svgtiny_stroke_finish(&s, true, start_x, start_y);
+			x = start_x;
+			y = start_y;
+			j++;
+			continue;
+		case svgtiny_PATH_LINE:
+			segment.bezier = false;
+			segment.c[4] = m[0] * p[j + 1] + m[2] * p[j + 2] + m[4];
+			segment.c[5] = m[1] * p[j + 1] + m[3] * p[j + 2] + m[5];
+			j += 3;
+			break;
+		case svgtiny_PATH_BEZIER:
+			segment.bezier = true;
+			for (k = 0; k != 6; k += 2) {
+				segment.c[k] = m[0] * p[j + 1 + k] +
+						m[2] * p[j + 2 + k] + m[4];
+				segment.c[k + 1] = m[1] * p[j + 1 + k] +
+						m[3] * p[j + 2 + k] + m[5];
+			}
+			j += 7;
+			break;
+		default:
+			assert(0);
+			return;
+		}
+		svgtiny_stroke_add(&s, &segment);
+		x = segment.c[4];
+		y = segment.c[5];
+	}
+	svgtiny_stroke_finish(&s, false, start_x, start_y);
+}
+
+
+/**
+ * Add a segment to the current subpath, unless it has no length, outlining
+ * the segments so far first if there is no room for it.
+ */
+
+void svgtiny_stroke_add(struct svgtiny_stroker *s,
+		const struct svgtiny_stroke_segment *segment)
+{
+	struct svgtiny_stroke_segment *added;
+	float q[8] = { segment->x0, segment->y0, segment->c[0],
+			segment->c[1], segment->c[2], segment->c[3],
+			segment->c[4], segment->c[5] };
+
+	s->drawn = true;
+	if (!segment->bezier) {
+		q[2] = q[4] = q[6];
+		q[3] = q[5] = q[7];
+	}
+	if (s->count == SVGTINY_STROKE_CHUNK) {
+		svgtiny_stroke_piece(s, false, false);
+		s->last_dx = s->segment[s->count - 1].dx1;
+		s->last_dy = s->segment[s->count - 1].dy1;
+		s->count = 0;
+		s->continued = true;
+	}
+
+	added = &s->segment[s->count];
+	*added = *segment;
+	if (!svgtiny_stroke_direction(q, false, &added->dx0, &added->dy0))
+		return;
+	svgtiny_stroke_direction(q, true, &added->dx1, &added->dy1);
+	if (s->count == 0 && !s->continued) {
+		s->first_dx = added->dx0;
+		s->first_dy = added->dy0;
+	}
+	if (s->count == 0 && s->continued)
+		svgtiny_stroke_wedge(s, added->x0, added->y0,
+				s->last_dx, s->last_dy,
+				added->dx0, added->dy0);
+	s->count++;
+}
+
+
+/**
+ * Outline what remains of the current subpath, which starts at (x, y), and
+ * start a new one.
+ */
+
+void svgtiny_stroke_finish(struct svgtiny_stroker *s, bool closed,
+		float x, float y)
+{
+	float h = s->half_width;
+
+	if (s->count == 0 && !s->continued) {
+		/* a subpath of no length has caps but no direction */
+		if (s->drawn && s->cap != svgtiny_CAP_BUTT) {
+			svgtiny_stroke_point(s, svgtiny_PATH_MOVE, x, y + h);
+			svgtiny_stroke_cap(s, x, y, 1, 0);
+			svgtiny_stroke_cap(s, x, y, -1, 0);
+			svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+		}
+	} else if (!s->continued) {
+		if (closed)
+			svgtiny_stroke_loops(s);
+		else
+			svgtiny_stroke_piece(s, true, true);
+	} else {
+		const struct svgtiny_stroke_segment *last =
+				&s->segment[s->count - 1];
+		svgtiny_stroke_piece(s, false, !closed);
+		if (closed) {
+			svgtiny_stroke_wedge(s, x, y, last->dx1, last->dy1,
+					s->first_dx, s->first_dy);
+		} else if (s->cap != svgtiny_CAP_BUTT) {
+			svgtiny_stroke_point(s, svgtiny_PATH_MOVE,
+					x + s->first_dy * h,
+					y - s->first_dx * h);
+			svgtiny_stroke_cap(s, x, y, -s->first_dx,
+					-s->first_dy);
+			svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+		}
+	}
+
+	s->count = 0;
+	s->continued = false;
+	s->drawn = false;
+}
+
+
+/**
+ * Outline the segments read as one closed piece: forward along the left
+ * side, back along the right, with caps at the ends if asked for and else
+ * straight across.
+ */
+
+void svgtiny_stroke_piece(struct svgtiny_stroker *s,
+		bool start_cap, bool end_cap)
+{
+	const struct svgtiny_stroke_segment *first = &s->segment[0];
+	const struct svgtiny_stroke_segment *last = &s->segment[s->count - 1];
+	float h = s->half_width;
+
+	svgtiny_stroke_point(s, svgtiny_PATH_MOVE,
+			first->x0 - first->dy0 * h, first->y0 + first->dx0 * h);
+	svgtiny_stroke_forward(s);
+	if (end_cap)
+		svgtiny_stroke_cap(s, last->c[4], last->c[5],
+				last->dx1, last->dy1);
+	else
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+				last->c[4] + last->dy1 * h,
+				last->c[5] - last->dx1 * h);
+	svgtiny_stroke_backward(s);
+	if (start_cap)
+		svgtiny_stroke_cap(s, first->x0, first->y0,
+				-first->dx0, -first->dy0);
+	svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+}
+
+
+/**
+ * Outline a closed subpath read whole, as a loop along each side.
+ */
+
+void svgtiny_stroke_loops(struct svgtiny_stroker *s)
+{
+	const struct svgtiny_stroke_segment *first = &s->segment[0];
+	const struct svgtiny_stroke_segment *last = &s->segment[s->count - 1];
+	float h = s->half_width;
+
+	svgtiny_stroke_point(s, svgtiny_PATH_MOVE,
+			first->x0 - first->dy0 * h, first->y0 + first->dx0 * h);
+	svgtiny_stroke_forward(s);
+	svgtiny_stroke_join(s, s->join, first->x0, first->y0,
+			last->dx1, last->dy1, first->dx0, first->dy0);
+	svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+
+	svgtiny_stroke_point(s, svgtiny_PATH_MOVE,
+			last->c[4] + last->dy1 * h, last->c[5] - last->dx1 * h);
+	svgtiny_stroke_backward(s);
+	svgtiny_stroke_join(s, s->join, first->x0, first->y0,
+			-first->dx0, -first->dy0, -last->dx1, -last->dy1);
+	svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+}
+
+
+/**
+ * Outline the left side of the segments read, from the start of the first,
+ * with joins between them.
+ */
+
+void svgtiny_stroke_forward(struct svgtiny_stroker *s)
+{
+	float h = s->half_width;
+	unsigned int i;
+
+	for (i = 0; i != s->count; i++) {
+		const struct svgtiny_stroke_segment *segment = &s->segment[i];
+		if (i != 0)
+			svgtiny_stroke_join(s, s->join,
+					segment->x0, segment->y0,
+					s->segment[i - 1].dx1,
+					s->segment[i - 1].dy1,
+					segment->dx0, segment->dy0);
+		if (segment->bezier) {
+			float q[8] = { segment->x0, segment->y0,
+					segment->c[0], segment->c[1],
+					segment->c[2], segment->c[3],
+					segment->c[4], segment->c[5] };
+			svgtiny_stroke_offset(s, q, 0);
+		} else {
+			svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+					segment->c[4] - segment->dy1 * h,
+					segment->c[5] + segment->dx1 * h);
+		}
+	}
+}
+
+
+/**
+ * Outline the right side of the segments read, from the end of the last,
+ * with joins between them.
+ */
+
+void svgtiny_stroke_backward(struct svgtiny_stroker *s)
+{
+	float h = s->half_width;
+	unsigned int i;
+
+	for (i = s->count; i-- != 0; ) {
+		const struct svgtiny_stroke_segment *segment = &s->segment[i];
+		if (i + 1 != s->count)
+			svgtiny_stroke_join(s, s->join,
+					segment->c[4], segment->c[5],
+					-s->segment[i + 1].dx0,
+					-s->segment[i + 1].dy0,
+					-segment->dx1, -segment->dy1);
+		if (segment->bezier) {
+			float q[8] = { segment->c[4], segment->c[5],
+					segment->c[2], segment->c[3],
+					segment->c[0], segment->c[1],
+					segment->x0, segment->y0 };
+			svgtiny_stroke_offset(s, q, 0);
+		} else {
+			svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+					segment->x0 + segment->dy0 * h,
+					segment->y0 - segment->dx0 * h);
+		}
+	}
+}
+
+
+/**
+ * Continue the outline along the left offset of the cubic Bézier from
+ * (q[0], q[1]) through (q[2], q[3]) and (q[4], q[5]) to (q[6], q[7]), from
+ * the offset of its start.
+ */
+
+void svgtiny_stroke_offset(struct svgtiny_stroker *s,
+		const float *q, unsigned int depth)
+{
+	float h = s->half_width;
+	float dx0, dy0, dx1, dy1;
+	float leg[3][2], normal[3][2], length[3];
+	float c[6];
+	unsigned int k;
+
+	if (!svgtiny_stroke_direction(q, false, &dx0, &dy0))
+		return;
+	svgtiny_stroke_direction(q, true, &dx1, &dy1);
+	c[4] = q[6] - dy1 * h;
+	c[5] = q[7] + dx1 * h;
+
+	if (s->sink->outside) {
+		float box[4] = {
+			fminf(fminf(q[0], q[2]), fminf(q[4], q[6])) - h,
+			fminf(fminf(q[1], q[3]), fminf(q[5], q[7])) - h,
+			fmaxf(fmaxf(q[0], q[2]), fmaxf(q[4], q[6])) + h,
+			fmaxf(fmaxf(q[1], q[3]), fmaxf(q[5], q[7])) + h };
+		if (s->sink->outside(s->sink, box)) {
+			svgtiny_stroke_point(s, svgtiny_PATH_LINE, c[4], c[5]);
+			return;
+		}
+	}
+
+	/* the legs of the control polygon, offset by h, meet at the offset
+	 * control points; a leg of no length takes its neighbour's normal */
+	for (k = 0; k != 3; k++) {
+		leg[k][0] = q[2 * k + 2] - q[2 * k];
+		leg[k][1] = q[2 * k + 3] - q[2 * k + 1];
+		length[k] = hypotf(leg[k][0], leg[k][1]);
+		if (0 < length[k]) {
+			normal[k][0] = -leg[k][1] / length[k];
+			normal[k][1] = leg[k][0] / length[k];
+		}
+	}
+	if (!(0 < length[0])) {
+		normal[0][0] = -dy0;
+		normal[0][1] = dx0;
+	}
+	if (!(0 < length[2])) {
+		normal[2][0] = -dy1;
+		normal[2][1] = dx1;
+	}
+	if (!(0 < length[1])) {
+		normal[1][0] = normal[0][0];
+		normal[1][1] = normal[0][1];
+	}
+	for (k = 0; k != 2; k++) {
+		/* control point k + 1 ends leg k and starts leg k + 1 */
+		float px = q[2 * k + 2] + normal[k][0] * h;
+		float py = q[2 * k + 3] + normal[k][1] * h;
+		float qx = q[2 * k + 2] + normal[k + 1][0] * h;
+		float qy = q[2 * k + 3] + normal[k + 1][1] * h;
+		float cross = leg[k][0] * leg[k + 1][1] -
+				leg[k][1] * leg[k + 1][0];
+		float dot = normal[k][0] * normal[k + 1][0] +
+				normal[k][1] * normal[k + 1][1];
+		if (!(0 < length[k])) {
+			c[2 * k] = qx;
+			c[2 * k + 1] = qy;
+		} else if (!(0 < length[k + 1])) {
+			c[2 * k] = px;
+			c[2 * k + 1] = py;
+		} else if (0.05f < fabsf(cross) / (length[k] * length[k + 1])) {
+			float t = ((qx - px) * leg[k + 1][1] -
+					(qy - py) * leg[k + 1][0]) / cross;
+			c[2 * k] = px + t * leg[k][0];
+			c[2 * k + 1] = py + t * leg[k][1];
+		} else if (0 < dot) {
+			/* nearly straight on: the mean of the offsets */
+			c[2 * k] = (px + qx) / 2;
+			c[2 * k + 1] = (py + qy) / 2;
+		} else {
+			/* turning back on itself: no offset fits */
+			c[2 * k] = q[2 * k + 2];
+			c[2 * k + 1] = q[2 * k + 3];
+		}
+	}
+
+	if (depth != SVGTINY_STROKE_MAX_DEPTH) {
+		float a0x = q[0] - dy0 * h, a0y = q[1] + dx0 * h;
+		float tolerance_squared = s->tolerance * s->tolerance;
+		bool fits = true;
+		for (k = 1; k != 4 && fits; k++) {
+			float t = k / 4.0f, u = 1 - t;
+			float b0 = u * u * u, b1 = 3 * u * u * t;
+			float b2 = 3 * u * t * t, b3 = t * t * t;
+			/* the curve and its derivative at t */
+			float x = b0 * q[0] + b1 * q[2] + b2 * q[4] + b3 * q[6];
+			float y = b0 * q[1] + b1 * q[3] + b2 * q[5] + b3 * q[7];
+			float dx = u * u * (q[2] - q[0]) +
+					2 * u * t * (q[4] - q[2]) +
+					t * t * (q[6] - q[4]);
+			float dy = u * u * (q[3] - q[1]) +
+					2 * u * t * (q[5] - q[3]) +
+					t * t * (q[7] - q[5]);
+			float length = hypotf(dx, dy);
+			float ox, oy;
+			if (!(0 < length)) {
+				fits = false;
+				break;
+			}
+			ox = b0 * a0x + b1 * c[0] + b2 * c[2] + b3 * c[4] -
+					(x - dy / length * h);
+			oy = b0 * a0y + b1 * c[1] + b2 * c[3] + b3 * c[5] -
+					(y + dx / length * h);
+			fits = ox * ox + oy * oy <= tolerance_squared;
+		}
+		if (!fits) {
+			/* split in half by de Casteljau */
+			float x01 = (q[0] + q[2]) / 2, y01 = (q[1] + q[3]) / 2;
+			float x12 = (q[2] + q[4]) / 2, y12 = (q[3] + q[5]) / 2;
+			float x23 = (q[4] + q[6]) / 2, y23 = (q[5] + q[7]) / 2;
+			float xa = (x01 + x12) / 2, ya = (y01 + y12) / 2;
+			float xb = (x12 + x23) / 2, yb = (y12 + y23) / 2;
+			float xm = (xa + xb) / 2, ym = (ya + yb) / 2;
+			float half0[8] = { q[0], q[1], x01, y01, xa, ya,
+					xm, ym };
+			float half1[8] = { xm, ym, xb, yb, x23, y23,
+					q[6], q[7] };
+			float ax, ay, bx, by;
+			svgtiny_stroke_offset(s, half0, depth + 1);
+			/* at a cusp the curve turns back on itself, and its
+			 * stroke has a round end there */
+			if (svgtiny_stroke_direction(half0, true, &ax, &ay) &&
+					svgtiny_stroke_direction(half1, false,
+					&bx, &by) && !(0 < ax * bx + ay * by &&
+					fabsf(ax * by - ay * bx) < 1e-4f))
+				svgtiny_stroke_join(s, svgtiny_JOIN_ROUND,
+						xm, ym, ax, ay, bx, by);
+			svgtiny_stroke_offset(s, half1, depth + 1);
+			return;
+		}
+	}
+
+	s->sink->command(s->sink, svgtiny_PATH_BEZIER, c);
+}
+
+
+/**
+ * Find the unit direction of the cubic Bézier q at its start, or at its end
+ * if end is set, from the nearest control point that differs. Returns false
+ * if all four are the same.
+ */
+
+bool svgtiny_stroke_direction(const float *q, bool end,
+		float *dx, float *dy)
+{
+	unsigned int k;
+
+	for (k = 1; k != 4; k++) {
+		float x, y, length;
+		if (end) {
+			x = q[6] - q[6 - 2 * k];
+			y = q[7] - q[7 - 2 * k];
+		} else {
+			x = q[2 * k] - q[0];
+			y = q[2 * k + 1] - q[1];
+		}
+		length = hypotf(x, y);
+		if (0 < length) {
+			*dx = x / length;
+			*dy = y / length;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Continue the left side of an outline at the vertex (x, y), from the offset
+ * of a segment arriving in unit direction (ax, ay) to that of one leaving
+ * in (bx, by), with a join of the given svgtiny_JOIN_ kind if on the
+ * outside of the turn.
+ */
+
+void svgtiny_stroke_join(struct svgtiny_stroker *s, int join,
+		float x, float y, float ax, float ay, float bx, float by)
+{
+	float h = s->half_width;
+	float cross = ax * by - ay * bx, dot = ax * bx + ay * by;
+
+	if (0 < dot && fabsf(cross) < 1e-4f) {
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE, x - by * h,
+				y + bx * h);
+	} else if (0 < cross) {
+		/* the inside of the turn */
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE, x, y);
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE, x - by * h,
+				y + bx * h);
+	} else {
+		svgtiny_stroke_outer_join(s, join, x, y, ax, ay, bx, by);
+	}
+}
+
+
+/**
+ * Continue the left side of an outline around the outside of a turn at the
+ * vertex (x, y), from unit direction (ax, ay) to (bx, by).
+ */
+
+void svgtiny_stroke_outer_join(struct svgtiny_stroker *s, int join,
+		float x, float y, float ax, float ay, float bx, float by)
+{
+	float h = s->half_width;
+	float cross = ax * by - ay * bx, dot = ax * bx + ay * by;
+
+	switch (join) {
+	case svgtiny_JOIN_ROUND:
+		svgtiny_stroke_arc(s, x, y, -ay * h, ax * h,
+				-fabsf(atan2f(cross, dot)));
+		return;
+	case svgtiny_JOIN_MITER:
+		/* the mitre is 1 / cos of half the turn half widths long */
+		if (0 < 1 + dot && 2 <= s->miter_limit * s->miter_limit *
+				(1 + dot)) {
+			svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+					x - (ay + by) * h / (1 + dot),
+					y + (ax + bx) * h / (1 + dot));
+		}
+		/* fall through */
+	default:
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE, x - by * h,
+				y + bx * h);
+	}
+}
+
+
+/**
+ * Outline the join at the vertex (x, y) between two pieces of a subpath, in
+ * unit directions (ax, ay) and (bx, by), as a closed wedge from the vertex.
+ */
+
+void svgtiny_stroke_wedge(struct svgtiny_stroker *s,
+		float x, float y, float ax, float ay, float bx, float by)
+{
+	float h = s->half_width;
+	float cross = ax * by - ay * bx, dot = ax * bx + ay * by;
+
+	if (0 < dot && fabsf(cross) < 1e-4f)
+		return;
+	if (0 < cross) {
+		/* the outside of the turn is on the right: go round it
+		 * backwards */
+		float x0 = ax, y0 = ay;
+		ax = -bx;
+		ay = -by;
+		bx = -x0;
+		by = -y0;
+	}
+	svgtiny_stroke_point(s, svgtiny_PATH_MOVE, x, y);
+	svgtiny_stroke_point(s, svgtiny_PATH_LINE, x - ay * h, y + ax * h);
+	svgtiny_stroke_outer_join(s, s->join, x, y, ax, ay, bx, by);
+	svgtiny_stroke_point(s, svgtiny_PATH_CLOSE, 0, 0);
+}
+
+
+/**
+ * Continue an outline around a cap at the end (x, y) of a subpath leaving
+ * in unit direction (dx, dy), from the left side to the right.
+ */
+
+void svgtiny_stroke_cap(struct svgtiny_stroker *s,
+		float x, float y, float dx, float dy)
+{
+	float h = s->half_width;
+
+	switch (s->cap) {
+	case svgtiny_CAP_ROUND:
+		svgtiny_stroke_arc(s, x, y, -dy * h, dx * h, -M_PI);
+		return;
+	case svgtiny_CAP_SQUARE:
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+				x + (dx - dy) * h, y + (dy + dx) * h);
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE,
+				x + (dx + dy) * h, y + (dy - dx) * h);
+		/* fall through */
+	default:
+		svgtiny_stroke_point(s, svgtiny_PATH_LINE, x + dy * h,
+				y - dx * h);
+	}
+}
+
+
+/**
+ * Continue an outline along the circular arc about (x, y) from (x, y) +
+ * (ux, uy), turning through sweep radians, in cubics of at most a quarter
+ * turn.
+ */
+
+void svgtiny_stroke_arc(struct svgtiny_stroker *s,
+		float x, float y, float ux, float uy, float sweep)
+{
+	unsigned int pieces = ceilf(fabsf(sweep) / (M_PI / 2) - 1e-4f);
+	float angle, k, cos_a, sin_a;
+	unsigned int i;
+
+	if (pieces == 0)
+		return;
+	angle = sweep / pieces;
+	k = 4.0f / 3 * tanf(angle / 4);
+	cos_a = cosf(angle);
+	sin_a = sinf(angle);
+	for (i = 0; i != pieces; i++) {
+		float vx = ux * cos_a - uy * sin_a;
+		float vy = ux * sin_a + uy * cos_a;
+		float c[6] = { x + ux - k * uy, y + uy + k * ux,
+				x + vx + k * vy, y + vy - k * vx,
+				x + vx, y + vy };
+		s->sink->command(s->sink, svgtiny_PATH_BEZIER, c);
+		ux = vx;
+		uy = vy;
+	}
+}
+
+
+/**
+ * Pass a move, line or close to the sink.
+ */
+
+void svgtiny_stroke_point(struct svgtiny_stroker *s, int command,
+		float x, float y)
+{
+	float point[2] = { x, y };
+	s->sink->command(s->sink, command, point);
+}
+
+
+/**
+ * Expand the stroke of a shape into an outline, as a path to be filled by
+ * the non-zero rule in the stroke's paint. Curves of the outline are within
+ * tolerance of the true offsets of the path's curves.
+ *
+ * The outline is written to out if it fits in out_length floats. Returns
+ * the number of floats it takes, or 0 if the shape has no path or stroke
+ * width.
+ */
+
+size_t svgtiny_stroke_to_path(const struct svgtiny_shape *shape,
+		float tolerance, const struct svgtiny_stroke_style *style,
+		float *out, size_t out_length)
+{
+	struct svgtiny_stroke_buffer buffer;
+
+	if (!shape->path || !(0 < shape->stroke_width))
+		return 0;
+
+	/* measure, then write if it fits */
+	buffer.sink.command = svgtiny_stroke_buffer_command;
+	buffer.sink.outside = 0;
+	buffer.out = 0;
+	buffer.length = 0;
+	svgtiny_stroke_path(shape->path, shape->path_length, 0,
+			shape->stroke_width / 2.0f, style, tolerance,
+			&buffer.sink);
+	if (!out || out_length < buffer.length)
+		return buffer.length;
+
+	buffer.out = out;
+	buffer.length = 0;
+	svgtiny_stroke_path(shape->path, shape->path_length, 0,
+			shape->stroke_width / 2.0f, style, tolerance,
+			&buffer.sink);
+	return buffer.length;
+}
+
+
+/**
+ * Write a command to a struct svgtiny_stroke_buffer, or count its floats.
+ */
+
+void svgtiny_stroke_buffer_command(struct svgtiny_path_sink *sink,
+		int command, const float *point)
+{
+	struct svgtiny_stroke_buffer *buffer =
+			(struct svgtiny_stroke_buffer *) sink;
+	unsigned int size = command == svgtiny_PATH_CLOSE ? 1 :
+			command == svgtiny_PATH_BEZIER ? 7 : 3;
+	unsigned int k;
+
+	if (buffer->out) {
+		buffer->out[buffer->length] = command;
+		for (k = 1; k != size; k++)
+			buffer->out[buffer->length + k] = point[k - 1];
+	}
+	buffer->length += size;
+}
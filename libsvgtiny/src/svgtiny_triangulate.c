@@ -0,0 +1,1338 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/**
+ * Triangulation of filled paths by the non-zero rule, in O((n + k) log n)
+ * for n edges crossing k times.
+ *
+ * Paths are flattened into closed polygons, whose edges are swept from top
+ * to bottom, ordered by y and then x so that horizontal edges need no
+ * special case. The edges crossing the sweep line are kept in a skip list
+ * ordered by x. Adjacent edges are checked for crossings below the sweep,
+ * and both are split where they cross, so the edges only ever meet at
+ * their ends (Bentley and Ottmann). A vertex that lies on an edge splits it
+ * too, which handles shared and overlapping edges.
+ *
+ * Each region between adjacent edges knows its winding number, from the
+ * region to its left and the edge between them. Regions with a winding
+ * number other than 0 are covered by y-monotone polygons, started, split
+ * and merged at vertices as in the monotone decomposition of de Berg et al.
+ * A split connects the vertex to the lowest vertex of the polygon so far; a
+ * merge leaves two polygons pending in one region until the next vertex
+ * that touches it. Each monotone polygon is triangulated as its vertices
+ * arrive, keeping only a stack of reflex vertices.
+ *
+ * Coordinates are floats, so the orientation tests, done in double, are
+ * exact for coordinates of similar magnitude, but crossing points are
+ * rounded to floats and so may miss other edges through the same point. An
+ * edge is taken to pass through a vertex within a few float roundings of
+ * it, and is split there, in the manner of snap rounding.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "svgtiny_internal.h"
+
+#define SVGTINY_TESS_NONE UINT_MAX
+/* levels of the skip list of edges crossing the sweep line */
+#define SVGTINY_TESS_LEVELS 16
+/* the edge standing for the region left of every edge */
+#define SVGTINY_TESS_HEAD 0
+
+enum {
+	SVGTINY_TESS_TOP,
+	SVGTINY_TESS_LEFT,
+	SVGTINY_TESS_RIGHT
+};
+
+struct svgtiny_tess_vertex {
+	float x, y;
+	/* first edge starting here */
+	unsigned int edge;
+	/* index in the output, or SVGTINY_TESS_NONE if not used yet */
+	unsigned int output;
+};
+
+/**
+ * An edge, from its top vertex to its bottom one in sweep order, with the
+ * winding it adds to regions to its right.
+ */
+struct svgtiny_tess_edge {
+	unsigned int top, bottom;
+	int winding;
+	/* next edge starting at top */
+	unsigned int next;
+	/* while crossing the sweep line: its level and first pair of next
+	 * and previous edges in svgtiny_tess.link, and the region to its
+	 * right, with its winding number and monotone polygons */
+	unsigned int level, link;
+	int right_winding;
+	unsigned int poly, pending;
+};
+
+/**
+ * A monotone polygon being triangulated: its vertices not yet in a
+ * triangle, a stack in svgtiny_tess.stack, all on one chain but the
+ * bottom one.
+ */
+struct svgtiny_tess_poly {
+	unsigned int stack;
+	unsigned int last;
+	int last_side;
+};
+
+struct svgtiny_tess_stack {
+	unsigned int vertex;
+	int side;
+	unsigned int below;
+};
+
+struct svgtiny_tess {
+	const svgtiny_allocator *allocator;
+	svgtiny_code code;
+	struct svgtiny_triangles *out;
+	unsigned int vertex_size, index_size, fill_size;
+
+	struct svgtiny_tess_vertex *vertex;
+	unsigned int vertex_count, vertex_capacity;
+	struct svgtiny_tess_edge *edge;
+	unsigned int edge_count, edge_capacity;
+	unsigned int *link;
+	unsigned int link_count, link_capacity;
+	struct svgtiny_tess_poly *poly;
+	unsigned int poly_count, poly_capacity;
+	struct svgtiny_tess_stack *stack;
+	unsigned int stack_count, stack_capacity, stack_free;
+	/* vertices not yet swept */
+	unsigned int *heap;
+	unsigned int heap_count, heap_capacity;
+	/* edges ending and starting at the vertex being swept */
+	unsigned int *ending, *starting;
+	unsigned int ending_capacity, starting_capacity;
+
+	uint32_t random;
+};
+
+static void svgtiny_triangulate_part(struct svgtiny_tess *t,
+		const struct svgtiny_shape *shape, const float *m,
+		svgtiny_colour fill, float tolerance);
+static void svgtiny_tess_init(struct svgtiny_tess *t,
+		const svgtiny_allocator *allocator,
+		struct svgtiny_triangles *out);
+static void svgtiny_tess_free(struct svgtiny_tess *t);
+static void svgtiny_tess_path(struct svgtiny_tess *t, const float *p,
+		unsigned int n, const float *m, float tolerance);
+static void svgtiny_tess_fill(struct svgtiny_tess *t, unsigned int first,
+		svgtiny_colour fill);
+static void svgtiny_tess_contour(struct svgtiny_tess *t, unsigned int first);
+static void *svgtiny_tess_grow(struct svgtiny_tess *t, void *array,
+		unsigned int *capacity, unsigned int count, size_t size);
+static unsigned int svgtiny_tess_add_vertex(struct svgtiny_tess *t,
+		float x, float y);
+static unsigned int svgtiny_tess_add_edge(struct svgtiny_tess *t,
+		unsigned int top, unsigned int bottom, int winding);
+static bool svgtiny_tess_before(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b);
+static bool svgtiny_tess_same(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b);
+static double svgtiny_tess_orient(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b, unsigned int c);
+static int svgtiny_tess_side(const struct svgtiny_tess *t, unsigned int e,
+		unsigned int v);
+static void svgtiny_tess_push(struct svgtiny_tess *t, unsigned int v);
+static unsigned int svgtiny_tess_pop(struct svgtiny_tess *t);
+static void svgtiny_tess_sweep(struct svgtiny_tess *t);
+static void svgtiny_tess_event(struct svgtiny_tess *t, unsigned int w);
+static void svgtiny_tess_regions(struct svgtiny_tess *t, unsigned int w,
+		unsigned int left, unsigned int ending, unsigned int starting);
+static void svgtiny_tess_split(struct svgtiny_tess *t, unsigned int e,
+		unsigned int v);
+static void svgtiny_tess_cross(struct svgtiny_tess *t, unsigned int w,
+		unsigned int a, unsigned int b);
+static unsigned int svgtiny_tess_next(const struct svgtiny_tess *t,
+		unsigned int e, unsigned int level);
+static void svgtiny_tess_insert(struct svgtiny_tess *t, unsigned int e,
+		unsigned int *update);
+static void svgtiny_tess_remove(struct svgtiny_tess *t, unsigned int e);
+static unsigned int svgtiny_tess_poly_create(struct svgtiny_tess *t,
+		unsigned int top);
+static void svgtiny_tess_poly_add(struct svgtiny_tess *t, unsigned int poly,
+		unsigned int v, int side);
+static void svgtiny_tess_poly_close(struct svgtiny_tess *t,
+		unsigned int poly, unsigned int v);
+static unsigned int svgtiny_tess_stack_push(struct svgtiny_tess *t,
+		unsigned int below, unsigned int v, int side);
+static unsigned int svgtiny_tess_stack_pop(struct svgtiny_tess *t,
+		unsigned int node);
+static void svgtiny_tess_triangle(struct svgtiny_tess *t,
+		unsigned int a, unsigned int b, unsigned int c);
+static unsigned int svgtiny_tess_output(struct svgtiny_tess *t,
+		unsigned int v);
+static svgtiny_code svgtiny_tess_finish(struct svgtiny_tess *t);
+
+
+/**
+ * Triangulate the area a shape's path fills by the non-zero rule, with
+ * curves flattened to within tolerance. Its paint is not looked at.
+ *
+ * The triangles are allocated by the default allocator, and are freed by
+ * svgtiny_triangles_free().
+ */
+
+svgtiny_code svgtiny_triangulate_shape(const struct svgtiny_shape *shape,
+		float tolerance, struct svgtiny_triangles **triangles)
+{
+	const svgtiny_allocator *allocator = &svgtiny_default_allocator;
+	struct svgtiny_triangles *out;
+	struct svgtiny_tess t;
+
+	*triangles = 0;
+	out = svgtiny_mem_alloc(allocator, sizeof *out);
+	if (!out)
+		return svgtiny_OUT_OF_MEMORY;
+	memset(out, 0, sizeof *out);
+	out->_internal_allocator = *allocator;
+
+	svgtiny_tess_init(&t, allocator, out);
+	if (shape->path)
+		svgtiny_tess_path(&t, shape->path, shape->path_length, 0,
+				tolerance);
+	if (svgtiny_tess_finish(&t) != svgtiny_OK) {
+		svgtiny_triangles_free(out);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	*triangles = out;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Add the triangles of a shape of a diagram, transformed by m if not NULL,
+ * with the fill it is drawn with, unless it is not filled.
+ */
+
+void svgtiny_triangulate_part(struct svgtiny_tess *t,
+		const struct svgtiny_shape *shape, const float *m,
+		svgtiny_colour fill, float tolerance)
+{
+	unsigned int first = t->out->triangle_count;
+
+	if (!shape->path || fill == svgtiny_TRANSPARENT)
+		return;
+	svgtiny_tess_path(t, shape->path, shape->path_length, m, tolerance);
+	svgtiny_tess_fill(t, first, fill);
+}
+
+
+/**
+ * Triangulate every filled shape of a diagram into one set of triangles,
+ * allocated by the diagram's allocator. The triangles of shape i are
+ * shape_triangle[i] to shape_triangle[i + 1] - 1. An instance is expanded
+ * into the triangles of each of its symbol shapes in turn, transformed.
+ */
+
+svgtiny_code svgtiny_triangulate_diagram(
+		const struct svgtiny_diagram *diagram, float tolerance,
+		struct svgtiny_triangles **triangles)
+{
+	const svgtiny_allocator *allocator =
+			svgtiny_arena_allocator(diagram->_internal_arena);
+	struct svgtiny_triangles *out;
+	struct svgtiny_tess t;
+	unsigned int i, k;
+	float m[6];
+
+	*triangles = 0;
+	out = svgtiny_mem_alloc(allocator, sizeof *out);
+	if (!out)
+		return svgtiny_OUT_OF_MEMORY;
+	memset(out, 0, sizeof *out);
+	out->_internal_allocator = *allocator;
+	out->shape_triangle = svgtiny_mem_alloc(allocator,
+			((size_t) diagram->shape_count + 1) *
+			sizeof out->shape_triangle[0]);
+	if (!out->shape_triangle) {
+		svgtiny_triangles_free(out);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+
+	svgtiny_tess_init(&t, allocator, out);
+	for (i = 0; i != diagram->shape_count && t.code == svgtiny_OK; i++) {
+		const struct svgtiny_shape *shape = &diagram->shape[i];
+		const struct svgtiny_instance *instance = shape->instance;
+		out->shape_triangle[i] = out->triangle_count;
+		if (!instance) {
+			svgtiny_triangulate_part(&t, shape, 0, shape->fill,
+					tolerance);
+			continue;
+		}
+		m[0] = instance->transform.a;
+		m[1] = instance->transform.b;
+		m[2] = instance->transform.c;
+		m[3] = instance->transform.d;
+		m[4] = instance->transform.e;
+		m[5] = instance->transform.f;
+		for (k = instance->first; k != instance->first +
+				instance->count && t.code == svgtiny_OK; k++) {
+			const struct svgtiny_shape *s =
+					&diagram->symbol_shape[k];
+			svgtiny_triangulate_part(&t, s, m,
+					s->fill ? s->fill : instance->fill,
+					tolerance);
+		}
+	}
+	out->shape_triangle[diagram->shape_count] = out->triangle_count;
+	if (svgtiny_tess_finish(&t) != svgtiny_OK) {
+		svgtiny_triangles_free(out);
+		return svgtiny_OUT_OF_MEMORY;
+	}
+	*triangles = out;
+	return svgtiny_OK;
+}
+
+
+/**
+ * Free triangles from svgtiny_triangulate_shape() or
+ * svgtiny_triangulate_diagram().
+ */
+
+void svgtiny_triangles_free(struct svgtiny_triangles *triangles)
+{
+	svgtiny_allocator allocator;
+
+	if (!triangles)
+		return;
+	allocator = triangles->_internal_allocator;
+	svgtiny_mem_free(&allocator, triangles->vertex);
+	svgtiny_mem_free(&allocator, triangles->index);
+	svgtiny_mem_free(&allocator, triangles->shape_triangle);
+	svgtiny_mem_free(&allocator, triangles->fill);
+	svgtiny_mem_free(&allocator, triangles);
+}
+
+
+void svgtiny_tess_init(struct svgtiny_tess *t,
+		const svgtiny_allocator *allocator,
+		struct svgtiny_triangles *out)
+{
+	memset(t, 0, sizeof *t);
+	t->allocator = allocator;
+	t->code = svgtiny_OK;
+	t->out = out;
+	t->random = 0x9e3779b9;
+}
+
+
+void svgtiny_tess_free(struct svgtiny_tess *t)
+{
+	svgtiny_mem_free(t->allocator, t->vertex);
+	svgtiny_mem_free(t->allocator, t->edge);
+	svgtiny_mem_free(t->allocator, t->link);
+	svgtiny_mem_free(t->allocator, t->poly);
+	svgtiny_mem_free(t->allocator, t->stack);
+	svgtiny_mem_free(t->allocator, t->heap);
+	svgtiny_mem_free(t->allocator, t->ending);
+	svgtiny_mem_free(t->allocator, t->starting);
+}
+
+
+/**
+ * Free the working memory, and trim the output to its size.
+ */
+
+svgtiny_code svgtiny_tess_finish(struct svgtiny_tess *t)
+{
+	struct svgtiny_triangles *out = t->out;
+
+	svgtiny_tess_free(t);
+	if (t->code != svgtiny_OK)
+		return t->code;
+	if (out->vertex_count != 0 && 2 * out->vertex_count != t->vertex_size) {
+		float *vertex = svgtiny_mem_realloc(t->allocator, out->vertex,
+				2 * out->vertex_count * sizeof vertex[0]);
+		if (vertex)
+			out->vertex = vertex;
+	}
+	if (out->triangle_count != 0 &&
+			3 * out->triangle_count != t->index_size) {
+		uint32_t *index = svgtiny_mem_realloc(t->allocator,
+				out->index, 3 * out->triangle_count *
+				sizeof index[0]);
+		if (index)
+			out->index = index;
+	}
+	if (out->fill && out->triangle_count != 0 &&
+			out->triangle_count != t->fill_size) {
+		svgtiny_colour *fill = svgtiny_mem_realloc(t->allocator,
+				out->fill, out->triangle_count *
+				sizeof fill[0]);
+		if (fill)
+			out->fill = fill;
+	}
+	return svgtiny_OK;
+}
+
+
+/**
+ * Add the triangles of the area a path of n floats fills to the output,
+ * transforming it by m first if m is not NULL.
+ */
+
+void svgtiny_tess_path(struct svgtiny_tess *t, const float *p,
+		unsigned int n, const float *m, float tolerance)
+{
+	float line[3 * SVGTINY_FLATTEN_MAX_LINES];
+	float point[6];
+	float x = 0, y = 0;
+	unsigned int j, k, size, lines, first = 0;
+	bool open = false;
+
+	t->vertex_count = 0;
+	t->link_count = 0;
+	t->poly_count = 0;
+	t->stack_count = 0;
+	t->stack_free = SVGTINY_TESS_NONE;
+	t->heap_count = 0;
+	/* the head of the skip list */
+	t->edge_count = 0;
+	svgtiny_tess_add_edge(t, 0, 0, 0);
+	if (t->code != svgtiny_OK)
+		return;
+	t->edge[SVGTINY_TESS_HEAD].level = SVGTINY_TESS_LEVELS;
+	t->edge[SVGTINY_TESS_HEAD].link = 0;
+	t->link = svgtiny_tess_grow(t, t->link, &t->link_capacity,
+			2 * SVGTINY_TESS_LEVELS, sizeof t->link[0]);
+	if (!t->link)
+		return;
+	for (k = 0; k != 2 * SVGTINY_TESS_LEVELS; k++)
+		t->link[k] = SVGTINY_TESS_NONE;
+	t->link_count = 2 * SVGTINY_TESS_LEVELS;
+
+	/* flatten into closed contours */
+	for (j = 0; j != n && t->code == svgtiny_OK; j += 1 + size) {
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+		case svgtiny_PATH_LINE:
+			size = 2;
+			break;
+		case svgtiny_PATH_BEZIER:
+			size = 6;
+			break;
+		case svgtiny_PATH_CLOSE:
+			size = 0;
+			break;
+		default:
+			assert(0);
+			return;
+		}
+		for (k = 0; k != size; k += 2) {
+			float px = p[j + 1 + k], py = p[j + 2 + k];
+			point[k] = m ? m[0] * px + m[2] * py + m[4] : px;
+			point[k + 1] = m ? m[1] * px + m[3] * py + m[5] : py;
+		}
+
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			if (open)
+				svgtiny_tess_contour(t, first);
+			first = t->vertex_count;
+			open = true;
+			x = point[0];
+			y = point[1];
+			svgtiny_tess_add_vertex(t, x, y);
+			break;
+		case svgtiny_PATH_CLOSE:
+			if (open)
+				svgtiny_tess_contour(t, first);
+			open = false;
+			break;
+		case svgtiny_PATH_LINE:
+			if (!open) {
+				first = t->vertex_count;
+				open = true;
+				svgtiny_tess_add_vertex(t, x, y);
+			}
+			x = point[0];
+			y = point[1];
+			svgtiny_tess_add_vertex(t, x, y);
+			break;
+		case svgtiny_PATH_BEZIER:
+			if (!open) {
+				first = t->vertex_count;
+				open = true;
+				svgtiny_tess_add_vertex(t, x, y);
+			}
+			lines = svgtiny_flatten_bezier_lines(x, y, point,
+					tolerance);
+			assert(3 * lines <= sizeof line / sizeof line[0]);
+			svgtiny_flatten_bezier(x, y, point, lines, line);
+			for (k = 0; k != lines; k++)
+				svgtiny_tess_add_vertex(t, line[3 * k + 1],
+						line[3 * k + 2]);
+			x = point[4];
+			y = point[5];
+			break;
+		}
+	}
+	if (open)
+		svgtiny_tess_contour(t, first);
+	if (t->code != svgtiny_OK)
+		return;
+
+	svgtiny_tess_sweep(t);
+}
+
+
+/**
+ * Set the fill of the triangles from first to the last added.
+ */
+
+void svgtiny_tess_fill(struct svgtiny_tess *t, unsigned int first,
+		svgtiny_colour fill)
+{
+	struct svgtiny_triangles *out = t->out;
+	svgtiny_colour *grown;
+	unsigned int i;
+
+	if (t->code != svgtiny_OK || first == out->triangle_count)
+		return;
+	grown = svgtiny_tess_grow(t, out->fill, &t->fill_size,
+			out->triangle_count, sizeof grown[0]);
+	if (!grown)
+		return;
+	out->fill = grown;
+	for (i = first; i != out->triangle_count; i++)
+		grown[i] = fill;
+}
+
+
+/**
+ * Join the vertices from first to the last added into a closed polygon of
+ * edges, leaving out edges of no length.
+ */
+
+void svgtiny_tess_contour(struct svgtiny_tess *t, unsigned int first)
+{
+	unsigned int i, last = t->vertex_count;
+
+	for (i = first; i != last && t->code == svgtiny_OK; i++) {
+		unsigned int a = i, b = i + 1 == last ? first : i + 1;
+		if (svgtiny_tess_same(t, a, b))
+			continue;
+		if (svgtiny_tess_before(t, a, b))
+			svgtiny_tess_add_edge(t, a, b, 1);
+		else
+			svgtiny_tess_add_edge(t, b, a, -1);
+	}
+}
+
+
+/**
+ * Make room for count items of size bytes in an array, growing it by half
+ * as much again if needed. Returns the array, or NULL if out of memory, when
+ * the old array is kept.
+ */
+
+void *svgtiny_tess_grow(struct svgtiny_tess *t, void *array,
+		unsigned int *capacity, unsigned int count, size_t size)
+{
+	size_t new_capacity;
+	void *grown;
+
+	if (count <= *capacity)
+		return array;
+	new_capacity = *capacity + *capacity / 2;
+	if (new_capacity < count)
+		new_capacity = count;
+	if (new_capacity < 16)
+		new_capacity = 16;
+	if (UINT_MAX / size < new_capacity) {
+		t->code = svgtiny_OUT_OF_MEMORY;
+		return 0;
+	}
+	grown = svgtiny_mem_realloc(t->allocator, array, new_capacity * size);
+	if (!grown) {
+		t->code = svgtiny_OUT_OF_MEMORY;
+		return 0;
+	}
+	*capacity = new_capacity;
+	return grown;
+}
+
+
+unsigned int svgtiny_tess_add_vertex(struct svgtiny_tess *t, float x, float y)
+{
+	struct svgtiny_tess_vertex *vertex;
+
+	vertex = svgtiny_tess_grow(t, t->vertex, &t->vertex_capacity,
+			t->vertex_count + 1, sizeof vertex[0]);
+	if (!vertex)
+		return SVGTINY_TESS_NONE;
+	t->vertex = vertex;
+	vertex += t->vertex_count;
+	vertex->x = x;
+	vertex->y = y;
+	vertex->edge = SVGTINY_TESS_NONE;
+	vertex->output = SVGTINY_TESS_NONE;
+	return t->vertex_count++;
+}
+
+
+unsigned int svgtiny_tess_add_edge(struct svgtiny_tess *t,
+		unsigned int top, unsigned int bottom, int winding)
+{
+	struct svgtiny_tess_edge *edge;
+
+	edge = svgtiny_tess_grow(t, t->edge, &t->edge_capacity,
+			t->edge_count + 1, sizeof edge[0]);
+	if (!edge)
+		return SVGTINY_TESS_NONE;
+	t->edge = edge;
+	edge += t->edge_count;
+	edge->top = top;
+	edge->bottom = bottom;
+	edge->winding = winding;
+	edge->level = 0;
+	edge->link = 0;
+	edge->right_winding = 0;
+	edge->poly = edge->pending = SVGTINY_TESS_NONE;
+	if (t->edge_count != SVGTINY_TESS_HEAD) {
+		edge->next = t->vertex[top].edge;
+		t->vertex[top].edge = t->edge_count;
+	}
+	return t->edge_count++;
+}
+
+
+/**
+ * Whether vertex a comes before b in the sweep, by y and then x.
+ */
+
+bool svgtiny_tess_before(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b)
+{
+	const struct svgtiny_tess_vertex *va = &t->vertex[a];
+	const struct svgtiny_tess_vertex *vb = &t->vertex[b];
+	return va->y < vb->y || (va->y == vb->y && va->x < vb->x);
+}
+
+
+bool svgtiny_tess_same(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b)
+{
+	return t->vertex[a].x == t->vertex[b].x &&
+			t->vertex[a].y == t->vertex[b].y;
+}
+
+
+/**
+ * Twice the signed area of the triangle a, b, c: negative if c is right of
+ * the line from a down to b, 0 if on it.
+ */
+
+double svgtiny_tess_orient(const struct svgtiny_tess *t,
+		unsigned int a, unsigned int b, unsigned int c)
+{
+	const struct svgtiny_tess_vertex *va = &t->vertex[a];
+	const struct svgtiny_tess_vertex *vb = &t->vertex[b];
+	const struct svgtiny_tess_vertex *vc = &t->vertex[c];
+	return ((double) vb->x - va->x) * ((double) vc->y - va->y) -
+			((double) vb->y - va->y) * ((double) vc->x - va->x);
+}
+
+
+/**
+ * Which side of edge e vertex v is: -1 if right, 1 if left, 0 if within
+ * rounding of the line through it.
+ */
+
+int svgtiny_tess_side(const struct svgtiny_tess *t, unsigned int e,
+		unsigned int v)
+{
+	const struct svgtiny_tess_vertex *top = &t->vertex[t->edge[e].top];
+	const struct svgtiny_tess_vertex *bottom =
+			&t->vertex[t->edge[e].bottom];
+	const struct svgtiny_tess_vertex *p = &t->vertex[v];
+	double dx = (double) bottom->x - top->x;
+	double dy = (double) bottom->y - top->y;
+	double o = dx * ((double) p->y - top->y) -
+			dy * ((double) p->x - top->x);
+	double snap = 4 * FLT_EPSILON * (fabs(p->x) + fabs(p->y)) *
+			sqrt(dx * dx + dy * dy);
+
+	if (o < -snap)
+		return -1;
+	if (snap < o)
+		return 1;
+	return 0;
+}
+
+
+/**
+ * Add a vertex to the heap of vertices not yet swept.
+ */
+
+void svgtiny_tess_push(struct svgtiny_tess *t, unsigned int v)
+{
+	unsigned int *heap, i;
+
+	heap = svgtiny_tess_grow(t, t->heap, &t->heap_capacity,
+			t->heap_count + 1, sizeof heap[0]);
+	if (!heap)
+		return;
+	t->heap = heap;
+	for (i = t->heap_count++; i != 0; ) {
+		unsigned int parent = (i - 1) / 2;
+		if (!svgtiny_tess_before(t, v, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = v;
+}
+
+
+/**
+ * Remove and return the first vertex of the heap in sweep order.
+ */
+
+unsigned int svgtiny_tess_pop(struct svgtiny_tess *t)
+{
+	unsigned int *heap = t->heap;
+	unsigned int first = heap[0], v, i = 0;
+
+	v = heap[--t->heap_count];
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+		if (t->heap_count <= child)
+			break;
+		if (child + 1 < t->heap_count &&
+				svgtiny_tess_before(t, heap[child + 1],
+				heap[child]))
+			child++;
+		if (!svgtiny_tess_before(t, heap[child], v))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (t->heap_count != 0)
+		heap[i] = v;
+	return first;
+}
+
+
+/**
+ * Sweep the vertices in order, merging those at the same point.
+ */
+
+void svgtiny_tess_sweep(struct svgtiny_tess *t)
+{
+	unsigned int i;
+
+	for (i = 0; i != t->vertex_count && t->code == svgtiny_OK; i++)
+		svgtiny_tess_push(t, i);
+
+	while (t->heap_count != 0 && t->code == svgtiny_OK) {
+		unsigned int w = svgtiny_tess_pop(t);
+		while (t->heap_count != 0 &&
+				svgtiny_tess_same(t, t->heap[0], w)) {
+			unsigned int v = svgtiny_tess_pop(t);
+			unsigned int e = t->vertex[v].edge;
+			while (e != SVGTINY_TESS_NONE) {
+				unsigned int next = t->edge[e].next;
+				t->edge[e].top = w;
+				t->edge[e].next = t->vertex[w].edge;
+				t->vertex[w].edge = e;
+				e = next;
+			}
+			t->vertex[v].edge = SVGTINY_TESS_NONE;
+		}
+		svgtiny_tess_event(t, w);
+	}
+}
+
+
+/**
+ * Sweep past vertex w: replace the edges ending at it by those starting at
+ * it, and update the regions between them.
+ */
+
+void svgtiny_tess_event(struct svgtiny_tess *t, unsigned int w)
+{
+	unsigned int update[SVGTINY_TESS_LEVELS];
+	unsigned int left = SVGTINY_TESS_HEAD, e, level, i, j;
+	unsigned int ending = 0, starting = 0;
+
+	/* find the last edge w is right of */
+	for (level = SVGTINY_TESS_LEVELS; level-- != 0; ) {
+		while ((e = svgtiny_tess_next(t, left, level)) !=
+				SVGTINY_TESS_NONE &&
+				svgtiny_tess_side(t, e, w) < 0)
+			left = e;
+		update[level] = left;
+	}
+
+	/* the edges through w end there; those that go on are split */
+	for (e = svgtiny_tess_next(t, left, 0); e != SVGTINY_TESS_NONE &&
+			svgtiny_tess_side(t, e, w) == 0;
+			e = svgtiny_tess_next(t, e, 0)) {
+		unsigned int *array = svgtiny_tess_grow(t, t->ending,
+				&t->ending_capacity, ending + 1,
+				sizeof array[0]);
+		if (!array)
+			return;
+		t->ending = array;
+		if (!svgtiny_tess_same(t, t->edge[e].bottom, w))
+			svgtiny_tess_split(t, e, w);
+		t->edge[e].bottom = w;
+		t->ending[ending++] = e;
+	}
+	if (t->code != svgtiny_OK)
+		return;
+
+	/* the edges starting at w, from left to right */
+	for (e = t->vertex[w].edge; e != SVGTINY_TESS_NONE;
+			e = t->edge[e].next) {
+		const struct svgtiny_tess_vertex *b =
+				&t->vertex[t->edge[e].bottom];
+		unsigned int *array = svgtiny_tess_grow(t, t->starting,
+				&t->starting_capacity, starting + 1,
+				sizeof array[0]);
+		if (!array)
+			return;
+		t->starting = array;
+		for (i = starting; i != 0; i--) {
+			const struct svgtiny_tess_vertex *a =
+					&t->vertex[t->edge[
+					t->starting[i - 1]].bottom];
+			double ax = (double) a->x - t->vertex[w].x;
+			double ay = (double) a->y - t->vertex[w].y;
+			double bx = (double) b->x - t->vertex[w].x;
+			double by = (double) b->y - t->vertex[w].y;
+			if (ax * by - ay * bx <= 0)
+				break;
+			t->starting[i] = t->starting[i - 1];
+		}
+		t->starting[i] = e;
+		starting++;
+	}
+	t->vertex[w].edge = SVGTINY_TESS_NONE;
+
+	svgtiny_tess_regions(t, w, left, ending, starting);
+	if (t->code != svgtiny_OK)
+		return;
+
+	for (i = 0; i != ending; i++)
+		svgtiny_tess_remove(t, t->ending[i]);
+	for (j = 0; j != starting; j++) {
+		svgtiny_tess_insert(t, t->starting[j], update);
+		if (t->code != svgtiny_OK)
+			return;
+	}
+
+	/* new neighbours may cross below w */
+	if (starting != 0) {
+		svgtiny_tess_cross(t, w, left, t->starting[0]);
+		svgtiny_tess_cross(t, w, t->starting[starting - 1],
+				svgtiny_tess_next(t,
+				t->starting[starting - 1], 0));
+	} else {
+		svgtiny_tess_cross(t, w, left, svgtiny_tess_next(t, left, 0));
+	}
+}
+
+
+/**
+ * Update the regions and monotone polygons around vertex w, where the
+ * edges t->ending end and t->starting start, all right of edge left.
+ */
+
+void svgtiny_tess_regions(struct svgtiny_tess *t, unsigned int w,
+		unsigned int left, unsigned int ending, unsigned int starting)
+{
+	struct svgtiny_tess_edge *l = &t->edge[left];
+	unsigned int left_poly = l->poly, left_pending = l->pending;
+	unsigned int right_poly = left_poly, right_pending = left_pending;
+	unsigned int i, poly;
+	int winding;
+
+	/* regions between edges that end here are finished */
+	for (i = 0; i + 1 < ending; i++) {
+		struct svgtiny_tess_edge *e = &t->edge[t->ending[i]];
+		if (e->poly != SVGTINY_TESS_NONE)
+			svgtiny_tess_poly_close(t, e->poly, w);
+		if (e->pending != SVGTINY_TESS_NONE)
+			svgtiny_tess_poly_close(t, e->pending, w);
+	}
+	if (ending != 0) {
+		struct svgtiny_tess_edge *e = &t->edge[t->ending[ending - 1]];
+		right_poly = e->poly;
+		right_pending = e->pending;
+
+		/* w is on the right of the region to the left: a polygon
+		 * pending there since a merge ends, and the other goes on */
+		if (left_pending != SVGTINY_TESS_NONE)
+			svgtiny_tess_poly_close(t, left_pending, w);
+		if (left_poly != SVGTINY_TESS_NONE)
+			svgtiny_tess_poly_add(t, left_poly, w,
+					SVGTINY_TESS_RIGHT);
+		left_pending = SVGTINY_TESS_NONE;
+		/* and on the left of the region to the right */
+		if (right_pending != SVGTINY_TESS_NONE) {
+			if (right_poly != SVGTINY_TESS_NONE)
+				svgtiny_tess_poly_close(t, right_poly, w);
+			right_poly = right_pending;
+			right_pending = SVGTINY_TESS_NONE;
+		}
+		if (right_poly != SVGTINY_TESS_NONE)
+			svgtiny_tess_poly_add(t, right_poly, w,
+					SVGTINY_TESS_LEFT);
+	} else if (starting != 0 && left_poly != SVGTINY_TESS_NONE) {
+		/* w is inside a region, which is split in two by joining w
+		 * to the lowest vertex of its polygon, or to where two
+		 * polygons pending in it met */
+		if (left_pending != SVGTINY_TESS_NONE) {
+			right_poly = left_pending;
+		} else {
+			struct svgtiny_tess_poly *p = &t->poly[left_poly];
+			unsigned int last = p->last;
+			bool on_left = p->last_side != SVGTINY_TESS_RIGHT;
+			poly = svgtiny_tess_poly_create(t, last);
+			if (poly == SVGTINY_TESS_NONE)
+				return;
+			if (on_left) {
+				right_poly = left_poly;
+				left_poly = poly;
+			} else {
+				right_poly = poly;
+			}
+		}
+		left_pending = right_pending = SVGTINY_TESS_NONE;
+		svgtiny_tess_poly_add(t, left_poly, w, SVGTINY_TESS_RIGHT);
+		svgtiny_tess_poly_add(t, right_poly, w, SVGTINY_TESS_LEFT);
+	}
+
+	if (starting == 0) {
+		if (ending != 0) {
+			/* the regions either side merge, and their polygons
+			 * wait for the next vertex in the region */
+			if (left_poly == SVGTINY_TESS_NONE) {
+				left_poly = right_poly;
+				right_poly = SVGTINY_TESS_NONE;
+			}
+			l->poly = left_poly;
+			l->pending = right_poly;
+		}
+		return;
+	}
+
+	/* the regions between the edges that start here are new */
+	l->poly = left_poly;
+	l->pending = left_pending;
+	winding = l->right_winding;
+	for (i = 0; i != starting; i++) {
+		struct svgtiny_tess_edge *e = &t->edge[t->starting[i]];
+		winding += e->winding;
+		e->right_winding = winding;
+		e->pending = SVGTINY_TESS_NONE;
+		if (i + 1 == starting)
+			poly = right_poly;
+		else
+			poly = winding != 0 ? svgtiny_tess_poly_create(t, w) :
+					SVGTINY_TESS_NONE;
+		if (i + 1 == starting && (winding != 0) !=
+				(poly != SVGTINY_TESS_NONE)) {
+			/* only if rounding has upset the order of edges */
+			if (poly != SVGTINY_TESS_NONE)
+				svgtiny_tess_poly_close(t, poly, w);
+			poly = winding != 0 ? svgtiny_tess_poly_create(t, w) :
+					SVGTINY_TESS_NONE;
+		}
+		e = &t->edge[t->starting[i]];
+		e->poly = poly;
+	}
+}
+
+
+/**
+ * Split edge e at vertex v, which is below its top: it now ends at v, and a
+ * new edge goes on from v.
+ */
+
+void svgtiny_tess_split(struct svgtiny_tess *t, unsigned int e,
+		unsigned int v)
+{
+	unsigned int bottom = t->edge[e].bottom;
+
+	if (svgtiny_tess_same(t, bottom, v) || svgtiny_tess_same(t,
+			t->edge[e].top, v))
+		return;
+	if (svgtiny_tess_add_edge(t, v, bottom, t->edge[e].winding) ==
+			SVGTINY_TESS_NONE)
+		return;
+	t->edge[e].bottom = v;
+}
+
+
+/**
+ * Split adjacent edges a and b, a to the left, where they cross below the
+ * vertex w being swept, if they do.
+ */
+
+void svgtiny_tess_cross(struct svgtiny_tess *t, unsigned int w,
+		unsigned int a, unsigned int b)
+{
+	const struct svgtiny_tess_edge *ea, *eb;
+	const struct svgtiny_tess_vertex *ta, *ba, *tb, *bb;
+	unsigned int first, v;
+	double dax, day, dbx, dby, denominator, s;
+	float x, y;
+
+	if (a == SVGTINY_TESS_HEAD || b == SVGTINY_TESS_NONE ||
+			t->code != svgtiny_OK)
+		return;
+	ea = &t->edge[a];
+	eb = &t->edge[b];
+	if (svgtiny_tess_same(t, ea->bottom, eb->bottom))
+		return;
+
+	/* they cross if their order is the other way round where the first
+	 * of them ends */
+	if (svgtiny_tess_before(t, ea->bottom, eb->bottom)) {
+		first = ea->bottom;
+		if (0 <= svgtiny_tess_side(t, b, first))
+			return;
+	} else {
+		first = eb->bottom;
+		if (svgtiny_tess_side(t, a, first) <= 0)
+			return;
+	}
+
+	ta = &t->vertex[ea->top];
+	ba = &t->vertex[ea->bottom];
+	tb = &t->vertex[eb->top];
+	bb = &t->vertex[eb->bottom];
+	dax = (double) ba->x - ta->x;
+	day = (double) ba->y - ta->y;
+	dbx = (double) bb->x - tb->x;
+	dby = (double) bb->y - tb->y;
+	denominator = dax * dby - day * dbx;
+	if (denominator == 0)
+		return;
+	s = (((double) tb->x - ta->x) * dby -
+			((double) tb->y - ta->y) * dbx) / denominator;
+	x = ta->x + s * dax;
+	y = ta->y + s * day;
+
+	/* rounding may put the crossing outside the span where the edges
+	 * are known to cross: at or before the vertex just swept, when the
+	 * edges are near level and the crossing is within a rounding below
+	 * it, or past the end of the first edge, which is then close to the
+	 * other */
+	if (y < t->vertex[w].y)
+		y = t->vertex[w].y;
+	if (y == t->vertex[w].y && x <= t->vertex[w].x)
+		y = nextafterf(y, INFINITY);
+	v = svgtiny_tess_add_vertex(t, x, y);
+	if (v == SVGTINY_TESS_NONE)
+		return;
+	if (!svgtiny_tess_before(t, v, first)) {
+		t->vertex_count--;
+		v = first;
+	} else {
+		svgtiny_tess_push(t, v);
+	}
+	/* ea and eb may move as edges are added */
+	svgtiny_tess_split(t, a, v);
+	svgtiny_tess_split(t, b, v);
+}
+
+
+/**
+ * The edge after e in the skip list at a level, or SVGTINY_TESS_NONE.
+ */
+
+unsigned int svgtiny_tess_next(const struct svgtiny_tess *t,
+		unsigned int e, unsigned int level)
+{
+	if (t->edge[e].level <= level)
+		return SVGTINY_TESS_NONE;
+	return t->link[2 * (t->edge[e].link + level)];
+}
+
+
+/**
+ * Insert edge e into the skip list after the edges update[level], which are
+ * then updated to e at the levels it takes part in.
+ */
+
+void svgtiny_tess_insert(struct svgtiny_tess *t, unsigned int e,
+		unsigned int *update)
+{
+	unsigned int level = 1, k;
+	unsigned int *link;
+
+	/* each further level with probability 1/4 */
+	t->random ^= t->random << 13;
+	t->random ^= t->random >> 17;
+	t->random ^= t->random << 5;
+	while (level != SVGTINY_TESS_LEVELS &&
+			((t->random >> (2 * level)) & 3) == 0)
+		level++;
+
+	link = svgtiny_tess_grow(t, t->link, &t->link_capacity,
+			t->link_count + 2 * level, sizeof link[0]);
+	if (!link)
+		return;
+	t->link = link;
+	t->edge[e].level = level;
+	t->edge[e].link = t->link_count / 2;
+	t->link_count += 2 * level;
+
+	for (k = 0; k != level; k++) {
+		unsigned int previous = update[k];
+		unsigned int *p = &link[2 * (t->edge[previous].link + k)];
+		unsigned int next = p[0];
+		link[2 * (t->edge[e].link + k)] = next;
+		link[2 * (t->edge[e].link + k) + 1] = previous;
+		if (next != SVGTINY_TESS_NONE)
+			link[2 * (t->edge[next].link + k) + 1] = e;
+		p[0] = e;
+		update[k] = e;
+	}
+}
+
+
+/**
+ * Remove edge e from the skip list.
+ */
+
+void svgtiny_tess_remove(struct svgtiny_tess *t, unsigned int e)
+{
+	unsigned int *link = t->link;
+	unsigned int k;
+
+	for (k = 0; k != t->edge[e].level; k++) {
+		unsigned int next = link[2 * (t->edge[e].link + k)];
+		unsigned int previous = link[2 * (t->edge[e].link + k) + 1];
+		link[2 * (t->edge[previous].link + k)] = next;
+		if (next != SVGTINY_TESS_NONE)
+			link[2 * (t->edge[next].link + k) + 1] = previous;
+	}
+	t->edge[e].level = 0;
+}
+
+
+/**
+ * Start a monotone polygon at its top vertex.
+ */
+
+unsigned int svgtiny_tess_poly_create(struct svgtiny_tess *t,
+		unsigned int top)
+{
+	struct svgtiny_tess_poly *poly;
+
+	poly = svgtiny_tess_grow(t, t->poly, &t->poly_capacity,
+			t->poly_count + 1, sizeof poly[0]);
+	if (!poly)
+		return SVGTINY_TESS_NONE;
+	t->poly = poly;
+	poly += t->poly_count;
+	poly->stack = svgtiny_tess_stack_push(t, SVGTINY_TESS_NONE, top,
+			SVGTINY_TESS_TOP);
+	poly->last = top;
+	poly->last_side = SVGTINY_TESS_TOP;
+	if (poly->stack == SVGTINY_TESS_NONE)
+		return SVGTINY_TESS_NONE;
+	return t->poly_count++;
+}
+
+
+/**
+ * Add the next vertex of a monotone polygon, on its left or right chain,
+ * with the triangles it completes.
+ */
+
+void svgtiny_tess_poly_add(struct svgtiny_tess *t, unsigned int poly,
+		unsigned int v, int side)
+{
+	struct svgtiny_tess_poly *p = &t->poly[poly];
+	unsigned int top = p->stack;
+	struct svgtiny_tess_stack *s = &t->stack[top];
+
+	if (v == p->last)
+		return;
+	if (s->below == SVGTINY_TESS_NONE) {
+		/* only the top vertex */
+	} else if (s->side != side) {
+		/* across to the other chain: every vertex on the stack
+		 * can be seen from v, and only the last one stays */
+		unsigned int u = s->vertex;
+		int u_side = s->side;
+		unsigned int node = top;
+		while (t->stack[node].below != SVGTINY_TESS_NONE) {
+			unsigned int below = t->stack[node].below;
+			svgtiny_tess_triangle(t, v, t->stack[node].vertex,
+					t->stack[below].vertex);
+			node = svgtiny_tess_stack_pop(t, node);
+		}
+		svgtiny_tess_stack_pop(t, node);
+		top = svgtiny_tess_stack_push(t, SVGTINY_TESS_NONE, u, u_side);
+		if (top == SVGTINY_TESS_NONE)
+			return;
+	} else {
+		/* along the same chain: cut off the vertices that are
+		 * convex as seen from v */
+		unsigned int u = t->stack[top].vertex;
+		int u_side = t->stack[top].side;
+		top = svgtiny_tess_stack_pop(t, top);
+		while (top != SVGTINY_TESS_NONE) {
+			double o = svgtiny_tess_orient(t, t->stack[top].vertex,
+					v, u);
+			if (side == SVGTINY_TESS_LEFT ? o <= 0 : 0 <= o)
+				break;
+			svgtiny_tess_triangle(t, v, u, t->stack[top].vertex);
+			u = t->stack[top].vertex;
+			u_side = t->stack[top].side;
+			top = svgtiny_tess_stack_pop(t, top);
+		}
+		top = svgtiny_tess_stack_push(t, top, u, u_side);
+		if (top == SVGTINY_TESS_NONE)
+			return;
+	}
+	top = svgtiny_tess_stack_push(t, top, v, side);
+	p = &t->poly[poly];
+	p->stack = top;
+	p->last = v;
+	p->last_side = side;
+}
+
+
+/**
+ * Finish a monotone polygon at its bottom vertex.
+ */
+
+void svgtiny_tess_poly_close(struct svgtiny_tess *t,
+		unsigned int poly, unsigned int v)
+{
+	unsigned int node = t->poly[poly].stack;
+
+	while (node != SVGTINY_TESS_NONE) {
+		unsigned int below = t->stack[node].below;
+		if (below != SVGTINY_TESS_NONE)
+			svgtiny_tess_triangle(t, v, t->stack[node].vertex,
+					t->stack[below].vertex);
+		node = svgtiny_tess_stack_pop(t, node);
+	}
+	t->poly[poly].stack = SVGTINY_TESS_NONE;
+}
+
+
+/**
+ * Push vertex v on a chain side onto the stack whose top is below. Returns
+ * the new top.
+ */
+
+unsigned int svgtiny_tess_stack_push(struct svgtiny_tess *t,
+		unsigned int below, unsigned int v, int side)
+{
+	unsigned int node = t->stack_free;
+
+	if (node != SVGTINY_TESS_NONE) {
+		t->stack_free = t->stack[node].below;
+	} else {
+		struct svgtiny_tess_stack *stack = svgtiny_tess_grow(t,
+				t->stack, &t->stack_capacity,
+				t->stack_count + 1, sizeof stack[0]);
+		if (!stack)
+			return SVGTINY_TESS_NONE;
+		t->stack = stack;
+		node = t->stack_count++;
+	}
+	t->stack[node].vertex = v;
+	t->stack[node].side = side;
+	t->stack[node].below = below;
+	return node;
+}
+
+
+/**
+ * Pop the top node of a stack. Returns the node below it.
+ */
+
+unsigned int svgtiny_tess_stack_pop(struct svgtiny_tess *t, unsigned int node)
+{
+	unsigned int below = t->stack[node].below;
+
+	t->stack[node].below = t->stack_free;
+	t->stack_free = node;
+	return below;
+}
+
+
+/**
+ * Output a triangle, wound the same way as every other, unless it has no
+ * area.
+ */
+
+void svgtiny_tess_triangle(struct svgtiny_tess *t,
+		unsigned int a, unsigned int b, unsigned int c)
+{
+	struct svgtiny_triangles *out = t->out;
+	double o = svgtiny_tess_orient(t, a, b, c);
+	uint32_t *index;
+
+	if (o == 0 || t->code != svgtiny_OK)
+		return;
+	if (o < 0) {
+		unsigned int swap = b;
+		b = c;
+		c = swap;
+	}
+	index = svgtiny_tess_grow(t, out->index, &t->index_size,
+			out->triangle_count * 3 + 3, sizeof index[0]);
+	if (!index)
+		return;
+	out->index = index;
+	a = svgtiny_tess_output(t, a);
+	b = svgtiny_tess_output(t, b);
+	c = svgtiny_tess_output(t, c);
+	if (t->code != svgtiny_OK)
+		return;
+	index += out->triangle_count * 3;
+	index[0] = a;
+	index[1] = b;
+	index[2] = c;
+	out->triangle_count++;
+}
+
+
+/**
+ * The index of a vertex in the output, adding it there if needed.
+ */
+
+unsigned int svgtiny_tess_output(struct svgtiny_tess *t, unsigned int v)
+{
+	struct svgtiny_triangles *out = t->out;
+	float *vertex;
+
+	if (t->vertex[v].output != SVGTINY_TESS_NONE)
+		return t->vertex[v].output;
+	vertex = svgtiny_tess_grow(t, out->vertex, &t->vertex_size,
+			2 * out->vertex_count + 2, sizeof vertex[0]);
+	if (!vertex)
+		return 0;
+	out->vertex = vertex;
+	vertex[2 * out->vertex_count] = t->vertex[v].x;
+	vertex[2 * out->vertex_count + 1] = t->vertex[v].y;
+	t->vertex[v].output = out->vertex_count;
+	return out->vertex_count++;
+}
@@ -10,49 +10,121 @@
 #include "xml2dom.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <libxml/tree.h>
 #include <libxml/parser.h>
+#include <libxml/xmlmemory.h>
 #include <libxml/xmlstring.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 
-static int sDidInitXML2Lib = 0;
+#include "svgtiny.h"
+
+static pthread_once_t sInitXML2Lib = PTHREAD_ONCE_INIT;
 
 enum  {
   MAGIC_DOCUMENT_NODE =  10000
 };
 
-static void lower(char *s) {
-  for (; *s; ++s) {
-    if (isupper(*s)) {
-      *s = tolower(*s);
+// Allocator for the objects made on this thread, or NULL for the C library's.
+static __thread const svgtiny_allocator *sAllocator = NULL;
+
+// Allocator given to libxml2 by svgtiny_set_xml_allocator().
+static svgtiny_allocator sXMLAllocator;
+
+const svgtiny_allocator *dom_set_thread_allocator(const svgtiny_allocator *allocator) {
+  const svgtiny_allocator *previous = sAllocator;
+  sAllocator = allocator;
+  return previous;
+}
+
+static void *dom_alloc(size_t size) {
+  return sAllocator ? sAllocator->alloc(size, sAllocator->ctx) : malloc(size);
+}
+
+static void *dom_calloc(size_t size) {
+  void *result = dom_alloc(size);
+  if (result) {
+    memset(result, 0, size);
+  }
+  return result;
+}
+
+static void *dom_realloc(void *ptr, size_t size) {
+  return sAllocator ? sAllocator->realloc(ptr, size, sAllocator->ctx) : realloc(ptr, size);
+}
+
+static void dom_free(void *ptr) {
+  if (sAllocator) {
+    if (ptr) {
+      sAllocator->free(ptr, sAllocator->ctx);
     }
+  } else {
+    free(ptr);
   }
 }
 
 static char *my_strdup(const uint8_t *data, size_t len) {
-  char *result = (char *)malloc(len+1);
-  memcpy(result, data, len);
-  result[len] = '\0';
+  char *result = (char *)dom_alloc(len+1);
+  if (result) {
+    memcpy(result, data, len);
+    result[len] = '\0';
+  }
+  return result;
+}
+
+static void *xml_malloc(size_t size) {
+  return sXMLAllocator.alloc(size, sXMLAllocator.ctx);
+}
+
+static void *xml_realloc(void *ptr, size_t size) {
+  return sXMLAllocator.realloc(ptr, size, sXMLAllocator.ctx);
+}
+
+static void xml_free(void *ptr) {
+  if (ptr) {
+    sXMLAllocator.free(ptr, sXMLAllocator.ctx);
+  }
+}
+
+static char *xml_strdup(const char *s) {
+  size_t len = strlen(s);
+  char *result = (char *)xml_malloc(len+1);
+  if (result) {
+    memcpy(result, s, len+1);
+  }
   return result;
 }
 
+svgtiny_code svgtiny_set_xml_allocator(const svgtiny_allocator *allocator) {
+  sXMLAllocator = *allocator;
+  if (0 != xmlMemSetup(xml_free, xml_malloc, xml_realloc, xml_strdup)) {
+    return svgtiny_LIBDOM_ERROR;
+  }
+  return svgtiny_OK;
+}
+
 
 dom_xml_parser *dom_xml_parser_create(void *dontCare1, void *dontCare2, MesgFuncPtr mesgFunc, void *dontCare3, dom_document **outDocument) {
-  if (!sDidInitXML2Lib) {
-    xmlInitParser();
-    sDidInitXML2Lib = 1;
+  pthread_once(&sInitXML2Lib, xmlInitParser);
+  dom_document *docResult = (dom_document *)dom_calloc(sizeof(dom_document));
+  dom_xml_parser *result = (dom_xml_parser *)dom_calloc(sizeof(dom_xml_parser));
+  if (NULL == docResult || NULL == result) {
+    dom_free(docResult);
+    dom_free(result);
+    *outDocument = NULL;
+    return NULL;
   }
-  dom_document *docResult = (dom_document *)calloc(sizeof(dom_document), 1);
+  // Until a document is parsed into it, this is a plain node the caller may unref.
+  docResult->ref = 1;
   *outDocument = docResult;
-  dom_xml_parser *result = (dom_xml_parser *)calloc(sizeof(dom_xml_parser), 1);
   result->doc = docResult;
   return result;
 }
 
 dom_xml_error dom_xml_parser_parse_chunk(dom_xml_parser *parser, const uint8_t *data, size_t len) {
   assert(parser);
-  xmlDoc *doc = xmlReadMemory((const char *)data, (int)len, NULL, NULL, XML_PARSE_NOCDATA | XML_PARSE_NOBLANKS);
+  xmlDoc *doc = xmlReadMemory((const char *)data, (int)len, NULL, NULL, XML_PARSE_NOCDATA | XML_PARSE_NOBLANKS | XML_PARSE_HUGE);
   if (doc) {
     parser->doc->node = (xmlNode *)doc;
     parser->doc->ref = MAGIC_DOCUMENT_NODE;
@@ -67,29 +139,40 @@ dom_xml_error dom_xml_parser_completed(dom_xml_parser *parser) {
 
 dom_xml_error dom_xml_parser_destroy(dom_xml_parser *parser) {
   // we intentionally don't free the document here.
-  free(parser);
+  dom_free(parser);
   return DOM_XML_OK;
 }
 
 dom_exception dom_document_get_document_element(dom_document *document, dom_element **outNode) {
-  dom_element *element = (dom_element *)calloc(sizeof(dom_element), 1);
+  dom_element *element = (dom_element *)dom_calloc(sizeof(dom_element));
+  if (NULL == element) {
+    *outNode = NULL;
+    return DOM_MEM_ERR;
+  }
   element->node = xmlDocGetRootElement((xmlDoc *)(document->node));
   element->ref = 1;
   *outNode = element;
   return DOM_NO_ERR;
 }
 
+// Walks the tree in document order using the parent links, so neither deep
+// nesting nor long runs of siblings consume C stack.
 static xmlElement * getElementById(xmlElement *element, const xmlChar *idValue) {
-  xmlAttrPtr attrPtr = xmlHasProp((xmlNode *)element, (const xmlChar *)"id");
-  if (attrPtr && attrPtr->children && attrPtr->children->content && 0 == strcasecmp((const char *)attrPtr->children->content, (const char *)idValue)) {
-    return element;
-  }
-  xmlElement *result;
-  if (element->next && NULL != (result = getElementById((xmlElement *)element->next, idValue))) {
-    return result;
-  }
-  if (element->children && NULL != (result = getElementById((xmlElement *)element->children, idValue))) {
-    return result;
+  xmlNode *root = (xmlNode *)element;
+  xmlNode *node = root;
+  while (node) {
+    xmlAttrPtr attrPtr = xmlHasProp(node, (const xmlChar *)"id");
+    if (attrPtr && attrPtr->children && attrPtr->children->content && 0 == strcasecmp((const char *)attrPtr->children->content, (const char *)idValue)) {
+      return (xmlElement *)node;
+    }
+    if (node->children) {
+      node = node->children;
+    } else {
+      while (node != root && NULL == node->next) {
+        node = node->parent;
+      }
+      node = (node == root) ? NULL : node->next;
+    }
   }
   return NULL;
 }
@@ -103,7 +186,11 @@ dom_exception dom_document_get_element_by_id(dom_node *node, dom_string *string,
   }
   xmlElement *resultXML = getElementById((xmlElement *)node->node, (const xmlChar *)string->s);
   if (resultXML) {
-    dom_element *result = (dom_element *)calloc(sizeof(dom_element), 1);
+    dom_element *result = (dom_element *)dom_calloc(sizeof(dom_element));
+    if (NULL == result) {
+      *outNode = NULL;
+      return DOM_MEM_ERR;
+    }
     result->node = (xmlNode *)resultXML;
     result->ref = 1;
     *outNode = result;
@@ -133,29 +220,34 @@ dom_exception dom_element_get_elements_by_tag_name(dom_element *element, dom_str
   int nodeCount = 0;
   for (xmlElement *candidate = (xmlElement *)element->node->children;candidate;candidate = (xmlElement *)candidate->next) {
     if (0 == strcmp((const char *)candidate->name, string->s)) {
-      if (NULL == nodeList) {
-        nodeList = (dom_element **)malloc(nodeCount * sizeof(dom_element *));
-      } else {
-        dom_element **t = realloc(nodeList, (1+nodeCount) * sizeof(dom_element *));
-        if (t) {
-          nodeList = t;
-        } else {
-          for (int i = 0; i < nodeCount; ++i) {
-            dom_node_unref(nodeList[i]);
-          }
-          free(nodeList);
-          *outNodeList = result;
-          return DOM_MEM_ERR;
+      dom_element **t = dom_realloc(nodeList, (1+nodeCount) * sizeof(dom_element *));
+      dom_element *elem = t ? (dom_element *)dom_calloc(sizeof(dom_element)) : NULL;
+      if (t) {
+        nodeList = t;
+      }
+      if (NULL == elem) {
+        for (int i = 0; i < nodeCount; ++i) {
+          dom_node_unref(nodeList[i]);
         }
+        dom_free(nodeList);
+        *outNodeList = NULL;
+        return DOM_MEM_ERR;
       }
-      dom_element *elem = (dom_element *)calloc(sizeof(dom_element), 1);
       elem->node = (xmlNode *)candidate;
       elem->ref = 1;
       nodeList[nodeCount++] = elem;
     }
   }
   if (nodeCount) {
-    result = calloc(sizeof(dom_nodelist), 1);
+    result = dom_calloc(sizeof(dom_nodelist));
+    if (NULL == result) {
+      for (int i = 0; i < nodeCount; ++i) {
+        dom_node_unref(nodeList[i]);
+      }
+      dom_free(nodeList);
+      *outNodeList = NULL;
+      return DOM_MEM_ERR;
+    }
     result->nodes = nodeList;
     result->count = nodeCount;
     result->ref = 1;
@@ -168,10 +260,12 @@ dom_exception dom_node_get_node_name(dom_node *node, dom_string **outString) {
   xmlNode *n = node->node;
   dom_exception errCode = DOM_NO_ERR;
   if (n->ns && n->ns->prefix) {
-    char *qname = NULL;
-    if (-1 != asprintf(&qname, "%s:%s", n->ns->prefix, n->name)) {
-      errCode = dom_string_create_interned((const uint8_t *)qname, strlen(qname), outString);
-      free(qname);
+    size_t len = strlen((const char *)n->ns->prefix) + 1 + strlen((const char *)n->name);
+    char *qname = (char *)dom_alloc(len+1);
+    if (qname) {
+      snprintf(qname, len+1, "%s:%s", n->ns->prefix, n->name);
+      errCode = dom_string_create_interned((const uint8_t *)qname, len, outString);
+      dom_free(qname);
     } else {
       errCode = DOM_MEM_ERR;
     }
@@ -185,11 +279,11 @@ void dom_node_unref(dom_node *node) {
   assert(node);
   if (MAGIC_DOCUMENT_NODE == node->ref) {
     xmlFreeDoc((xmlDoc *)node->node);
-    free(node);
+    dom_free(node);
   } else {
     node->ref--;
     if (0 == node->ref) {
-      free(node);
+      dom_free(node);
     }
   }
 }
@@ -215,9 +309,9 @@ void dom_nodelist_unref(dom_nodelist *nodeList) {
       dom_node_unref(nodeList->nodes[i]);
     }
     if (0 < count) {
-     free(nodeList->nodes);
+     dom_free(nodeList->nodes);
     }
-    free(nodeList);
+    dom_free(nodeList);
   }
 }
 
@@ -225,7 +319,11 @@ dom_exception dom_node_get_first_child(dom_element *element, dom_element **outCh
   dom_element *newElement = NULL;
   xmlElement *child = (xmlElement *)element->node->children;
   if (child) {
-    newElement = (dom_element *)calloc(sizeof(dom_element), 1);
+    newElement = (dom_element *)dom_calloc(sizeof(dom_element));
+    if (NULL == newElement) {
+      *outChild = NULL;
+      return DOM_MEM_ERR;
+    }
     newElement->node = (xmlNode *)child;
     newElement->ref = 1;
   }
@@ -258,7 +356,11 @@ dom_exception dom_node_get_next_sibling(dom_element *element, dom_element **outC
   dom_element *nextElement = NULL;
   xmlElement *child = (xmlElement *)element->node->next;
   if (child) {
-    nextElement = (dom_element *)calloc(sizeof(dom_element), 1);
+    nextElement = (dom_element *)dom_calloc(sizeof(dom_element));
+    if (NULL == nextElement) {
+      *outChild = NULL;
+      return DOM_MEM_ERR;
+    }
     nextElement->node = (xmlNode *)child;
     nextElement->ref = 1;
   }
@@ -267,7 +369,12 @@ dom_exception dom_node_get_next_sibling(dom_element *element, dom_element **outC
 }
 
 dom_exception dom_text_get_whole_text(dom_element *element, dom_string **outString) {
-  return DOM_NO_ERR;
+  const char *content = (const char *)element->node->content;
+  if (NULL == content) {
+    *outString = NULL;
+    return DOM_NO_ERR;
+  }
+  return dom_string_create_interned((const uint8_t *)content, strlen(content), outString);
 }
 
 lwc_error lwc_intern_string(const char *data, size_t len, lwc_string **outString) {
@@ -287,8 +394,14 @@ uint32_t dom_string_byte_length(dom_string *str) {
 }
 
 dom_exception dom_string_create_interned(const uint8_t *data, size_t len, dom_string **outString) {
-  dom_string *newStr = (dom_string *)calloc(sizeof(dom_string), 1);
-  newStr->s = my_strdup(data, len);
+  dom_string *newStr = (dom_string *)dom_calloc(sizeof(dom_string));
+  char *s = newStr ? my_strdup(data, len) : NULL;
+  if (NULL == s) {
+    dom_free(newStr);
+    *outString = NULL;
+    return DOM_MEM_ERR;
+  }
+  newStr->s = s;
   newStr->ref = 1;
   *outString = newStr;
   return DOM_NO_ERR;
@@ -303,27 +416,22 @@ int dom_string_isequal(dom_string *a, dom_string *b) {
 }
 
 dom_string *dom_string_ref(dom_string *str) {
-  str->ref++;
+  if (DOM_STRING_STATIC_REF != str->ref) {
+    str->ref++;
+  }
   return str;
 }
 
 void dom_string_unref(dom_string *str) {
+  if (DOM_STRING_STATIC_REF == str->ref) {
+    return;
+  }
   str->ref--;
   if (0 == str->ref) {
-    free(str->s);
-    free(str);
+    dom_free(str->s);
+    dom_free(str);
   }
 }
 
-char *strduplower2(const uint8_t *data, size_t len) {
-  char *lowerStr = my_strdup(data, len);
-  lower(lowerStr);
-  return lowerStr;
-}
-
-char *strduplower(const char *s) {
-  return strduplower2((const uint8_t *)s, strlen(s));
-}
-
 
 
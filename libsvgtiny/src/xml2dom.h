@@ -64,10 +64,18 @@ typedef struct dom_nodelist {
 } dom_nodelist;
 
 typedef struct dom_string {
-  char *s;  // alocated on the heap.
+  char *s;  // alocated on the heap, unless ref is DOM_STRING_STATIC_REF.
   int ref;
 } dom_string;
 
+// A dom_string with this ref count is a compile-time constant, shared by all
+// threads. dom_string_ref() and dom_string_unref() leave it untouched.
+enum {
+  DOM_STRING_STATIC_REF = -1
+};
+
+#define DOM_STRING_STATIC_INIT(str) { (char *)(str), DOM_STRING_STATIC_REF }
+
 typedef dom_string lwc_string;
 
 typedef void (*MesgFuncPtr)(uint32_t severity, void *ctx, const char *msg, ...);
@@ -100,7 +108,10 @@ int dom_string_isequal(dom_string *a, dom_string *b);
 dom_string *dom_string_ref(dom_string *str);
 void dom_string_unref(dom_string *str);
 
-char *strduplower2(const uint8_t *data, size_t len);
-char *strduplower(const char *s);
+// Objects created on the calling thread get their memory from allocator, NULL
+// for the C library's, until the next call. Free them before switching.
+// Returns the previous allocator.
+struct svgtiny_allocator;
+const struct svgtiny_allocator *dom_set_thread_allocator(const struct svgtiny_allocator *allocator);
 
 #endif  // SVGTINY_XML2DOM_H
@@ -0,0 +1,139 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Parse a file through a svgtiny_cache, and check that lookups find the
+ * same entry, that the entry matches a plain parse, and that threads
+ * sharing the cache all see the same diagram.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+#define THREADS 8
+#define LOOKUPS 50
+
+struct worker {
+	pthread_t thread;
+	struct svgtiny_cache *cache;
+	const char *buffer;
+	size_t size;
+	unsigned int shape_count;
+	unsigned int mismatches;
+};
+
+
+static void *lookup(void *data)
+{
+	struct worker *w = data;
+	struct svgtiny_cache_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i != LOOKUPS; i++) {
+		svgtiny_cache_parse(w->cache, w->buffer, w->size,
+				1000, 1000 + i % 3, &entry);
+		if (!entry ||
+				svgtiny_cache_diagram(entry)->shape_count !=
+				w->shape_count)
+			w->mismatches++;
+		svgtiny_cache_release(entry);
+	}
+	return NULL;
+}
+
+
+static int same_shapes(const struct svgtiny_diagram *a,
+		const struct svgtiny_diagram *b)
+{
+	unsigned int i;
+
+	if (a->shape_count != b->shape_count)
+		return 0;
+	for (i = 0; i != a->shape_count; i++) {
+		const struct svgtiny_shape *s = &a->shape[i], *t = &b->shape[i];
+		if (s->fill != t->fill || s->stroke != t->stroke ||
+				s->path_length != t->path_length ||
+				(s->path_length && memcmp(s->path, t->path,
+				s->path_length * sizeof s->path[0])))
+			return 0;
+	}
+	return 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct worker worker[THREADS];
+	struct svgtiny_cache *cache;
+	struct svgtiny_cache_entry *first, *second, *other;
+	struct svgtiny_diagram *diagram;
+	svgtiny_code code;
+	unsigned int i, mismatches = 0;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	code = svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+
+	cache = svgtiny_cache_create(64 * 1024 * 1024);
+	if (!cache)
+		return 1;
+	code = svgtiny_cache_parse(cache, buffer, size, 1000, 1000, &first);
+	printf("parse: code %i, %u shapes\n", code,
+			svgtiny_cache_diagram(first)->shape_count);
+	printf("matches svgtiny_parse: %s\n",
+			same_shapes(svgtiny_cache_diagram(first), diagram) ?
+			"yes" : "no");
+
+	svgtiny_cache_parse(cache, buffer, size, 1000, 1000, &second);
+	printf("same source: %s\n",
+			first == second ? "same entry" : "new entry");
+	svgtiny_cache_parse(cache, buffer, size, 500, 1000, &other);
+	printf("other viewport: %s\n",
+			first == other ? "same entry" : "new entry");
+	svgtiny_cache_release(other);
+	svgtiny_cache_release(second);
+
+	for (i = 0; i != THREADS; i++) {
+		worker[i].cache = cache;
+		worker[i].buffer = buffer;
+		worker[i].size = size;
+		worker[i].shape_count = diagram->shape_count;
+		worker[i].mismatches = 0;
+		pthread_create(&worker[i].thread, NULL, lookup, &worker[i]);
+	}
+	for (i = 0; i != THREADS; i++) {
+		pthread_join(worker[i].thread, NULL);
+		mismatches += worker[i].mismatches;
+	}
+	printf("threads: %u lookups, %u mismatches\n",
+			THREADS * LOOKUPS, mismatches);
+	svgtiny_cache_free(cache);
+
+	/* entries stay valid after the cache is freed, until released */
+	printf("after svgtiny_cache_free: %u shapes\n",
+			svgtiny_cache_diagram(first)->shape_count);
+	svgtiny_cache_release(first);
+
+	svgtiny_free(diagram);
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Parse a file with a range of svgtiny_diagram.min_size values, dropping
+ * and then merging small shapes, and print how many shapes are left. No
+ * unstroked shape smaller than min_size may be kept, except the rectangles
+ * that svgtiny_MERGE_SMALL_SHAPES makes, which are listed. Gradients are
+ * kept whole, as an element is measured before its fill is split, and a
+ * stroked shape is not checked, as its stroke width was rounded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+
+/**
+ * Whether a path is a rectangle as made by merging: a move, three lines
+ * and a close.
+ */
+
+static int rectangle(const struct svgtiny_shape *shape)
+{
+	return shape->path_length == 13 &&
+			shape->path[0] == svgtiny_PATH_MOVE &&
+			shape->path[3] == svgtiny_PATH_LINE &&
+			shape->path[6] == svgtiny_PATH_LINE &&
+			shape->path[9] == svgtiny_PATH_LINE &&
+			shape->path[12] == svgtiny_PATH_CLOSE;
+}
+
+
+/**
+ * Whether a shape is an unstroked path smaller than min_size both across
+ * and down.
+ */
+
+static int smaller(const struct svgtiny_shape *shape, float min_size)
+{
+	return shape->path && shape->stroke == svgtiny_TRANSPARENT &&
+			shape->bounds.x1 - shape->bounds.x0 < min_size &&
+			shape->bounds.y1 - shape->bounds.y0 < min_size;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const float min_size[] = { 0, 2, 8, 50 };
+	struct svgtiny_diagram *diagram;
+	unsigned int i, k, merge, small, merged;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	for (k = 0; k != sizeof min_size / sizeof min_size[0]; k++) {
+		for (merge = 0; merge != 2; merge++) {
+			diagram = svgtiny_create();
+			if (!diagram)
+				return 1;
+			diagram->min_size = min_size[k];
+			diagram->options = svgtiny_KEEP_GRADIENTS;
+			if (merge)
+				diagram->options |= svgtiny_MERGE_SMALL_SHAPES;
+			svgtiny_parse(diagram, buffer, size, argv[1],
+					1000, 1000);
+
+			small = merged = 0;
+			for (i = 0; i != diagram->shape_count; i++) {
+				const struct svgtiny_shape *s =
+						&diagram->shape[i];
+				if (!smaller(s, min_size[k]))
+					continue;
+				if (merge && rectangle(s))
+					merged++;
+				else
+					small++;
+			}
+			printf("min_size %g%s: %u shapes", min_size[k],
+					merge ? ", merged" : "",
+					diagram->shape_count);
+			if (merged)
+				printf(", %u small rectangles", merged);
+			if (small)
+				printf(", %u too small", small);
+			printf("\n");
+
+			for (i = 0; merge && i != diagram->shape_count; i++) {
+				const struct svgtiny_shape *s =
+						&diagram->shape[i];
+				if (!smaller(s, min_size[k]) || !rectangle(s))
+					continue;
+				printf("  %u: fill #%.8x "
+						"[%.1f %.1f %.1f %.1f]\n",
+						i, s->fill,
+						s->bounds.x0, s->bounds.y0,
+						s->bounds.x1, s->bounds.y1);
+			}
+			svgtiny_free(diagram);
+		}
+	}
+
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Flatten the curves of a file with svgtiny_flatten_shape() and
+ * svgtiny_flatten_diagram(), at a coarse and a fine tolerance, and check
+ * that no curve is left, that both agree, and that every point of the
+ * flattened paths lies within the bounds of the original.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+
+/**
+ * Count the curves and points of a path, and the points outside a box
+ * grown by slack.
+ */
+
+static void scan(const float *p, unsigned int n, const float *box,
+		float slack, unsigned int *curves, unsigned int *points,
+		unsigned int *outside)
+{
+	unsigned int j = 0, k, size;
+
+	while (j < n) {
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+		case svgtiny_PATH_LINE:
+			size = 2;
+			break;
+		case svgtiny_PATH_BEZIER:
+			(*curves)++;
+			size = 6;
+			break;
+		default:
+			size = 0;
+			break;
+		}
+		for (k = 0; k != size; k += 2) {
+			(*points)++;
+			if (p[j + 1 + k] < box[0] - slack ||
+					box[2] + slack < p[j + 1 + k] ||
+					p[j + 2 + k] < box[1] - slack ||
+					box[3] + slack < p[j + 2 + k])
+				(*outside)++;
+		}
+		j += 1 + size;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const float tolerance[] = { 1, 0.05 };
+	struct svgtiny_diagram *diagram, *flat;
+	unsigned int i, k, curves, points, outside, differ;
+	size_t size, n;
+	char *buffer;
+	float *out;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+	curves = points = outside = 0;
+	for (i = 0; i != diagram->shape_count; i++)
+		if (diagram->shape[i].path)
+			scan(diagram->shape[i].path,
+					diagram->shape[i].path_length,
+					&diagram->shape[i].bounds.x0, 0,
+					&curves, &points, &outside);
+	printf("parsed: %u curves, %u points\n", curves, points);
+
+	for (k = 0; k != sizeof tolerance / sizeof tolerance[0]; k++) {
+		flat = svgtiny_create();
+		if (!flat)
+			return 1;
+		svgtiny_parse(flat, buffer, size, argv[1], 1000, 1000);
+		if (svgtiny_flatten_diagram(flat, tolerance[k]) !=
+				svgtiny_OK) {
+			fprintf(stderr, "svgtiny_flatten_diagram failed\n");
+			return 1;
+		}
+
+		curves = points = outside = differ = 0;
+		for (i = 0; i != diagram->shape_count; i++) {
+			const struct svgtiny_shape *s = &diagram->shape[i];
+			if (!s->path)
+				continue;
+			n = svgtiny_flatten_shape(s, tolerance[k], NULL, 0);
+			out = malloc(n * sizeof out[0]);
+			if (!out)
+				return 1;
+			if (svgtiny_flatten_shape(s, tolerance[k], out, n) !=
+					n || n != flat->shape[i].path_length ||
+					memcmp(out, flat->shape[i].path,
+					n * sizeof out[0]))
+				differ++;
+			free(out);
+			scan(flat->shape[i].path, flat->shape[i].path_length,
+					&s->bounds.x0, tolerance[k],
+					&curves, &points, &outside);
+		}
+		printf("tolerance %g: %u curves, %u points, %u outside, "
+				"%u differ from svgtiny_flatten_shape()\n",
+				tolerance[k], curves, points, outside, differ);
+		svgtiny_free(flat);
+	}
+
+	svgtiny_free(diagram);
+	free(buffer);
+
+	return 0;
+}
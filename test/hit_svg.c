@@ -0,0 +1,86 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Hit test a grid of points over a file, with and without an index, and
+ * print the shapes found at each point that hits anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+#define GRID 8
+#define SHOWN 8
+
+
+int main(int argc, char *argv[])
+{
+	struct svgtiny_diagram *diagram;
+	struct svgtiny_index *index;
+	unsigned int found[SHOWN], unindexed[SHOWN];
+	unsigned int i, j, k, n, m, disagree = 0;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+	free(buffer);
+
+	index = svgtiny_index_create(diagram);
+	if (!index) {
+		fprintf(stderr, "svgtiny_index_create failed\n");
+		return 1;
+	}
+
+	/* the centres of a grid of cells, exactly and with a tolerance */
+	for (k = 0; k != 2; k++) {
+		float tolerance = k ? 2 : 0;
+		printf("tolerance %g\n", tolerance);
+		for (j = 0; j != GRID; j++) {
+			for (i = 0; i != GRID; i++) {
+				float x = diagram->width * (i + 0.5f) / GRID;
+				float y = diagram->height * (j + 0.5f) / GRID;
+				n = svgtiny_hit_test(diagram, index, x, y,
+						tolerance, found, SHOWN);
+				m = svgtiny_hit_test(diagram, NULL, x, y,
+						tolerance, unindexed, SHOWN);
+				if (n != m || memcmp(found, unindexed,
+						(n < SHOWN ? n : SHOWN) *
+						sizeof found[0]))
+					disagree++;
+				if (n == 0)
+					continue;
+				printf("  %g %g: %u", x, y, n);
+				for (m = 0; m != n && m != SHOWN; m++)
+					printf(" %u", found[m]);
+				printf(n > SHOWN ? " ...\n" : "\n");
+			}
+		}
+	}
+	printf("index and no index disagree at %u points\n", disagree);
+
+	/* far outside the diagram nothing is hit */
+	printf("outside: %u\n", svgtiny_hit_test(diagram, index,
+			-1000, -1000, 0, found, SHOWN));
+
+	svgtiny_index_free(index);
+	svgtiny_free(diagram);
+
+	return 0;
+}
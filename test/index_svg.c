@@ -0,0 +1,121 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Build a svgtiny_index over a file and query a grid of rectangles,
+ * printing the shapes found and checking them against the shape bounds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+#define GRID 4
+#define SHOWN 10
+
+
+/**
+ * Whether the bounds of a shape, grown by reach, touch a rectangle.
+ */
+
+static int touches(const struct svgtiny_shape *shape, float reach,
+		float x0, float y0, float x1, float y1)
+{
+	return shape->bounds.x0 <= shape->bounds.x1 &&
+			shape->bounds.x0 - reach <= x1 &&
+			x0 <= shape->bounds.x1 + reach &&
+			shape->bounds.y0 - reach <= y1 &&
+			y0 <= shape->bounds.y1 + reach;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct svgtiny_diagram *diagram;
+	struct svgtiny_index *index;
+	unsigned int *found;
+	unsigned int i, j, k, n, missing, extra, disordered;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+	free(buffer);
+
+	index = svgtiny_index_create(diagram);
+	found = malloc((diagram->shape_count + 1) * sizeof found[0]);
+	if (!index || !found) {
+		fprintf(stderr, "svgtiny_index_create failed\n");
+		return 1;
+	}
+	printf("%u shapes\n", diagram->shape_count);
+
+	for (j = 0; j != GRID; j++) {
+		for (i = 0; i != GRID; i++) {
+			float x0 = (float) diagram->width * i / GRID;
+			float y0 = (float) diagram->height * j / GRID;
+			float x1 = (float) diagram->width * (i + 1) / GRID;
+			float y1 = (float) diagram->height * (j + 1) / GRID;
+
+			n = svgtiny_index_query(index, x0, y0, x1, y1,
+					found, diagram->shape_count);
+			printf("%g %g %g %g: %u", x0, y0, x1, y1, n);
+			for (k = 0; k != n && k != SHOWN; k++)
+				printf(" %u", found[k]);
+			printf(n > SHOWN ? " ...\n" : "\n");
+
+			/* every shape inside must be found, in order, and no
+			 * shape found may be further away than its stroke
+			 * could reach */
+			missing = extra = disordered = 0;
+			for (k = 0; k != n; k++) {
+				const struct svgtiny_shape *shape =
+						&diagram->shape[found[k]];
+				if (!touches(shape, 4 * shape->stroke_width,
+						x0, y0, x1, y1))
+					extra++;
+				if (k != 0 && found[k] <= found[k - 1])
+					disordered++;
+			}
+			for (k = 0; k != diagram->shape_count; k++) {
+				unsigned int m;
+				if (!touches(&diagram->shape[k], 0,
+						x0, y0, x1, y1))
+					continue;
+				for (m = 0; m != n && found[m] != k; m++)
+					continue;
+				if (m == n)
+					missing++;
+			}
+			if (missing || extra || disordered)
+				printf("  %u missing, %u extra, "
+						"%u out of order\n",
+						missing, extra, disordered);
+		}
+	}
+
+	/* a short buffer is filled and the full count returned */
+	n = svgtiny_index_query(index, 0, 0, diagram->width, diagram->height,
+			found, 1);
+	printf("whole diagram: %u\n", n);
+
+	free(found);
+	svgtiny_index_free(index);
+	svgtiny_free(diagram);
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Shared by the test drivers: read a whole file into memory.
+ */
+
+#ifndef LOAD_FILE_H
+#define LOAD_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+/**
+ * Load a file into a buffer allocated by malloc(), or print why not and
+ * return NULL.
+ */
+
+static char *load_file(const char *path, size_t *size)
+{
+	FILE *fd;
+	struct stat sb;
+	char *buffer;
+
+	fd = fopen(path, "rb");
+	if (!fd) {
+		perror(path);
+		return NULL;
+	}
+
+	if (stat(path, &sb)) {
+		perror(path);
+		fclose(fd);
+		return NULL;
+	}
+	*size = sb.st_size;
+
+	buffer = malloc(*size ? *size : 1);
+	if (!buffer) {
+		fprintf(stderr, "Unable to allocate %lld bytes\n",
+				(long long) *size);
+		fclose(fd);
+		return NULL;
+	}
+
+	if (fread(buffer, 1, *size, fd) != *size) {
+		perror(path);
+		free(buffer);
+		fclose(fd);
+		return NULL;
+	}
+
+	fclose(fd);
+	return buffer;
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Time svgtiny_render() and svgtiny_render_parallel() on 1, 2, 4, 8 and 16
+ * threads, drawing a file into a square image, and print the best time of
+ * each and its speed-up over one thread. Each thread count has its own pool,
+ * made before the timing. Not run by runtest.sh, as the times depend on
+ * the machine.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+
+/**
+ * The best of repeats times, in milliseconds, to draw the diagram with
+ * svgtiny_render_parallel() and pool, or with svgtiny_render() if
+ * parallel is false.
+ */
+
+static double best_time(const struct svgtiny_diagram *diagram,
+		unsigned char *pixels, unsigned int side, bool parallel,
+		struct svgtiny_render_pool *pool, unsigned int repeats)
+{
+	double best = 0;
+	unsigned int r;
+
+	for (r = 0; r != repeats; r++) {
+		struct timespec start, end;
+		double ms;
+
+		memset(pixels, 0, (size_t) side * side * 4);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (parallel)
+			svgtiny_render_parallel(diagram, pixels, side, side,
+					side * 4, pool);
+		else
+			svgtiny_render(diagram, pixels, side, side, side * 4);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = (end.tv_sec - start.tv_sec) * 1e3 +
+				(end.tv_nsec - start.tv_nsec) / 1e6;
+		if (r == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct svgtiny_diagram *diagram;
+	unsigned int side = 2000, repeats = 5;
+	unsigned char *pixels;
+	double one = 0, ms;
+	unsigned int threads;
+	size_t size;
+	char *buffer;
+
+	if (argc < 2 || 4 < argc) {
+		fprintf(stderr, "Usage: %s FILE [SIDE] [REPEATS]\n", argv[0]);
+		return 1;
+	}
+	if (3 <= argc)
+		side = atoi(argv[2]);
+	if (4 <= argc)
+		repeats = atoi(argv[3]);
+	if (side == 0 || repeats == 0)
+		return 1;
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	pixels = malloc((size_t) side * side * 4);
+	if (!diagram || !pixels)
+		return 1;
+	if (svgtiny_parse(diagram, buffer, size, argv[1], side, side) !=
+			svgtiny_OK) {
+		fprintf(stderr, "svgtiny_parse failed\n");
+		return 1;
+	}
+	printf("%s: %u shapes, %u by %u pixels, %li processors\n", argv[1],
+			diagram->shape_count, side, side,
+			sysconf(_SC_NPROCESSORS_ONLN));
+
+	printf("svgtiny_render: %.1f ms\n",
+			best_time(diagram, pixels, side, false, 0, repeats));
+	for (threads = 1; threads <= 16; threads *= 2) {
+		struct svgtiny_render_pool *pool =
+				svgtiny_render_pool_create(threads);
+		if (!pool)
+			return 1;
+		ms = best_time(diagram, pixels, side, true, pool, repeats);
+		svgtiny_render_pool_free(pool);
+		if (threads == 1)
+			one = ms;
+		printf("%2u threads: %.1f ms, %.2fx\n", threads, ms, one / ms);
+	}
+
+	free(pixels);
+	svgtiny_free(diagram);
+	free(buffer);
+
+	return 0;
+}
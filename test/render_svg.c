@@ -0,0 +1,90 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Draw a file with svgtiny_render() and with svgtiny_render_parallel() on
+ * 1 to 8 threads: with no pool for 1, and a pool of its own, used twice,
+ * for the rest. Every parallel image must be identical to svgtiny_render()'s.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+#define WIDTH 500
+#define HEIGHT 400
+
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int threads[] = { 1, 2, 3, 4, 8 };
+	struct svgtiny_diagram *diagram;
+	unsigned char *single, *parallel;
+	size_t size, i, bytes = (size_t) WIDTH * HEIGHT * 4;
+	unsigned int k, call, differ, drawn = 0;
+	bool failed = false;
+	svgtiny_code code;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	single = calloc(bytes, 1);
+	parallel = malloc(bytes);
+	if (!diagram || !single || !parallel)
+		return 1;
+	svgtiny_parse(diagram, buffer, size, argv[1], WIDTH, HEIGHT);
+	code = svgtiny_render(diagram, single, WIDTH, HEIGHT, WIDTH * 4);
+	for (i = 0; i != bytes; i += 4)
+		if (single[i] | single[i + 1] | single[i + 2] | single[i + 3])
+			drawn++;
+	printf("svgtiny_render: code %i, %u pixels drawn\n", code, drawn);
+
+	for (k = 0; k != sizeof threads / sizeof threads[0]; k++) {
+		struct svgtiny_render_pool *pool = 0;
+		if (threads[k] != 1) {
+			pool = svgtiny_render_pool_create(threads[k]);
+			if (!pool)
+				return 1;
+		}
+		/* twice, so that the pool's threads take a second job */
+		differ = 0;
+		for (call = 0; call != 2; call++) {
+			memset(parallel, 0, bytes);
+			code = svgtiny_render_parallel(diagram, parallel,
+					WIDTH, HEIGHT, WIDTH * 4, pool);
+			for (i = 0; i != bytes; i++)
+				if (parallel[i] != single[i])
+					differ++;
+		}
+		svgtiny_render_pool_free(pool);
+		if (differ == 0) {
+			printf("%u threads: code %i, same as "
+					"svgtiny_render()\n", threads[k], code);
+		} else {
+			printf("%u threads: code %i, %u channels differ from "
+					"svgtiny_render()\n", threads[k], code,
+					differ);
+			failed = true;
+		}
+	}
+
+	free(parallel);
+	free(single);
+	svgtiny_free(diagram);
+	free(buffer);
+
+	return failed ? 1 : 0;
+}
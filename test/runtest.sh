@@ -2,17 +2,26 @@
 
 TEST_PATH=$1
 TEST_OUT=${TEST_PATH}/svg
+FAILED=0
 
-mkdir -p ${TEST_OUT}
-
-svgdecode()
+# run test_${1}_svg on a file, with a stack no bigger than a small worker
+# thread's, and compare what it prints with test/expected/${1}
+svgcheck()
 {
-    OUTF=$(basename ${1} .svg)
-    ${TEST_PATH}/test_decode_svg ${1} > ${TEST_OUT}/${OUTF}.svg
+    OUTF=${TEST_OUT}/${1}/$(basename ${2} .svg).txt
+    (ulimit -s 256; ${TEST_PATH}/test_${1}_svg ${2}) > ${OUTF} 2>&1
+    if ! cmp -s ${OUTF} test/expected/${1}/$(basename ${2} .svg).txt; then
+        echo "FAIL: ${1} ${2}"
+        FAILED=1
+    fi
 }
 
 
-for SVG in $(ls test/data/*.svg);do
-    svgdecode ${SVG}
+for TEST in $(ls test/expected);do
+    mkdir -p ${TEST_OUT}/${TEST}
+    for SVG in $(ls test/data/*.svg);do
+        svgcheck ${TEST} ${SVG}
+    done
 done
 
+exit ${FAILED}
@@ -0,0 +1,166 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Save a parsed file with svgtiny_save(), load it back with svgtiny_load(),
+ * and check that every shape survives, for each set of parse options that
+ * changes what a diagram holds. Damaged data must be refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+
+static int same_floats(const float *a, const float *b, unsigned int n)
+{
+	return n == 0 || memcmp(a, b, n * sizeof a[0]) == 0;
+}
+
+
+static int same_shape(const struct svgtiny_shape *a,
+		const struct svgtiny_shape *b)
+{
+	const struct svgtiny_linear_gradient *ga, *gb;
+	const struct svgtiny_mesh *ma, *mb;
+
+	if (a->fill != b->fill || a->stroke != b->stroke ||
+			a->stroke_width != b->stroke_width ||
+			a->path_length != b->path_length ||
+			!same_floats(a->path, b->path, a->path_length) ||
+			!a->text != !b->text ||
+			(a->text && (strcmp(a->text, b->text) ||
+			a->text_x != b->text_x || a->text_y != b->text_y)) ||
+			memcmp(&a->bounds, &b->bounds, sizeof a->bounds) ||
+			!a->instance != !b->instance)
+		return 0;
+	if (a->instance && (a->instance->first != b->instance->first ||
+			a->instance->count != b->instance->count ||
+			memcmp(&a->instance->transform,
+			&b->instance->transform,
+			sizeof a->instance->transform) ||
+			a->instance->fill != b->instance->fill ||
+			a->instance->stroke != b->instance->stroke))
+		return 0;
+
+	ga = svgtiny_shape_linear_gradient(a);
+	gb = svgtiny_shape_linear_gradient(b);
+	if (!ga != !gb || (ga && (ga->x1 != gb->x1 || ga->y1 != gb->y1 ||
+			ga->x2 != gb->x2 || ga->y2 != gb->y2 ||
+			ga->stop_count != gb->stop_count ||
+			memcmp(ga->stop, gb->stop,
+			ga->stop_count * sizeof ga->stop[0]))))
+		return 0;
+
+	ma = svgtiny_shape_mesh(a);
+	mb = svgtiny_shape_mesh(b);
+	if (!ma != !mb || (ma && (ma->vertex_count != mb->vertex_count ||
+			ma->triangle_count != mb->triangle_count ||
+			!same_floats(ma->vertex, mb->vertex,
+			2 * ma->vertex_count) ||
+			memcmp(ma->colour, mb->colour,
+			ma->vertex_count * sizeof ma->colour[0]) ||
+			memcmp(ma->index, mb->index,
+			3 * ma->triangle_count * sizeof ma->index[0]))))
+		return 0;
+
+	return 1;
+}
+
+
+/**
+ * Load data into a new diagram and print the code and whether it matches.
+ */
+
+static void load(const char *what, const struct svgtiny_diagram *original,
+		const void *data, size_t size)
+{
+	struct svgtiny_diagram *diagram = svgtiny_create();
+	svgtiny_code code;
+	unsigned int i, differ = 0;
+
+	if (!diagram)
+		exit(1);
+	code = svgtiny_load(diagram, data, size);
+	printf("  %s: code %i", what, code);
+	if (code == svgtiny_OK) {
+		if (diagram->width != original->width ||
+				diagram->height != original->height ||
+				diagram->shape_count != original->shape_count ||
+				diagram->symbol_shape_count !=
+				original->symbol_shape_count)
+			differ++;
+		for (i = 0; !differ && i != diagram->shape_count; i++)
+			differ += !same_shape(&diagram->shape[i],
+					&original->shape[i]);
+		for (i = 0; !differ && i != diagram->symbol_shape_count; i++)
+			differ += !same_shape(&diagram->symbol_shape[i],
+					&original->symbol_shape[i]);
+		printf(", %u shapes, %s", diagram->shape_count,
+				differ ? "differ" : "identical");
+	}
+	printf("\n");
+	svgtiny_free(diagram);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int options[] = {
+		0,
+		svgtiny_KEEP_INSTANCES,
+		svgtiny_KEEP_GRADIENTS,
+		svgtiny_GRADIENT_MESH
+	};
+	struct svgtiny_diagram *diagram;
+	unsigned int i;
+	size_t size, saved;
+	char *buffer, *data;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	for (i = 0; i != sizeof options / sizeof options[0]; i++) {
+		diagram = svgtiny_create();
+		if (!diagram)
+			return 1;
+		diagram->options = options[i];
+		svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+
+		saved = svgtiny_save(diagram, NULL, 0);
+		data = malloc(saved);
+		if (!data || svgtiny_save(diagram, data, saved) != saved) {
+			fprintf(stderr, "svgtiny_save failed\n");
+			return 1;
+		}
+		printf("options %u: %u shapes, %u symbol shapes, "
+				"saved %zu bytes\n", options[i],
+				diagram->shape_count,
+				diagram->symbol_shape_count, saved);
+
+		load("load", diagram, data, saved);
+		load("truncated", diagram, data, saved - 4);
+		data[8] ^= 0x40;
+		load("other version", diagram, data, saved);
+		data[8] ^= 0x40;
+		data[0] = 'S';
+		load("not binary", diagram, data, saved);
+
+		free(data);
+		svgtiny_free(diagram);
+	}
+
+	free(buffer);
+
+	return 0;
+}
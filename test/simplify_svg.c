@@ -0,0 +1,181 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Parse a file with a range of svgtiny_diagram.simplify_tolerance values and
+ * print how many path floats are left. Every shape must still be there, and
+ * no point of either outline, flattened, may lie further than the tolerance
+ * from the other. Gradients are kept whole, as how a fill is split depends
+ * on its outline.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+#define FLATNESS 0.01f
+
+
+/**
+ * Flatten a shape's path into a new array, returning its length.
+ */
+
+static size_t flatten(const struct svgtiny_shape *shape, float **out)
+{
+	size_t n = svgtiny_flatten_shape(shape, FLATNESS, NULL, 0);
+
+	*out = malloc((n ? n : 1) * sizeof (*out)[0]);
+	if (!*out)
+		exit(1);
+	return svgtiny_flatten_shape(shape, FLATNESS, *out, n);
+}
+
+
+/**
+ * Distance from a point to the segment a to b.
+ */
+
+static float segment_distance(float x, float y, const float *a,
+		const float *b)
+{
+	float dx = b[0] - a[0], dy = b[1] - a[1];
+	float t = 0, length = dx * dx + dy * dy;
+
+	if (length != 0) {
+		t = ((x - a[0]) * dx + (y - a[1]) * dy) / length;
+		t = t < 0 ? 0 : 1 < t ? 1 : t;
+	}
+	return hypotf(x - a[0] - t * dx, y - a[1] - t * dy);
+}
+
+
+/**
+ * Distance from a point to the nearest segment of a flattened path, where
+ * a close is a segment back to the start of its subpath.
+ */
+
+static float path_distance(float x, float y, const float *p, size_t n)
+{
+	const float *start = NULL, *last = NULL;
+	float best = INFINITY, d;
+	size_t j = 0;
+
+	while (j < n) {
+		switch ((int) p[j]) {
+		case svgtiny_PATH_MOVE:
+			start = last = &p[j + 1];
+			d = hypotf(x - start[0], y - start[1]);
+			j += 3;
+			break;
+		case svgtiny_PATH_LINE:
+			d = last ? segment_distance(x, y, last, &p[j + 1]) :
+					INFINITY;
+			last = &p[j + 1];
+			j += 3;
+			break;
+		default:
+			d = last ? segment_distance(x, y, last, start) :
+					INFINITY;
+			last = start;
+			j++;
+			break;
+		}
+		if (d < best)
+			best = d;
+	}
+	return best;
+}
+
+
+/**
+ * Largest distance from a point of path a to path b.
+ */
+
+static float furthest(const float *a, size_t an, const float *b, size_t bn)
+{
+	float most = 0, d;
+	size_t j = 0;
+
+	while (j < an) {
+		if ((int) a[j] == svgtiny_PATH_CLOSE) {
+			j++;
+			continue;
+		}
+		d = path_distance(a[j + 1], a[j + 2], b, bn);
+		if (most < d)
+			most = d;
+		j += 3;
+	}
+	return most;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const float tolerance[] = { 0, 0.5, 2 };
+	struct svgtiny_diagram *original, *simple;
+	unsigned int i, k, moved;
+	size_t size, floats, an, bn;
+	float *a, *b;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	original = svgtiny_create();
+	if (!original)
+		return 1;
+	original->options = svgtiny_KEEP_GRADIENTS;
+	svgtiny_parse(original, buffer, size, argv[1], 1000, 1000);
+
+	for (k = 0; k != sizeof tolerance / sizeof tolerance[0]; k++) {
+		simple = svgtiny_create();
+		if (!simple)
+			return 1;
+		simple->options = svgtiny_KEEP_GRADIENTS;
+		simple->simplify_tolerance = tolerance[k];
+		svgtiny_parse(simple, buffer, size, argv[1], 1000, 1000);
+
+		floats = moved = 0;
+		for (i = 0; i != simple->shape_count; i++)
+			floats += simple->shape[i].path_length;
+		printf("tolerance %g: %u shapes, %zu path floats",
+				tolerance[k], simple->shape_count, floats);
+		if (simple->shape_count != original->shape_count) {
+			printf(", shape count differs\n");
+			svgtiny_free(simple);
+			continue;
+		}
+
+		for (i = 0; i != simple->shape_count; i++) {
+			if (!simple->shape[i].path || !original->shape[i].path)
+				continue;
+			an = flatten(&original->shape[i], &a);
+			bn = flatten(&simple->shape[i], &b);
+			if (tolerance[k] + 2 * FLATNESS <
+					furthest(a, an, b, bn) ||
+					tolerance[k] + 2 * FLATNESS <
+					furthest(b, bn, a, an))
+				moved++;
+			free(b);
+			free(a);
+		}
+		printf(", %u moved too far\n", moved);
+		svgtiny_free(simple);
+	}
+
+	svgtiny_free(original);
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Check that svgtiny_parse_stream() passes on the shapes svgtiny_parse()
+ * keeps, and can be stopped; that a diagram emptied by svgtiny_reset()
+ * parses the same again; and that a diagram made with an allocator gives
+ * back everything it took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+struct stream {
+	const struct svgtiny_diagram *diagram;
+	unsigned int count;
+	unsigned int differ;
+	unsigned int stop_after;
+};
+
+static long blocks;
+
+
+static int same_shape(const struct svgtiny_shape *a,
+		const struct svgtiny_shape *b)
+{
+	return a->fill == b->fill && a->stroke == b->stroke &&
+			a->stroke_width == b->stroke_width &&
+			a->path_length == b->path_length &&
+			(a->path_length == 0 || memcmp(a->path, b->path,
+			a->path_length * sizeof a->path[0]) == 0) &&
+			!a->text == !b->text &&
+			(!a->text || strcmp(a->text, b->text) == 0);
+}
+
+
+static int same_diagram(const struct svgtiny_diagram *a,
+		const struct svgtiny_diagram *b)
+{
+	unsigned int i;
+
+	if (a->shape_count != b->shape_count)
+		return 0;
+	for (i = 0; i != a->shape_count; i++)
+		if (!same_shape(&a->shape[i], &b->shape[i]))
+			return 0;
+	return 1;
+}
+
+
+static svgtiny_code shape_found(const struct svgtiny_shape *shape,
+		void *ctx)
+{
+	struct stream *stream = ctx;
+
+	if (stream->count == stream->stop_after)
+		return svgtiny_SVG_ERROR;
+	if (stream->diagram->shape_count <= stream->count ||
+			!same_shape(shape,
+			&stream->diagram->shape[stream->count]))
+		stream->differ++;
+	stream->count++;
+	return svgtiny_OK;
+}
+
+
+static void *counted_alloc(size_t size, void *ctx)
+{
+	(void) ctx;
+	blocks++;
+	return malloc(size);
+}
+
+
+static void *counted_realloc(void *ptr, size_t size, void *ctx)
+{
+	(void) ctx;
+	if (!ptr)
+		blocks++;
+	return realloc(ptr, size);
+}
+
+
+static void counted_free(void *ptr, void *ctx)
+{
+	(void) ctx;
+	blocks--;
+	free(ptr);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const svgtiny_allocator allocator = {
+		counted_alloc, counted_realloc, counted_free, NULL
+	};
+	struct svgtiny_diagram *diagram, *counted;
+	struct stream stream;
+	svgtiny_code code;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	code = svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+	printf("parse: code %i, %u shapes\n", code, diagram->shape_count);
+
+	stream.diagram = diagram;
+	stream.count = stream.differ = 0;
+	stream.stop_after = -1;
+	code = svgtiny_parse_stream(buffer, size, 1000, 1000, shape_found,
+			&stream);
+	printf("stream: code %i, %u shapes, %u differ\n", code,
+			stream.count, stream.differ);
+
+	stream.count = stream.differ = 0;
+	stream.stop_after = 3;
+	code = svgtiny_parse_stream(buffer, size, 1000, 1000, shape_found,
+			&stream);
+	printf("stopped after 3: code %i, %u shapes\n", code, stream.count);
+
+	/* the same document, and then another, into one diagram */
+	counted = svgtiny_create_with_allocator(&allocator);
+	if (!counted)
+		return 1;
+	svgtiny_parse(counted, buffer, size, argv[1], 1000, 1000);
+	printf("allocator: %s\n",
+			same_diagram(counted, diagram) ? "same" : "differ");
+	svgtiny_reset(counted);
+	printf("reset: %u shapes\n", counted->shape_count);
+	svgtiny_parse(counted, buffer, size, argv[1], 1000, 1000);
+	printf("parse after reset: %s\n",
+			same_diagram(counted, diagram) ? "same" : "differ");
+	svgtiny_free(counted);
+	printf("blocks not freed: %li\n", blocks);
+
+	svgtiny_free(diagram);
+	free(buffer);
+
+	return 0;
+}
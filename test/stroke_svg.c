@@ -0,0 +1,142 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Expand the stroke of every stroked shape of a file into an outline with
+ * svgtiny_stroke_to_path(), in each join and cap style, and print the size
+ * and extent of each outline. A straight line is stroked first, whose
+ * outlines are known exactly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+static const struct svgtiny_stroke_style styles[] = {
+	{ svgtiny_JOIN_MITER, svgtiny_CAP_BUTT, 4 },
+	{ svgtiny_JOIN_ROUND, svgtiny_CAP_ROUND, 4 },
+	{ svgtiny_JOIN_BEVEL, svgtiny_CAP_SQUARE, 4 }
+};
+
+
+/**
+ * Stroke a shape in one style and print the outline's size and extent, or
+ * why there is none.
+ */
+
+static void stroke(const struct svgtiny_shape *shape,
+		const struct svgtiny_stroke_style *style)
+{
+	float x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	size_t n, written, j;
+	float *out;
+	int first = 1, closed = 1;
+
+	n = svgtiny_stroke_to_path(shape, 0.1, style, NULL, 0);
+	if (n == 0) {
+		printf(" -");
+		return;
+	}
+	out = malloc(n * sizeof out[0]);
+	if (!out)
+		exit(1);
+	written = svgtiny_stroke_to_path(shape, 0.1, style, out, n);
+
+	for (j = 0; j < written; ) {
+		unsigned int k, size;
+		switch ((int) out[j]) {
+		case svgtiny_PATH_MOVE:
+		case svgtiny_PATH_LINE:
+			size = 2;
+			break;
+		case svgtiny_PATH_BEZIER:
+			size = 6;
+			break;
+		case svgtiny_PATH_CLOSE:
+			size = 0;
+			break;
+		default:
+			printf(" error\n");
+			exit(1);
+		}
+		closed = (int) out[j] == svgtiny_PATH_CLOSE;
+		for (k = 0; k != size; k += 2) {
+			float x = out[j + 1 + k], y = out[j + 2 + k];
+			if (first || x < x0)
+				x0 = x;
+			if (first || y < y0)
+				y0 = y;
+			if (first || x1 < x)
+				x1 = x;
+			if (first || y1 < y)
+				y1 = y;
+			first = 0;
+		}
+		j += 1 + size;
+	}
+	printf(" %s%s[%.1f %.1f %.1f %.1f]",
+			written == n ? "" : "size differs ",
+			closed ? "" : "not closed ", x0, y0, x1, y1);
+	free(out);
+}
+
+
+int main(int argc, char *argv[])
+{
+	float line[] = {
+		svgtiny_PATH_MOVE, 0, 0,
+		svgtiny_PATH_LINE, 10, 0,
+		svgtiny_PATH_LINE, 10, 10
+	};
+	struct svgtiny_diagram *diagram;
+	struct svgtiny_shape shape;
+	unsigned int i, k;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	/* a right angle of width 2: mitre and bevel corners differ, and
+	 * butt, round and square caps reach 0, 1 and 1 past the ends */
+	memset(&shape, 0, sizeof shape);
+	shape.path = line;
+	shape.path_length = sizeof line / sizeof line[0];
+	shape.stroke = 0xff000000;
+	shape.stroke_width = 2;
+	printf("corner:");
+	for (k = 0; k != sizeof styles / sizeof styles[0]; k++)
+		stroke(&shape, &styles[k]);
+	printf("\n");
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		return 1;
+	svgtiny_parse(diagram, buffer, size, argv[1], 1000, 1000);
+	free(buffer);
+
+	for (i = 0; i != diagram->shape_count; i++) {
+		const struct svgtiny_shape *s = &diagram->shape[i];
+		if (!s->path || s->stroke == svgtiny_TRANSPARENT ||
+				s->stroke == 0)
+			continue;
+		printf("%u:", i);
+		for (k = 0; k != sizeof styles / sizeof styles[0]; k++)
+			stroke(s, &styles[k]);
+		printf("\n");
+	}
+
+	svgtiny_free(diagram);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * This file is part of Libsvgtiny
+ * Licensed under the MIT License,
+ *                http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ * Triangulate the filled shapes of a file, one at a time and as a whole
+ * diagram, and print the number of triangles and the area they cover.
+ * The diagram is also parsed with svgtiny_KEEP_INSTANCES, whose instances
+ * must triangulate to the same area. A few paths of known area come first.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "svgtiny.h"
+#include "load_file.h"
+
+
+/**
+ * The area covered by triangles first to last - 1.
+ */
+
+static double area(const struct svgtiny_triangles *t, unsigned int first,
+		unsigned int last)
+{
+	double sum = 0;
+	unsigned int i;
+
+	for (i = first; i != last; i++) {
+		const float *a = t->vertex + 2 * t->index[3 * i];
+		const float *b = t->vertex + 2 * t->index[3 * i + 1];
+		const float *c = t->vertex + 2 * t->index[3 * i + 2];
+		sum += fabs((double) (b[0] - a[0]) * (c[1] - a[1]) -
+				(double) (c[0] - a[0]) * (b[1] - a[1])) / 2;
+	}
+	return sum;
+}
+
+
+static void known(const char *name, float *path, unsigned int length)
+{
+	struct svgtiny_shape shape = { 0 };
+	struct svgtiny_triangles *t;
+
+	shape.path = path;
+	shape.path_length = length;
+	if (svgtiny_triangulate_shape(&shape, 0.1, &t) != svgtiny_OK)
+		exit(1);
+	printf("%s: %u triangles, area %.2f\n", name, t->triangle_count,
+			area(t, 0, t->triangle_count));
+	svgtiny_triangles_free(t);
+}
+
+
+/**
+ * Parse with options and triangulate the diagram, returning the total area
+ * and printing any shape whose triangles differ from its own triangulation.
+ */
+
+static double diagram_area(const char *buffer, size_t size, const char *url,
+		unsigned int options, int per_shape)
+{
+	struct svgtiny_diagram *diagram;
+	struct svgtiny_triangles *all, *one;
+	unsigned int i;
+	double total;
+
+	diagram = svgtiny_create();
+	if (!diagram)
+		exit(1);
+	diagram->options = options;
+	svgtiny_parse(diagram, buffer, size, url, 1000, 1000);
+	if (svgtiny_triangulate_diagram(diagram, 0.1, &all) != svgtiny_OK) {
+		fprintf(stderr, "svgtiny_triangulate_diagram failed\n");
+		exit(1);
+	}
+
+	for (i = 0; per_shape && i != diagram->shape_count; i++) {
+		const struct svgtiny_shape *shape = &diagram->shape[i];
+		unsigned int first = all->shape_triangle[i];
+		unsigned int last = all->shape_triangle[i + 1];
+		if (!shape->path || shape->fill == svgtiny_TRANSPARENT)
+			continue;
+		if (svgtiny_triangulate_shape(shape, 0.1, &one) != svgtiny_OK)
+			exit(1);
+		printf("%u: %u triangles, area %.1f", i,
+				one->triangle_count,
+				area(one, 0, one->triangle_count));
+		if (last - first != one->triangle_count)
+			printf(", %u in diagram", last - first);
+		printf("\n");
+		svgtiny_triangles_free(one);
+	}
+
+	total = area(all, 0, all->triangle_count);
+	printf("options %u: %u shapes, %u triangles, area %.1f\n", options,
+			diagram->shape_count, all->triangle_count, total);
+	svgtiny_triangles_free(all);
+	svgtiny_free(diagram);
+	return total;
+}
+
+
+int main(int argc, char *argv[])
+{
+	/* a 10 square with a 6 square hole wound the other way */
+	float hole[] = {
+		svgtiny_PATH_MOVE, 0, 0, svgtiny_PATH_LINE, 10, 0,
+		svgtiny_PATH_LINE, 10, 10, svgtiny_PATH_LINE, 0, 10,
+		svgtiny_PATH_CLOSE,
+		svgtiny_PATH_MOVE, 2, 2, svgtiny_PATH_LINE, 2, 8,
+		svgtiny_PATH_LINE, 8, 8, svgtiny_PATH_LINE, 8, 2,
+		svgtiny_PATH_CLOSE
+	};
+	/* the same with both wound the same way: non-zero fills the hole */
+	float filled[] = {
+		svgtiny_PATH_MOVE, 0, 0, svgtiny_PATH_LINE, 10, 0,
+		svgtiny_PATH_LINE, 10, 10, svgtiny_PATH_LINE, 0, 10,
+		svgtiny_PATH_CLOSE,
+		svgtiny_PATH_MOVE, 2, 2, svgtiny_PATH_LINE, 8, 2,
+		svgtiny_PATH_LINE, 8, 8, svgtiny_PATH_LINE, 2, 8,
+		svgtiny_PATH_CLOSE
+	};
+	/* a bow tie, crossing itself at (5, 5) */
+	float bow_tie[] = {
+		svgtiny_PATH_MOVE, 0, 0, svgtiny_PATH_LINE, 10, 10,
+		svgtiny_PATH_LINE, 10, 0, svgtiny_PATH_LINE, 0, 10,
+		svgtiny_PATH_CLOSE
+	};
+	double expanded, instanced;
+	size_t size;
+	char *buffer;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	buffer = load_file(argv[1], &size);
+	if (!buffer)
+		return 1;
+
+	known("hole", hole, sizeof hole / sizeof hole[0]);
+	known("filled", filled, sizeof filled / sizeof filled[0]);
+	known("bow tie", bow_tie, sizeof bow_tie / sizeof bow_tie[0]);
+
+	expanded = diagram_area(buffer, size, argv[1], 0, 1);
+	instanced = diagram_area(buffer, size, argv[1],
+			svgtiny_KEEP_INSTANCES, 0);
+	printf("instances %s\n", fabs(expanded - instanced) <=
+			1e-4 * expanded ? "match" : "differ");
+	free(buffer);
+
+	return 0;
+}